@@ -0,0 +1,103 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <algorithm>
+
+#include "deadlineregistry.hh"
+
+using namespace Hypergrace;
+using namespace Hypergrace::Bt;
+
+
+DeadlineRegistry::DeadlineRegistry() :
+    cursor_(0),
+    revision_(0),
+    missedCount_(0)
+{
+}
+
+void DeadlineRegistry::want(unsigned long long offset, unsigned long long size,
+                            const Util::Time &time)
+{
+    std::lock_guard<std::mutex> l(anchor_);
+
+    if (size == 0 || offset + size <= cursor_)
+        return;
+
+    deadlines_.push_back(Deadline { offset, size, time });
+    ++revision_;
+}
+
+void DeadlineRegistry::setCursor(unsigned long long cursor)
+{
+    std::lock_guard<std::mutex> l(anchor_);
+
+    cursor_ = cursor;
+
+    auto passed = std::remove_if(deadlines_.begin(), deadlines_.end(),
+            [cursor](const Deadline &d) { return d.offset + d.size <= cursor; });
+
+    deadlines_.erase(passed, deadlines_.end());
+    ++revision_;
+}
+
+void DeadlineRegistry::clear()
+{
+    std::lock_guard<std::mutex> l(anchor_);
+
+    deadlines_.clear();
+    ++revision_;
+}
+
+unsigned long long DeadlineRegistry::cursor() const
+{
+    std::lock_guard<std::mutex> l(anchor_);
+
+    return cursor_;
+}
+
+bool DeadlineRegistry::streaming() const
+{
+    std::lock_guard<std::mutex> l(anchor_);
+
+    return !deadlines_.empty();
+}
+
+unsigned long long DeadlineRegistry::missedCount() const
+{
+    return missedCount_;
+}
+
+std::vector<DeadlineRegistry::Deadline> DeadlineRegistry::deadlines() const
+{
+    std::lock_guard<std::mutex> l(anchor_);
+
+    return deadlines_;
+}
+
+unsigned long long DeadlineRegistry::revision() const
+{
+    return revision_;
+}
+
+void DeadlineRegistry::reportMiss()
+{
+    ++missedCount_;
+}
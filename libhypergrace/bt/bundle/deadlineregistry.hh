@@ -0,0 +1,94 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef BT_BUNDLE_DEADLINEREGISTRY_HH_
+#define BT_BUNDLE_DEADLINEREGISTRY_HH_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <util/time.hh>
+
+
+namespace Hypergrace {
+namespace Bt {
+
+/**
+ * Byte ranges a sequential consumer needs by a given time. While any
+ * range is registered the torrent is in the streaming mode: pieces due
+ * soon are requested from the fastest peers ahead of everything else
+ * and the rest of the torrent is still downloaded rarest first.
+ */
+class DeadlineRegistry
+{
+public:
+    struct Deadline
+    {
+        unsigned long long offset;
+        unsigned long long size;
+        Util::Time time;
+    };
+
+public:
+    DeadlineRegistry();
+
+    /**
+     * Asks for the byte range to be downloaded by the given monotonic
+     * time.
+     */
+    void want(unsigned long long, unsigned long long, const Util::Time &);
+
+    /**
+     * Moves the playback cursor. Ranges which end before the cursor
+     * are dropped as the consumer has no use for them anymore.
+     */
+    void setCursor(unsigned long long);
+    void clear();
+
+    unsigned long long cursor() const;
+    bool streaming() const;
+
+    /**
+     * Number of pieces which weren't downloaded by their deadline.
+     */
+    unsigned long long missedCount() const;
+
+public:
+    std::vector<Deadline> deadlines() const;
+    unsigned long long revision() const;
+
+    void reportMiss();
+
+private:
+    std::vector<Deadline> deadlines_;
+    unsigned long long cursor_;
+
+    // Bumped on every change so that readers know when to resync
+    std::atomic<unsigned long long> revision_;
+    std::atomic<unsigned long long> missedCount_;
+
+    mutable std::mutex anchor_;
+};
+
+} /* namespace Bt */
+} /* namespace Hypergrace */
+
+#endif /* BT_BUNDLE_DEADLINEREGISTRY_HH_ */
@@ -52,6 +52,9 @@ TorrentConfiguration::TorrentConfiguration() :
     d["dload-rate"] = new Bencode::BencodeInteger(-1);
     d["uload-rate"] = new Bencode::BencodeInteger(-1);
     d["uload-slots"] = new Bencode::BencodeInteger(6);
+    d["bandwidth-weight"] = new Bencode::BencodeInteger(1);
+    d["bandwidth-burst"] = new Bencode::BencodeInteger(0);
+    d["request-memory"] = new Bencode::BencodeInteger(32 * 1024 * 1024);
     d["prealloc-storage"] = new Bencode::BencodeInteger(1);
 }
 
@@ -102,6 +105,29 @@ void TorrentConfiguration::setUploadSlotCount(unsigned int count)
     onUploadSlotCountChanged();
 }
 
+void TorrentConfiguration::setBandwidthWeight(unsigned int weight)
+{
+    std::lock_guard<std::recursive_mutex> l(anchor_);
+
+    Bencode::Path(configTree_, "bandwidth-weight").resolve<Bencode::Integer>() = weight;
+    onBandwidthWeightChanged();
+}
+
+void TorrentConfiguration::setBandwidthBurst(int burst)
+{
+    std::lock_guard<std::recursive_mutex> l(anchor_);
+
+    Bencode::Path(configTree_, "bandwidth-burst").resolve<Bencode::Integer>() = burst;
+    onBandwidthBurstChanged();
+}
+
+void TorrentConfiguration::setRequestMemoryBudget(unsigned int budget)
+{
+    std::lock_guard<std::recursive_mutex> l(anchor_);
+
+    Bencode::Path(configTree_, "request-memory").resolve<Bencode::Integer>() = budget;
+}
+
 void TorrentConfiguration::setStorageDirectory(const std::string &path)
 {
     std::lock_guard<std::recursive_mutex> l(anchor_);
@@ -152,6 +178,27 @@ unsigned int TorrentConfiguration::uploadSlotCount() const
     return Bencode::Path(configTree_, "uload-slots").resolve<Bencode::Integer>();
 }
 
+unsigned int TorrentConfiguration::bandwidthWeight() const
+{
+    std::lock_guard<std::recursive_mutex> l(anchor_);
+
+    return Bencode::Path(configTree_, "bandwidth-weight").resolve<Bencode::Integer>();
+}
+
+int TorrentConfiguration::bandwidthBurst() const
+{
+    std::lock_guard<std::recursive_mutex> l(anchor_);
+
+    return Bencode::Path(configTree_, "bandwidth-burst").resolve<Bencode::Integer>();
+}
+
+unsigned int TorrentConfiguration::requestMemoryBudget() const
+{
+    std::lock_guard<std::recursive_mutex> l(anchor_);
+
+    return Bencode::Path(configTree_, "request-memory").resolve<Bencode::Integer>();
+}
+
 const std::string &TorrentConfiguration::storageDirectory() const
 {
     std::lock_guard<std::recursive_mutex> l(anchor_);
@@ -216,6 +263,23 @@ TorrentConfiguration *TorrentConfiguration::fromString(const std::string &s)
         Bencode::Path(configTree, "storage-dir").resolve<Bencode::String>();
         Bencode::Path(configTree, "sched-files").resolve<Bencode::List>();
         Bencode::Path(configTree, "prealloc-storage").resolve<Bencode::Integer>();
+
+        // Configurations saved by older versions have no bandwidth
+        // weight, burst and request memory budget.
+        auto &dict = configTree->get<Bencode::Dictionary>();
+
+        if (dict.find("bandwidth-weight") == dict.end())
+            dict["bandwidth-weight"] = new Bencode::BencodeInteger(1);
+
+        if (dict.find("bandwidth-burst") == dict.end())
+            dict["bandwidth-burst"] = new Bencode::BencodeInteger(0);
+
+        if (dict.find("request-memory") == dict.end())
+            dict["request-memory"] = new Bencode::BencodeInteger(32 * 1024 * 1024);
+
+        Bencode::Path(configTree, "bandwidth-weight").resolve<Bencode::Integer>();
+        Bencode::Path(configTree, "bandwidth-burst").resolve<Bencode::Integer>();
+        Bencode::Path(configTree, "request-memory").resolve<Bencode::Integer>();
     } catch (std::exception &e) {
         hDebug() << e.what();
         hSevere() << "Failed to deserialize a torrent configuration from string.";
@@ -47,6 +47,9 @@ public:
     void limitUploadRate(int);
     void limitConnections(int);
     void setUploadSlotCount(unsigned int);
+    void setBandwidthWeight(unsigned int);
+    void setBandwidthBurst(int);
+    void setRequestMemoryBudget(unsigned int);
     void setStorageDirectory(const std::string &);
     void setPreallocateStorage(bool);
 
@@ -55,6 +58,9 @@ public:
     int uploadRateLimit() const;
     int connectionLimit() const;
     unsigned int uploadSlotCount() const;
+    unsigned int bandwidthWeight() const;
+    int bandwidthBurst() const;
+    unsigned int requestMemoryBudget() const;
     const std::string &storageDirectory() const;
     bool preallocateStorage() const;
 
@@ -67,6 +73,8 @@ public: /* signals */
     Delegate::Signal<> onDownloadRateLimitChanged;
     Delegate::Signal<> onConnectionLimitChanged;
     Delegate::Signal<> onUploadSlotCountChanged;
+    Delegate::Signal<> onBandwidthWeightChanged;
+    Delegate::Signal<> onBandwidthBurstChanged;
     Delegate::Signal<> onStorageDirectoryChanged;
 
 private:
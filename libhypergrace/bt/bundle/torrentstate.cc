@@ -39,8 +39,14 @@ TorrentState::TorrentState(unsigned int pieceCount) :
     verifiedPieces_(pieceCount),
     downloaded_(0),
     uploaded_(0),
+    sentPayloadBytes_(0),
+    sentControlBytes_(0),
     downloadRate_(0),
-    uploadRate_(0)
+    uploadRate_(0),
+    payloadDownloadRate_(0),
+    payloadUploadRate_(0),
+    partialPieceCount_(0),
+    averagePieceTime_(0)
 {
     availablePieces_.unsetAll();
     scheduledPieces_.setAll();
@@ -71,6 +77,36 @@ size_t TorrentState::uploadRate() const
     return uploadRate_;
 }
 
+size_t TorrentState::payloadDownloadRate() const
+{
+    return payloadDownloadRate_;
+}
+
+size_t TorrentState::payloadUploadRate() const
+{
+    return payloadUploadRate_;
+}
+
+unsigned long long TorrentState::sentPayloadBytes() const
+{
+    return sentPayloadBytes_;
+}
+
+unsigned long long TorrentState::sentControlBytes() const
+{
+    return sentControlBytes_;
+}
+
+size_t TorrentState::partialPieceCount() const
+{
+    return partialPieceCount_;
+}
+
+size_t TorrentState::averagePieceTime() const
+{
+    return averagePieceTime_;
+}
+
 const Util::Bitfield &TorrentState::availablePieces() const
 {
     return availablePieces_;
@@ -106,6 +142,16 @@ const TrackerRegistry &TorrentState::trackerRegistry() const
     return trackerRegistry_;
 }
 
+DeadlineRegistry &TorrentState::deadlineRegistry()
+{
+    return deadlineRegistry_;
+}
+
+const DeadlineRegistry &TorrentState::deadlineRegistry() const
+{
+    return deadlineRegistry_;
+}
+
 void TorrentState::updateDownloaded(unsigned int increment)
 {
     downloaded_ += increment;
@@ -116,6 +162,12 @@ void TorrentState::updateUploaded(unsigned int increment)
     uploaded_ += increment;
 }
 
+void TorrentState::updateSent(unsigned int payload, unsigned int control)
+{
+    sentPayloadBytes_ += payload;
+    sentControlBytes_ += control;
+}
+
 void TorrentState::setDownloadRate(size_t rate)
 {
     downloadRate_ = rate;
@@ -126,6 +178,26 @@ void TorrentState::setUploadRate(size_t rate)
     uploadRate_ = rate;
 }
 
+void TorrentState::setPayloadDownloadRate(size_t rate)
+{
+    payloadDownloadRate_ = rate;
+}
+
+void TorrentState::setPayloadUploadRate(size_t rate)
+{
+    payloadUploadRate_ = rate;
+}
+
+void TorrentState::setPartialPieceCount(size_t count)
+{
+    partialPieceCount_ = count;
+}
+
+void TorrentState::setAveragePieceTime(size_t time)
+{
+    averagePieceTime_ = time;
+}
+
 void TorrentState::markPieceAsAvailable(unsigned int piece)
 {
     assert(piece < availablePieces_.bitCount());
@@ -206,12 +278,14 @@ TorrentState *TorrentState::fromString(const std::string &string)
         return 0;
     }
 
-    for (size_t piece = 0; piece < pieceCount; ++piece) {
-        if (!torrentState->availablePieces_.bit(piece)) {
-            torrentState->scheduledPieces_.set(piece);
-        } else {
-            torrentState->scheduledPieces_.unset(piece);
-        }
+    const Util::Bitfield &available = torrentState->availablePieces_;
+
+    torrentState->scheduledPieces_.setAll();
+
+    for (size_t piece = available.nextEnabled(0); piece != Util::Bitfield::NotFound;
+         piece = available.nextEnabled(piece + 1))
+    {
+        torrentState->scheduledPieces_.unset(piece);
     }
 
     torrentState->downloaded_ = downloaded;
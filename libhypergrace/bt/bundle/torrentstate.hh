@@ -21,6 +21,7 @@
 #ifndef BT_BUNDLE_TORRENTSTATE_HH_
 #define BT_BUNDLE_TORRENTSTATE_HH_
 
+#include <bt/bundle/deadlineregistry.hh>
 #include <bt/bundle/peerregistry.hh>
 #include <bt/bundle/trackerregistry.hh>
 
@@ -45,22 +46,52 @@ public:
     size_t downloadRate() const;
     size_t uploadRate() const;
 
+    /**
+     * Rates of block payload, protocol overhead excluded.
+     */
+    size_t payloadDownloadRate() const;
+    size_t payloadUploadRate() const;
+
+    /**
+     * Bytes of peer-wire messages we have queued for sending, split
+     * into block payload carried by PIECE messages and everything else
+     * (message headers and control messages such as HAVE or REQUEST).
+     */
+    unsigned long long sentPayloadBytes() const;
+    unsigned long long sentControlBytes() const;
+
+    /**
+     * Number of pieces being downloaded and the average time it takes
+     * from requesting the first block of a piece to receiving the last
+     * one, in milliseconds.
+     */
+    size_t partialPieceCount() const;
+    size_t averagePieceTime() const;
+
     const Util::Bitfield &availablePieces() const;
     const Util::Bitfield &scheduledPieces() const;
     const Util::Bitfield &verifiedPieces() const;
 
     TrackerRegistry &trackerRegistry();
     PeerRegistry &peerRegistry();
+    DeadlineRegistry &deadlineRegistry();
 
     const TrackerRegistry &trackerRegistry() const;
     const PeerRegistry &peerRegistry() const;
+    const DeadlineRegistry &deadlineRegistry() const;
 
 public:
     void updateDownloaded(unsigned int);
     void updateUploaded(unsigned int);
+    void updateSent(unsigned int payload, unsigned int control);
 
     void setDownloadRate(size_t);
     void setUploadRate(size_t);
+    void setPayloadDownloadRate(size_t);
+    void setPayloadUploadRate(size_t);
+
+    void setPartialPieceCount(size_t);
+    void setAveragePieceTime(size_t);
 
     void markPieceAsAvailable(unsigned int);
     void markPieceAsUnavailable(unsigned int);
@@ -85,11 +116,20 @@ public:
     volatile unsigned long long downloaded_;
     volatile unsigned long long uploaded_;
 
+    volatile unsigned long long sentPayloadBytes_;
+    volatile unsigned long long sentControlBytes_;
+
     volatile size_t downloadRate_;
     volatile size_t uploadRate_;
+    volatile size_t payloadDownloadRate_;
+    volatile size_t payloadUploadRate_;
+
+    volatile size_t partialPieceCount_;
+    volatile size_t averagePieceTime_;
 
     PeerRegistry peerRegistry_;
     TrackerRegistry trackerRegistry_;
+    DeadlineRegistry deadlineRegistry_;
 };
 
 } /* namespace Bt */
@@ -202,6 +202,12 @@ bool GlobalTorrentRegistry::startTorrent(TorrentBundle *bundle)
 
         torrent.bundle->configuration().onUploadRateLimitChanged.connect(
                 commandTask, &CommandTask::notifyRateLimitChanged);
+
+        torrent.bundle->configuration().onBandwidthWeightChanged.connect(
+                commandTask, &CommandTask::notifyRateLimitChanged);
+
+        torrent.bundle->configuration().onBandwidthBurstChanged.connect(
+                commandTask, &CommandTask::notifyRateLimitChanged);
     }
 
     if (!torrent.reactor->start()) {
@@ -244,11 +250,19 @@ void GlobalTorrentRegistry::setConnectionLimit(int limit)
 void GlobalTorrentRegistry::limitDownloadRate(int limit)
 {
     dloadRateLimit_ = limit;
+    downloadAllocator_.limit(limit > 0 ? limit : -1);
 }
 
 void GlobalTorrentRegistry::limitUploadRate(int limit)
 {
     uloadRateLimit_ = limit;
+    uploadAllocator_.limit(limit > 0 ? limit : -1);
+}
+
+void GlobalTorrentRegistry::setBandwidthBurst(int burst)
+{
+    downloadAllocator_.setBurst(burst);
+    uploadAllocator_.setBurst(burst);
 }
 
 void GlobalTorrentRegistry::setCacheSizeLimit(int limit)
@@ -273,12 +287,12 @@ unsigned int GlobalTorrentRegistry::connectionLimit() const
 
 unsigned int GlobalTorrentRegistry::uploadRateLimit() const
 {
-    return dloadRateLimit_;
+    return uloadRateLimit_;
 }
 
 unsigned int GlobalTorrentRegistry::downloadRateLimit() const
 {
-    return uloadRateLimit_;
+    return dloadRateLimit_;
 }
 
 unsigned int GlobalTorrentRegistry::cacheSizeLimit() const
@@ -296,6 +310,26 @@ unsigned int GlobalTorrentRegistry::connectionCount() const
     return connections;
 }
 
+size_t GlobalTorrentRegistry::downloadRate() const
+{
+    size_t rate = 0;
+
+    for (auto torrent = torrents_.begin(); torrent != torrents_.end(); ++torrent)
+        rate += (*torrent).second.bundle->state().downloadRate();
+
+    return rate;
+}
+
+size_t GlobalTorrentRegistry::uploadRate() const
+{
+    size_t rate = 0;
+
+    for (auto torrent = torrents_.begin(); torrent != torrents_.end(); ++torrent)
+        rate += (*torrent).second.bundle->state().uploadRate();
+
+    return rate;
+}
+
 std::vector<TorrentBundle *> GlobalTorrentRegistry::torrents() const
 {
     std::vector<TorrentBundle *> torrents;
@@ -54,6 +54,7 @@ public:
     void setConnectionLimit(int);
     void limitDownloadRate(int);
     void limitUploadRate(int);
+    void setBandwidthBurst(int);
     void setCacheSizeLimit(int);
 
     const PeerId &peerId() const;
@@ -65,6 +66,14 @@ public:
     unsigned int cacheSizeLimit() const;
 
     unsigned int connectionCount() const;
+
+    /**
+     * Total rates of all torrents. Each torrent estimates its own
+     * rates on its reactor thread, so the global ones are summed up
+     * here instead of being shared between the threads.
+     */
+    size_t downloadRate() const;
+    size_t uploadRate() const;
     std::vector<TorrentBundle *> torrents() const;
 
     static GlobalTorrentRegistry *self();
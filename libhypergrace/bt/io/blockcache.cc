@@ -19,6 +19,7 @@
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <tuple>
 #include <utility>
@@ -31,29 +32,92 @@
 using namespace Hypergrace;
 using namespace Hypergrace::Bt;
 
+// Received and pinned bytes of all caches
+static std::atomic<size_t> memoryUsed(0);
+
 
 BlockCache::BlockCache() :
     load_(0),
-    completeCount_(0)
+    completeCount_(0),
+    sizeLimit_(0)
 {
 }
 
 BlockCache::~BlockCache()
 {
+    for (auto pieceIt = cache_.begin(); pieceIt != cache_.end(); ++pieceIt)
+        memoryUsed -= (*pieceIt).second.used;
 }
 
-void BlockCache::reserve(unsigned int piece, unsigned int blockCount)
+void BlockCache::reserve(unsigned int piece, unsigned int blockCount, unsigned int pieceSize)
 {
     assert(cache_.find(piece) == cache_.end());
 
-    CacheEntry entry;
+    CacheEntry &entry = cache_[piece];
+
     entry.blocksHave = 0;
     entry.blockCount = blockCount;
-
-    cache_.insert(std::make_pair(piece, entry));
+    entry.pins = 0;
+    entry.load = 0;
+    entry.size = pieceSize;
+    entry.used = 0;
 }
 
 bool BlockCache::store(unsigned int piece, unsigned int offset, const std::string &data)
+{
+    char *slot = pin(piece, offset, data.size());
+
+    assert(slot != 0);
+
+    std::copy(data.begin(), data.end(), slot);
+
+    bool pieceCompleted = commit(piece, offset, data.size());
+
+    unpin(piece, data.size());
+
+    return pieceCompleted;
+}
+
+char *BlockCache::pin(unsigned int piece, unsigned int offset, unsigned int size)
+{
+    auto pieceIt = cache_.find(piece);
+
+    if (pieceIt == cache_.end())
+        return 0;
+
+    CacheEntry &entry = (*pieceIt).second;
+
+    if (offset > entry.size || size > entry.size - offset)
+        return 0;
+
+    if (entry.data.empty())
+        entry.data.resize(entry.size);
+
+    ++entry.pins;
+
+    entry.used += size;
+    memoryUsed += size;
+
+    return &entry.data[offset];
+}
+
+void BlockCache::unpin(unsigned int piece, unsigned int size)
+{
+    auto pieceIt = cache_.find(piece);
+
+    assert(pieceIt != cache_.end());
+
+    CacheEntry &entry = (*pieceIt).second;
+
+    assert(entry.pins > 0 && entry.used >= size);
+
+    --entry.pins;
+
+    entry.used -= size;
+    memoryUsed -= size;
+}
+
+bool BlockCache::commit(unsigned int piece, unsigned int offset, unsigned int size)
 {
     auto pieceIt = cache_.find(piece);
 
@@ -62,10 +126,13 @@ bool BlockCache::store(unsigned int piece, unsigned int offset, const std::strin
 
     CacheEntry &entry = (*pieceIt).second;
 
-    entry.blocks.push_back(std::make_pair(offset, data));
+    entry.blocks.push_back(std::make_pair(offset, size));
     entry.blocksHave += 1;
+    entry.load += size;
+    entry.used += size;
 
-    load_ += data.size();
+    load_ += size;
+    memoryUsed += size;
 
     if (entry.blocksHave == entry.blockCount) {
         ++completeCount_;
@@ -73,7 +140,6 @@ bool BlockCache::store(unsigned int piece, unsigned int offset, const std::strin
     } else {
         return false;
     }
-
 }
 
 DiskIo::WriteList BlockCache::flushEverything()
@@ -82,14 +148,17 @@ DiskIo::WriteList BlockCache::flushEverything()
 
     for (auto pieceIt = cache_.begin(); pieceIt != cache_.end(); ++pieceIt) {
         unsigned int piece = (*pieceIt).first;
-        BlockList &blocks = (*pieceIt).second.blocks;
+        CacheEntry &entry = (*pieceIt).second;
 
         std::transform(
-            blocks.begin(), blocks.end(), std::back_inserter(writeList),
-            [piece](Block &b) { return std::make_tuple(piece, b.first, b.second); }
+            entry.blocks.begin(), entry.blocks.end(), std::back_inserter(writeList),
+            [piece, &entry](Block &b) {
+                return std::make_tuple(piece, b.first, entry.data.substr(b.first, b.second));
+            }
         );
 
-        blocks.clear();
+        entry.blocks.clear();
+        entry.load = 0;
     }
 
     load_ = 0;
@@ -106,26 +175,27 @@ BlockCache::CompletePieceList BlockCache::flushComplete()
 
     auto pieceIt = cache_.begin();
     auto end = cache_.end();
-    unsigned int found = 0;
 
-    while (pieceIt != end && found < completeCount_) {
+    while (pieceIt != end && eraseList.size() < completeCount_) {
         unsigned int piece = (*pieceIt).first;
-        BlockList &blocks = (*pieceIt).second.blocks;
+        CacheEntry &entry = (*pieceIt).second;
 
-        if ((*pieceIt).second.blocksHave == (*pieceIt).second.blockCount) {
+        // Pinned pieces might still be written into, leave them till
+        // the next flush.
+        if (entry.blocksHave == entry.blockCount && entry.pins == 0) {
             completePieces.resize(completePieces.size() + 1);
 
             completePieces.back().first = piece;
 
-            for (auto blockIt = blocks.begin(); blockIt != blocks.end(); ++blockIt) {
-                completePieces.back().second.push_back(
-                        std::make_tuple(piece, (*blockIt).first, (*blockIt).second));
+            memoryUsed -= entry.used;
 
-                load_ -= (*blockIt).second.size();
-            }
+            // The whole piece buffer is handed over as a single write.
+            completePieces.back().second.push_back(
+                    std::make_tuple(piece, 0U, std::move(entry.data)));
+
+            load_ -= entry.load;
 
             eraseList.push_back(pieceIt);
-            ++found;
         }
 
         ++pieceIt;
@@ -134,11 +204,48 @@ BlockCache::CompletePieceList BlockCache::flushComplete()
     std::for_each(eraseList.begin(), eraseList.end(),
             [this](Cache::iterator &it) { cache_.erase(it); });
 
-    completeCount_ = 0;
+    completeCount_ -= eraseList.size();
 
     return std::move(completePieces);
 }
 
+bool BlockCache::drop(unsigned int piece)
+{
+    auto pieceIt = cache_.find(piece);
+
+    if (pieceIt == cache_.end())
+        return true;
+
+    CacheEntry &entry = (*pieceIt).second;
+
+    if (entry.pins > 0)
+        return false;
+
+    assert(entry.blocksHave < entry.blockCount);
+
+    load_ -= entry.load;
+    memoryUsed -= entry.used;
+
+    cache_.erase(pieceIt);
+
+    return true;
+}
+
+void BlockCache::setSizeLimit(size_t limit)
+{
+    sizeLimit_ = limit;
+}
+
+bool BlockCache::full() const
+{
+    return sizeLimit_ > 0 && memoryUsed >= sizeLimit_;
+}
+
+size_t BlockCache::memoryUsage()
+{
+    return memoryUsed;
+}
+
 unsigned int BlockCache::load() const
 {
     return load_;
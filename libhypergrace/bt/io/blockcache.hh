@@ -25,6 +25,7 @@
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <bt/io/diskio.hh>
 
@@ -40,12 +41,46 @@ public:
     BlockCache();
     ~BlockCache();
 
-    void reserve(unsigned int, unsigned int);
+    /**
+     * Registers the piece of the given size which consists of the
+     * given number of blocks. The piece buffer is allocated once the
+     * first block of the piece arrives.
+     */
+    void reserve(unsigned int, unsigned int, unsigned int);
     bool store(unsigned int, unsigned int, const std::string &);
 
+    /**
+     * Returns a pointer to the slot of the block within the piece
+     * buffer so that the block can be received into it directly, or
+     * 0 if the piece is not cached or the block is out of its bounds.
+     *
+     * The piece will not be flushed until every pin is released with
+     * unpin(). Once the data is in place commit() must be called to
+     * account the block.
+     */
+    char *pin(unsigned int, unsigned int, unsigned int);
+    void unpin(unsigned int, unsigned int);
+    bool commit(unsigned int, unsigned int, unsigned int);
+
+    /**
+     * Drops an incomplete piece along with its blocks. Returns false
+     * if the piece is pinned and can't be dropped yet.
+     */
+    bool drop(unsigned int);
+
     DiskIo::WriteList flushEverything();
     CompletePieceList flushComplete();
 
+    /**
+     * Memory taken by received and pinned blocks is shared by all
+     * caches. The cache is full once that memory reaches its size
+     * limit, 0 stands for no limit.
+     */
+    void setSizeLimit(size_t);
+    bool full() const;
+
+    static size_t memoryUsage();
+
     unsigned int load() const;
 
     unsigned int storedPieceCount() const;
@@ -54,20 +89,31 @@ public:
 private:
     struct CacheEntry;
 
-    typedef std::pair<unsigned int, std::string> Block;
-    typedef std::deque<Block> BlockList;
+    typedef std::pair<unsigned int, unsigned int> Block;
+    typedef std::vector<Block> BlockList;
     typedef std::unordered_map<unsigned int, CacheEntry> Cache;
 
     struct CacheEntry {
         unsigned int blocksHave;
         unsigned int blockCount;
+        unsigned int pins;
+        unsigned int load;
+        unsigned int size;
+
+        // Received and pinned bytes counted towards the memory usage
+        unsigned int used;
+
+        // Blocks stored since the last flush and the piece buffer
+        // they live in.
         BlockList blocks;
+        std::string data;
     };
 
     Cache cache_;
 
     unsigned int load_;
     unsigned int completeCount_;
+    size_t sizeLimit_;
 };
 
 } /* namespace Bt */
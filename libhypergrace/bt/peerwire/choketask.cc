@@ -96,10 +96,7 @@ void ChokeTask::doFullChokeRound()
 
     if (peers.size() > uploadSlots) {
 
-        std::partial_sort(
-            peers.begin(), peers.begin() + uploadSlots - 1, peers.end(),
-            [](PeerData *l, PeerData *r) { return l->rating() < r->rating(); }
-        );
+        rankPeers(peers, uploadSlots - 1);
 
         // Create a list of choked peers and randomly select one
         // for optimistic unchoke.
@@ -155,10 +152,7 @@ void ChokeTask::doPartialChokeRound()
 
     size_t willUnchoke = std::min<size_t>(uploadSlots - unchokedPeerCount_, peers.size());
 
-    std::partial_sort(
-        peers.begin(), peers.begin() + willUnchoke, peers.end(),
-        [](PeerData *l, PeerData *r) { return l->rating() < r->rating(); }
-    );
+    rankPeers(peers, willUnchoke);
 
     for (size_t i = 0; i < willUnchoke; ++i) {
         //hDebug() << "Unchoking" << peers[i]->socket().remoteAddress();
@@ -169,6 +163,36 @@ void ChokeTask::doPartialChokeRound()
     unchokedPeerCount_ += willUnchoke;
 }
 
+// Moves the given number of best ranked peers to the front. Peers
+// that give us the most come first, which is what keeps tit-for-tat
+// going. Once we are seeding nobody gives us anything, so peers that
+// take the most come first instead.
+void ChokeTask::rankPeers(std::vector<PeerData *> &peers, size_t count) const
+{
+    const Util::Bitfield &available = bundle_.state().availablePieces();
+    bool seeding = available.enabledCount() == available.bitCount();
+
+    std::vector<std::pair<size_t, PeerData *> > ranked;
+
+    // Rates are sampled once, they keep changing while we sort.
+    for (auto peer = peers.begin(); peer != peers.end(); ++peer) {
+        size_t rate = seeding ? (*peer)->payloadUploadRate().rate()
+                              : (*peer)->payloadDownloadRate().rate();
+
+        ranked.push_back(std::make_pair(rate, *peer));
+    }
+
+    std::partial_sort(
+        ranked.begin(), ranked.begin() + count, ranked.end(),
+        [](const std::pair<size_t, PeerData *> &l, const std::pair<size_t, PeerData *> &r) {
+            return l.first > r.first;
+        }
+    );
+
+    for (size_t i = 0; i < ranked.size(); ++i)
+        peers[i] = ranked[i].second;
+}
+
 void ChokeTask::execute()
 {
     doFullChokeRound();
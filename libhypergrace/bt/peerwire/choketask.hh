@@ -21,6 +21,8 @@
 #ifndef BT_IO_CHOKETASK_HH_
 #define BT_IO_CHOKETASK_HH_
 
+#include <vector>
+
 #include <net/task.hh>
 #include <util/shared.hh>
 
@@ -47,6 +49,8 @@ private:
     void doFullChokeRound();
     void doPartialChokeRound();
 
+    void rankPeers(std::vector<PeerData *> &, size_t) const;
+
     void execute();
 
 private:
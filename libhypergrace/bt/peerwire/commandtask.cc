@@ -36,12 +36,15 @@
 #include <bt/peerwire/messageassembler.hh>
 #include <bt/peerwire/peerdata.hh>
 #include <bt/peerwire/peerdatacollector.hh>
+#include <bt/peerwire/pipeline.hh>
 #include <bt/globaltorrentregistry.hh>
 
+#include <delegate/bind.hh>
+
 #include <net/bandwidthallocator.hh>
 #include <net/outputmiddleware.hh>
 #include <net/reactor.hh>
-#include <net/rateaccumulator.hh>
+#include <net/rateestimator.hh>
 #include <net/tcpsocket.hh>
 
 #include <util/filesystem.hh>
@@ -68,6 +71,8 @@ public:
         ioThread_(ioThread),
         globalDownloadAllocator_(globalDownloadAllocator),
         globalUploadAllocator_(globalUploadAllocator),
+        localDownloadAllocator_(&globalDownloadAllocator),
+        localUploadAllocator_(&globalUploadAllocator),
         chokeTask_(chokeTask),
         interestTask_(bundle),
         downloadTask_(downloadTask),
@@ -75,9 +80,6 @@ public:
         resetRateLimits_(true),
         resetScheduledPiecesMask_(true)
     {
-        reactor_.setDownloadRateAccumulator(&downloadRate_);
-        reactor_.setUploadRateAccumulator(&uploadRate_);
-
         Util::FileSystem::createPath(bundle_.bundleDirectory() + "/", 0755);
 
         serializeBundlePart(TorrentBundle::configurationFilename(), bundle_.configuration());
@@ -85,7 +87,7 @@ public:
         serializeBundlePart(TorrentBundle::stateFilename(), bundle_.state());
     }
 
-    void reconfigurePeer(PeerSettings &peerSettings)
+    void reconfigurePeer(const PeerSettings &peerSettings)
     {
         // Drop connection if we already have a peer with the same
         // peer id.
@@ -100,32 +102,46 @@ public:
         std::shared_ptr<PeerData> peer =
             std::make_shared<PeerData>(bundle_, *socket, peerSettings.peerId);
 
-        // Construct both I/O middleware chains.
-        // Input:  i --> MessageAssembler --> PeerDataCollector --> DownloadMediator
+        // Construct both I/O middleware chains. The peer-wire stages are
+        // composed at compile time, see Pipeline.
+        // Input:  i --> MessageAssembler --> [PeerDataCollector --> EventHub]
         // Output: o --> PeerDataCollector
+        typedef Pipeline<PeerDataCollector, EventHub> PeerPipeline;
+
+        PeerDataCollector *peerDataCollector =
+            new PeerDataCollector(bundle_, peer, Bt::InputMiddleware::Pointer());
+
         EventHub *eventHub =
             new EventHub(bundle_, peer, chokeTask_, interestTask_, downloadTask_, uploadTask_);
 
-        Bt::InputMiddleware::Pointer inputThird(eventHub);
+        std::shared_ptr<PeerPipeline> pipeline =
+            std::make_shared<PeerPipeline>(peerDataCollector, eventHub);
 
-        PeerDataCollector *peerDataCollector =
-            new PeerDataCollector(bundle_, peer, inputThird);
+        Net::InputMiddleware::Pointer inputFirst(new MessageAssembler(pipeline));
+        Net::OutputMiddleware::Pointer outputFirst(pipeline, peerDataCollector);
 
-        Bt::InputMiddleware::Pointer inputSecond(peerDataCollector);
-        Net::InputMiddleware::Pointer inputFirst(new MessageAssembler(inputSecond));
-        Net::OutputMiddleware::Pointer outputFirst(inputSecond, peerDataCollector);
+        socket->downloadRate().setParent(&downloadRate_);
+        socket->uploadRate().setParent(&uploadRate_);
+        peer->payloadDownloadRate().setParent(&payloadDownloadRate_);
+        peer->payloadUploadRate().setParent(&payloadUploadRate_);
 
         socket->setLocalBandwidthAllocators(&localDownloadAllocator_, &localUploadAllocator_);
         socket->setGlobalBandwidthAllocators(&globalDownloadAllocator_, &globalUploadAllocator_);
         socket->setInputMiddleware(inputFirst);
         socket->setOutputMiddleware(outputFirst);
 
-        reactor_.observe(socket);
+        // The socket owns the descriptor and the middleware chains.
+        if (!reactor_.observe(socket)) {
+            delete socket;
+            return;
+        }
 
         // Let the input middleware process the data we got past the
         // handshake message.
-        if (!peerSettings.streamContinuation.empty())
-            socket->inputMiddleware().receive(*socket, peerSettings.streamContinuation);
+        if (!peerSettings.streamContinuation.empty()) {
+            std::string continuation = peerSettings.streamContinuation;
+            socket->inputMiddleware().receive(*socket, continuation);
+        }
     }
 
     bool updateFileStorage(const std::string &filename, long long size)
@@ -316,8 +332,10 @@ public:
 
         ioResults_.clear();
 
-        if (successes > 0)
+        if (successes > 0) {
+            downloadTask_.broadcastHaves();
             serializeBundlePart(TorrentBundle::stateFilename(), bundle_.state());
+        }
     }
 
     void notifyWriteSuccess(unsigned int piece)
@@ -365,14 +383,16 @@ public:
     DownloadTask &downloadTask_;
     UploadTask &uploadTask_;
 
-    Net::RateAccumulator downloadRate_;
-    Net::RateAccumulator uploadRate_;
+    // Rates of the torrent, the sockets and peers feed them.
+    Net::RateEstimator downloadRate_;
+    Net::RateEstimator uploadRate_;
+    Net::RateEstimator payloadDownloadRate_;
+    Net::RateEstimator payloadUploadRate_;
 
     volatile bool resetRateLimits_;
     volatile bool resetScheduledPiecesMask_;
 
     std::deque<FlushResult> ioResults_;
-    std::deque<PeerSettings> waitingPeers_;
 
     std::mutex anchor_;
 };
@@ -411,9 +431,12 @@ void CommandTask::notifyFileMaskChanged()
 
 void CommandTask::notifyPeerConnected(const PeerSettings &peerSettings)
 {
-    std::lock_guard<std::mutex> l(d->anchor_);
-
-    d->waitingPeers_.push_back(peerSettings);
+    // Hand the peer over to the reactor's thread right away instead of
+    // waiting for the next execute() tick.
+    if (!d->reactor_.post(Delegate::bind(&Private::reconfigurePeer, d, peerSettings))) {
+        // Nobody is going to take over the connection.
+        ::close(peerSettings.socketFd);
+    }
 }
 
 void CommandTask::execute()
@@ -421,14 +444,23 @@ void CommandTask::execute()
     std::lock_guard<std::mutex> l(d->anchor_);
 
     // Update I/O rates.
-    d->bundle_.state().setDownloadRate(d->downloadRate_.reset());
-    d->bundle_.state().setUploadRate(d->uploadRate_.reset());
+    d->bundle_.state().setDownloadRate(d->downloadRate_.rate());
+    d->bundle_.state().setUploadRate(d->uploadRate_.rate());
+    d->bundle_.state().setPayloadDownloadRate(d->payloadDownloadRate_.rate());
+    d->bundle_.state().setPayloadUploadRate(d->payloadUploadRate_.rate());
 
     // Reset bandwidth rate limits on local allocators if limits has
     // been changed.
     if (d->resetRateLimits_) {
+        d->localDownloadAllocator_.setBurst(d->bundle_.configuration().bandwidthBurst());
+        d->localUploadAllocator_.setBurst(d->bundle_.configuration().bandwidthBurst());
+
         d->localDownloadAllocator_.limit(d->bundle_.configuration().downloadRateLimit());
         d->localUploadAllocator_.limit(d->bundle_.configuration().uploadRateLimit());
+
+        d->localDownloadAllocator_.setWeight(d->bundle_.configuration().bandwidthWeight());
+        d->localUploadAllocator_.setWeight(d->bundle_.configuration().bandwidthWeight());
+
         d->resetRateLimits_ = false;
     }
 
@@ -440,24 +472,15 @@ void CommandTask::execute()
         d->resetScheduledPiecesMask(unmaskedFiles);
         // TODO: Handle failure case.
         d->updateUnmaskedFilesStorage(unmaskedFiles);
+        d->downloadTask_.notifyScheduleChanged();
 
         d->resetScheduledPiecesMask_ = false;
     }
 
-    // Renew available bandwith amount.
-    d->localDownloadAllocator_.renew();
-    d->localUploadAllocator_.renew();
-
     // Maintain block cache.
     if (d->downloadTask_.cache().completePieceCount() > 0)
         d->flushPendingPieces();
 
     if (!d->ioResults_.empty())
         d->processIoResults();
-
-    // Receive peers with whom we have completed handshake.
-    for (auto peer = d->waitingPeers_.begin(); peer != d->waitingPeers_.end(); ++peer)
-        d->reconfigurePeer(*peer);
-
-    d->waitingPeers_.clear();
 }
@@ -26,16 +26,20 @@
 #include <list>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #include <bt/peerwire/message.hh>
 
+#include <bt/globaltorrentregistry.hh>
+#include <bt/bundle/deadlineregistry.hh>
 #include <bt/bundle/peerregistry.hh>
 #include <bt/bundle/torrentbundle.hh>
 #include <bt/bundle/torrentconfiguration.hh>
 #include <bt/bundle/torrentmodel.hh>
 #include <bt/bundle/torrentstate.hh>
 #include <bt/io/blockcache.hh>
+#include <bt/peerwire/partialpiecetable.hh>
 #include <bt/peerwire/peerdata.hh>
 #include <bt/peerwire/pieceadvisor.hh>
 
@@ -43,8 +47,6 @@
 #include <delegate/bind.hh>
 #include <net/socket.hh>
 
-#include <util/murmurhash2.hh>
-
 #include "downloadtask.hh"
 
 using namespace Hypergrace;
@@ -54,86 +56,34 @@ using namespace Hypergrace::Bt;
 class DownloadTask::Private
 {
 public:
-    struct BlockLocation
-    {
-        inline bool operator ==(const BlockLocation &other) const
-        {
-            return offset == other.offset && size == other.size;
-        }
-
-        inline bool operator !=(const BlockLocation &other) const
-        {
-            return !(*this == other);
-        }
-
-        inline bool operator <(const BlockLocation &other) const
-        {
-            return offset < other.offset;
-        }
-
-        unsigned int offset;
-        unsigned int size;
-    };
-
-    struct BlockId
-    {
-        inline bool operator ==(const BlockId &other) const
-        {
-            return piece == other.piece && location == other.location;
-        }
-
-        inline bool operator !=(const BlockId &other) const
-        {
-            return !(*this == other);
-        }
-
-        inline bool operator <(const BlockId &other) const
-        {
-            return piece < other.piece || (piece == other.piece && location < other.location);
-        }
-
-        unsigned int piece;
-        BlockLocation location;
-    };
-
-    struct BlockIdHash
-    {
-        inline size_t operator ()(const BlockId &blockId) const
-        {
-            union {
-                unsigned int init[2];
-                char bytes[sizeof(unsigned int[2])];
-            } key = {{ blockId.piece, blockId.location.offset }};
-
-            return Util::murmurHash2(key.bytes, sizeof(key), 1495723221);
-        }
-    };
-
     struct DownloadState : public PeerData::CustomData
     {
         bool ignorePeer;
         Util::Time ignorePeerUntil;
 
-        std::vector<BlockId> requestedBlocks;
+        // Slot of the peer in the partial piece table
+        unsigned int slot;
         Util::Time lastUploadActivity;
 
+        DownloadTask::SpeedClass speedClass;
+
+        // Number of requests to keep outstanding, follows the rate and
+        // the round trip time of the peer
+        unsigned int queueDepth;
+
         std::vector<unsigned int> requestCache;
         Util::Time requestCacheUpdateTime;
     };
 
-    struct BlockDescriptor
-    {
-        std::vector<PeerData *> involvedPeers;
-    };
-
-    typedef std::map<unsigned int, std::vector<BlockLocation> > PendingPiecesMap;
-
 public:
     Private(TorrentBundle &bundle) :
         bundle_(bundle),
         peers_(bundle.state().peerRegistry().internalPeerList()),
-        pieceAdvisor_(bundle),
-        downloadingBlocks_(1000)
+        pieceAdvisor_(bundle.state().scheduledPieces()),
+        partialPieces_(bundle.model().torrentSize(), bundle.model().pieceSize(),
+                       DownloadTask::BlockSize),
+        requestBudget_(bundle.configuration().requestMemoryBudget()),
+        deadlineRevision_(0)
     {
     }
 
@@ -145,6 +95,18 @@ public:
             PeerData *peer = *peerIt;
             auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
+            peerState->queueDepth = DownloadTask::requestQueueDepth(
+                    peer->payloadDownloadRate().rate(), peer->socket().roundTripTime());
+
+            DownloadTask::SpeedClass speedClass = DownloadTask::speedClass(
+                    peer->payloadDownloadRate().rate(), bundle_.model().pieceSize());
+
+            // Pieces of a peer which has slowed down are open to others.
+            if (peerState->speedClass == DownloadTask::FastPeer && speedClass != DownloadTask::FastPeer)
+                partialPieces_.release(peerState->slot);
+
+            peerState->speedClass = speedClass;
+
             if (peer->peerChokedUs())
                 continue;
 
@@ -155,7 +117,7 @@ public:
                     peerState->lastUploadActivity = now;
                     hDebug() << "Forgiven peer" << peer->socket().remoteAddress();
                 }
-            } else if (peerState->requestedBlocks.size() > 0 &&
+            } else if (outstanding(*peerState) > 0 &&
                        peerState->lastUploadActivity + Util::Time(0, 0, 60) <= now) {
                 // Start ignoring peer if it didn't sent us any requested
                 // blocks for a long time.
@@ -169,67 +131,95 @@ public:
         }
     }
 
+    // Drops all requests outstanding at the peer. Blocks nobody else
+    // has been asked for become free to be requested again.
     void cancelDownload(PeerData *peer)
     {
-        auto &requests = peer->getData<DownloadState>(PeerData::DownloadTask)->requestedBlocks;
+        unsigned int slot = peer->getData<DownloadState>(PeerData::DownloadTask)->slot;
+
+        partialPieces_.cancelAll(slot);
+        partialPieces_.release(slot);
+    }
 
-        for (auto requestIt = requests.begin(); requestIt != requests.end(); ++requestIt) {
-            // Remove uploader from the expected uploaders list of
-            // this block.
-            auto blockIt = downloadingBlocks_.find(*requestIt);
-            assert(blockIt != downloadingBlocks_.end());
+    // Whether the peer may be handed free blocks of the piece. Pieces
+    // a fast peer has claimed are left to it.
+    bool mayRequest(const DownloadState &peerState, unsigned int piece) const
+    {
+        unsigned int owner = partialPieces_.owner(piece);
 
-            BlockDescriptor &block = (*blockIt).second;
+        return owner == PartialPieceTable::NoSlot || owner == peerState.slot;
+    }
 
-            auto peerIt = std::find(block.involvedPeers.begin(), block.involvedPeers.end(), peer);
-            assert(peerIt != block.involvedPeers.end());
+    void claimIfFast(const DownloadState &peerState, unsigned int piece)
+    {
+        if (peerState.speedClass == DownloadTask::FastPeer &&
+            partialPieces_.owner(piece) == PartialPieceTable::NoSlot)
+        {
+            partialPieces_.claim(piece, peerState.slot);
+        }
+    }
 
-            std::iter_swap(peerIt, block.involvedPeers.end() - 1);
-            block.involvedPeers.pop_back();
+    // Whether a fast peer holding the piece could start on it right
+    // now. Slow peers leave fresh pieces to such peers.
+    bool fastPeerAvailable(unsigned int piece) const
+    {
+        for (auto peerIt = peers_.begin(); peerIt != peers_.end(); ++peerIt) {
+            PeerData *peer = *peerIt;
+            auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
-            // If we didn't request this block from anyone else, it
-            // shall be returned into the pending blocks list so it
-            // can possibly be requested later.
-            if (block.involvedPeers.empty()) {
-                pendingPieces_[(*requestIt).piece].push_back((*requestIt).location);
-                downloadingBlocks_.erase(blockIt);
+            if (peerState->speedClass == DownloadTask::FastPeer && !peerState->ignorePeer &&
+                !peer->peerChokedUs() && peer->weAreInterested() &&
+                peer->bitfield().bit(piece) && freeSlots(*peerState) > 0)
+            {
+                return true;
             }
         }
 
-        requests.clear();
+        return false;
     }
 
-    template<typename OutputIterator>
-    void breakPieceIntoBlocks(unsigned int piece, OutputIterator result)
-    {
-        const unsigned int blockSize = 16 * 1024;
-        unsigned int lastPieceIndex = bundle_.model().pieceCount() - 1;
-        unsigned int pieceSize = 0;
-
-        if (piece < lastPieceIndex) {
-            pieceSize = bundle_.model().pieceSize();
-        } else if (piece == lastPieceIndex) {
-            unsigned int modulo = bundle_.model().torrentSize() % bundle_.model().pieceSize();
-            pieceSize = (modulo != 0) ? modulo : bundle_.model().pieceSize();
-        } else {
-            assert(!"Piece number is out of range");
-            return;
-        }
+    size_t outstanding(const DownloadState &peerState) const
+    {
+        return partialPieces_.outstanding(peerState.slot);
+    }
 
-        // Construct full-sized blocks first.
-        for (unsigned int piece = 0; piece < pieceSize / blockSize; ++piece) {
-            BlockLocation location = { piece * blockSize, blockSize };
-            *result++ = location;
+    // Marks the block as received, cancels its duplicates and tops up
+    // request queues of every peer it has been requested from. Returns
+    // false if the block hasn't been requested at all.
+    bool settleRequests(PeerData *peer, unsigned int piece, unsigned int block)
+    {
+        if (!partialPieces_.active(piece) ||
+            partialPieces_.state(piece, block) != PartialPieceTable::Requested)
+        {
+            return false;
         }
 
-        // Construct tail block of variable size if it exists.
-        if (pieceSize % blockSize != 0) {
-            unsigned int offset = (pieceSize / blockSize) * blockSize;
-            unsigned int size = pieceSize - offset;
+        Util::Time now = Util::Time::monotonicTime();
+
+        std::vector<unsigned int> slots;
+        partialPieces_.requesters(piece, block, slots);
+
+        unsigned int offset = partialPieces_.blockOffset(block);
+        unsigned int size = partialPieces_.blockSize(piece, block);
+
+        if (partialPieces_.receive(piece, block))
+            notifyPieceReceived(piece, now);
+
+        for (auto slotIt = slots.begin(); slotIt != slots.end(); ++slotIt) {
+            PeerData *involvedPeer = peerSlots_[*slotIt];
+            auto involvedPeerState =
+                involvedPeer->getData<DownloadState>(PeerData::DownloadTask);
+
+            if (peer != involvedPeer)
+                involvedPeer->socket().send(new CancelMessage(piece, offset, size));
+
+            involvedPeerState->lastUploadActivity = now;
 
-            BlockLocation location = { offset, size };
-            *result++ = location;
+            if (wantsRequests(*involvedPeerState))
+                feedUploader(involvedPeer, now);
         }
+
+        return true;
     }
 
     template<typename OutputIterator>
@@ -244,22 +234,64 @@ public:
         }
     }
 
-    std::vector<BlockLocation> &enqueueNewPiece(unsigned int piece)
+    // Folds the time the piece took to arrive into the average piece
+    // time of the torrent.
+    void notifyPieceReceived(unsigned int piece, const Util::Time &now)
     {
-        auto result = pendingPieces_.insert(
-                std::make_pair(piece, std::vector<BlockLocation>()));
-        std::vector<BlockLocation> &blocks = (*result.first).second;
+        auto startIt = pieceStartTimes_.find(piece);
+        assert(startIt != pieceStartTimes_.end());
+
+        size_t elapsed = (now - (*startIt).second).toMilliseconds();
+        size_t average = bundle_.state().averagePieceTime();
 
-        breakPieceIntoBlocks(piece, std::back_inserter(blocks));
-        blockCache_.reserve(piece, blocks.size());
+        average = (average == 0) ? elapsed : (average * 7 + elapsed) / 8;
+
+        bundle_.state().setAveragePieceTime(average);
+        pieceStartTimes_.erase(startIt);
+    }
+
+    // Opens the piece for download unless the block caches have used
+    // up their memory, in which case false is returned.
+    bool enqueueNewPiece(unsigned int piece)
+    {
+        if (blockCache_.full())
+            return false;
+
+        blockCache_.reserve(piece, partialPieces_.blockCount(piece),
+                            partialPieces_.pieceLength(piece));
+
+        partialPieces_.open(piece);
+        pieceStartTimes_[piece] = Util::Time::monotonicTime();
 
         // Mark the piece as "dirty" so the piece advisor will not try
         // to include it in the future recommendations.
         pieceAdvisor_.markDirty(piece);
 
-        assert(result.second);
+        return true;
+    }
+
+    // Gives up pieces in transit that no connected peer has. Blocks
+    // received so far would hold cache memory until such a peer shows
+    // up, possibly never.
+    void abandonOrphanPieces()
+    {
+        std::vector<unsigned int> pieces = partialPieces_.activePieces();
+
+        for (auto it = pieces.begin(); it != pieces.end(); ++it) {
+            unsigned int piece = *it;
+
+            auto holder = std::find_if(peers_.begin(), peers_.end(),
+                    [piece](PeerData *peer) { return peer->bitfield().bit(piece); });
+
+            if (holder != peers_.end() || !blockCache_.drop(piece))
+                continue;
+
+            partialPieces_.abort(piece);
+            pieceAdvisor_.markClean(piece);
 
-        return blocks;
+            prioritizedPieces_.erase(piece);
+            pieceStartTimes_.erase(piece);
+        }
     }
 
     void pumpInPrioritizedPieces()
@@ -270,115 +302,277 @@ public:
             if (piece == (unsigned int)-1)
                 break;
 
-            enqueueNewPiece(piece);
+            if (!enqueueNewPiece(piece))
+                break;
 
             auto result = prioritizedPieces_.insert(piece);
             assert(result.second);
         }
     }
 
-    void sendDeferredRequests()
+    // Maps the byte ranges wanted by the streaming consumer to the
+    // earliest deadline of every piece still missing.
+    void synchronizeDeadlines()
     {
-        // Sort pieces by priority.
-        std::deque<PendingPiecesMap::iterator> priorityQueue_;
+        DeadlineRegistry &registry = bundle_.state().deadlineRegistry();
+        unsigned long long revision = registry.revision();
 
-        for (auto it = pendingPieces_.begin(); it != pendingPieces_.end(); ++it) {
-            if (prioritizedPieces_.find((*it).first) != prioritizedPieces_.end())
-                priorityQueue_.push_front(it);
-            else
-                priorityQueue_.push_back(it);
-        }
+        if (revision == deadlineRevision_)
+            return;
 
-        // Try to send pending requests.
-        for (auto it = priorityQueue_.begin(); it != priorityQueue_.end(); ++it) {
-            unsigned int piece = (**it).first;
-            std::vector<BlockLocation> &blocks = (**it).second;
-            std::vector<PeerData *> pieceUploaders;
+        const unsigned long long pieceSize = bundle_.model().pieceSize();
+        const unsigned int pieceCount = bundle_.model().pieceCount();
+        const Util::Bitfield &available = bundle_.state().availablePieces();
 
-            enumPieceHolders(piece, std::back_inserter(pieceUploaders));
+        auto ranges = registry.deadlines();
 
-            std::sort(
-                    pieceUploaders.begin(), pieceUploaders.end(),
-                    [](PeerData *l, PeerData *r) {
-                        auto ls = l->getData<DownloadState>(PeerData::DownloadTask);
-                        auto rs = r->getData<DownloadState>(PeerData::DownloadTask);
-                        return ls->requestedBlocks.size() < rs->requestedBlocks.size();
-                    }
-            );
+        deadlines_.clear();
+        deadlineRevision_ = revision;
 
-            if (!pieceUploaders.empty()) {
-                distributeRequests(pieceUploaders, piece, blocks);
+        for (auto rangeIt = ranges.begin(); rangeIt != ranges.end(); ++rangeIt) {
+            const DeadlineRegistry::Deadline &range = *rangeIt;
 
-                if (blocks.empty())
-                    pendingPieces_.erase(*it);
-            } else {
-                // Demote piece to avoid clogging prioritized slots
-                // with dead pieces.
-                prioritizedPieces_.erase(piece);
+            unsigned long long first = range.offset / pieceSize;
+            unsigned long long last = (range.offset + range.size - 1) / pieceSize;
+
+            for (unsigned long long piece = first; piece <= last && piece < pieceCount; ++piece) {
+                if (available.bit(piece))
+                    continue;
+
+                auto result = deadlines_.insert(std::make_pair(piece, range.time));
+
+                if (!result.second && range.time < (*result.first).second)
+                    (*result.first).second = range.time;
             }
         }
+
+        // Forget misses of pieces nobody waits for anymore.
+        for (auto it = missedPieces_.begin(); it != missedPieces_.end();) {
+            if (deadlines_.find(*it) == deadlines_.end())
+                missedPieces_.erase(it++);
+            else
+                ++it;
+        }
     }
 
-    void updateRequestCache(PeerData *peer)
+    // Orders peers fastest first. Rates are sampled once, they keep
+    // changing while we sort.
+    void sortByRate(std::vector<PeerData *> &peers) const
     {
-        const size_t capacity = 10;
+        std::vector<std::pair<size_t, PeerData *> > ranked;
+        ranked.reserve(peers.size());
+
+        for (auto peer = peers.begin(); peer != peers.end(); ++peer)
+            ranked.push_back(std::make_pair((*peer)->payloadDownloadRate().rate(), *peer));
 
-        auto &requestCache = peer->getData<DownloadState>(PeerData::DownloadTask)->requestCache;
+        std::sort(
+            ranked.begin(), ranked.end(),
+            [](const std::pair<size_t, PeerData *> &l, const std::pair<size_t, PeerData *> &r) {
+                return l.first > r.first;
+            }
+        );
+
+        for (size_t i = 0; i < ranked.size(); ++i)
+            peers[i] = ranked[i].second;
+    }
+
+    // Requests pieces due within the streaming window from the fastest
+    // peers having them, earliest deadline first, before the rarest
+    // first selection gets to fill up the request queues.
+    void serveDeadlines(const Util::Time &now)
+    {
+        synchronizeDeadlines();
+
+        if (deadlines_.empty())
+            return;
 
-        const Util::Bitfield &peerBitfield = peer->bitfield();
         const Util::Bitfield &schedPieces = bundle_.state().scheduledPieces();
-        unsigned int pieceCount = bundle_.model().pieceCount();
+        const Util::Time window = now + Util::Time(0, 0, DownloadTask::StreamingWindow);
+        const Util::Time urgency = now + Util::Time(0, 0, DownloadTask::DeadlineUrgency);
 
-        unsigned int start = rand() % peerBitfield.byteCount();
-        unsigned int byteOffset = start;
+        std::vector<std::pair<Util::Time, unsigned int> > duePieces;
 
-        requestCache.clear();
-        requestCache.reserve(capacity);
+        for (auto it = deadlines_.begin(); it != deadlines_.end(); ++it) {
+            unsigned int piece = (*it).first;
+            const Util::Time &deadline = (*it).second;
+
+            if (deadline <= now && missedPieces_.insert(piece).second) {
+                bundle_.state().deadlineRegistry().reportMiss();
+
+                hcWarning(bundle_.model().name())
+                    << "Piece" << piece << "has missed its deadline";
+            }
+
+            if (deadline <= window && schedPieces.bit(piece))
+                duePieces.push_back(std::make_pair(deadline, piece));
+        }
+
+        std::sort(duePieces.begin(), duePieces.end());
+
+        for (auto it = duePieces.begin(); it != duePieces.end(); ++it) {
+            unsigned int piece = (*it).second;
+            std::vector<PeerData *> holders;
 
-        // Try to find not downloaded/downloading pieces. Walk forward.
-        while (byteOffset < schedPieces.byteCount() && requestCache.size() < capacity) {
-            if (peerBitfield.byte(byteOffset) == 0 || schedPieces.byte(byteOffset) == 0) {
-                ++byteOffset;
+            enumPieceHolders(piece, std::back_inserter(holders));
+
+            if (holders.empty())
                 continue;
+
+            sortByRate(holders);
+
+            if (!pieceAdvisor_.isDirty(piece))
+                enqueueNewPiece(piece);
+
+            if (partialPieces_.active(piece)) {
+                for (auto peerIt = holders.begin(); peerIt != holders.end() &&
+                     partialPieces_.freeBlockCount(piece) > 0; ++peerIt)
+                {
+                    sendBlockRequests(*peerIt, piece, 0);
+                }
             }
 
-            unsigned int limit = std::min(byteOffset * CHAR_BIT + CHAR_BIT, pieceCount);
+            if ((*it).first <= urgency)
+                duplicateRequests(piece, holders);
+        }
+    }
 
-            for (unsigned int piece = byteOffset * CHAR_BIT; piece < limit; ++piece) {
-                if (peerBitfield.bit(piece) && schedPieces.bit(piece) &&
-                    !pieceAdvisor_.isDirty(piece))
+    // Requests blocks of a piece which is about to miss its deadline
+    // from the fastest holders not asked for them yet.
+    void duplicateRequests(unsigned int piece, const std::vector<PeerData *> &holders)
+    {
+        if (!partialPieces_.active(piece))
+            return;
+
+        unsigned int blocks = partialPieces_.blockCount(piece);
+
+        for (unsigned int block = 0; block < blocks; ++block) {
+            if (partialPieces_.state(piece, block) != PartialPieceTable::Requested)
+                continue;
+
+            for (auto peerIt = holders.begin(); peerIt != holders.end(); ++peerIt) {
+                if (partialPieces_.requesterCount(piece, block) >= DownloadTask::MaximumDeadlineRequests)
+                    break;
+
+                auto peerState = (*peerIt)->getData<DownloadState>(PeerData::DownloadTask);
+
+                if (freeSlots(*peerState) == 0 ||
+                    partialPieces_.requestedFrom(piece, block, peerState->slot))
                 {
-                    requestCache.push_back(piece);
+                    continue;
                 }
+
+                sendBlockRequest(*peerIt, piece, block);
             }
+        }
+    }
+
+    void sendDeferredRequests()
+    {
+        // Sort pieces with free blocks by priority.
+        std::deque<unsigned int> priorityQueue_;
+        std::vector<unsigned int> pieces = partialPieces_.activePieces();
 
-            ++byteOffset;
+        for (auto it = pieces.begin(); it != pieces.end(); ++it) {
+            if (partialPieces_.freeBlockCount(*it) == 0)
+                continue;
+
+            if (prioritizedPieces_.find(*it) != prioritizedPieces_.end())
+                priorityQueue_.push_front(*it);
+            else
+                priorityQueue_.push_back(*it);
         }
 
-        // Try to find not downloaded/downloading pieces. Walk backwards.
-        byteOffset = start - 1;
+        // Try to send pending requests.
+        for (auto it = priorityQueue_.begin(); it != priorityQueue_.end(); ++it) {
+            unsigned int piece = *it;
+            std::vector<PeerData *> pieceUploaders;
 
-        while (byteOffset != (unsigned int)-1 && requestCache.size() < capacity) {
-            if (peerBitfield.byte(byteOffset) == 0 || schedPieces.byte(byteOffset) == 0) {
-                --byteOffset;
+            enumPieceHolders(piece, std::back_inserter(pieceUploaders));
+
+            if (pieceUploaders.empty()) {
+                // Demote piece to avoid clogging prioritized slots
+                // with dead pieces.
+                prioritizedPieces_.erase(piece);
                 continue;
             }
 
-            unsigned int limit = byteOffset * CHAR_BIT + CHAR_BIT;
+            auto denied = std::remove_if(
+                    pieceUploaders.begin(), pieceUploaders.end(),
+                    [this, piece](PeerData *peer) {
+                        return !mayRequest(*peer->getData<DownloadState>(PeerData::DownloadTask), piece);
+                    }
+            );
 
-            for (unsigned int piece = byteOffset * CHAR_BIT; piece < limit; ++piece) {
-                if (peerBitfield.bit(piece) && schedPieces.bit(piece) &&
-                    !pieceAdvisor_.isDirty(piece))
-                {
-                    requestCache.push_back(piece);
+            pieceUploaders.erase(denied, pieceUploaders.end());
+
+            if (pieceUploaders.empty())
+                continue;
+
+            // A fast peer takes the whole piece rather than sharing it
+            // with slower ones, provided it has room for the requests.
+            sortByRate(pieceUploaders);
+
+            PeerData *fastest = pieceUploaders.front();
+            auto fastestState = fastest->getData<DownloadState>(PeerData::DownloadTask);
+
+            if (fastestState->speedClass == DownloadTask::FastPeer) {
+                if (sendBlockRequests(fastest, piece, 0) > 0) {
+                    claimIfFast(*fastestState, piece);
+                    continue;
                 }
             }
 
-            --byteOffset;
+            std::sort(
+                    pieceUploaders.begin(), pieceUploaders.end(),
+                    [this](PeerData *l, PeerData *r) {
+                        auto ls = l->getData<DownloadState>(PeerData::DownloadTask);
+                        auto rs = r->getData<DownloadState>(PeerData::DownloadTask);
+                        return outstanding(*ls) < outstanding(*rs);
+                    }
+            );
+
+            distributeRequests(pieceUploaders, piece);
         }
     }
 
-    void feedUploader(PeerData *peer, const Util::Time &now)
+    // Whether the peer's request queue has drained far enough to be
+    // topped up.
+    bool wantsRequests(const DownloadState &peerState) const
+    {
+        return outstanding(peerState) < peerState.queueDepth / 2;
+    }
+
+    // Number of requests that can be sent to the peer right now
+    // without exceeding its queue depth or the memory budget of the
+    // torrent.
+    size_t freeSlots(const DownloadState &peerState) const
+    {
+        size_t queued = outstanding(peerState);
+        size_t slots = (queued < peerState.queueDepth) ? peerState.queueDepth - queued : 0;
+        size_t requestedBytes = partialPieces_.requestedBytes();
+        size_t memory = (requestedBytes < requestBudget_)
+                ? (requestBudget_ - requestedBytes) / DownloadTask::BlockSize : 0;
+
+        return std::min(slots, memory);
+    }
+
+    void updateRequestCache(PeerData *peer)
+    {
+        auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
+        auto &requestCache = peerState->requestCache;
+
+        // Cache enough pieces to fill the whole request queue.
+        size_t blocksPerPiece = bundle_.model().pieceSize() / DownloadTask::BlockSize;
+        size_t capacity = std::max<size_t>(10, peerState->queueDepth / std::max<size_t>(blocksPerPiece, 1) + 1);
+
+        requestCache.clear();
+        requestCache.reserve(capacity);
+
+        // Rarest pieces the peer has come first.
+        pieceAdvisor_.recommend(peer->bitfield(), capacity, requestCache);
+    }
+
+    void refreshRequestCache(PeerData *peer, const Util::Time &now)
     {
         auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
@@ -388,16 +582,20 @@ public:
             updateRequestCache(peer);
             peerState->requestCacheUpdateTime = now;
         }
+    }
+
+    void feedUploader(PeerData *peer, const Util::Time &now)
+    {
+        auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
+
+        refreshRequestCache(peer, now);
 
         auto pieceIt = peerState->requestCache.begin();
-        unsigned int requestLimit = 8;
         unsigned int sentRequests = 0;
 
         const Util::Bitfield &schedPieces = bundle_.state().scheduledPieces();
 
-        while (pieceIt != peerState->requestCache.end() &&
-               peerState->requestedBlocks.size() < requestLimit)
-        {
+        while (pieceIt != peerState->requestCache.end() && freeSlots(*peerState) > 0) {
             unsigned int piece = *pieceIt;
 
             if (!schedPieces.bit(piece)) {
@@ -407,30 +605,38 @@ public:
 
             if (!pieceAdvisor_.isDirty(piece)) {
                 // This piece is "clean". It's not being downloaded.
-                std::vector<BlockLocation> &blocks = enqueueNewPiece(piece);
+                if (peerState->speedClass == DownloadTask::SlowPeer && fastPeerAvailable(piece)) {
+                    ++pieceIt;
+                    continue;
+                }
+
+                // The cache has no room for another piece, keep to
+                // those in progress.
+                if (!enqueueNewPiece(piece))
+                    break;
 
                 //hDebug() << "Feeding peer with clean" << piece;
-                sentRequests += sendBlockRequests(peer, piece, blocks, 0);
+                unsigned int sent = sendBlockRequests(peer, piece, 0);
 
-                // Don't forget to erase pending request entry if we
-                // sent all blocks.
-                if (blocks.empty())
-                    pendingPieces_.erase(piece);
+                if (sent > 0)
+                    claimIfFast(*peerState, piece);
+
+                sentRequests += sent;
             } else  {
                 // This piece is "dirty". We can only continue if there
-                // are some pending requests. No pending requests
-                // indicates that we expect the piece to arrive soon or
-                // just waiting an I/O manager to flush it to disk.
+                // are some free blocks. No free blocks indicates that we
+                // expect the piece to arrive soon or just waiting an I/O
+                // manager to flush it to disk.
                 assert(!bundle_.state().availablePieces().bit(piece));
 
                 //hDebug() << "Feeding peer with dirty" << piece;
-                auto pendingIt = pendingPieces_.find(piece);
+                if (partialPieces_.active(piece) && mayRequest(*peerState, piece)) {
+                    unsigned int sent = sendBlockRequests(peer, piece, 0);
 
-                if (pendingIt != pendingPieces_.end()) {
-                    sentRequests += sendBlockRequests(peer, piece, (*pendingIt).second, 0);
+                    if (sent > 0)
+                        claimIfFast(*peerState, piece);
 
-                    if ((*pendingIt).second.empty())
-                        pendingPieces_.erase(pendingIt);
+                    sentRequests += sent;
                 }
             }
 
@@ -443,6 +649,21 @@ public:
         }
     }
 
+    // Issues requests to the peer right away instead of leaving it idle
+    // until the next tick if it is able to take some.
+    void feedReadyUploader(PeerData *peer)
+    {
+        auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
+
+        if (peer->peerChokedUs() || !peer->weAreInterested() || peerState->ignorePeer ||
+            !wantsRequests(*peerState) || bundle_.state().scheduledPieces().enabledCount() == 0)
+        {
+            return;
+        }
+
+        feedUploader(peer, Util::Time::monotonicTime());
+    }
+
     void feedStarvingUploaders()
     {
         Util::Time now = Util::Time::monotonicTime();
@@ -451,7 +672,7 @@ public:
             PeerData *peer = *peerIt;
             auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
-            if (peerState->requestedBlocks.size() < 5 && !peer->peerChokedUs() &&
+            if (wantsRequests(*peerState) && !peer->peerChokedUs() &&
                 peer->weAreInterested() && !peerState->ignorePeer)
             {
                 feedUploader(peer, now);
@@ -459,116 +680,173 @@ public:
 
             //hDebug() << "Peer" << peer->socket().remoteAddress() << "has"
             //         << ((peer->peerChokedUs()) ? "choked us" : "unchoked us")
-            //         << "and has" << peerState->requestedBlocks.size() << "requests"
+            //         << "and has" << outstanding(*peerState) << "requests"
             //         << "in processing";
         }
     }
 
+    // Bytes of scheduled pieces which haven't been received yet.
+    unsigned long long remainingBytes() const
+    {
+        return (unsigned long long)pieceAdvisor_.cleanPieceCount() * bundle_.model().pieceSize() +
+                partialPieces_.missingBytes();
+    }
+
+    // Requests blocks in transit from further peers, fastest first,
+    // until every block has EndGameRequests requesters or the request
+    // queues are full. Duplicates are cancelled as soon as one of the
+    // requests is served.
     void doEndGameRound()
     {
-        std::vector<BlockId> targetBlocks;
-        targetBlocks.reserve(downloadingBlocks_.size());
+        std::vector<std::pair<unsigned int, unsigned int> > targetBlocks;
+        std::vector<unsigned int> pieces = partialPieces_.activePieces();
 
-        for (auto it = downloadingBlocks_.begin(); it != downloadingBlocks_.end(); ++it)
-            targetBlocks.push_back((*it).first);
+        for (auto it = pieces.begin(); it != pieces.end(); ++it) {
+            unsigned int blocks = partialPieces_.blockCount(*it);
+
+            for (unsigned int block = 0; block < blocks; ++block) {
+                if (partialPieces_.state(*it, block) == PartialPieceTable::Requested &&
+                    partialPieces_.requesterCount(*it, block) < DownloadTask::EndGameRequests)
+                {
+                    targetBlocks.push_back(std::make_pair(*it, block));
+                }
+            }
+        }
+
+        if (targetBlocks.empty())
+            return;
+
+        std::vector<PeerData *> uploaders;
 
         for (auto peerIt = peers_.begin(); peerIt != peers_.end(); ++peerIt) {
             PeerData *peer = *peerIt;
             auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
-            if (peerState->requestedBlocks.size() > 5 || peerState->ignorePeer)
-                continue;
+            if (!peer->peerChokedUs() && !peerState->ignorePeer && freeSlots(*peerState) > 0)
+                uploaders.push_back(peer);
+        }
 
-            // Shuffling the block list makes the chance to receive
-            // duplicate blocks marginally lower.
-            std::random_shuffle(targetBlocks.begin(), targetBlocks.end());
+        sortByRate(uploaders);
 
-            auto blockIt = targetBlocks.begin();
-            auto blocksEnd = targetBlocks.end();
+        size_t duplicates = 0;
 
-            while (blockIt != blocksEnd && peerState->requestedBlocks.size() <= 10) {
-                if (!peer->bitfield().bit((*blockIt).piece)) {
-                    ++blockIt;
-                    continue;
-                }
+        for (auto peerIt = uploaders.begin(); peerIt != uploaders.end(); ++peerIt) {
+            PeerData *peer = *peerIt;
+            auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
-                auto requestIt = std::find(peerState->requestedBlocks.begin(),
-                        peerState->requestedBlocks.end(), *blockIt);
+            for (auto blockIt = targetBlocks.begin();
+                 blockIt != targetBlocks.end() && freeSlots(*peerState) > 0; ++blockIt)
+            {
+                unsigned int piece = (*blockIt).first;
+                unsigned int block = (*blockIt).second;
 
-                if (requestIt != peerState->requestedBlocks.end()) {
-                    ++blockIt;
+                if (partialPieces_.requesterCount(piece, block) >= DownloadTask::EndGameRequests ||
+                    !peer->bitfield().bit(piece) ||
+                    partialPieces_.requestedFrom(piece, block, peerState->slot))
+                {
                     continue;
                 }
 
-                sendBlockRequest(peer, *blockIt);
-
-                ++blockIt;
+                sendBlockRequest(peer, piece, block);
+                ++duplicates;
             }
         }
+
+        hcDebug(bundle_.model().name())
+            << "End game round:" << targetBlocks.size() << "blocks under-requested;"
+            << duplicates << "duplicate requests sent";
     }
 
-    void distributeRequests(
-            std::vector<PeerData *> &peers,
-            unsigned int piece,
-            std::vector<BlockLocation> &blocks)
+    void distributeRequests(std::vector<PeerData *> &peers, unsigned int piece)
     {
-        if (peers.empty() || blocks.empty())
+        size_t freeBlocks = partialPieces_.freeBlockCount(piece);
+
+        if (peers.empty() || freeBlocks == 0)
             return;
 
-        size_t requestsPerPeer = blocks.size() / peers.size();
+        size_t requestsPerPeer = freeBlocks / peers.size();
         size_t totalSent = 0;
 
         if (requestsPerPeer == 0)
             requestsPerPeer = 1;
 
         for (auto peerIt = peers.begin(); peerIt != peers.end(); ++peerIt) {
-            if (blocks.empty())
+            if (partialPieces_.freeBlockCount(piece) == 0)
                 return;
 
-            totalSent += sendBlockRequests(*peerIt, piece, blocks, requestsPerPeer);
+            totalSent += sendBlockRequests(*peerIt, piece, requestsPerPeer);
         }
 
         // Don't start new round if we didn't send any requests in
         // the current round. No sent requests means that uploaders
         // has full request queues.
         if (totalSent > 0)
-            distributeRequests(peers, piece, blocks);
+            distributeRequests(peers, piece);
     }
 
-    unsigned int sendBlockRequests(
-            PeerData *peer,
-            unsigned int piece,
-            std::vector<BlockLocation> &blocks,
-            unsigned int sendLimit)
+    // Requests free blocks of the piece in order.
+    unsigned int sendBlockRequests(PeerData *peer, unsigned int piece, unsigned int sendLimit)
     {
         auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
-        size_t freeSlots = 10 - peerState->requestedBlocks.size();
+        size_t slots = freeSlots(*peerState);
+        size_t freeBlocks = partialPieces_.freeBlockCount(piece);
         size_t willSend = (sendLimit > 0)
-                ? std::min(std::min((size_t)sendLimit, freeSlots), blocks.size())
-                : std::min(freeSlots, blocks.size());
+                ? std::min(std::min((size_t)sendLimit, slots), freeBlocks)
+                : std::min(slots, freeBlocks);
 
         unsigned int sent;
+        unsigned int block = 0;
 
         for (sent = 0; sent < willSend; ++sent) {
-            sendBlockRequest(peer, BlockId { piece, blocks.back() });
-            blocks.pop_back();
+            block = partialPieces_.nextFreeBlock(piece, block);
+            assert(block != PartialPieceTable::NoBlock);
+
+            sendBlockRequest(peer, piece, block);
         }
 
         return sent;
     }
 
-    void sendBlockRequest(PeerData *peer, const BlockId &blockId)
+    void sendBlockRequest(PeerData *peer, unsigned int piece, unsigned int block)
     {
-        peer->getData<DownloadState>(PeerData::DownloadTask)->requestedBlocks.push_back(blockId);
-        downloadingBlocks_[blockId].involvedPeers.push_back(peer);
+        auto peerState = peer->getData<DownloadState>(PeerData::DownloadTask);
 
-        RequestMessage *message =
-            new RequestMessage(blockId.piece, blockId.location.offset, blockId.location.size);
+        partialPieces_.request(piece, block, peerState->slot);
+
+        RequestMessage *message = new RequestMessage(
+                piece, partialPieces_.blockOffset(block), partialPieces_.blockSize(piece, block));
 
         peer->socket().send(message);
     }
 
+    void broadcastHaves()
+    {
+        size_t sent = 0;
+        size_t suppressed = 0;
+
+        for (auto peerIt = peers_.begin(); peerIt != peers_.end(); ++peerIt) {
+            PeerData *peer = *peerIt;
+
+            for (auto pieceIt = pendingHaves_.begin(); pieceIt != pendingHaves_.end(); ++pieceIt) {
+                // The peer can't make any use of a HAVE for a piece it
+                // already has.
+                if (peer->bitfield().bit(*pieceIt)) {
+                    ++suppressed;
+                } else {
+                    peer->socket().send(new HaveMessage(*pieceIt));
+                    ++sent;
+                }
+            }
+        }
+
+        hcDebug(bundle_.model().name())
+            << "Announced" << pendingHaves_.size() << "pieces with" << sent
+            << "HAVE messages;" << suppressed << "suppressed";
+
+        pendingHaves_.clear();
+    }
+
 public:
     TorrentBundle &bundle_;
     const InternalPeerList &peers_;
@@ -576,10 +854,32 @@ public:
 
     PieceAdvisor pieceAdvisor_;
 
-    std::unordered_map<BlockId, BlockDescriptor, BlockIdHash> downloadingBlocks_;
-    PendingPiecesMap pendingPieces_;
+    // Blocks of the pieces in transit, and peers by their slots in it
+    PartialPieceTable partialPieces_;
+    std::vector<PeerData *> peerSlots_;
+
+    // Blocks being received straight into their cache slots. Another
+    // copy of such a block is dropped so that it can't overwrite the
+    // one in progress or, once that is accepted, the accepted data.
+    std::set<std::pair<unsigned int, unsigned int> > receivingBlocks_;
 
     std::set<unsigned int> prioritizedPieces_;
+
+    // Payload the torrent may have outstanding in requests at most
+    size_t requestBudget_;
+
+    // Verified pieces which haven't been announced to peers yet
+    std::vector<unsigned int> pendingHaves_;
+
+    // Deadlines of missing pieces the streaming consumer waits for,
+    // the revision of the registry they have been taken from and the
+    // pieces which have missed them already
+    std::map<unsigned int, Util::Time> deadlines_;
+    unsigned long long deadlineRevision_;
+    std::set<unsigned int> missedPieces_;
+
+    // When the pieces in transit have been opened
+    std::unordered_map<unsigned int, Util::Time> pieceStartTimes_;
 };
 
 DownloadTask::DownloadTask(TorrentBundle &bundle) :
@@ -597,14 +897,26 @@ void DownloadTask::registerPeer(PeerData *peer)
     Private::DownloadState *peerState = new Private::DownloadState();
 
     peerState->ignorePeer = false;
+    peerState->slot = d->partialPieces_.attachPeer();
     peerState->lastUploadActivity = Util::Time::monotonicTime();
+    peerState->queueDepth = MinimumQueueDepth;
+    peerState->speedClass = SlowPeer;
+
+    if (peerState->slot >= d->peerSlots_.size())
+        d->peerSlots_.resize(peerState->slot + 1);
+
+    d->peerSlots_[peerState->slot] = peer;
 
     peer->setData(PeerData::DownloadTask, peerState);
 }
 
 void DownloadTask::unregisterPeer(PeerData *peer)
 {
-    d->cancelDownload(peer);
+    auto peerState = peer->getData<Private::DownloadState>(PeerData::DownloadTask);
+
+    d->partialPieces_.detachPeer(peerState->slot);
+    d->peerSlots_[peerState->slot] = 0;
+
     d->pieceAdvisor_.unreference(peer->bitfield());
 }
 
@@ -614,63 +926,103 @@ bool DownloadTask::notifyDownloadedBlock(
         unsigned int offset,
         const std::string &data)
 {
-    Private::BlockId blockId = {piece, {offset, (unsigned int)data.size()}};
-    Util::Time now = Util::Time::monotonicTime();
+    unsigned int block = d->partialPieces_.blockIndex(piece, offset, data.size());
 
-    auto blockIt = d->downloadingBlocks_.find(blockId);
-    if (blockIt == d->downloadingBlocks_.end())
+    if (block == PartialPieceTable::NoBlock)
         return false;
 
-    Private::BlockDescriptor &block = (*blockIt).second;
+    // Leave the block to the peer delivering it into the cache.
+    if (d->receivingBlocks_.find(std::make_pair(piece, block)) != d->receivingBlocks_.end()) {
+        auto peerState = peer->getData<Private::DownloadState>(PeerData::DownloadTask);
 
-    for (auto peerIt = block.involvedPeers.begin(); peerIt != block.involvedPeers.end(); ++peerIt)
-    {
-        PeerData *involvedPeer = *peerIt;
-        auto involvedPeerState =
-            involvedPeer->getData<Private::DownloadState>(PeerData::DownloadTask);
+        if (d->partialPieces_.requestedFrom(piece, block, peerState->slot))
+            d->partialPieces_.cancel(piece, block, peerState->slot);
+
+        return false;
+    }
+
+    if (!d->settleRequests(peer, piece, block))
+        return false;
 
-        if (peer != involvedPeer)
-            involvedPeer->socket().send(new CancelMessage(piece, offset, data.size()));
+    bool pieceCompleted = d->blockCache_.store(piece, offset, data);
 
-        auto requestIt = std::find(
-                involvedPeerState->requestedBlocks.begin(),
-                involvedPeerState->requestedBlocks.end(),
-                blockId);
+    if (pieceCompleted)
+        d->prioritizedPieces_.erase(piece);
 
-        assert(requestIt != involvedPeerState->requestedBlocks.end());
+    return true;
+}
 
-        std::iter_swap(requestIt, involvedPeerState->requestedBlocks.end() - 1);
+char *DownloadTask::reserveBlock(
+        PeerData *peer,
+        unsigned int piece,
+        unsigned int offset,
+        unsigned int size)
+{
+    auto peerState = peer->getData<Private::DownloadState>(PeerData::DownloadTask);
+    unsigned int block = d->partialPieces_.blockIndex(piece, offset, size);
 
-        involvedPeerState->requestedBlocks.pop_back();
-        involvedPeerState->lastUploadActivity = now;
+    // Only accept blocks we've asked this very peer for. Requests of
+    // a received block are gone, so late duplicates end up here too.
+    if (block == PartialPieceTable::NoBlock ||
+        !d->partialPieces_.requestedFrom(piece, block, peerState->slot))
+    {
+        return 0;
+    }
 
-        if (involvedPeerState->requestedBlocks.size() < 5)
-            d->feedUploader(involvedPeer, now);
+    // Another peer is delivering the block right now. Drop this copy
+    // and forget the request, the peer has answered it.
+    if (!d->receivingBlocks_.insert(std::make_pair(piece, block)).second) {
+        d->partialPieces_.cancel(piece, block, peerState->slot);
+        return 0;
     }
 
-    d->downloadingBlocks_.erase(blockIt);
+    char *slot = d->blockCache_.pin(piece, offset, size);
 
-    bool pieceCompleted = d->blockCache_.store(piece, offset, data);
+    if (slot == 0)
+        d->receivingBlocks_.erase(std::make_pair(piece, block));
 
-    if (pieceCompleted)
+    return slot;
+}
+
+bool DownloadTask::notifyDownloadedBlock(
+        PeerData *peer,
+        unsigned int piece,
+        unsigned int offset,
+        unsigned int size,
+        bool received)
+{
+    unsigned int block = d->partialPieces_.blockIndex(piece, offset, size);
+
+    d->receivingBlocks_.erase(std::make_pair(piece, block));
+
+    bool accepted = received && block != PartialPieceTable::NoBlock &&
+            d->settleRequests(peer, piece, block);
+
+    // The payload has been received into the reserved slot already.
+    if (accepted && d->blockCache_.commit(piece, offset, size))
         d->prioritizedPieces_.erase(piece);
 
-    return true;
+    d->blockCache_.unpin(piece, size);
+
+    return accepted;
 }
 
 void DownloadTask::notifyDownloadedGoodPiece(unsigned int piece)
 {
     d->pieceAdvisor_.markClean(piece);
+    d->pendingHaves_.push_back(piece);
 
-    std::for_each(
-        d->peers_.begin(), d->peers_.end(),
-        [piece](PeerData *p) { p->socket().send(new HaveMessage(piece)); }
-    );
+    d->deadlines_.erase(piece);
+    d->missedPieces_.erase(piece);
 
-    if (d->bundle_.state().scheduledPieces().enabledCount() == 0) {
-        assert(d->downloadingBlocks_.size() == 0);
-        assert(d->pendingPieces_.size() == 0);
-    }
+    if (d->bundle_.state().scheduledPieces().enabledCount() == 0)
+        assert(d->partialPieces_.activeCount() == 0);
+}
+
+void DownloadTask::broadcastHaves()
+{
+    if (!d->pendingHaves_.empty())
+        d->broadcastHaves();
 }
 
 void DownloadTask::notifyDownloadedBadPiece(unsigned int piece)
@@ -678,6 +1030,11 @@ void DownloadTask::notifyDownloadedBadPiece(unsigned int piece)
     d->pieceAdvisor_.markClean(piece);
 }
 
+void DownloadTask::notifyScheduleChanged()
+{
+    d->pieceAdvisor_.resynchronize();
+}
+
 void DownloadTask::notifyChokeEvent(PeerData *peer)
 {
     d->cancelDownload(peer);
@@ -689,16 +1046,56 @@ void DownloadTask::notifyUnchokeEvent(PeerData *peer)
 
     peerState->ignorePeer = false;
     peerState->lastUploadActivity = Util::Time::monotonicTime();
+
+    // Pick pieces afresh, the cache may be long out of date.
+    peerState->requestCache.clear();
+
+    d->feedReadyUploader(peer);
 }
 
-void DownloadTask::notifyHaveEvent(PeerData *, unsigned int piece)
+void DownloadTask::notifyHaveEvent(PeerData *peer, unsigned int piece)
 {
     d->pieceAdvisor_.reference(piece);
+
+    if (!d->bundle_.state().scheduledPieces().bit(piece))
+        return;
+
+    // A peer which is busy anyway picks the piece up with the next
+    // refresh of its cache.
+    auto peerState = peer->getData<Private::DownloadState>(PeerData::DownloadTask);
+    auto &requestCache = peerState->requestCache;
+
+    if (!d->wantsRequests(*peerState))
+        return;
+
+    d->refreshRequestCache(peer, Util::Time::monotonicTime());
+
+    // Slot a piece nobody works on into the cache by its availability
+    // so that the cache stays rarest first.
+    if (!d->pieceAdvisor_.isDirty(piece) &&
+        std::find(requestCache.begin(), requestCache.end(), piece) == requestCache.end())
+    {
+        unsigned int availability = d->pieceAdvisor_.availability(piece);
+
+        auto position = std::find_if(requestCache.begin(), requestCache.end(),
+                [this, availability](unsigned int cached) {
+                    return d->pieceAdvisor_.availability(cached) > availability;
+                });
+
+        if (position != requestCache.end())
+            requestCache.insert(position, piece);
+    }
+
+    d->feedReadyUploader(peer);
 }
 
 void DownloadTask::notifyBitfieldEvent(PeerData *peer)
 {
     d->pieceAdvisor_.reference(peer->bitfield());
+
+    peer->getData<Private::DownloadState>(PeerData::DownloadTask)->requestCache.clear();
+
+    d->feedReadyUploader(peer);
 }
 
 BlockCache &DownloadTask::cache()
@@ -706,26 +1103,65 @@ BlockCache &DownloadTask::cache()
     return d->blockCache_;
 }
 
+unsigned int DownloadTask::requestQueueDepth(size_t rate, unsigned int roundTripTime)
+{
+    if (roundTripTime == 0)
+        roundTripTime = DefaultRoundTripTime;
+
+    unsigned long long window =
+            (unsigned long long)rate * (roundTripTime + RequestQueueTime * 1000ULL) / 1000000;
+    unsigned long long depth = (window + BlockSize - 1) / BlockSize;
+
+    return std::min<unsigned long long>(
+            std::max<unsigned long long>(depth, MinimumQueueDepth), MaximumQueueDepth);
+}
+
+unsigned long long DownloadTask::endGameThreshold(size_t rate)
+{
+    return std::max<unsigned long long>(EndGameBytes, (unsigned long long)rate * EndGameTime);
+}
+
+DownloadTask::SpeedClass DownloadTask::speedClass(size_t rate, unsigned int pieceSize)
+{
+    if ((unsigned long long)rate * FastPieceTime >= pieceSize)
+        return FastPeer;
+    else if ((unsigned long long)rate * SlowPieceTime >= pieceSize)
+        return MediumPeer;
+    else
+        return SlowPeer;
+}
+
 void DownloadTask::execute()
 {
+    broadcastHaves();
+
+    d->bundle_.state().setPartialPieceCount(d->partialPieces_.activeCount());
+
     size_t schedPieceCount = d->bundle_.state().scheduledPieces().enabledCount();
 
     if (schedPieceCount > 0) {
+        d->requestBudget_ = d->bundle_.configuration().requestMemoryBudget();
+
+        // Requests in flight end up in the cache, so it may take at
+        // least as much memory as they do.
+        d->blockCache_.setSizeLimit(std::max<size_t>(
+                GlobalTorrentRegistry::self()->cacheSizeLimit(), d->requestBudget_));
+
         d->maintainUploadersState();
+        d->abandonOrphanPieces();
 
+        d->serveDeadlines(Util::Time::monotonicTime());
         d->pumpInPrioritizedPieces();
         d->sendDeferredRequests();
         d->feedStarvingUploaders();
 
-        // If we are running low on scheduled pieces, enter the end
-        // game mode.
+        // Enter the end game once the rest of the torrent is about to
+        // arrive so that the last blocks don't wait for slow peers.
+        unsigned long long remaining = d->remainingBytes();
 
-        // Decrease the end mode threshold to compensate the
-        // flush-to-disk delay.
-        if (schedPieceCount <= d->blockCache_.storedPieceCount() + 10) {
+        if (remaining <= endGameThreshold(d->bundle_.state().payloadDownloadRate())) {
             hcDebug(d->bundle_.model().name())
-                << "End game round:"
-                << d->blockCache_.storedPieceCount() << "pieces in transit;"
+                << "End game:" << remaining << "bytes remaining;"
                 << schedPieceCount << "pieces scheduled";
 
             d->doEndGameRound();
@@ -37,6 +37,52 @@ namespace Bt {
 
 class DownloadTask : public Net::Task
 {
+public:
+    enum SpeedClass {
+        SlowPeer,
+        MediumPeer,
+        FastPeer
+    };
+
+    enum {
+        BlockSize = 16 * 1024,
+
+        // Bounds of the number of requests outstanding at a peer
+        MinimumQueueDepth = 8,
+        MaximumQueueDepth = 512,
+
+        // Time in milliseconds requests are queued ahead for on top
+        // of the round trip to the peer, absorbing rate fluctuations
+        RequestQueueTime = 500,
+
+        // Round trip time in microseconds assumed for peers whose
+        // transport has no estimate
+        DefaultRoundTripTime = 200000,
+
+        // Seconds ahead of its deadline a piece of a streaming torrent
+        // is requested from the fastest peers
+        StreamingWindow = 20,
+
+        // Seconds ahead of its deadline a piece still in transit gets
+        // its blocks requested from more than one peer, and the bound
+        // on the number of peers a block is requested from then
+        DeadlineUrgency = 3,
+        MaximumDeadlineRequests = 2,
+
+        // The end game starts once the bytes left to download would
+        // take less than EndGameTime seconds at the current rate, or
+        // drop below EndGameBytes on slow torrents. Blocks are then
+        // requested from up to EndGameRequests peers at once.
+        EndGameBytes = 4 * 1024 * 1024,
+        EndGameTime = 5,
+        EndGameRequests = 2,
+
+        // Seconds a fast peer takes to deliver a whole piece at most
+        // and a slow one at least
+        FastPieceTime = 5,
+        SlowPieceTime = 30
+    };
+
 public:
     DownloadTask(TorrentBundle &);
     ~DownloadTask();
@@ -45,9 +91,33 @@ public:
     void unregisterPeer(PeerData *);
 
     bool notifyDownloadedBlock(PeerData *, unsigned int, unsigned int, const std::string &);
+
+    /**
+     * Returns the slot in the piece buffer the block requested from
+     * the peer should be received into or 0 if the block is not
+     * expected from the peer. A successful reservation must be
+     * followed by a notifyDownloadedBlock() call for the block with
+     * the last argument telling whether the block has been received.
+     */
+    char *reserveBlock(PeerData *, unsigned int, unsigned int, unsigned int);
+    bool notifyDownloadedBlock(PeerData *, unsigned int, unsigned int, unsigned int, bool);
     void notifyDownloadedGoodPiece(unsigned int);
     void notifyDownloadedBadPiece(unsigned int);
 
+    /**
+     * Sends HAVE messages for the good pieces reported since the last
+     * call. Peers which already have a piece don't get a HAVE for it.
+     * Announcements are batched this way so that all of them go out
+     * in a single write per peer.
+     */
+    void broadcastHaves();
+
+    /**
+     * Must be called after pieces have been scheduled or unscheduled
+     * in bulk so that newly scheduled pieces get picked.
+     */
+    void notifyScheduleChanged();
+
     void notifyChokeEvent(PeerData *);
     void notifyUnchokeEvent(PeerData *);
 
@@ -56,6 +126,30 @@ public:
 
     BlockCache &cache();
 
+    /**
+     * Returns the number of requests to keep outstanding at a peer
+     * delivering the given payload rate (bytes per second) over a
+     * connection with the given round trip time (microseconds), i.e.
+     * the bandwidth-delay product of the peer in blocks plus the
+     * request queue time.
+     */
+    static unsigned int requestQueueDepth(size_t, unsigned int);
+
+    /**
+     * Returns the number of bytes left to download below which the
+     * end game starts for a torrent downloading at the given rate.
+     */
+    static unsigned long long endGameThreshold(size_t);
+
+    /**
+     * Classifies a peer delivering the given payload rate by the time
+     * it takes to download a piece of the given size. Fast peers get
+     * pieces of their own, medium ones start pieces anyone may join
+     * and slow ones join pieces no fast peer is working on, starting
+     * a piece only when no fast peer holding it has room for it.
+     */
+    static SpeedClass speedClass(size_t, unsigned int);
+
 private:
     void execute();
 
@@ -74,41 +74,49 @@ EventHub::~EventHub()
     interestTask_.unregisterPeer(peer_.get());
 }
 
-void EventHub::processMessage(Net::Socket &, ChokeMessage &)
+bool EventHub::handle(Net::Socket &, ChokeMessage &)
 {
     downloadTask_.notifyChokeEvent(peer_.get());
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, UnchokeMessage &)
+bool EventHub::handle(Net::Socket &, UnchokeMessage &)
 {
     downloadTask_.notifyUnchokeEvent(peer_.get());
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, InterestedMessage &)
+bool EventHub::handle(Net::Socket &, InterestedMessage &)
 {
     chokeTask_.notifyPeerBecameInterested(peer_.get());
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, NotInterestedMessage &)
+bool EventHub::handle(Net::Socket &, NotInterestedMessage &)
 {
     chokeTask_.notifyPeerBecameNotInterested(peer_.get());
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, HaveMessage &message)
+bool EventHub::handle(Net::Socket &, HaveMessage &message)
 {
     unsigned int piece = message.field<2>();
 
     interestTask_.notifyHaveEvent(peer_.get(), piece);
     downloadTask_.notifyHaveEvent(peer_.get(), piece);
+
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, BitfieldMessage &)
+bool EventHub::handle(Net::Socket &, BitfieldMessage &)
 {
     interestTask_.notifyBitfieldEvent(peer_.get());
     downloadTask_.notifyBitfieldEvent(peer_.get());
+
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, PieceMessage &message)
+bool EventHub::handle(Net::Socket &, PieceMessage &message)
 {
     unsigned int piece = message.field<2>();
     unsigned int offset = message.field<3>();
@@ -118,22 +126,45 @@ void EventHub::processMessage(Net::Socket &, PieceMessage &message)
 
     if (good)
         bundle_.state().updateDownloaded(payload.size());
+
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, RequestMessage &message)
+bool EventHub::handle(Net::Socket &, RequestMessage &message)
 {
     unsigned int piece = message.field<2>();
     unsigned int offset = message.field<3>();
     unsigned int size = message.field<4>();
 
     uploadTask_.notifyRequestEvent(peer_.get(), piece, offset, size);
+
+    return true;
 }
 
-void EventHub::processMessage(Net::Socket &, CancelMessage &message)
+bool EventHub::handle(Net::Socket &, CancelMessage &message)
 {
     unsigned int piece = message.field<2>();
     unsigned int offset = message.field<3>();
     unsigned int size = message.field<4>();
 
     uploadTask_.notifyCancelEvent(peer_.get(), piece, offset, size);
+
+    return true;
+}
+
+char *EventHub::handleReservation(Net::Socket &, unsigned int piece, unsigned int offset,
+                                  unsigned int size)
+{
+    return downloadTask_.reserveBlock(peer_.get(), piece, offset, size);
+}
+
+bool EventHub::handleBlock(Net::Socket &, unsigned int piece, unsigned int offset,
+                           unsigned int size, bool received)
+{
+    bool good = downloadTask_.notifyDownloadedBlock(peer_.get(), piece, offset, size, received);
+
+    if (good)
+        bundle_.state().updateDownloaded(size);
+
+    return true;
 }
@@ -25,6 +25,7 @@
 
 #include <bt/peerwire/message.hh>
 #include <bt/peerwire/inputmiddleware.hh>
+#include <bt/peerwire/pipeline.hh>
 
 namespace Hypergrace { namespace Bt { class ChokeTask; }}
 namespace Hypergrace { namespace Bt { class DownloadTask; }}
@@ -36,7 +37,7 @@ namespace Hypergrace { namespace Bt { class UploadTask; }}
 namespace Hypergrace {
 namespace Bt {
 
-class EventHub : public Bt::InputMiddleware
+class EventHub : public Bt::StageMiddleware<EventHub>
 {
 public:
     EventHub(TorrentBundle &, std::shared_ptr<PeerData>, ChokeTask &, InterestTask &,
@@ -44,15 +45,19 @@ public:
     ~EventHub();
 
 public:
-    void processMessage(Net::Socket &, ChokeMessage &);
-    void processMessage(Net::Socket &, UnchokeMessage &);
-    void processMessage(Net::Socket &, InterestedMessage &);
-    void processMessage(Net::Socket &, NotInterestedMessage &);
-    void processMessage(Net::Socket &, HaveMessage &);
-    void processMessage(Net::Socket &, BitfieldMessage &);
-    void processMessage(Net::Socket &, PieceMessage &);
-    void processMessage(Net::Socket &, RequestMessage &);
-    void processMessage(Net::Socket &, CancelMessage &);
+    // Pipeline stage interface, EventHub is the last stage of the peer pipeline
+    bool handle(Net::Socket &, ChokeMessage &);
+    bool handle(Net::Socket &, UnchokeMessage &);
+    bool handle(Net::Socket &, InterestedMessage &);
+    bool handle(Net::Socket &, NotInterestedMessage &);
+    bool handle(Net::Socket &, HaveMessage &);
+    bool handle(Net::Socket &, BitfieldMessage &);
+    bool handle(Net::Socket &, PieceMessage &);
+    bool handle(Net::Socket &, RequestMessage &);
+    bool handle(Net::Socket &, CancelMessage &);
+
+    char *handleReservation(Net::Socket &, unsigned int, unsigned int, unsigned int);
+    bool handleBlock(Net::Socket &, unsigned int, unsigned int, unsigned int, bool);
 
 private:
     TorrentBundle &bundle_;
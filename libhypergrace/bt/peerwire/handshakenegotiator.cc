@@ -23,6 +23,7 @@
 #include <bt/peerwire/message.hh>
 #include <bt/types.hh>
 
+#include <net/receivebuffer.hh>
 #include <net/socket.hh>
 #include <net/simplepacket.hh>
 
@@ -50,16 +51,21 @@ HandshakeNegotiator::~HandshakeNegotiator()
 
 void HandshakeNegotiator::receive(Net::Socket &socket, std::string &data)
 {
-    const static size_t minimumSize = Net::YieldPacketSize<HashPart>::value;
-    const static size_t requiredSize = Net::YieldPacketSize<HandshakeMessage>::value;
+    if (!socket.receiveBuffer().append(data.data(), data.size())) {
+        socket.close();
+        return;
+    }
 
-    buffer_.append(data);
+    receive(socket, socket.receiveBuffer());
+}
 
+void HandshakeNegotiator::receive(Net::Socket &socket, Net::ReceiveBuffer &buffer)
+{
     // We've got enough data to peek into the info hash.
-    if (!hashAlreadyDiscovered_ && buffer_.size() >= minimumSize) {
+    if (!hashAlreadyDiscovered_ && buffer.size() >= HashPart::fixedSize) {
         HashPart hp;
 
-        if (!hp.absorb(buffer_) || hp.field<1>() != "BitTorrent protocol") {
+        if (!hp.decode(buffer.data(), buffer.size()) || hp.field<1>() != "BitTorrent protocol") {
             socket.close();
             return;
         }
@@ -75,10 +81,10 @@ void HandshakeNegotiator::receive(Net::Socket &socket, std::string &data)
     }
 
     // Handshake packet completely assembled.
-    if (buffer_.size() >= requiredSize) {
+    if (buffer.size() >= HandshakeMessage::fixedSize) {
         HandshakeMessage hsm;
 
-        if (!hsm.absorb(buffer_)) {
+        if (!hsm.decode(buffer.data(), buffer.size())) {
             hDebug() << "Something went wrong while shaking hands with peer";
             socket.close();
             return;
@@ -92,11 +98,14 @@ void HandshakeNegotiator::receive(Net::Socket &socket, std::string &data)
             return;
         }
 
+        buffer.consume(HandshakeMessage::fixedSize);
+
         peerSettings_.socketFd = socket.cloneFd();
         peerSettings_.address = socket.remoteAddress();
         memcpy(peerSettings_.supportedFeatures, hsm.field<2>().data(), hsm.size<2>());
-        peerSettings_.streamContinuation = buffer_.substr(requiredSize);
+        peerSettings_.streamContinuation.assign(buffer.data(), buffer.size());
 
+        buffer.consume(buffer.size());
         socket.close();
 
         reconfigurePeer(peerSettings_);
@@ -27,6 +27,7 @@
 #include <net/inputmiddleware.hh>
 #include <net/hostaddress.hh>
 
+namespace Hypergrace { namespace Net { class ReceiveBuffer; }}
 namespace Hypergrace { namespace Net { class Socket; }}
 
 
@@ -44,10 +45,10 @@ protected:
 
 protected:
     void receive(Net::Socket &, std::string &);
+    void receive(Net::Socket &, Net::ReceiveBuffer &);
     void shutdown(Net::Socket &);
 
 private:
-    std::string buffer_;
     bool hashAlreadyDiscovered_;
     PeerSettings peerSettings_;
 };
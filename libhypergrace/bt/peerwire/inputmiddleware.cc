@@ -81,6 +81,18 @@ void InputMiddleware::processMessage(Net::Socket &c, CancelMessage &p)
     delegateMessage(c, p);
 }
 
+char *InputMiddleware::reserveBlock(Net::Socket &c, unsigned int piece, unsigned int offset,
+                                    unsigned int size)
+{
+    return delegateReserveBlock(c, piece, offset, size);
+}
+
+void InputMiddleware::processBlock(Net::Socket &c, unsigned int piece, unsigned int offset,
+                                   unsigned int size, bool received)
+{
+    delegateBlock(c, piece, offset, size, received);
+}
+
 void InputMiddleware::delegateMessage(Net::Socket &c, ChokeMessage &p)
 {
     if (delegate_)
@@ -134,3 +146,19 @@ void InputMiddleware::delegateMessage(Net::Socket &c, CancelMessage &p)
     if (delegate_)
         delegate_->processMessage(c, p);
 }
+
+char *InputMiddleware::delegateReserveBlock(Net::Socket &c, unsigned int piece,
+                                            unsigned int offset, unsigned int size)
+{
+    if (delegate_)
+        return delegate_->reserveBlock(c, piece, offset, size);
+    else
+        return 0;
+}
+
+void InputMiddleware::delegateBlock(Net::Socket &c, unsigned int piece, unsigned int offset,
+                                    unsigned int size, bool received)
+{
+    if (delegate_)
+        delegate_->processBlock(c, piece, offset, size, received);
+}
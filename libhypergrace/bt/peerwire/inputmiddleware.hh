@@ -49,6 +49,24 @@ public:
     virtual void processMessage(Net::Socket &, RequestMessage &);
     virtual void processMessage(Net::Socket &, CancelMessage &);
 
+    /**
+     * Asks for the location the payload of a PIECE message should be
+     * received into.
+     *
+     * Returns a pointer to the block's slot in the piece buffer or 0 if
+     * the block hasn't been requested and should be discarded. Every
+     * successful reservation is followed by exactly one processBlock()
+     * call for the same block.
+     */
+    virtual char *reserveBlock(Net::Socket &, unsigned int, unsigned int, unsigned int);
+
+    /**
+     * Notifies that the payload of a reserved block has been received
+     * in its entirety (the last argument is true) or that the
+     * connection broke off before that.
+     */
+    virtual void processBlock(Net::Socket &, unsigned int, unsigned int, unsigned int, bool);
+
 protected:
     void delegateMessage(Net::Socket &, ChokeMessage &);
     void delegateMessage(Net::Socket &, UnchokeMessage &);
@@ -60,6 +78,9 @@ protected:
     void delegateMessage(Net::Socket &, RequestMessage &);
     void delegateMessage(Net::Socket &, CancelMessage &);
 
+    char *delegateReserveBlock(Net::Socket &, unsigned int, unsigned int, unsigned int);
+    void delegateBlock(Net::Socket &, unsigned int, unsigned int, unsigned int, bool);
+
 protected:
     InputMiddleware();
 
@@ -130,10 +130,5 @@ void InterestTask::updateWantedPieceCount(PeerData *peer)
     const Util::Bitfield &schedPieces = bundle_.state().scheduledPieces();
     const Util::Bitfield &peerBitfield = peer->bitfield();
 
-    interestState->piecesWanted = 0;
-
-    for (size_t piece = 0; piece < schedPieces.bitCount(); ++piece) {
-        if (peerBitfield.bit(piece) && schedPieces.bit(piece))
-            interestState->piecesWanted += 1;
-    }
+    interestState->piecesWanted = schedPieces.commonCount(peerBitfield);
 }
@@ -24,6 +24,7 @@
 #include <cassert>
 #include <cstdint>
 
+#include <net/packetpool.hh>
 #include <net/simplepacket.hh>
 
 #include <bt/bundle/torrentconfiguration.hh>
@@ -63,6 +64,19 @@ public:
         this->setPacketClass(BitTorrentPacketClass);
         this->setPacketId(MessageId_);
     }
+
+public:
+    // Outgoing messages are recycled through a per-thread free list,
+    // see Net::PacketPool.
+    static void *operator new(size_t size)
+    {
+        return Net::PacketPool<Message>::allocate(size);
+    }
+
+    static void operator delete(void *storage, size_t size)
+    {
+        Net::PacketPool<Message>::release(storage, size);
+    }
 };
 
 template<unsigned char MessageId_>
@@ -90,6 +104,17 @@ public:
     }
 
     virtual ~Message() = default;
+
+public:
+    static void *operator new(size_t size)
+    {
+        return Net::PacketPool<Message>::allocate(size);
+    }
+
+    static void operator delete(void *storage, size_t size)
+    {
+        Net::PacketPool<Message>::release(storage, size);
+    }
 };
 
 class HandshakeMessage
@@ -18,15 +18,19 @@
    Fifth Floor, Boston, MA 02110-1301, USA.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <deque>
 #include <memory>
+#include <type_traits>
 
 #include <debug/debug.hh>
 
 #include <bt/peerwire/message.hh>
 
+#include <net/receivebuffer.hh>
 #include <net/simplepacket.hh>
 #include <net/socket.hh>
 
@@ -36,30 +40,83 @@ using namespace Hypergrace;
 using namespace Hypergrace::Bt;
 
 typedef Net::SimplePacket<Net::BigEndianIntegerMatcher<uint32_t> > MessageSizeField;
-typedef Net::SimplePacket<Net::ByteMatcher> MessageIdField;
+
+typedef Net::SimplePacket<
+    Net::BigEndianIntegerMatcher<uint32_t>,
+    Net::ByteMatcher,
+    Net::BigEndianIntegerMatcher<uint32_t>,
+    Net::BigEndianIntegerMatcher<uint32_t>
+> PieceHeader;
+
+namespace {
+
+template<typename MessageClass>
+inline bool absorbMessage(MessageClass &message, const char *data, size_t size, std::false_type)
+{
+    return message.absorb(std::string(data, size));
+}
+
+template<typename MessageClass>
+inline bool absorbMessage(MessageClass &message, const char *data, size_t size, std::true_type)
+{
+    // Fixed layout messages are decoded straight from the buffer.
+    return message.decode(data, size);
+}
+
+} /* namespace */
 
 
 MessageAssembler::MessageAssembler(Bt::InputMiddleware::Pointer delegate) :
-    delegate_(delegate)
+    delegate_(delegate),
+    discardRemaining_(0)
 {
+    pendingBlock_.active = false;
 }
 
 void MessageAssembler::receive(Net::Socket &socket, std::string &data)
 {
-    if (!buffer_.empty())
-        buffer_.append(data);
-    else
-        buffer_ = data;
+    // Data handed over outside of the socket's read path (e.g. bytes
+    // which followed the handshake) continues a block being received
+    // directly, if any, and joins the receive buffer.
+    size_t taken = 0;
+
+    if (pendingBlock_.active)
+        taken = socket.deliverDirectly(data.data(), data.size());
+
+    if (!socket.receiveBuffer().append(data.data() + taken, data.size() - taken)) {
+        hDebug() << "Peer" << socket.remoteAddress() << "overflowed the receive buffer."
+                 << "Connection will be dropped.";
+        socket.close();
+        return;
+    }
+
+    receive(socket, socket.receiveBuffer());
+}
+
+void MessageAssembler::receive(Net::Socket &socket, Net::ReceiveBuffer &buffer)
+{
+    if (pendingBlock_.active) {
+        // The rest of the payload is being received straight into the
+        // piece buffer.
+        if (socket.directReceiveRemaining() > 0)
+            return;
+
+        completeBlock(socket, true);
+    }
+
+    if (!discardPayload(buffer))
+        return;
 
-    size_t offset = 0;
     MessageSizeField sizeField;
 
-    while (sizeField.absorb(buffer_, offset)) {
+    // Messages are parsed in place; only complete messages are
+    // consumed from the buffer.
+    while (sizeField.decode(buffer.data(), buffer.size())) {
         size_t payloadSize = sizeField.field<0>();
 
         if (payloadSize == 0) {
             // The message is the keep-alive message
-            offset += Net::YieldPacketSize<MessageSizeField>::value;
+            buffer.consume(MessageSizeField::fixedSize);
 
             // TODO: Update socket liveness
             continue;
@@ -71,12 +128,28 @@ void MessageAssembler::receive(Net::Socket &socket, std::string &data)
             return;
         }
 
-        size_t messageSize = Net::YieldPacketSize<MessageSizeField>::value + payloadSize;
+        size_t messageSize = MessageSizeField::fixedSize + payloadSize;
+
+        if (buffer.size() == MessageSizeField::fixedSize)
+            break;
+
+        if ((unsigned char)buffer.data()[MessageSizeField::fixedSize] == PieceMessage::id) {
+            // Payload of PIECE messages goes to the piece buffer as
+            // soon as we know where it belongs.
+            if (buffer.size() < PieceHeader::fixedSize)
+                break;
+
+            if (!assembleBlock(socket, buffer, messageSize)) {
+                socket.close();
+                return;
+            }
 
-        if (buffer_.size() >= offset + messageSize) {
+            if (pendingBlock_.active || discardRemaining_ > 0)
+                return;
+        } else if (buffer.size() >= messageSize) {
             // We can assemble at least one message.
-            if (dispatchMessage(socket, offset)) {
-                offset += messageSize;
+            if (dispatchMessage(socket, buffer.data(), messageSize)) {
+                buffer.consume(messageSize);
             } else {
                 socket.close();
                 return;
@@ -86,21 +159,83 @@ void MessageAssembler::receive(Net::Socket &socket, std::string &data)
             break;
         }
     }
-
-    // Remove parsed messages from buffer.
-    buffer_ = buffer_.substr(offset);
 }
 
 void MessageAssembler::shutdown(Net::Socket &socket)
 {
+    if (pendingBlock_.active)
+        completeBlock(socket, false);
+}
+
+bool MessageAssembler::assembleBlock(Net::Socket &socket, Net::ReceiveBuffer &buffer,
+                                     size_t messageSize)
+{
+    PieceHeader header;
+
+    if (messageSize <= PieceHeader::fixedSize || !header.decode(buffer.data(), buffer.size())) {
+        hDebug() << "Received an invalid message from" << socket.remoteAddress();
+        return false;
+    }
+
+    unsigned int piece = header.field<2>();
+    unsigned int offset = header.field<3>();
+    unsigned int size = messageSize - PieceHeader::fixedSize;
+
+    buffer.consume(PieceHeader::fixedSize);
+
+    char *destination = delegate_->reserveBlock(socket, piece, offset, size);
+
+    if (destination == 0) {
+        // Nobody is waiting for this block, drop it as it arrives.
+        discardRemaining_ = size;
+        discardPayload(buffer);
+
+        return true;
+    }
+
+    size_t available = std::min<size_t>(buffer.size(), size);
+
+    std::memcpy(destination, buffer.data(), available);
+    buffer.consume(available);
+
+    pendingBlock_.active = true;
+    pendingBlock_.piece = piece;
+    pendingBlock_.offset = offset;
+    pendingBlock_.size = size;
+
+    if (available == size)
+        completeBlock(socket, true);
+    else
+        socket.receiveDirectly(destination + available, size - available);
+
+    return true;
+}
+
+void MessageAssembler::completeBlock(Net::Socket &socket, bool received)
+{
+    pendingBlock_.active = false;
+
+    delegate_->processBlock(socket, pendingBlock_.piece, pendingBlock_.offset,
+                            pendingBlock_.size, received);
+}
+
+bool MessageAssembler::discardPayload(Net::ReceiveBuffer &buffer)
+{
+    size_t discarded = std::min(discardRemaining_, buffer.size());
+
+    buffer.consume(discarded);
+    discardRemaining_ -= discarded;
+
+    return discardRemaining_ == 0;
 }
 
 template<typename MessageClass>
-bool MessageAssembler::delegateMessage(Net::Socket &socket, size_t bufferOffset)
+bool MessageAssembler::delegateMessage(Net::Socket &socket, const char *data, size_t size)
 {
     MessageClass message;
 
-    if (message.absorb(buffer_, bufferOffset)) {
+    if (absorbMessage(message, data, size,
+                      std::integral_constant<bool, MessageClass::fixedLayout>())) {
         delegate_->processMessage(socket, message);
         return true;
     } else {
@@ -109,44 +244,40 @@ bool MessageAssembler::delegateMessage(Net::Socket &socket, size_t bufferOffset)
     }
 }
 
-bool MessageAssembler::dispatchMessage(Net::Socket &socket, size_t bufferOffset)
+bool MessageAssembler::dispatchMessage(Net::Socket &socket, const char *data, size_t size)
 {
-    MessageIdField idField;
-
-    bool r = idField.absorb(buffer_, bufferOffset + Net::YieldPacketSize<MessageSizeField>::value);
-
-    assert(r == true);
+    assert(size > MessageSizeField::fixedSize);
 
-    unsigned char messageId = idField.field<0>();
+    unsigned char messageId = data[MessageSizeField::fixedSize];
 
     switch (messageId) {
     case ChokeMessage::id:
         //hDebug() << socket.fd() << "Got choke message from" << socket.remoteAddress();
-        return delegateMessage<ChokeMessage>(socket, bufferOffset);
+        return delegateMessage<ChokeMessage>(socket, data, size);
     case UnchokeMessage::id:
         //hDebug() << socket.fd() << "Got unchoke message from" << socket.remoteAddress();
-        return delegateMessage<UnchokeMessage>(socket, bufferOffset);
+        return delegateMessage<UnchokeMessage>(socket, data, size);
     case InterestedMessage::id:
         //hDebug() << socket.fd() << "Got interested message from" << socket.remoteAddress();
-        return delegateMessage<InterestedMessage>(socket, bufferOffset);
+        return delegateMessage<InterestedMessage>(socket, data, size);
     case NotInterestedMessage::id:
         //hDebug() << socket.fd() << "Got not-interested message from" << socket.remoteAddress();
-        return delegateMessage<NotInterestedMessage>(socket, bufferOffset);
+        return delegateMessage<NotInterestedMessage>(socket, data, size);
     case HaveMessage::id:
         //hDebug() << socket.fd() << "Got have message from" << socket.remoteAddress();
-        return delegateMessage<HaveMessage>(socket, bufferOffset);
+        return delegateMessage<HaveMessage>(socket, data, size);
     case BitfieldMessage::id:
         //hDebug() << socket.fd() << "Got bitfield message from" << socket.remoteAddress();
-        return delegateMessage<BitfieldMessage>(socket, bufferOffset);
+        return delegateMessage<BitfieldMessage>(socket, data, size);
     case RequestMessage::id:
         //hDebug() << socket.fd() << "Got request message from" << socket.remoteAddress();
-        return delegateMessage<RequestMessage>(socket, bufferOffset);
+        return delegateMessage<RequestMessage>(socket, data, size);
     case PieceMessage::id:
         //hDebug() << socket.fd() << "Got piece message from" << socket.remoteAddress();
-        return delegateMessage<PieceMessage>(socket, bufferOffset);
+        return delegateMessage<PieceMessage>(socket, data, size);
     case CancelMessage::id:
         //hDebug() << socket.fd() << "Got cancel message from" << socket.remoteAddress();
-        return delegateMessage<CancelMessage>(socket, bufferOffset);
+        return delegateMessage<CancelMessage>(socket, data, size);
     default:
         //hDebug() << "Received unknown message" << (unsigned int)messageId
         //         << "from" << socket.remoteAddress();
@@ -24,6 +24,7 @@
 #include <net/inputmiddleware.hh>
 #include <bt/peerwire/inputmiddleware.hh>
 
+namespace Hypergrace { namespace Net { class ReceiveBuffer; }}
 namespace Hypergrace { namespace Net { class Socket; }}
 
 
@@ -36,16 +37,32 @@ public:
     MessageAssembler(Bt::InputMiddleware::Pointer);
 
     void receive(Net::Socket &, std::string &);
+    void receive(Net::Socket &, Net::ReceiveBuffer &);
     void shutdown(Net::Socket &);
 
 private:
     template<typename MessageClass>
-    bool delegateMessage(Net::Socket &, size_t);
-    bool dispatchMessage(Net::Socket &, size_t);
+    bool delegateMessage(Net::Socket &, const char *, size_t);
+    bool dispatchMessage(Net::Socket &, const char *, size_t);
+
+    bool assembleBlock(Net::Socket &, Net::ReceiveBuffer &, size_t);
+    void completeBlock(Net::Socket &, bool);
+    bool discardPayload(Net::ReceiveBuffer &);
 
 private:
-    std::string buffer_;
     Bt::InputMiddleware::Pointer delegate_;
+
+    // PIECE message whose payload is being received directly into
+    // the piece buffer.
+    struct PendingBlock {
+        bool active;
+        unsigned int piece;
+        unsigned int offset;
+        unsigned int size;
+    } pendingBlock_;
+
+    // Remaining payload of an unsolicited PIECE message.
+    size_t discardRemaining_;
 };
 
 } /* namespace Bt */
@@ -0,0 +1,440 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <algorithm>
+#include <cassert>
+
+#include "partialpiecetable.hh"
+
+using namespace Hypergrace;
+using namespace Hypergrace::Bt;
+
+
+namespace {
+
+const unsigned int WordBits = 64;
+
+} /* namespace */
+
+PartialPieceTable::PartialPieceTable(unsigned long long torrentSize, unsigned int pieceSize,
+                                     unsigned int blockSize) :
+    torrentSize_(torrentSize),
+    pieceSize_(pieceSize),
+    blockSize_(blockSize),
+    pieceCount_((torrentSize + pieceSize - 1) / pieceSize),
+    slotWords_(1),
+    requestedBytes_(0),
+    missingBytes_(0)
+{
+    assert(pieceSize > 0 && blockSize > 0);
+}
+
+unsigned int PartialPieceTable::attachPeer()
+{
+    unsigned int slot;
+
+    if (!detachedSlots_.empty()) {
+        slot = detachedSlots_.back();
+        detachedSlots_.pop_back();
+    } else {
+        slot = slots_.size();
+        slots_.push_back(Slot());
+
+        if (slots_.size() > slotWords_ * WordBits)
+            growSlotWords();
+    }
+
+    slots_[slot].attached = true;
+    slots_[slot].outstanding = 0;
+
+    return slot;
+}
+
+void PartialPieceTable::detachPeer(unsigned int slot)
+{
+    assert(slot < slots_.size() && slots_[slot].attached);
+
+    cancelAll(slot);
+    release(slot);
+
+    slots_[slot].attached = false;
+    detachedSlots_.push_back(slot);
+}
+
+void PartialPieceTable::open(unsigned int index)
+{
+    assert(index < pieceCount_);
+    assert(!active(index));
+
+    unsigned int blocks = blockCount(index);
+
+    Piece piece;
+
+    piece.index = index;
+    piece.owner = NoSlot;
+    piece.freeCount = blocks;
+    piece.receivedCount = 0;
+    piece.states.assign(blocks, Free);
+    piece.requesterCounts.assign(blocks, 0);
+    piece.requesters.assign(blocks * slotWords_, 0);
+
+    positions_[index] = pieces_.size();
+    pieces_.push_back(std::move(piece));
+
+    missingBytes_ += pieceLength(index);
+}
+
+bool PartialPieceTable::active(unsigned int index) const
+{
+    return positions_.find(index) != positions_.end();
+}
+
+size_t PartialPieceTable::activeCount() const
+{
+    return pieces_.size();
+}
+
+std::vector<unsigned int> PartialPieceTable::activePieces() const
+{
+    std::vector<unsigned int> result;
+    result.reserve(pieces_.size());
+
+    for (auto it = pieces_.begin(); it != pieces_.end(); ++it)
+        result.push_back((*it).index);
+
+    return result;
+}
+
+unsigned int PartialPieceTable::pieceLength(unsigned int index) const
+{
+    assert(index < pieceCount_);
+
+    if (index + 1 < pieceCount_)
+        return pieceSize_;
+
+    return torrentSize_ - (unsigned long long)index * pieceSize_;
+}
+
+unsigned int PartialPieceTable::blockCount(unsigned int index) const
+{
+    return (pieceLength(index) + blockSize_ - 1) / blockSize_;
+}
+
+unsigned int PartialPieceTable::blockOffset(unsigned int block) const
+{
+    return block * blockSize_;
+}
+
+unsigned int PartialPieceTable::blockSize(unsigned int index, unsigned int block) const
+{
+    unsigned int length = pieceLength(index);
+    unsigned int offset = blockOffset(block);
+
+    assert(offset < length);
+
+    return std::min(blockSize_, length - offset);
+}
+
+unsigned int PartialPieceTable::blockIndex(unsigned int index, unsigned int offset,
+                                           unsigned int size) const
+{
+    if (index >= pieceCount_ || offset % blockSize_ != 0 || offset >= pieceLength(index))
+        return NoBlock;
+
+    unsigned int block = offset / blockSize_;
+
+    return (blockSize(index, block) == size) ? block : (unsigned int)NoBlock;
+}
+
+PartialPieceTable::BlockState PartialPieceTable::state(unsigned int index, unsigned int block) const
+{
+    return (BlockState) piece(index).states[block];
+}
+
+unsigned int PartialPieceTable::freeBlockCount(unsigned int index) const
+{
+    return piece(index).freeCount;
+}
+
+unsigned int PartialPieceTable::nextFreeBlock(unsigned int index, unsigned int from) const
+{
+    const Piece &p = piece(index);
+
+    if (p.freeCount > 0) {
+        for (unsigned int block = from; block < p.states.size(); ++block) {
+            if (p.states[block] == Free)
+                return block;
+        }
+    }
+
+    return NoBlock;
+}
+
+unsigned int PartialPieceTable::requesterCount(unsigned int index, unsigned int block) const
+{
+    return piece(index).requesterCounts[block];
+}
+
+bool PartialPieceTable::requestedFrom(unsigned int index, unsigned int block,
+                                      unsigned int slot) const
+{
+    auto position = positions_.find(index);
+
+    if (position == positions_.end() || slot >= slots_.size())
+        return false;
+
+    const Piece &p = pieces_[(*position).second];
+
+    if (block >= p.states.size())
+        return false;
+
+    return p.requesters[block * slotWords_ + slot / WordBits] & (1ULL << (slot % WordBits));
+}
+
+void PartialPieceTable::requesters(unsigned int index, unsigned int block,
+                                   std::vector<unsigned int> &result) const
+{
+    const Piece &p = piece(index);
+
+    for (size_t word = 0; word < slotWords_; ++word) {
+        uint64_t bits = p.requesters[block * slotWords_ + word];
+
+        while (bits != 0) {
+            result.push_back(word * WordBits + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+}
+
+unsigned int PartialPieceTable::outstanding(unsigned int slot) const
+{
+    assert(slot < slots_.size());
+
+    return slots_[slot].outstanding;
+}
+
+unsigned long long PartialPieceTable::requestedBytes() const
+{
+    return requestedBytes_;
+}
+
+unsigned long long PartialPieceTable::missingBytes() const
+{
+    return missingBytes_;
+}
+
+void PartialPieceTable::request(unsigned int index, unsigned int block, unsigned int slot)
+{
+    Piece &p = piece(index);
+
+    assert(slot < slots_.size() && slots_[slot].attached);
+    assert(p.states[block] != Received);
+    assert(!requestedFrom(index, block, slot));
+
+    if (p.states[block] == Free) {
+        p.states[block] = Requested;
+        --p.freeCount;
+    }
+
+    p.requesters[block * slotWords_ + slot / WordBits] |= 1ULL << (slot % WordBits);
+    ++p.requesterCounts[block];
+
+    ++slots_[slot].outstanding;
+    ++slots_[slot].pieces[index];
+
+    requestedBytes_ += blockSize(index, block);
+}
+
+void PartialPieceTable::cancel(unsigned int index, unsigned int block, unsigned int slot)
+{
+    Piece &p = piece(index);
+
+    assert(requestedFrom(index, block, slot));
+
+    dropRequest(p, block, slot);
+
+    // Nobody else has been asked for the block, so it can be handed
+    // out again.
+    if (p.requesterCounts[block] == 0) {
+        p.states[block] = Free;
+        ++p.freeCount;
+    }
+}
+
+void PartialPieceTable::cancelAll(unsigned int slot)
+{
+    assert(slot < slots_.size());
+
+    // Copy the piece list as cancelling updates it.
+    std::vector<unsigned int> involved;
+
+    for (auto it = slots_[slot].pieces.begin(); it != slots_[slot].pieces.end(); ++it)
+        involved.push_back((*it).first);
+
+    for (auto it = involved.begin(); it != involved.end(); ++it) {
+        unsigned int index = *it;
+        unsigned int blocks = piece(index).states.size();
+
+        for (unsigned int block = 0; block < blocks; ++block) {
+            if (requestedFrom(index, block, slot))
+                cancel(index, block, slot);
+        }
+    }
+
+    assert(slots_[slot].outstanding == 0);
+    assert(slots_[slot].pieces.empty());
+}
+
+void PartialPieceTable::claim(unsigned int index, unsigned int slot)
+{
+    assert(slot < slots_.size() && slots_[slot].attached);
+
+    piece(index).owner = slot;
+}
+
+void PartialPieceTable::release(unsigned int slot)
+{
+    for (auto it = pieces_.begin(); it != pieces_.end(); ++it) {
+        if ((*it).owner == slot)
+            (*it).owner = NoSlot;
+    }
+}
+
+unsigned int PartialPieceTable::owner(unsigned int index) const
+{
+    return piece(index).owner;
+}
+
+bool PartialPieceTable::receive(unsigned int index, unsigned int block)
+{
+    Piece &p = piece(index);
+
+    assert(p.states[block] != Received);
+
+    if (p.states[block] == Free)
+        --p.freeCount;
+
+    for (size_t word = 0; word < slotWords_; ++word) {
+        uint64_t bits = p.requesters[block * slotWords_ + word];
+
+        while (bits != 0) {
+            dropRequest(p, block, word * WordBits + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+
+    p.states[block] = Received;
+    missingBytes_ -= blockSize(index, block);
+
+    if (++p.receivedCount < p.states.size())
+        return false;
+
+    remove(index);
+
+    return true;
+}
+
+void PartialPieceTable::abort(unsigned int index)
+{
+    Piece &p = piece(index);
+
+    for (unsigned int block = 0; block < p.states.size(); ++block) {
+        for (size_t word = 0; word < slotWords_; ++word) {
+            uint64_t bits = p.requesters[block * slotWords_ + word];
+
+            while (bits != 0) {
+                dropRequest(p, block, word * WordBits + __builtin_ctzll(bits));
+                bits &= bits - 1;
+            }
+        }
+
+        if (p.states[block] != Received)
+            missingBytes_ -= blockSize(index, block);
+    }
+
+    remove(index);
+}
+
+PartialPieceTable::Piece &PartialPieceTable::piece(unsigned int index)
+{
+    auto position = positions_.find(index);
+    assert(position != positions_.end());
+
+    return pieces_[(*position).second];
+}
+
+const PartialPieceTable::Piece &PartialPieceTable::piece(unsigned int index) const
+{
+    auto position = positions_.find(index);
+    assert(position != positions_.end());
+
+    return pieces_[(*position).second];
+}
+
+void PartialPieceTable::dropRequest(Piece &p, unsigned int block, unsigned int slot)
+{
+    p.requesters[block * slotWords_ + slot / WordBits] &= ~(1ULL << (slot % WordBits));
+    --p.requesterCounts[block];
+
+    Slot &s = slots_[slot];
+    auto it = s.pieces.find(p.index);
+
+    --s.outstanding;
+
+    if (--(*it).second == 0)
+        s.pieces.erase(it);
+
+    requestedBytes_ -= blockSize(p.index, block);
+}
+
+void PartialPieceTable::remove(unsigned int index)
+{
+    // Move the last piece into the place of the removed one.
+    unsigned int position = positions_[index];
+
+    positions_.erase(index);
+
+    if (position + 1 < pieces_.size()) {
+        pieces_[position] = std::move(pieces_.back());
+        positions_[pieces_[position].index] = position;
+    }
+
+    pieces_.pop_back();
+}
+
+void PartialPieceTable::growSlotWords()
+{
+    size_t words = slotWords_ + 1;
+
+    // Spread the requester words of every block to the new stride.
+    for (auto it = pieces_.begin(); it != pieces_.end(); ++it) {
+        Piece &p = *it;
+        std::vector<uint64_t> requesters(p.states.size() * words, 0);
+
+        for (size_t block = 0; block < p.states.size(); ++block) {
+            for (size_t word = 0; word < slotWords_; ++word)
+                requesters[block * words + word] = p.requesters[block * slotWords_ + word];
+        }
+
+        p.requesters.swap(requesters);
+    }
+
+    slotWords_ = words;
+}
@@ -0,0 +1,176 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef BT_PEERWIRE_PARTIALPIECETABLE_HH_
+#define BT_PEERWIRE_PARTIALPIECETABLE_HH_
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+namespace Hypergrace {
+namespace Bt {
+
+/**
+ * Block states of the pieces being downloaded.
+ *
+ * Every piece in transit has a dense array of block states and, per
+ * block, a bitset of the peers the block has been requested from.
+ * Peers are referred to by small slot numbers handed out by the table.
+ * A piece enters the table with all of its blocks free and leaves it as
+ * soon as all of them have been received, so memory follows the number
+ * of pieces in transit rather than the size of the torrent.
+ */
+class PartialPieceTable
+{
+public:
+    enum BlockState {
+        Free,
+        Requested,
+        Received
+    };
+
+    enum {
+        NoBlock = (unsigned int)-1,
+        NoSlot = (unsigned int)-1
+    };
+
+public:
+    PartialPieceTable(unsigned long long, unsigned int, unsigned int);
+
+    unsigned int attachPeer();
+    void detachPeer(unsigned int);
+
+    void open(unsigned int);
+    bool active(unsigned int) const;
+
+    size_t activeCount() const;
+    std::vector<unsigned int> activePieces() const;
+
+    unsigned int pieceLength(unsigned int) const;
+    unsigned int blockCount(unsigned int) const;
+    unsigned int blockOffset(unsigned int) const;
+    unsigned int blockSize(unsigned int, unsigned int) const;
+
+    /**
+     * Returns the index of the block at the given offset of the piece
+     * or NoBlock if the offset and size don't match a block.
+     */
+    unsigned int blockIndex(unsigned int, unsigned int, unsigned int) const;
+
+    BlockState state(unsigned int, unsigned int) const;
+    unsigned int freeBlockCount(unsigned int) const;
+    unsigned int nextFreeBlock(unsigned int, unsigned int) const;
+
+    unsigned int requesterCount(unsigned int, unsigned int) const;
+    bool requestedFrom(unsigned int, unsigned int, unsigned int) const;
+    void requesters(unsigned int, unsigned int, std::vector<unsigned int> &) const;
+
+    /**
+     * Number of requests outstanding at the peer, and payload of all
+     * outstanding requests with duplicates included.
+     */
+    unsigned int outstanding(unsigned int) const;
+    unsigned long long requestedBytes() const;
+
+    /**
+     * Payload of the pieces in transit which hasn't been received yet.
+     */
+    unsigned long long missingBytes() const;
+
+    void request(unsigned int, unsigned int, unsigned int);
+    void cancel(unsigned int, unsigned int, unsigned int);
+    void cancelAll(unsigned int);
+
+    /**
+     * Reserves the free blocks of the piece for the peer. A peer's
+     * pieces are released when it is detached or with release().
+     */
+    void claim(unsigned int, unsigned int);
+    void release(unsigned int);
+    unsigned int owner(unsigned int) const;
+
+    /**
+     * Marks the block as received and drops all of its requests.
+     * Returns true if that completes the piece, which leaves the table
+     * then.
+     */
+    bool receive(unsigned int, unsigned int);
+
+    /**
+     * Drops the piece with all of its requests, received blocks
+     * included. The piece can be opened again later.
+     */
+    void abort(unsigned int);
+
+private:
+    struct Piece
+    {
+        unsigned int index;
+        unsigned int owner;
+        unsigned int freeCount;
+        unsigned int receivedCount;
+
+        std::vector<unsigned char> states;
+        std::vector<unsigned short> requesterCounts;
+
+        // blockCount * slotWords_ words, bit n of a block's words
+        // standing for the peer in slot n
+        std::vector<uint64_t> requesters;
+    };
+
+    struct Slot
+    {
+        bool attached;
+        unsigned int outstanding;
+
+        // Number of requests the peer has outstanding per piece
+        std::unordered_map<unsigned int, unsigned int> pieces;
+    };
+
+    Piece &piece(unsigned int);
+    const Piece &piece(unsigned int) const;
+
+    void dropRequest(Piece &, unsigned int, unsigned int);
+    void remove(unsigned int);
+    void growSlotWords();
+
+private:
+    const unsigned long long torrentSize_;
+    const unsigned int pieceSize_;
+    const unsigned int blockSize_;
+    const unsigned int pieceCount_;
+
+    std::vector<Piece> pieces_;
+    std::unordered_map<unsigned int, unsigned int> positions_;
+
+    std::vector<Slot> slots_;
+    std::vector<unsigned int> detachedSlots_;
+    size_t slotWords_;
+
+    unsigned long long requestedBytes_;
+    unsigned long long missingBytes_;
+};
+
+} /* namespace Bt */
+} /* namespace Hypergrace */
+
+#endif /* BT_PEERWIRE_PARTIALPIECETABLE_HH_ */
@@ -50,9 +50,14 @@ const Util::Bitfield &PeerData::bitfield() const
     return bitfield_;
 }
 
-const Util::Rating &PeerData::rating() const
+const Net::RateEstimator &PeerData::payloadDownloadRate() const
 {
-    return rating_;
+    return payloadDownloadRate_;
+}
+
+const Net::RateEstimator &PeerData::payloadUploadRate() const
+{
+    return payloadUploadRate_;
 }
 
 bool PeerData::peerIsInterested() const
@@ -85,9 +90,14 @@ Util::Bitfield &PeerData::bitfield()
     return bitfield_;
 }
 
-Util::Rating &PeerData::rating()
+Net::RateEstimator &PeerData::payloadDownloadRate()
+{
+    return payloadDownloadRate_;
+}
+
+Net::RateEstimator &PeerData::payloadUploadRate()
 {
-    return rating_;
+    return payloadUploadRate_;
 }
 
 void PeerData::setPeerIsInterested(bool interested)
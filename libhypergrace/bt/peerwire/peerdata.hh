@@ -25,7 +25,7 @@
 
 #include <bt/types.hh>
 
-#include <util/rating.hh>
+#include <net/rateestimator.hh>
 #include <util/bitfield.hh>
 
 namespace Hypergrace { namespace Bt { class TorrentBundle; }}
@@ -50,7 +50,13 @@ public:
     const PeerId &peerId() const;
 
     const Util::Bitfield &bitfield() const;
-    const Util::Rating &rating() const;
+
+    /**
+     * Estimated rates of block payload received from and sent to the
+     * peer, protocol overhead excluded.
+     */
+    const Net::RateEstimator &payloadDownloadRate() const;
+    const Net::RateEstimator &payloadUploadRate() const;
 
     bool peerIsInterested() const;
     bool peerChokedUs() const;
@@ -62,7 +68,8 @@ public:
 
 public:
     Util::Bitfield &bitfield();
-    Util::Rating &rating();
+    Net::RateEstimator &payloadDownloadRate();
+    Net::RateEstimator &payloadUploadRate();
 
     void setPeerIsInterested(bool);
     void setPeerChokedUs(bool);
@@ -93,7 +100,8 @@ private:
     PeerId peerId_;
 
     Util::Bitfield bitfield_;
-    Util::Rating rating_;
+    Net::RateEstimator payloadDownloadRate_;
+    Net::RateEstimator payloadUploadRate_;
 
     bool dropBitfield_;
 
@@ -36,7 +36,7 @@ PeerDataCollector::PeerDataCollector(
         const TorrentBundle &bundle,
         std::shared_ptr<PeerData> peerData,
         Bt::InputMiddleware::Pointer input) :
-    InputMiddleware(input),
+    StageMiddleware(input),
     OutputMiddleware(),
     bundle_(bundle),
     peerData_(peerData),
@@ -49,7 +49,7 @@ PeerDataCollector::PeerDataCollector(
         std::shared_ptr<PeerData> peerData,
         Bt::InputMiddleware::Pointer input,
         Net::OutputMiddleware::Pointer output) :
-    InputMiddleware(input),
+    StageMiddleware(input),
     OutputMiddleware(output),
     bundle_(bundle),
     peerData_(peerData),
@@ -61,51 +61,55 @@ PeerDataCollector::~PeerDataCollector()
 {
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, ChokeMessage &message)
+bool PeerDataCollector::handle(Net::Socket &, ChokeMessage &)
 {
     dropBitfield_ = true;
 
     if (!peerData_->peerChokedUs()) {
         peerData_->setPeerChokedUs(true);
-
-        delegateMessage(socket, message);
+        return true;
     }
+
+    return false;
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, UnchokeMessage &message)
+bool PeerDataCollector::handle(Net::Socket &, UnchokeMessage &)
 {
     dropBitfield_ = true;
 
     if (peerData_->peerChokedUs()) {
         peerData_->setPeerChokedUs(false);
-
-        delegateMessage(socket, message);
+        return true;
     }
+
+    return false;
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, InterestedMessage &message)
+bool PeerDataCollector::handle(Net::Socket &, InterestedMessage &)
 {
     dropBitfield_ = true;
 
     if (!peerData_->peerIsInterested()) {
         peerData_->setPeerIsInterested(true);
-
-        delegateMessage(socket, message);
+        return true;
     }
+
+    return false;
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, NotInterestedMessage &message)
+bool PeerDataCollector::handle(Net::Socket &, NotInterestedMessage &)
 {
     dropBitfield_ = true;
 
     if (peerData_->peerIsInterested()) {
         peerData_->setPeerIsInterested(false);
-
-        delegateMessage(socket, message);
+        return true;
     }
+
+    return false;
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, HaveMessage &message)
+bool PeerDataCollector::handle(Net::Socket &, HaveMessage &message)
 {
     unsigned int piece = message.field<2>();
     Util::Bitfield &bitfield = peerData_->bitfield();
@@ -114,28 +118,30 @@ void PeerDataCollector::processMessage(Net::Socket &socket, HaveMessage &message
 
     if (piece < bitfield.bitCount() && !bitfield.bit(piece)) {
         bitfield.set(piece);
-
-        delegateMessage(socket, message);
+        return true;
     }
+
+    return false;
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, BitfieldMessage &message)
+bool PeerDataCollector::handle(Net::Socket &socket, BitfieldMessage &message)
 {
     if (dropBitfield_)
-        return;
+        return false;
+
+    dropBitfield_ = true;
 
     if (peerData_->bitfield().assign(message.field<2>())) {
-        delegateMessage(socket, message);
+        return true;
     } else {
         hDebug() << "Assignment of bitfield failed. Connection with" << socket.remoteAddress()
                  << "will be dropped";
         socket.close();
+        return false;
     }
-
-    dropBitfield_ = true;
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, RequestMessage &message)
+bool PeerDataCollector::handle(Net::Socket &socket, RequestMessage &message)
 {
     dropBitfield_ = true;
 
@@ -148,17 +154,17 @@ void PeerDataCollector::processMessage(Net::Socket &socket, RequestMessage &mess
         offset + size > model.pieceSize())
     {
         hDebug() << "Got a bogus block request from" << socket.remoteAddress();
-        return;
+        return false;
     }
 
     if (!bundle_.state().availablePieces().bit(piece)) {
         hDebug() << "Got a request for a non-existent piece from" << socket.remoteAddress();
-        return;
+        return false;
     }
 
     if (peerData_->weChokedPeer()) {
         hDebug() << "Got a block request from a choked peer" << socket.remoteAddress();
-        return;
+        return false;
     }
 
     if (size > 32768) {
@@ -166,19 +172,31 @@ void PeerDataCollector::processMessage(Net::Socket &socket, RequestMessage &mess
                  << socket.remoteAddress() << "; The block is too large,"
                  << "connection will be dropped";
         socket.close();
-        return;
+        return false;
     }
 
-    delegateMessage(socket, message);
+    return true;
 }
 
-void PeerDataCollector::processMessage(Net::Socket &socket, PieceMessage &message)
+bool PeerDataCollector::handle(Net::Socket &, PieceMessage &message)
 {
     dropBitfield_ = true;
 
-    peerData_->rating().upvote();
+    peerData_->payloadDownloadRate().add(message.field<4>().size());
+
+    return true;
+}
+
+bool PeerDataCollector::handleBlock(Net::Socket &, unsigned int, unsigned int,
+                                    unsigned int size, bool received)
+{
+    if (received) {
+        dropBitfield_ = true;
+
+        peerData_->payloadDownloadRate().add(size);
+    }
 
-    delegateMessage(socket, message);
+    return true;
 }
 
 void PeerDataCollector::send(Net::Socket &socket, Net::Packet *packet)
@@ -186,26 +204,59 @@ void PeerDataCollector::send(Net::Socket &socket, Net::Packet *packet)
     // Catch torrent messages that we are sending to the peer to update
     // state accordingly.
     if (packet->packetClass() == Bt::BitTorrentPacketClass) {
+        unsigned int payload = 0;
+        unsigned int control = 0;
+
         switch (packet->packetId()) {
         case ChokeMessage::id:
             peerData_->setWeChokedPeer(true);
+            control = ChokeMessage::fixedSize;
             break;
         case UnchokeMessage::id:
             peerData_->setWeChokedPeer(false);
+            control = UnchokeMessage::fixedSize;
             break;
         case InterestedMessage::id:
             peerData_->setWeAreInterested(true);
+            control = InterestedMessage::fixedSize;
             break;
         case NotInterestedMessage::id:
             peerData_->setWeAreInterested(false);
+            control = NotInterestedMessage::fixedSize;
+            break;
+        case HaveMessage::id:
+            control = HaveMessage::fixedSize;
+            break;
+        case BitfieldMessage::id:
+            control = static_cast<BitfieldMessage *>(packet)->size();
+            break;
+        case RequestMessage::id:
+            control = RequestMessage::fixedSize;
             break;
         case PieceMessage::id:
-            peerData_->rating().downvote();
+            payload = static_cast<PieceMessage *>(packet)->field<4>().size();
+            control = static_cast<PieceMessage *>(packet)->size() - payload;
+            break;
+        case CancelMessage::id:
+            control = CancelMessage::fixedSize;
             break;
         default:
             break;
         };
+
+        // Account the message once it has left, the sender's own
+        // notification still follows.
+        packet->onSent = Delegate::bind(&PeerDataCollector::handleSentEvent, this,
+                                        packet->onSent, payload, control);
     }
 
     Net::OutputMiddleware::delegateSendEvent(socket, packet);
 }
+
+void PeerDataCollector::handleSentEvent(Delegate::Delegate<> onSent,
+                                        unsigned int payload, unsigned int control)
+{
+    bundle_.state().updateSent(payload, control);
+
+    onSent();
+}
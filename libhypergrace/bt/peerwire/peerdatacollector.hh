@@ -23,6 +23,8 @@
 
 #include <bt/peerwire/inputmiddleware.hh>
 #include <bt/peerwire/message.hh>
+#include <bt/peerwire/pipeline.hh>
+#include <delegate/delegate.hh>
 #include <net/outputmiddleware.hh>
 
 namespace Hypergrace { namespace Bt { class PeerData; }}
@@ -33,7 +35,9 @@ namespace Hypergrace { namespace Net { class Socket; }}
 namespace Hypergrace {
 namespace Bt {
 
-class PeerDataCollector : public Bt::InputMiddleware, public Net::OutputMiddleware
+class PeerDataCollector :
+      public Bt::StageMiddleware<PeerDataCollector>,
+      public Net::OutputMiddleware
 {
 public:
     PeerDataCollector(const TorrentBundle &, std::shared_ptr<PeerData>,
@@ -43,17 +47,27 @@ public:
     ~PeerDataCollector();
 
 public:
-    void processMessage(Net::Socket &, ChokeMessage &);
-    void processMessage(Net::Socket &, UnchokeMessage &);
-    void processMessage(Net::Socket &, InterestedMessage &);
-    void processMessage(Net::Socket &, NotInterestedMessage &);
-    void processMessage(Net::Socket &, HaveMessage &);
-    void processMessage(Net::Socket &, BitfieldMessage &);
-    void processMessage(Net::Socket &, PieceMessage &);
-    void processMessage(Net::Socket &, RequestMessage &);
-
     void send(Net::Socket &, Net::Packet *);
 
+public:
+    // Pipeline stage interface, returns whether the message should
+    // be passed on.
+    using PipelineStage::handle;
+
+    bool handle(Net::Socket &, ChokeMessage &);
+    bool handle(Net::Socket &, UnchokeMessage &);
+    bool handle(Net::Socket &, InterestedMessage &);
+    bool handle(Net::Socket &, NotInterestedMessage &);
+    bool handle(Net::Socket &, HaveMessage &);
+    bool handle(Net::Socket &, BitfieldMessage &);
+    bool handle(Net::Socket &, PieceMessage &);
+    bool handle(Net::Socket &, RequestMessage &);
+
+    bool handleBlock(Net::Socket &, unsigned int, unsigned int, unsigned int, bool);
+
+private:
+    void handleSentEvent(Delegate::Delegate<>, unsigned int, unsigned int);
+
 private:
     const TorrentBundle &bundle_;
     std::shared_ptr<PeerData> peerData_;
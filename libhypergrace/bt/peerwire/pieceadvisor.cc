@@ -20,10 +20,7 @@
 
 #include <algorithm>
 #include <cassert>
-
-#include <bt/bundle/torrentbundle.hh>
-#include <bt/bundle/torrentmodel.hh>
-#include <bt/bundle/torrentstate.hh>
+#include <cstdlib>
 
 #include <util/bitfield.hh>
 
@@ -33,27 +30,31 @@ using namespace Hypergrace;
 using namespace Hypergrace::Bt;
 
 
-PieceAdvisor::PieceAdvisor(const TorrentBundle &bundle) :
-    bundle_(bundle),
-    dirtyPieces_(bundle.model().pieceCount())
+PieceAdvisor::PieceAdvisor(const Util::Bitfield &scheduledPieces) :
+    scheduledPieces_(scheduledPieces),
+    references_(scheduledPieces.bitCount(), 0),
+    dirtyPieces_(scheduledPieces.bitCount()),
+    position_(scheduledPieces.bitCount(), NotCandidate),
+    bucketStart_(1, 0)
 {
-    references_.resize(bundle.model().pieceCount(), 0);
+    resynchronize();
 }
 
 void PieceAdvisor::reference(unsigned int piece)
 {
     assert(piece < references_.size());
 
-    ++references_[piece];
+    increase(piece);
 }
 
 void PieceAdvisor::reference(const Util::Bitfield &mask)
 {
     assert(mask.bitCount() == references_.size());
 
-    for (size_t piece = 0; piece < mask.bitCount(); ++piece) {
-        if (mask.bit(piece))
-            ++references_[piece];
+    for (size_t piece = mask.nextEnabled(0); piece != Util::Bitfield::NotFound;
+         piece = mask.nextEnabled(piece + 1))
+    {
+        increase(piece);
     }
 }
 
@@ -62,18 +63,18 @@ void PieceAdvisor::unreference(unsigned int piece)
     assert(piece < references_.size());
     assert(references_[piece] > 0);
 
-    --references_[piece];
+    decrease(piece);
 }
 
 void PieceAdvisor::unreference(const Util::Bitfield &mask)
 {
     assert(mask.bitCount() == references_.size());
 
-    for (size_t piece = 0; piece < mask.bitCount(); ++piece) {
-        if (mask.bit(piece)) {
-            assert(references_[piece] > 0);
-            --references_[piece];
-        }
+    for (size_t piece = mask.nextEnabled(0); piece != Util::Bitfield::NotFound;
+         piece = mask.nextEnabled(piece + 1))
+    {
+        assert(references_[piece] > 0);
+        decrease(piece);
     }
 }
 
@@ -82,6 +83,9 @@ void PieceAdvisor::markDirty(unsigned int piece)
     assert(piece < dirtyPieces_.bitCount());
 
     dirtyPieces_.set(piece);
+
+    if (position_[piece] != NotCandidate)
+        remove(piece);
 }
 
 void PieceAdvisor::markClean(unsigned int piece)
@@ -89,6 +93,9 @@ void PieceAdvisor::markClean(unsigned int piece)
     assert(piece < dirtyPieces_.bitCount());
 
     dirtyPieces_.unset(piece);
+
+    if (position_[piece] == NotCandidate && scheduledPieces_.bit(piece))
+        insert(piece);
 }
 
 bool PieceAdvisor::isDirty(unsigned int piece) const
@@ -98,60 +105,180 @@ bool PieceAdvisor::isDirty(unsigned int piece) const
     return dirtyPieces_.bit(piece);
 }
 
-unsigned int PieceAdvisor::recommend()
+size_t PieceAdvisor::cleanPieceCount() const
 {
-    if (cache_.empty())
-        refillCache();
+    return scheduledPieces_.exclusiveCount(dirtyPieces_);
+}
 
-    // Fail with an invalid index if last refill didn't succeed
-    if (cache_.empty())
-        return -1;
+void PieceAdvisor::resynchronize()
+{
+    unsigned int maximum = 0;
+
+    for (size_t piece = 0; piece < references_.size(); ++piece)
+        maximum = std::max(maximum, references_[piece]);
+
+    // Count the candidates in every bucket and lay the buckets out
+    // one after another.
+    std::vector<unsigned int> counts(maximum + 1, 0);
+
+    for (size_t piece = scheduledPieces_.nextExclusive(dirtyPieces_, 0);
+         piece != Util::Bitfield::NotFound;
+         piece = scheduledPieces_.nextExclusive(dirtyPieces_, piece + 1))
+    {
+        ++counts[references_[piece]];
+    }
+
+    bucketStart_.assign(maximum + 1, 0);
+
+    for (unsigned int bucket = 1; bucket <= maximum; ++bucket)
+        bucketStart_[bucket] = bucketStart_[bucket - 1] + counts[bucket - 1];
 
-    unsigned int piece = cache_.back();
+    std::vector<unsigned int> next(bucketStart_);
 
-    cache_.pop_back();
+    order_.resize(bucketStart_[maximum] + counts[maximum]);
+    std::fill(position_.begin(), position_.end(), NotCandidate);
 
-    // Check whether the piece is still downloadable and if not
-    // recursively try to recommend something better
-    if (bundle_.state().scheduledPieces().bit(piece) &&
-        references_[piece] > 0 &&
-        !dirtyPieces_.bit(piece))
+    for (size_t piece = scheduledPieces_.nextExclusive(dirtyPieces_, 0);
+         piece != Util::Bitfield::NotFound;
+         piece = scheduledPieces_.nextExclusive(dirtyPieces_, piece + 1))
     {
-        dirtyPieces_.set(piece);
-        return piece;
-    } else {
-        return recommend();
+        position_[piece] = next[references_[piece]]++;
+        order_[position_[piece]] = piece;
     }
 }
 
-void PieceAdvisor::refillCache()
+unsigned int PieceAdvisor::availability(unsigned int piece) const
+{
+    assert(piece < references_.size());
+
+    return references_[piece];
+}
+
+unsigned int PieceAdvisor::recommend()
+{
+    std::vector<unsigned int> picked;
+
+    pick([](unsigned int) { return true; }, 1, picked);
+
+    if (picked.empty())
+        return -1;
+
+    markDirty(picked.front());
+
+    return picked.front();
+}
+
+void PieceAdvisor::recommend(const Util::Bitfield &peerPieces, size_t count,
+                             std::vector<unsigned int> &result)
+{
+    assert(peerPieces.bitCount() == references_.size());
+
+    pick([&peerPieces](unsigned int piece) { return peerPieces.bit(piece); }, count, result);
+}
+
+template<typename Accept>
+void PieceAdvisor::pick(Accept accept, size_t count, std::vector<unsigned int> &result)
 {
-    std::vector<unsigned int> downloadablePieces;
+    std::vector<unsigned int> unscheduled;
+    size_t picked = 0;
+
+    // Nobody has the pieces in the first bucket.
+    for (unsigned int bucket = 1; bucket < bucketStart_.size() && picked < count; ++bucket) {
+        unsigned int start = bucketStart_[bucket];
+        unsigned int size = bucketEnd(bucket) - start;
+
+        if (size == 0)
+            continue;
 
-    const Util::Bitfield& schedPieces = bundle_.state().scheduledPieces();
+        unsigned int offset = rand() % size;
 
-    for (unsigned int i = 0; i < references_.size(); ++i) {
-        // Insert index only if it's valid and there's at least one peer
-        // that can serve the piece
-        if (references_[i] > 0 && schedPieces.bit(i) && !dirtyPieces_.bit(i))
-            downloadablePieces.push_back(i);
+        for (unsigned int i = 0; i < size && picked < count; ++i) {
+            unsigned int piece = order_[start + (offset + i) % size];
+
+            if (!scheduledPieces_.bit(piece)) {
+                unscheduled.push_back(piece);
+            } else if (accept(piece)) {
+                result.push_back(piece);
+                ++picked;
+            }
+        }
     }
 
-    if (downloadablePieces.size() == 0)
+    // Drop the pieces which have been unscheduled meanwhile so that
+    // they are not walked over again.
+    for (auto it = unscheduled.begin(); it != unscheduled.end(); ++it)
+        remove(*it);
+}
+
+void PieceAdvisor::increase(unsigned int piece)
+{
+    unsigned int bucket = references_[piece]++;
+
+    if (bucket + 1 == bucketStart_.size())
+        bucketStart_.push_back(order_.size());
+
+    if (position_[piece] == NotCandidate)
+        return;
+
+    // Move the piece to the end of its bucket and let the next bucket
+    // take it over.
+    swap(position_[piece], bucketStart_[bucket + 1] - 1);
+    --bucketStart_[bucket + 1];
+}
+
+void PieceAdvisor::decrease(unsigned int piece)
+{
+    unsigned int bucket = references_[piece]--;
+
+    if (position_[piece] == NotCandidate)
         return;
 
-    if (downloadablePieces.size() > 10) {
-        cache_.clear();
-        cache_.resize(10);
-
-        std::partial_sort_copy(
-                downloadablePieces.begin(), downloadablePieces.end(),
-                cache_.begin(), cache_.end(),
-                [this](size_t l, size_t r) { return references_[l] < references_[r]; }
-        );
-    } else {
-        cache_ = std::move(downloadablePieces);
+    // Move the piece to the beginning of its bucket and let the
+    // previous bucket take it over.
+    swap(position_[piece], bucketStart_[bucket]);
+    ++bucketStart_[bucket];
+}
+
+void PieceAdvisor::insert(unsigned int piece)
+{
+    unsigned int bucket = references_[piece];
+
+    // The piece enters the last bucket at the end of the array and
+    // sinks down to its own one bucket by bucket.
+    order_.push_back(piece);
+    position_[piece] = order_.size() - 1;
+
+    for (unsigned int above = bucketStart_.size() - 1; above > bucket; --above) {
+        swap(position_[piece], bucketStart_[above]);
+        ++bucketStart_[above];
+    }
+}
+
+void PieceAdvisor::remove(unsigned int piece)
+{
+    unsigned int bucket = references_[piece];
+
+    // Float the piece up to the end of the array bucket by bucket.
+    for (unsigned int above = bucket + 1; above < bucketStart_.size(); ++above) {
+        swap(position_[piece], bucketStart_[above] - 1);
+        --bucketStart_[above];
     }
 
-    std::random_shuffle(cache_.begin(), cache_.end());
+    swap(position_[piece], order_.size() - 1);
+
+    order_.pop_back();
+    position_[piece] = NotCandidate;
+}
+
+void PieceAdvisor::swap(unsigned int first, unsigned int second)
+{
+    std::swap(order_[first], order_[second]);
+
+    position_[order_[first]] = first;
+    position_[order_[second]] = second;
+}
+
+unsigned int PieceAdvisor::bucketEnd(unsigned int bucket) const
+{
+    return (bucket + 1 < bucketStart_.size()) ? bucketStart_[bucket + 1] : order_.size();
 }
@@ -28,10 +28,21 @@
 namespace Hypergrace {
 namespace Bt {
 
+/**
+ * Rarest-first piece picker.
+ *
+ * Candidate pieces (scheduled ones that are not being downloaded) are
+ * kept in a single array ordered by availability, pieces seen by the
+ * same number of peers forming a contiguous bucket. A change of
+ * availability by one moves the piece across the edge of its bucket
+ * with a single swap, so HAVEs, bitfields and disconnects cost O(1)
+ * per piece. Picking walks the buckets from the rarest one and starts
+ * at a random position within each bucket to break ties.
+ */
 class PieceAdvisor
 {
 public:
-    explicit PieceAdvisor(const TorrentBundle &);
+    explicit PieceAdvisor(const Util::Bitfield &);
 
     void reference(unsigned int);
     void reference(const Util::Bitfield &);
@@ -43,17 +54,63 @@ public:
 
     bool isDirty(unsigned int) const;
 
+    /**
+     * Returns the number of scheduled pieces which are not being
+     * downloaded yet.
+     */
+    size_t cleanPieceCount() const;
+
+    /**
+     * Rebuilds the candidate set after pieces have been scheduled or
+     * unscheduled. Pieces unscheduled meanwhile are dropped lazily,
+     * but newly scheduled ones aren't picked until this is called.
+     */
+    void resynchronize();
+
+    /**
+     * Returns the number of peers known to have the piece.
+     */
+    unsigned int availability(unsigned int) const;
+
+    /**
+     * Picks the rarest candidate piece any peer has and marks it
+     * dirty. Returns -1 if there is none.
+     */
     unsigned int recommend();
 
+    /**
+     * Collects up to the given number of the rarest candidate pieces
+     * the peer with the given bitfield has, rarest first. Pieces are
+     * not marked dirty.
+     */
+    void recommend(const Util::Bitfield &, size_t, std::vector<unsigned int> &);
+
 private:
-    void refillCache();
+    enum { NotCandidate = (unsigned int)-1 };
+
+    void increase(unsigned int);
+    void decrease(unsigned int);
+
+    void insert(unsigned int);
+    void remove(unsigned int);
+    void swap(unsigned int, unsigned int);
+
+    unsigned int bucketEnd(unsigned int) const;
+
+    template<typename Accept>
+    void pick(Accept, size_t, std::vector<unsigned int> &);
 
 private:
-    const TorrentBundle &bundle_;
+    const Util::Bitfield &scheduledPieces_;
 
-    std::vector<unsigned int> cache_;
     std::vector<unsigned int> references_;
     Util::Bitfield dirtyPieces_;
+
+    // Candidates ordered by availability, the position of every piece
+    // in it and the first position of every bucket
+    std::vector<unsigned int> order_;
+    std::vector<unsigned int> position_;
+    std::vector<unsigned int> bucketStart_;
 };
 
 } /* namespace Bt */
@@ -0,0 +1,259 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef BT_PEERWIRE_PIPELINE_HH_
+#define BT_PEERWIRE_PIPELINE_HH_
+
+#include <cstddef>
+#include <memory>
+#include <tuple>
+
+#include <bt/peerwire/inputmiddleware.hh>
+#include <bt/peerwire/message.hh>
+
+namespace Hypergrace { namespace Net { class Socket; }}
+
+
+namespace Hypergrace {
+namespace Bt {
+
+/**
+ * Base class for stages of a statically composed Pipeline.
+ *
+ * A stage handles messages with non-virtual handle() overloads which
+ * return whether the message should travel further down the pipeline.
+ * The defaults pass everything through; stages hide the overloads they
+ * are interested in (and must bring the rest into scope with a using
+ * declaration).
+ */
+class PipelineStage
+{
+public:
+    template<typename MessageType>
+    inline bool handle(Net::Socket &, MessageType &) { return true; }
+
+    inline char *handleReservation(Net::Socket &, unsigned int, unsigned int, unsigned int)
+    {
+        return 0;
+    }
+
+    inline bool handleBlock(Net::Socket &, unsigned int, unsigned int, unsigned int, bool)
+    {
+        return true;
+    }
+};
+
+/**
+ * Runtime middleware front of a single pipeline stage.
+ *
+ * Lets a stage (passed as the template argument, CRTP style) also be
+ * used as an ordinary link of a runtime middleware chain: every
+ * InputMiddleware call goes to the matching handle() overload of the
+ * stage and whatever the stage lets through is passed on to the
+ * delegate.
+ */
+template<typename Stage>
+class StageMiddleware : public Bt::InputMiddleware, public PipelineStage
+{
+public:
+    void processMessage(Net::Socket &s, ChokeMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, UnchokeMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, InterestedMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, NotInterestedMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, HaveMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, BitfieldMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, PieceMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, RequestMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, CancelMessage &m) { dispatch(s, m); }
+
+    char *reserveBlock(Net::Socket &socket, unsigned int piece, unsigned int offset,
+                       unsigned int size)
+    {
+        char *slot = self()->handleReservation(socket, piece, offset, size);
+
+        if (slot != 0)
+            return slot;
+
+        return delegateReserveBlock(socket, piece, offset, size);
+    }
+
+    void processBlock(Net::Socket &socket, unsigned int piece, unsigned int offset,
+                      unsigned int size, bool received)
+    {
+        if (self()->handleBlock(socket, piece, offset, size, received))
+            delegateBlock(socket, piece, offset, size, received);
+    }
+
+protected:
+    StageMiddleware() {}
+    explicit StageMiddleware(Bt::InputMiddleware::Pointer delegate) :
+        Bt::InputMiddleware(delegate)
+    {
+    }
+
+private:
+    inline Stage *self() { return static_cast<Stage *>(this); }
+
+    template<typename MessageType>
+    inline void dispatch(Net::Socket &socket, MessageType &message)
+    {
+        if (self()->handle(socket, message))
+            delegateMessage(socket, message);
+    }
+};
+
+namespace Details {
+
+    template<size_t stage, size_t stageCount>
+    struct WalkPipeline
+    {
+        template<typename Stages, typename MessageType>
+        static inline bool handle(Stages &stages, Net::Socket &socket, MessageType &message)
+        {
+            return std::get<stage>(stages)->handle(socket, message) &&
+                   WalkPipeline<stage + 1, stageCount>::handle(stages, socket, message);
+        }
+
+        template<typename Stages>
+        static inline char *handleReservation(Stages &stages, Net::Socket &socket,
+                unsigned int piece, unsigned int offset, unsigned int size)
+        {
+            char *slot = std::get<stage>(stages)->handleReservation(socket, piece, offset, size);
+
+            if (slot != 0)
+                return slot;
+
+            return WalkPipeline<stage + 1, stageCount>::handleReservation(
+                    stages, socket, piece, offset, size);
+        }
+
+        template<typename Stages>
+        static inline bool handleBlock(Stages &stages, Net::Socket &socket,
+                unsigned int piece, unsigned int offset, unsigned int size, bool received)
+        {
+            return std::get<stage>(stages)->handleBlock(socket, piece, offset, size, received) &&
+                   WalkPipeline<stage + 1, stageCount>::handleBlock(
+                           stages, socket, piece, offset, size, received);
+        }
+    };
+
+    template<size_t stageCount>
+    struct WalkPipeline<stageCount, stageCount>
+    {
+        template<typename Stages, typename MessageType>
+        static inline bool handle(Stages &, Net::Socket &, MessageType &) { return true; }
+
+        template<typename Stages>
+        static inline char *handleReservation(Stages &, Net::Socket &,
+                unsigned int, unsigned int, unsigned int)
+        {
+            return 0;
+        }
+
+        template<typename Stages>
+        static inline bool handleBlock(Stages &, Net::Socket &,
+                unsigned int, unsigned int, unsigned int, bool)
+        {
+            return true;
+        }
+    };
+
+} /* namespace Details */
+
+/**
+ * Input middleware composed of stages at compile time.
+ *
+ * Stages (see PipelineStage) are called directly in the order they
+ * are listed, which lets the compiler inline the whole chain into a
+ * single dispatch per message instead of a virtual hop per stage.
+ * Messages which make it through every stage are passed on to the
+ * runtime delegate, if any, so dynamically added middleware keeps
+ * working behind the pipeline.
+ *
+ * The pipeline takes ownership of the stages.
+ */
+template<typename... Stages>
+class Pipeline : public Bt::InputMiddleware
+{
+public:
+    explicit Pipeline(Stages *... stages) :
+        stages_(std::unique_ptr<Stages>(stages)...)
+    {
+    }
+
+    Pipeline(Bt::InputMiddleware::Pointer delegate, Stages *... stages) :
+        Bt::InputMiddleware(delegate),
+        stages_(std::unique_ptr<Stages>(stages)...)
+    {
+    }
+
+    template<size_t i>
+    inline auto stage() -> typename std::tuple_element<i, std::tuple<Stages...> >::type &
+    {
+        return *std::get<i>(stages_);
+    }
+
+public:
+    void processMessage(Net::Socket &s, ChokeMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, UnchokeMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, InterestedMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, NotInterestedMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, HaveMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, BitfieldMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, PieceMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, RequestMessage &m) { dispatch(s, m); }
+    void processMessage(Net::Socket &s, CancelMessage &m) { dispatch(s, m); }
+
+    char *reserveBlock(Net::Socket &socket, unsigned int piece, unsigned int offset,
+                       unsigned int size)
+    {
+        char *slot = Walker::handleReservation(stages_, socket, piece, offset, size);
+
+        if (slot != 0)
+            return slot;
+
+        return delegateReserveBlock(socket, piece, offset, size);
+    }
+
+    void processBlock(Net::Socket &socket, unsigned int piece, unsigned int offset,
+                      unsigned int size, bool received)
+    {
+        if (Walker::handleBlock(stages_, socket, piece, offset, size, received))
+            delegateBlock(socket, piece, offset, size, received);
+    }
+
+private:
+    typedef Details::WalkPipeline<0, sizeof...(Stages)> Walker;
+
+    template<typename MessageType>
+    inline void dispatch(Net::Socket &socket, MessageType &message)
+    {
+        if (Walker::handle(stages_, socket, message))
+            delegateMessage(socket, message);
+    }
+
+private:
+    std::tuple<std::unique_ptr<Stages>...> stages_;
+};
+
+} /* namespace Bt */
+} /* namespace Hypergrace */
+
+#endif /* BT_PEERWIRE_PIPELINE_HH_ */
@@ -46,6 +46,7 @@ UploadTask::UploadTask(TorrentBundle &bundle, std::shared_ptr<DiskIo> ioThread)
 void UploadTask::registerPeer(PeerData *peer)
 {
     UploadState *uploadState = new UploadState();
+    uploadState->peer = peer;
     uploadState->ioRequests = 0;
 
     peer->setData(PeerData::UploadTask, uploadState);
@@ -56,6 +57,8 @@ void UploadTask::unregisterPeer(PeerData *peer)
     auto uploadState = peer->getData<UploadState>(PeerData::UploadTask);
     std::lock_guard<std::mutex> l(uploadState->anchor);
 
+    uploadState->peer = 0;
+
     std::for_each(
         uploadState->assembledMessages.begin(), uploadState->assembledMessages.end(),
         [](Net::Packet *p) { delete p; }
@@ -205,6 +208,13 @@ void UploadTask::handleMessageSentEvent(std::shared_ptr<UploadState> uploadState
 
     // Sending order is never violated thus it's safe to assume that
     // the sent message would be in front of the list.
+    PieceMessage *message = uploadState->sentMessages.front();
+
+    // Only payload which has actually left counts towards the rate
+    // choking decisions are based on.
+    if (uploadState->peer != 0)
+        uploadState->peer->payloadUploadRate().add(message->field<4>().size());
+
     uploadState->sentMessages.pop_front();
 }
 
@@ -64,6 +64,7 @@ private:
 private:
     struct UploadState : public PeerData::CustomData
     {
+        PeerData *peer;
         volatile size_t ioRequests;
         std::deque<PieceMessage *> assembledMessages;
         std::deque<PieceMessage *> sentMessages;
@@ -18,67 +18,363 @@
    Fifth Floor, Boston, MA 02110-1301, USA.
 */
 
+#include <algorithm>
+
+#include <util/time.hh>
+
 #include "bandwidthallocator.hh"
 
+using namespace Hypergrace;
 using namespace Hypergrace::Net;
 
 
-BandwidthAllocator::BandwidthAllocator() :
-    tokens_(-1),
-    maxTokens_(-1)
+BandwidthAllocator::BandwidthAllocator(BandwidthAllocator *parent) :
+    parent_(parent),
+    tokens_(0),
+    rate_(-1),
+    burst_(0),
+    lastRefill_(now()),
+    share_(0),
+    cache_(0),
+    lastActive_(0),
+    weight_(1)
 {
+    if (parent_ != 0) {
+        std::lock_guard<std::mutex> l(parent_->childrenAnchor_);
+        parent_->children_.push_back(this);
+    }
 }
 
 BandwidthAllocator::~BandwidthAllocator()
 {
+    if (parent_ != 0) {
+        std::lock_guard<std::mutex> l(parent_->childrenAnchor_);
+        auto &children = parent_->children_;
+        children.erase(std::remove(children.begin(), children.end(), this), children.end());
+    }
+}
+
+void BandwidthAllocator::limit(int rate)
+{
+    rate_ = rate;
+    lastRefill_ = now();
+    tokens_ = (rate > 0) ? effectiveBurst() : 0;
 }
 
-void BandwidthAllocator::limit(int limit)
+int BandwidthAllocator::limit() const
 {
-    maxTokens_ = limit;
-    renew();
+    return rate_;
+}
+
+void BandwidthAllocator::setBurst(int burst)
+{
+    burst_ = std::max(burst, 0);
+
+    // Drop the tokens that don't fit into the bucket anymore.
+    put(tokens_, 0, effectiveBurst());
+}
+
+int BandwidthAllocator::burst() const
+{
+    return effectiveBurst();
+}
+
+void BandwidthAllocator::setWeight(unsigned int weight)
+{
+    weight_ = std::max(weight, 1U);
+}
+
+unsigned int BandwidthAllocator::weight() const
+{
+    return weight_;
+}
+
+BandwidthAllocator *BandwidthAllocator::parent() const
+{
+    return parent_;
 }
 
 int BandwidthAllocator::allocate(int size)
 {
-    int maxTokens = maxTokens_;
+    return allocate(size, now());
+}
 
-    if (maxTokens > 0) {
-        int expected = tokens_;
-        int alloc;
+int BandwidthAllocator::allocate(int size, unsigned long long now)
+{
+    refill(now);
+    touch(now);
 
-        do {
-            alloc = (expected >= size) ? size : expected;
-        } while (!tokens_.compare_exchange_weak(expected, expected - alloc));
+    int rate = rate_;
+    int granted;
 
-        return alloc;
-    } else if (maxTokens == 0) {
+    if (rate > 0)
+        granted = take(tokens_, size);
+    else if (rate == 0)
         return 0;
-    } else {
-        return size;
+    else
+        granted = size;
+
+    if (granted == 0 || parent_ == 0)
+        return granted;
+
+    // Cover the allocation from the cache first and charge the
+    // ancestors a whole batch at a time.
+    int covered = take(cache_, granted);
+
+    if (covered < granted) {
+        int needed = granted - covered;
+        int fetched = parent_->grant(*this, std::max(needed, parent_->batchSize()), now);
+
+        if (fetched > needed)
+            cache_ += fetched - needed;
+
+        covered += std::min(fetched, needed);
     }
+
+    // Give back what the ancestors couldn't cover.
+    if (covered < granted && rate > 0)
+        put(tokens_, granted - covered, effectiveBurst());
+
+    return covered;
 }
 
 void BandwidthAllocator::release(int size)
 {
-    while (true) {
-        int expected = tokens_;
-        int maxTokens = maxTokens_;
-        int newValue = (expected + size <= maxTokens) ? expected + size : maxTokens;
+    if (rate_ > 0)
+        put(tokens_, size, effectiveBurst());
 
-        if (tokens_.compare_exchange_weak(expected, newValue)) {
-            break;
-        }
+    if (parent_ == 0)
+        return;
+
+    // Keep released tokens for the next allocation but don't hoard
+    // more than a batch.
+    int surplus = (cache_ += size) - parent_->batchSize();
+
+    if (surplus > 0)
+        parent_->reclaim(*this, take(cache_, surplus));
+}
+
+void BandwidthAllocator::refill(unsigned long long now)
+{
+    int rate = rate_;
+
+    if (rate <= 0)
+        return;
+
+    unsigned long long last = lastRefill_;
+
+    if (now < last + RefillGranularity)
+        return;
+
+    // Long quiet periods fill the bucket up anyway, don't let the
+    // arithmetic below overflow.
+    unsigned long long elapsed = std::min(now - last, 10000000ULL);
+    unsigned long long accrued = elapsed * rate / 1000000;
+
+    if (accrued == 0)
+        return;
+
+    // Advance the clock only by the time the accrued tokens took so
+    // that fractions of a token don't get lost at low rates.
+    unsigned long long next = (elapsed < now - last) ? now : last + accrued * 1000000 / rate;
+
+    // Somebody else is refilling the allocator concurrently.
+    if (!lastRefill_.compare_exchange_strong(last, next))
+        return;
+
+    distribute(std::min<unsigned long long>(accrued, effectiveBurst()), now);
+}
+
+int BandwidthAllocator::available()
+{
+    return available(now());
+}
+
+int BandwidthAllocator::available(unsigned long long now)
+{
+    refill(now);
+
+    int rate = rate_;
+    int available;
+
+    if (rate > 0)
+        available = std::max<int>(tokens_, 0);
+    else if (rate == 0)
+        available = 0;
+    else
+        available = -1;
+
+    if (parent_ == 0)
+        return available;
+
+    int fromParent = parent_->availableTo(*this, now);
+
+    // Cached tokens have been charged to the ancestors already.
+    if (fromParent >= 0)
+        fromParent += cache_;
+
+    if (available < 0)
+        return fromParent;
+    else if (fromParent < 0)
+        return available;
+    else
+        return std::min(available, fromParent);
+}
+
+int BandwidthAllocator::grant(BandwidthAllocator &child, int size, unsigned long long now)
+{
+    refill(now);
+    touch(now);
+
+    int rate = rate_;
+    int granted;
+
+    if (rate > 0) {
+        granted = take(child.share_, size);
+
+        if (granted < size)
+            granted += take(tokens_, size - granted);
+    } else if (rate == 0) {
+        return 0;
+    } else {
+        granted = size;
     }
+
+    if (granted == 0 || parent_ == 0)
+        return granted;
+
+    int fromParent = parent_->grant(*this, granted, now);
+
+    if (fromParent < granted && rate > 0)
+        child.share_ += granted - fromParent;
+
+    return fromParent;
 }
 
-void BandwidthAllocator::renew()
+void BandwidthAllocator::reclaim(BandwidthAllocator &child, int size)
 {
-    while (true) {
-        int expected = tokens_;
+    if (rate_ > 0)
+        child.share_ += size;
+
+    if (parent_ != 0)
+        parent_->reclaim(*this, size);
+}
+
+int BandwidthAllocator::availableTo(BandwidthAllocator &child, unsigned long long now)
+{
+    refill(now);
+
+    int rate = rate_;
+    int available;
+
+    if (rate > 0)
+        available = std::max<int>(child.share_ + tokens_, 0);
+    else if (rate == 0)
+        available = 0;
+    else
+        available = -1;
+
+    if (parent_ == 0)
+        return available;
+
+    int fromParent = parent_->availableTo(*this, now);
+
+    if (available < 0)
+        return fromParent;
+    else if (fromParent < 0)
+        return available;
+    else
+        return std::min(available, fromParent);
+}
+
+void BandwidthAllocator::distribute(int accrued, unsigned long long now)
+{
+    int burst = effectiveBurst();
+    int pool = accrued;
+
+    {
+        std::lock_guard<std::mutex> l(childrenAnchor_);
+
+        unsigned long long totalWeight = 0;
+
+        // Only children which have been asking for bandwidth recently
+        // take part in the split, shares of the others go back to the
+        // common pool.
+        for (auto child = children_.begin(); child != children_.end(); ++child) {
+            if ((*child)->lastActive_ + ActivityWindow * 1000ULL > now)
+                totalWeight += (*child)->weight_;
+            else
+                pool += (*child)->share_.exchange(0) + (*child)->cache_.exchange(0);
+        }
 
-        if (tokens_.compare_exchange_weak(expected, maxTokens_)) {
-            break;
+        for (auto child = children_.begin(); child != children_.end() && totalWeight > 0; ++child) {
+            if ((*child)->lastActive_ + ActivityWindow * 1000ULL <= now)
+                continue;
+
+            unsigned long long weight = (*child)->weight_;
+
+            // A share never grows beyond the child's part of the burst.
+            int part = accrued * weight / totalWeight;
+            int cap = burst * weight / totalWeight;
+            int added = std::max(0, std::min<int>(part, cap - (*child)->share_));
+
+            (*child)->share_ += added;
+            pool -= added;
         }
     }
+
+    // Undistributed tokens are up for grabs by any child.
+    put(tokens_, pool, burst);
+}
+
+int BandwidthAllocator::effectiveBurst() const
+{
+    int burst = burst_;
+
+    if (burst > 0)
+        return burst;
+
+    return std::max<long long>(MinimumBurst, (long long) rate_ * DefaultBurstInterval / 1000);
+}
+
+int BandwidthAllocator::batchSize() const
+{
+    if (rate_ <= 0)
+        return 0;
+
+    return std::max(1, std::min<int>(MaximumBatch, effectiveBurst() / 8));
+}
+
+// Marks the allocator active. Skips the store while the mark is fresh
+// so that threads sharing the allocator don't keep bouncing its cache
+// line.
+void BandwidthAllocator::touch(unsigned long long now)
+{
+    if (lastActive_ + RefillGranularity <= now)
+        lastActive_ = now;
+}
+
+int BandwidthAllocator::take(std::atomic<int> &tokens, int size)
+{
+    int expected = tokens;
+    int taken;
+
+    do {
+        taken = std::max(0, std::min(expected, size));
+    } while (taken > 0 && !tokens.compare_exchange_weak(expected, expected - taken));
+
+    return taken;
+}
+
+void BandwidthAllocator::put(std::atomic<int> &tokens, int size, int capacity)
+{
+    int expected = tokens;
+
+    while (!tokens.compare_exchange_weak(expected, std::min(expected + size, capacity)))
+        ;
+}
+
+unsigned long long BandwidthAllocator::now()
+{
+    return Util::Time::monotonicTime().toMicroseconds();
 }
@@ -22,27 +22,139 @@
 #define THREAD_BANDWIDTHALLOCATOR_HH_
 
 #include <atomic>
+#include <mutex>
+#include <vector>
 
 
 namespace Hypergrace {
 namespace Net {
 
+/**
+ * Token bucket limiting the bandwidth of a group of sockets.
+ *
+ * The bucket is refilled continuously at the limited rate, driven by
+ * the monotonic clock: every allocation first adds the tokens accrued
+ * since the previous refill. The bucket holds at most a burst worth of
+ * tokens, which bounds how much data may leave at once after a quiet
+ * period and keeps the output rate smooth.
+ *
+ * Allocators form a hierarchy (e.g. global -> torrent). Allocating
+ * from a child also charges its ancestors. When a limited parent is
+ * refilled it splits the new tokens among the children that have asked
+ * for bandwidth recently, in proportion to their weights. A child
+ * draws from its share first and then from whatever the parent has
+ * left undistributed, so the bandwidth of idle children goes to the
+ * busy ones.
+ *
+ * Children fetch tokens from their ancestors in batches and cache
+ * what they don't need right away, so that reactor threads sharing a
+ * global allocator rarely touch its atomics. Cached tokens have been
+ * taken from the ancestors already, so the global limit still holds;
+ * they are handed back once a child caches more than a batch or stops
+ * asking for bandwidth.
+ *
+ * Fairness between the sockets of a single allocator is up to the
+ * reactor, which grants bandwidth to them in rounds.
+ *
+ * A negative limit means unlimited, zero blocks all transfers.
+ */
 class BandwidthAllocator
 {
 public:
-    BandwidthAllocator();
+    enum {
+        // Smallest default burst, large enough for a whole block.
+        MinimumBurst = 0x4000,
+
+        // Default burst in milliseconds worth of the rate.
+        DefaultBurstInterval = 50,
+
+        // Children that haven't asked for bandwidth for this many
+        // milliseconds get no share of the parent's refills.
+        ActivityWindow = 1000,
+
+        // Refills are skipped until this many microseconds passed.
+        RefillGranularity = 1000,
+
+        // Largest batch of tokens a child fetches from its parent.
+        MaximumBatch = 0x4000
+    };
+
+public:
+    explicit BandwidthAllocator(BandwidthAllocator *parent = 0);
     ~BandwidthAllocator();
 
     int allocate(int);
     void release(int);
 
+    /**
+     * Limits the rate to the given amount of bytes per second and
+     * fills the bucket up.
+     */
     void limit(int);
+    int limit() const;
+
+    /**
+     * Sets the maximum amount of tokens the bucket holds. Zero picks
+     * DefaultBurstInterval worth of the rate but at least MinimumBurst.
+     */
+    void setBurst(int);
+    int burst() const;
+
+    void setWeight(unsigned int);
+    unsigned int weight() const;
+
+    BandwidthAllocator *parent() const;
+
+    /**
+     * Adds the tokens accrued up to the given point of monotonic time
+     * in microseconds. allocate() and available() refill the allocator
+     * from the current time themselves.
+     */
+    void refill(unsigned long long);
 
-    void renew();
+    /**
+     * Returns the amount of bandwidth that can be allocated right now
+     * or -1 if it is unlimited.
+     */
+    int available();
+
+public:
+    BandwidthAllocator(const BandwidthAllocator &) = delete;
+    BandwidthAllocator &operator =(const BandwidthAllocator &) = delete;
+
+private:
+    int allocate(int, unsigned long long);
+    int grant(BandwidthAllocator &, int, unsigned long long);
+    void reclaim(BandwidthAllocator &, int);
+    int available(unsigned long long);
+    int availableTo(BandwidthAllocator &, unsigned long long);
+    void distribute(int, unsigned long long);
+    int effectiveBurst() const;
+    int batchSize() const;
+    void touch(unsigned long long);
+
+    static int take(std::atomic<int> &, int);
+    static void put(std::atomic<int> &, int, int);
+    static unsigned long long now();
 
 private:
+    BandwidthAllocator *parent_;
+
     std::atomic<int> tokens_;
-    std::atomic<int> maxTokens_;
+    std::atomic<int> rate_;
+    std::atomic<int> burst_;
+    std::atomic<unsigned long long> lastRefill_;
+
+    // Tokens of the parent set aside for this allocator
+    std::atomic<int> share_;
+
+    // Tokens fetched from the ancestors but not allocated yet
+    std::atomic<int> cache_;
+    std::atomic<unsigned long long> lastActive_;
+    std::atomic<unsigned int> weight_;
+
+    std::mutex childrenAnchor_;
+    std::vector<BandwidthAllocator *> children_;
 };
 
 } /* namespace Net */
@@ -109,6 +109,16 @@ bool HostAddress::valid() const
     return size_ != 0;
 }
 
+const sockaddr *HostAddress::nativeAddress() const
+{
+    return &address_.sa;
+}
+
+size_t HostAddress::nativeAddressSize() const
+{
+    return size_;
+}
+
 std::string HostAddress::address() const
 {
     if (!valid())
@@ -41,6 +41,13 @@ public:
 
     bool valid() const;
 
+    /**
+     * Returns the address in the form accepted by the socket API and
+     * its length, e.g. for passing to sendto().
+     */
+    const sockaddr *nativeAddress() const;
+    size_t nativeAddressSize() const;
+
     bool operator <(const HostAddress &) const;
     bool operator >(const HostAddress &) const;
     bool operator ==(const HostAddress &) const;
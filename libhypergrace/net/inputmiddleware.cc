@@ -19,6 +19,8 @@
 */
 
 #include <debug/debug.hh>
+#include <net/receivebuffer.hh>
+
 #include "inputmiddleware.hh"
 
 using namespace Hypergrace;
@@ -43,6 +45,17 @@ void InputMiddleware::receive(Socket &socket, std::string &data)
     delegateReceiveEvent(socket, data);
 }
 
+void InputMiddleware::receive(Socket &socket, ReceiveBuffer &buffer)
+{
+    if (buffer.empty())
+        return;
+
+    std::string data(buffer.data(), buffer.size());
+
+    buffer.consume(buffer.size());
+    receive(socket, data);
+}
+
 void InputMiddleware::shutdown(Socket &socket)
 {
     delegateShutdownEvent(socket);
@@ -24,6 +24,7 @@
 #include <memory>
 #include <string>
 
+namespace Hypergrace { namespace Net { class ReceiveBuffer; }}
 namespace Hypergrace { namespace Net { class Socket; }}
 
 
@@ -40,6 +41,17 @@ public:
     virtual void receive(Socket &, std::string &);
     virtual void shutdown(Socket &);
 
+    /**
+     * Processes data accumulated in the socket's receive buffer.
+     *
+     * Middleware capable of parsing data in place should override
+     * this method and consume only the bytes it has processed; the
+     * rest will be kept in the buffer until more data arrives. The
+     * default implementation copies and consumes the whole buffer
+     * and hands it over to receive(Socket &, std::string &).
+     */
+    virtual void receive(Socket &, ReceiveBuffer &);
+
 protected:
     InputMiddleware();
     explicit InputMiddleware(Pointer);
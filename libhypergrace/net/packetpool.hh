@@ -0,0 +1,149 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NET_PACKETPOOL_HH_
+#define NET_PACKETPOOL_HH_
+
+#include <cstddef>
+#include <new>
+
+namespace Hypergrace {
+namespace Net {
+
+/**
+ * Per-thread free list for packets of a single type.
+ *
+ * Packets are handed to Socket::send() which deletes them once they
+ * have been written, both on the reactor thread. Keeping the released
+ * storage around lets the next packet of the same type reuse it
+ * without going through the allocator. Each thread has its own list,
+ * so there is no locking; a packet released on a different thread
+ * than the one it was allocated on simply migrates to that thread's
+ * list.
+ *
+ * Packet types opt in by defining class-level operator new/delete
+ * forwarding to allocate()/release(). Requests for a different size
+ * (e.g. a derived class without its own operators) bypass the pool.
+ */
+template<typename PacketType>
+class PacketPool
+{
+public:
+    /**
+     * Maximum number of idle objects kept per thread.
+     */
+    enum { MaximumIdle = 1024 };
+
+public:
+    static void *allocate(size_t size)
+    {
+        FreeList &list = freeList();
+
+        if (size != sizeof(PacketType) || list.head == 0) {
+            if (!list.closed)
+                drainOnExit();
+
+            return ::operator new(size);
+        }
+
+        Node *node = list.head;
+        list.head = node->next;
+        --list.count;
+
+        return node;
+    }
+
+    static void release(void *storage, size_t size)
+    {
+        FreeList &list = freeList();
+
+        if (storage == 0)
+            return;
+
+        if (size != sizeof(PacketType) || list.closed || list.count >= MaximumIdle) {
+            ::operator delete(storage);
+            return;
+        }
+
+        Node *node = static_cast<Node *>(storage);
+        node->next = list.head;
+        list.head = node;
+        ++list.count;
+    }
+
+    /**
+     * Returns the number of idle objects in the calling thread's list.
+     */
+    static size_t idle()
+    {
+        return freeList().count;
+    }
+
+private:
+    struct Node
+    {
+        Node *next;
+    };
+
+    // Trivially destructible so that it stays usable while other
+    // thread-local objects are being destroyed at thread exit.
+    struct FreeList
+    {
+        Node *head;
+        size_t count;
+        bool closed;
+    };
+
+    struct Drain
+    {
+        ~Drain()
+        {
+            FreeList &list = freeList();
+
+            while (list.head != 0) {
+                Node *node = list.head;
+                list.head = node->next;
+                ::operator delete(node);
+            }
+
+            list.count = 0;
+            list.closed = true;
+        }
+    };
+
+    static_assert(sizeof(PacketType) >= sizeof(Node), "Packet type is too small to be pooled");
+
+    static FreeList &freeList()
+    {
+        static thread_local FreeList list = { 0, 0, false };
+        return list;
+    }
+
+    static void drainOnExit()
+    {
+        static thread_local Drain drain;
+        (void) drain;
+    }
+};
+
+} /* namespace Net */
+} /* namespace Hypergrace */
+
+#endif /* NET_PACKETPOOL_HH_ */
@@ -0,0 +1,89 @@
+/*
+   Copyright (C) 2010 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <cmath>
+
+#include <util/time.hh>
+
+#include "rateestimator.hh"
+
+using namespace Hypergrace;
+using namespace Hypergrace::Net;
+
+
+RateEstimator::RateEstimator(RateEstimator *parent, unsigned int halfLife) :
+    parent_(parent),
+    total_(0),
+    halfLife_(halfLife),
+    foldedTotal_(0),
+    lastFold_(Util::Time::monotonicTime().toMicroseconds()),
+    rate_(0)
+{
+}
+
+void RateEstimator::setParent(RateEstimator *parent)
+{
+    parent_ = parent;
+}
+
+RateEstimator *RateEstimator::parent() const
+{
+    return parent_;
+}
+
+void RateEstimator::add(size_t bytes)
+{
+    total_.fetch_add(bytes, std::memory_order_relaxed);
+
+    if (parent_ != 0)
+        parent_->add(bytes);
+}
+
+size_t RateEstimator::rate() const
+{
+    return rate(Util::Time::monotonicTime().toMicroseconds());
+}
+
+size_t RateEstimator::rate(unsigned long long now) const
+{
+    std::lock_guard<std::mutex> l(anchor_);
+
+    if (now < lastFold_ + MinimumInterval)
+        return rate_ + 0.5;
+
+    unsigned long long total = total_.load(std::memory_order_relaxed);
+    double elapsed = now - lastFold_;
+
+    // Treat everything added since the last query as if it had been
+    // transferred evenly over the elapsed time.
+    double sample = (total - foldedTotal_) * 1000000.0 / elapsed;
+    double weight = 1.0 - std::exp2(-elapsed / (halfLife_ * 1000.0));
+
+    rate_ += weight * (sample - rate_);
+    foldedTotal_ = total;
+    lastFold_ = now;
+
+    return rate_ + 0.5;
+}
+
+unsigned long long RateEstimator::total() const
+{
+    return total_.load(std::memory_order_relaxed);
+}
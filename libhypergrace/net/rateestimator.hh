@@ -0,0 +1,95 @@
+/*
+   Copyright (C) 2010 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NET_RATEESTIMATOR_HH_
+#define NET_RATEESTIMATOR_HH_
+
+#include <atomic>
+#include <mutex>
+
+
+namespace Hypergrace {
+namespace Net {
+
+/**
+ * Exponentially weighted moving average of a transfer rate.
+ *
+ * add() is a single relaxed atomic addition, cheap enough to call on
+ * every read and write from any thread. The average is folded lazily
+ * whenever the rate is queried: the bytes added since the previous
+ * query are weighed against the old rate according to the time that
+ * has passed, so that a sample half-life old counts half as much.
+ *
+ * Estimators can be chained, bytes added to an estimator are added to
+ * its parent as well (e.g. peer -> torrent).
+ */
+class RateEstimator
+{
+public:
+    enum {
+        // Default half-life of a sample in milliseconds
+        DefaultHalfLife = 2000,
+
+        // Queries closer than this many microseconds return the
+        // previous rate
+        MinimumInterval = 10000
+    };
+
+public:
+    explicit RateEstimator(RateEstimator *parent = 0, unsigned int halfLife = DefaultHalfLife);
+
+    void setParent(RateEstimator *);
+    RateEstimator *parent() const;
+
+    void add(size_t);
+
+    /**
+     * Returns the rate in bytes per second.
+     */
+    size_t rate() const;
+
+    /**
+     * Returns the rate in bytes per second as of the given point of
+     * monotonic time in microseconds.
+     */
+    size_t rate(unsigned long long) const;
+
+    unsigned long long total() const;
+
+public:
+    RateEstimator(const RateEstimator &) = delete;
+    RateEstimator &operator =(const RateEstimator &) = delete;
+
+private:
+    RateEstimator *parent_;
+    std::atomic<unsigned long long> total_;
+
+    const unsigned int halfLife_;
+
+    mutable std::mutex anchor_;
+    mutable unsigned long long foldedTotal_;
+    mutable unsigned long long lastFold_;
+    mutable double rate_;
+};
+
+} /* namespace Net */
+} /* namespace Hypergrace */
+
+#endif /* NET_RATEESTIMATOR_HH_ */
@@ -21,9 +21,10 @@
 #ifndef NET_REACTOR_HH_
 #define NET_REACTOR_HH_
 
+#include <delegate/delegate.hh>
 #include <util/shared.hh>
 
-namespace Hypergrace { namespace Net { class RateAccumulator; }}
+namespace Hypergrace { namespace Net { struct ReactorStatistics; }}
 namespace Hypergrace { namespace Net { class Socket; }}
 namespace Hypergrace { namespace Net { class Task; }}
 
@@ -34,16 +35,32 @@ namespace Net {
 class Reactor
 {
 public:
+    typedef Delegate::Delegate<void ()> Job;
+
     Reactor();
     ~Reactor();
 
 public:
     bool observe(Socket *);
 
+    /**
+     * Queues the job for execution on the reactor's thread.
+     *
+     * Safe to call from any thread. The reactor is woken up
+     * immediately and runs the job on its next loop iteration,
+     * before the socket events are processed.
+     */
+    bool post(const Job &);
+
     void scheduleTask(Task *, int);
 
-    void setDownloadRateAccumulator(RateAccumulator *);
-    void setUploadRateAccumulator(RateAccumulator *);
+    /**
+     * Returns a snapshot of the event loop counters.
+     *
+     * Can be called from any thread. Counters are never reset and
+     * are accumulated since the reactor was created.
+     */
+    ReactorStatistics statistics() const;
 
 public:
     bool start();
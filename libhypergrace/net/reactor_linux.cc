@@ -18,30 +18,41 @@
    Fifth Floor, Boston, MA 02110-1301, USA.
 */
 
+#include <poll.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
 
+#include <cxxabi.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <deque>
 #include <functional>
-#include <map>
+#include <limits>
 #include <mutex>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <typeinfo>
+#include <vector>
 
 #include <debug/debug.hh>
+#include <delegate/bind.hh>
 #include <delegate/delegate.hh>
 
 #include <net/inputmiddleware.hh>
 #include <net/outputmiddleware.hh>
-#include <net/rateaccumulator.hh>
+#include <net/reactorstatistics.hh>
 #include <net/socket.hh>
 #include <net/task.hh>
 
+#include <thread/mpscqueue.hh>
+
 #include <util/time.hh>
 
 #include "reactor.hh"
@@ -59,11 +70,37 @@ class Reactor::Private
         Util::Time interval;
     };
 
+    // Observed sockets are indexed by their file descriptors. The
+    // generation is bumped every time a slot gets a new socket and is
+    // stored in the epoll event along with the descriptor, so events
+    // queued for a purged socket are never delivered to a newcomer
+    // that has reused the same descriptor.
+    struct SocketSlot
+    {
+        Socket *socket;
+        uint32_t generation;
+    };
+
+    // Socket held back by its bandwidth allocators in the last pulse
+    struct PendingSocket
+    {
+        int fd;
+        uint32_t generation;
+        bool upload;
+    };
+
+    enum {
+        // Smallest amount of bandwidth granted to a socket in a round
+        MinimumQuantum = 0x1000,
+
+        // How often to check whether sockets held back by their
+        // allocators can proceed, in milliseconds
+        BandwidthPollInterval = 5
+    };
+
 public:
     Private() :
         thread_(0),
-        downloadRate_(0),
-        uploadRate_(0),
         bailout_(true)
     {
         epollfd_ = epoll_create1(0);
@@ -74,6 +111,13 @@ public:
                          "epoll to provide a basic foundation for network  infrastructure. "
                          "A failure to initialize epoll renders libhypergrace useless.";
         }
+
+        wakeupfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (wakeupfd_ == -1) {
+            hSevere() << "Failed to open a wake up event file descriptor"
+                      << "(" << strerror(errno) << ")";
+        }
     }
 
     ~Private()
@@ -81,23 +125,43 @@ public:
         stop();
 
         ::close(epollfd_);
+        ::close(wakeupfd_);
 
         std::for_each(tasks_.begin(), tasks_.end(), [](TaskDescriptor &d) { delete d.task; });
     }
 
-    bool enqueueSocket(Socket *socket)
+    // Jobs are only accepted while the reactor runs. stop() flips
+    // the state under the same lock, so every accepted job is either
+    // run by the loop or drained once the loop has finished.
+    bool post(const Job &job)
     {
-        std::lock_guard<std::mutex> l(socketQueueLock_);
-        auto pos = observedSockets_.find(socket->fd());
+        std::lock_guard<std::mutex> l(postAnchor_);
 
-        if (pos != observedSockets_.end())
+        if (!running())
             return false;
 
-        waitingSockets_.push_back(socket);
+        jobs_.push(job);
+        wakeUp();
 
         return true;
     }
 
+    void wakeUp()
+    {
+        uint64_t increment = 1;
+
+        // The only possible failure is the counter overflow, which
+        // means that the reactor is already due to wake up.
+        if (::write(wakeupfd_, &increment, sizeof(increment)) == -1 && errno != EAGAIN)
+            hDebug() << "Failed to wake up reactor (" << strerror(errno) << ")";
+    }
+
+    void observeSocket(Socket *socket)
+    {
+        if (!observe(socket))
+            delete socket;
+    }
+
     void scheduleTask(Task *task, int interval)
     {
         TaskDescriptor descriptor;
@@ -108,6 +172,18 @@ public:
         descriptor.interval = Util::Time(interval);
 
         tasks_.push_back(descriptor);
+
+        // Statistics of a task share the index with its descriptor.
+        TaskStatistics taskStatistics;
+        int status = 0;
+        char *demangledName = abi::__cxa_demangle(typeid(*task).name(), 0, 0, &status);
+
+        taskStatistics.name = (status == 0) ? demangledName : typeid(*task).name();
+        taskStatistics.interval = interval;
+
+        statistics_.tasks.push_back(taskStatistics);
+
+        free(demangledName);
     }
 
     bool running() const
@@ -117,7 +193,7 @@ public:
 
     bool start()
     {
-        if (epollfd_ == -1) {
+        if (epollfd_ == -1 || wakeupfd_ == -1) {
             hSevere() << "Unable to start a reactor because epoll has failed to initialize";
             return false;
         }
@@ -137,17 +213,24 @@ public:
         if (!running())
             return;
 
-        bailout_ = true;
+        {
+            std::lock_guard<std::mutex> l(postAnchor_);
+            bailout_ = true;
+        }
+
+        wakeUp();
         thread_->join();
 
         delete thread_;
         thread_ = 0;
 
+        // Jobs which arrived after the last round of the loop, sockets
+        // they hand over get deleted below.
+        runJobs();
+
         std::for_each(
                 observedSockets_.begin(), observedSockets_.end(),
-                [](std::map<int, Socket *>::value_type &v) { delete v.second; });
-
-        observedSockets_.clear();
+                [](SocketSlot &slot) { delete slot.socket; slot.socket = 0; });
     }
 
 private:
@@ -155,12 +238,22 @@ private:
     {
         nearestTaskDeadline_ = Util::Time::maximumTime();
 
-        for (auto it = tasks_.begin(); it != tasks_.end(); ++it) {
-            TaskDescriptor &descriptor = *it;
+        for (size_t i = 0; i < tasks_.size(); ++i) {
+            TaskDescriptor &descriptor = tasks_[i];
 
             if ((descriptor.deadline - now).toMilliseconds() == 0) {
+                Util::Time start = Util::Time::monotonicTime();
+
                 descriptor.task->execute();
 
+                size_t runTime = (Util::Time::monotonicTime() - start).toMicroseconds();
+                statistics_.tasks[i].runTime.record(runTime);
+
+                if (runTime >= 100000) {
+                    hWarning() << statistics_.tasks[i].name << "has blocked reactor for"
+                               << runTime / 1000 << "ms";
+                }
+
                 // XXX: Update 'now'? Might be good idea if
                 // there are some heavy-lifting tasks.
                 descriptor.deadline = now + descriptor.interval;
@@ -197,25 +290,37 @@ private:
         while (!bailout_) {
             now = Util::Time::monotonicTime();
 
+            runJobs();
+
             if ((nearestTaskDeadline_ - now).toMilliseconds() == 0) {
                 executeTasks(now);
             }
 
+            // Allocators refill continuously, serve sockets waiting for
+            // bandwidth as soon as they can send a quantum instead of
+            // at the next pulse.
+            if (!pending_.empty() && bandwidthRefilled())
+                pulseDeadline_ = now;
+
             if ((pulseDeadline_ - now).toMilliseconds() == 0) {
                 pulseDeadline_ = now + Util::Time(100);
                 pulse();
             }
 
-            if (!waitingSockets_.empty()) {
-                observeNewSockets();
-            }
+            statistics_.loopTime.record((Util::Time::monotonicTime() - now).toMicroseconds());
+
+            int sleepTime = (std::min(pulseDeadline_, nearestTaskDeadline_) - now).toMilliseconds();
 
-            unsigned int sleepTime =
-                (std::min(pulseDeadline_, nearestTaskDeadline_) - now).toMilliseconds() * 1000;
+            if (!pending_.empty())
+                sleepTime = std::min<int>(sleepTime, BandwidthPollInterval);
 
-            ::usleep(sleepTime);
+            waitForJobs(sleepTime);
         }
 
+        // Jobs might have been posted between the last iteration and
+        // the stop request.
+        runJobs();
+
         std::for_each(tasks_.begin(), tasks_.end(), [](TaskDescriptor &d) { d.task->stop(); });
     }
 
@@ -226,50 +331,50 @@ private:
 
         eventCount = epoll_wait(epollfd_, events, sizeof(events) / sizeof(epoll_event), 0);
 
+        if (eventCount >= 0)
+            statistics_.eventsPerPulse.record(eventCount);
+
+        readers_.clear();
+        writers_.clear();
+        touched_.clear();
+        pending_.clear();
+
         for (int i = 0; i < eventCount; ++i) {
             epoll_event &event = events[i];
-            Net::Socket *socket = reinterpret_cast<Net::Socket *>(event.data.ptr);
-
-            assert(socket != 0);
-
-            //hDebug() << socket->fd()
-            //         << ((event.events & EPOLLIN)    ? "EPOLLIN"    : "......."   )
-            //         << ((event.events & EPOLLOUT)   ? "EPOLLOUT"   : "........"  )
-            //         << ((event.events & EPOLLERR)   ? "EPOLLERR"   : "........"  )
-            //         << ((event.events & EPOLLHUP)   ? "EPOLLHUP"   : "........"  )
-            //         << ((event.events & EPOLLRDHUP) ? "EPOLLRDHUP" : "..........")
-            //         << socket->remoteAddress();
-
-            //if (event.events & EPOLLERR) {
-            //    int error = 0;
-            //    socklen_t len = sizeof(error);
-            //    if (getsockopt(socket->fd(), SOL_SOCKET, SO_ERROR, &error, &len) != -1) {
-            //        hDebug() << "An error has occurred on socket descriptor"
-            //                    "(" << strerror(error) << ")";
-            //    } else {
-            //        hDebug() << "An error has occurred on socket descriptor";
-            //    }
-            //}
+
+            int fd = event.data.u64 & 0xFFFFFFFF;
+            uint32_t generation = event.data.u64 >> 32;
+
+            assert(fd >= 0 && (size_t)fd < observedSockets_.size());
+
+            SocketSlot &slot = observedSockets_[fd];
+            Net::Socket *socket = slot.socket;
+
+            // The socket has been purged earlier in this pulse.
+            if (socket == 0 || slot.generation != generation)
+                continue;
 
             bool hungUp = event.events & EPOLLRDHUP || event.events & EPOLLHUP;
 
-            if (event.events & EPOLLOUT && !hungUp) {
-                if (uploadRate_ != 0)
-                    uploadRate_->accumulate(socket->write());
-                else
-                    socket->write();
-            }
+            if (event.events & EPOLLOUT && !hungUp)
+                writers_.push_back(socket);
 
-            if (event.events & EPOLLIN) {
-                if (downloadRate_ != 0)
-                    downloadRate_->accumulate(socket->read());
-                else
-                    socket->read();
-            }
+            if (event.events & EPOLLIN)
+                readers_.push_back(socket);
+
+            touched_.push_back(std::make_pair(fd, hungUp));
+        }
 
-            if (hungUp || socket->closed()) {
+        transferInRounds(writers_, true);
+        transferInRounds(readers_, false);
+
+        for (auto touchedIt = touched_.begin(); touchedIt != touched_.end(); ++touchedIt) {
+            SocketSlot &slot = observedSockets_[(*touchedIt).first];
+            Net::Socket *socket = slot.socket;
+
+            if ((*touchedIt).second || socket->closed()) {
                 unobserve(socket);
-                observedSockets_.erase(socket->fd());
+                slot.socket = 0;
 
                 socket->shutdown();
                 delete socket;
@@ -277,16 +382,121 @@ private:
         }
     }
 
-    void observeNewSockets()
+    // Shares the bandwidth available to the ready sockets among them
+    // in rounds instead of letting whichever socket epoll reports
+    // first drain the allocators. Each round grants every socket still
+    // willing to transfer an equal part of what its allocators have
+    // left; sockets that move less than their quota are done for this
+    // pulse. Sockets held back by their allocators are remembered so
+    // that a refill can wake them up before the next pulse.
+    void transferInRounds(std::vector<Socket *> &sockets, bool upload)
     {
-        std::lock_guard<std::mutex> l(socketQueueLock_);
+        size_t active = sockets.size();
+        bool firstRound = true;
+
+        while (active > 0) {
+            size_t next = 0;
+
+            for (size_t i = 0; i < active; ++i) {
+                Socket *socket = sockets[i];
+
+                if (socket->closed())
+                    continue;
+
+                int available = upload ? socket->availableUploadBandwidth()
+                                       : socket->availableDownloadBandwidth();
+
+                size_t quota = std::numeric_limits<size_t>::max();
+
+                // Split what is left among the sockets not yet served
+                // in this round.
+                if (available >= 0)
+                    quota = std::max<size_t>(MinimumQuantum, available / (active - i));
+
+                ssize_t transferred;
+
+                if (upload) {
+                    transferred = firstRound ? socket->write(quota) : socket->writeGathered(quota);
 
-        for (auto conn = waitingSockets_.begin(); conn != waitingSockets_.end(); ++conn) {
-            if (!observe(*conn))
-                delete *conn;
+                    if (transferred > 0)
+                        statistics_.bytesPerWrite.record(transferred);
+                } else {
+                    transferred = socket->read(quota);
+
+                    if (transferred > 0)
+                        statistics_.bytesPerRead.record(transferred);
+                }
+
+                if (upload ? socket->uploadStarved() : socket->downloadStarved()) {
+                    PendingSocket pending = {
+                        socket->fd(),
+                        observedSockets_[socket->fd()].generation,
+                        upload
+                    };
+
+                    pending_.push_back(pending);
+                } else if (static_cast<size_t>(transferred) == quota) {
+                    sockets[next++] = socket;
+                }
+            }
+
+            active = next;
+            firstRound = false;
         }
+    }
+
+    // Whether any socket held back by its bandwidth allocators can
+    // send or receive at least a quantum by now.
+    bool bandwidthRefilled() const
+    {
+        for (auto pendingIt = pending_.begin(); pendingIt != pending_.end(); ++pendingIt) {
+            const SocketSlot &slot = observedSockets_[(*pendingIt).fd];
 
-        waitingSockets_.clear();
+            if (slot.socket == 0 || slot.generation != (*pendingIt).generation)
+                continue;
+
+            int available = (*pendingIt).upload ? slot.socket->availableUploadBandwidth()
+                                                : slot.socket->availableDownloadBandwidth();
+
+            if (available < 0 || available >= MinimumQuantum)
+                return true;
+        }
+
+        return false;
+    }
+
+    void waitForJobs(int timeout)
+    {
+        // Sockets are polled once per pulse and most of them are
+        // writable at any given moment, so the reactor sleeps on the
+        // wake up descriptor alone rather than on the whole epoll set.
+        pollfd wakeup = { wakeupfd_, POLLIN, 0 };
+
+        if (::poll(&wakeup, 1, timeout) == -1 && errno != EINTR)
+            hDebug() << "Failed to wait for the reactor jobs (" << strerror(errno) << ")";
+    }
+
+    void runJobs()
+    {
+        uint64_t counter;
+
+        // Reset the wake up counter before draining the queue so no
+        // job pushed meanwhile will go unnoticed.
+        if (::read(wakeupfd_, &counter, sizeof(counter)) == -1 && errno != EAGAIN)
+            hDebug() << "Failed to reset wake up counter (" << strerror(errno) << ")";
+
+        Job job;
+
+        if (!jobs_.pop(job))
+            return;
+
+        Util::Time start = Util::Time::monotonicTime();
+
+        do {
+            job();
+        } while (jobs_.pop(job));
+
+        statistics_.jobRunTime.record((Util::Time::monotonicTime() - start).toMicroseconds());
     }
 
     bool observe(Socket *socket)
@@ -294,26 +504,36 @@ private:
         int fd = socket->fd();
         epoll_event descriptor = { 0 };
 
-        descriptor.events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
-        descriptor.data.ptr = socket;
-
-        auto hint = observedSockets_.lower_bound(fd);
+        assert(fd >= 0);
 
-        if (hint == observedSockets_.end() || (*hint).first != fd) {
-            observedSockets_.insert(hint, std::make_pair(fd, socket));
+        if ((size_t)fd >= observedSockets_.size()) {
+            SocketSlot emptySlot = { 0, 0 };
+            observedSockets_.resize(std::max<size_t>(fd + 1, observedSockets_.size() * 2),
+                                    emptySlot);
+        }
 
-            if (::epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &descriptor) == -1) {
-                hWarning() << "Failed to add socket (" << fd << ") into epoll instance"
-                           << "(" << strerror(errno) << ")";
-                observedSockets_.erase(fd);
-                return false;
-            }
+        SocketSlot &slot = observedSockets_[fd];
 
-            return true;
-        } else {
+        if (slot.socket != 0) {
             hDebug() << "Socket with similar file descriptor is already being observed";
             return false;
         }
+
+        ++slot.generation;
+
+        descriptor.events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
+        descriptor.data.u64 = (uint64_t)slot.generation << 32 | (uint32_t)fd;
+
+        if (::epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &descriptor) == -1) {
+            hWarning() << "Failed to add socket (" << fd << ") into epoll instance"
+                       << "(" << strerror(errno) << ")";
+            return false;
+        }
+
+        slot.socket = socket;
+        socket->statistics_ = &statistics_;
+
+        return true;
     }
 
     void unobserve(const Net::Socket *socket)
@@ -328,12 +548,12 @@ public:
     std::thread *thread_;
 
     int epollfd_;
-    std::map<int, Socket *> observedSockets_;
-    std::deque<Net::Socket *> waitingSockets_;
-    std::mutex socketQueueLock_;
+    std::vector<SocketSlot> observedSockets_;
+
+    int wakeupfd_;
+    Thread::MpscQueue<Job> jobs_;
+    std::mutex postAnchor_;
 
-    RateAccumulator *downloadRate_;
-    RateAccumulator *uploadRate_;
 
     Util::Time nearestTaskDeadline_;
     Util::Time pulseDeadline_;
@@ -343,7 +563,16 @@ public:
     // modify() method.
     std::vector<TaskDescriptor> tasks_;
 
-    bool bailout_;
+    ReactorStatistics statistics_;
+
+    // Scratch space of pulse(), kept around to avoid reallocations
+    std::vector<Socket *> readers_;
+    std::vector<Socket *> writers_;
+    std::vector<std::pair<int, bool> > touched_;
+
+    std::vector<PendingSocket> pending_;
+
+    std::atomic<bool> bailout_;
 };
 
 Reactor::Reactor() :
@@ -358,14 +587,24 @@ Reactor::~Reactor()
 
 bool Reactor::observe(Net::Socket *socket)
 {
-    if (d->running()) {
-        return d->enqueueSocket(socket);
+    if (d->post(Delegate::bind(&Private::observeSocket, d, socket))) {
+        return true;
     } else {
         hWarning() << "Cannot observe a socket when reactor is in the stopped state";
         return false;
     }
 }
 
+bool Reactor::post(const Job &job)
+{
+    if (d->post(job)) {
+        return true;
+    } else {
+        hWarning() << "Cannot post a job when reactor is in the stopped state";
+        return false;
+    }
+}
+
 void Reactor::scheduleTask(Task *task, int interval)
 {
     if (!d->running())
@@ -374,14 +613,9 @@ void Reactor::scheduleTask(Task *task, int interval)
         hWarning() << "Cannot schedule task while reactor is running";
 }
 
-void Reactor::setDownloadRateAccumulator(RateAccumulator *accumulator)
-{
-    d->downloadRate_ = accumulator;
-}
-
-void Reactor::setUploadRateAccumulator(RateAccumulator *accumulator)
+ReactorStatistics Reactor::statistics() const
 {
-    d->uploadRate_ = accumulator;
+    return d->statistics_;
 }
 
 bool Reactor::running() const
@@ -0,0 +1,142 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <debug/debug.hh>
+
+#include "reactorstatistics.hh"
+
+using namespace Hypergrace;
+using namespace Hypergrace::Net;
+
+
+Histogram::Histogram() :
+    count_(0),
+    sum_(0),
+    max_(0)
+{
+    for (size_t i = 0; i < BucketCount; ++i)
+        buckets_[i] = 0;
+}
+
+Histogram::Histogram(const Histogram &other)
+{
+    *this = other;
+}
+
+void Histogram::operator =(const Histogram &other)
+{
+    for (size_t i = 0; i < BucketCount; ++i)
+        buckets_[i].store(other.bucket(i), std::memory_order_relaxed);
+
+    count_.store(other.count(), std::memory_order_relaxed);
+    sum_.store(other.sum(), std::memory_order_relaxed);
+    max_.store(other.max(), std::memory_order_relaxed);
+}
+
+void Histogram::record(uint64_t value)
+{
+    size_t index = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+
+    if (index >= BucketCount)
+        index = BucketCount - 1;
+
+    increase(buckets_[index], 1);
+    increase(count_, 1);
+    increase(sum_, value);
+
+    if (value > max_.load(std::memory_order_relaxed))
+        max_.store(value, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum() const
+{
+    return sum_.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::max() const
+{
+    return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::mean() const
+{
+    uint64_t samples = count();
+    return (samples > 0) ? sum() / samples : 0;
+}
+
+uint64_t Histogram::bucket(size_t index) const
+{
+    return (index < BucketCount) ? buckets_[index].load(std::memory_order_relaxed) : 0;
+}
+
+uint64_t Histogram::bucketUpperBound(size_t index)
+{
+    return (index == 0) ? 0 : (uint64_t(1) << index) - 1;
+}
+
+uint64_t Histogram::percentile(unsigned int percent) const
+{
+    uint64_t samples = count();
+    uint64_t threshold = (samples * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (samples == 0)
+        return 0;
+
+    for (size_t i = 0; i < BucketCount; ++i) {
+        seen += bucket(i);
+
+        if (seen >= threshold)
+            return bucketUpperBound(i);
+    }
+
+    return max();
+}
+
+Hypergrace::Debug::Debug &
+operator <<(Hypergrace::Debug::Debug &stream, const Hypergrace::Net::Histogram &histogram)
+{
+    return stream << "{ n:" << histogram.count()
+                  << "mean:" << histogram.mean()
+                  << "p99:" << histogram.percentile(99)
+                  << "max:" << histogram.max() << "}";
+}
+
+Hypergrace::Debug::Debug &
+operator <<(Hypergrace::Debug::Debug &stream, const Hypergrace::Net::ReactorStatistics &stats)
+{
+    stream << "loop(us):" << stats.loopTime
+           << "events/pulse:" << stats.eventsPerPulse
+           << "jobs(us):" << stats.jobRunTime
+           << "read(B):" << stats.bytesPerRead
+           << "write(B):" << stats.bytesPerWrite
+           << "input-mw(us):" << stats.inputMiddlewareTime
+           << "output-mw(us):" << stats.outputMiddlewareTime;
+
+    for (auto it = stats.tasks.begin(); it != stats.tasks.end(); ++it)
+        stream << (*it).name << "(us):" << (*it).runTime;
+
+    return stream;
+}
@@ -0,0 +1,133 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NET_REACTORSTATISTICS_HH_
+#define NET_REACTORSTATISTICS_HH_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace Hypergrace { namespace Debug { class Debug; }}
+
+
+namespace Hypergrace {
+namespace Net {
+
+/**
+ * Histogram with power-of-two buckets.
+ *
+ * Bucket 0 counts zero samples, bucket N counts samples in range
+ * [2^(N-1), 2^N). The last bucket absorbs everything above.
+ *
+ * Only one thread is allowed to record samples, while any thread may
+ * read or copy the histogram at any time. The values read that way
+ * might be slightly inconsistent with each other but never torn.
+ */
+class Histogram
+{
+public:
+    enum { BucketCount = 32 };
+
+    Histogram();
+    Histogram(const Histogram &);
+
+    void record(uint64_t);
+
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t max() const;
+    uint64_t mean() const;
+
+    uint64_t bucket(size_t) const;
+    static uint64_t bucketUpperBound(size_t);
+
+    /**
+     * Returns the upper bound of the bucket containing the specified
+     * percentile (0-100) of samples.
+     */
+    uint64_t percentile(unsigned int) const;
+
+    void operator =(const Histogram &);
+
+private:
+    static inline void increase(std::atomic<uint64_t> &value, uint64_t amount)
+    {
+        // Single writer, so there's no need for an atomic RMW.
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> buckets_[BucketCount];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+struct TaskStatistics
+{
+    std::string name;
+    unsigned int interval;
+
+    // Time spent in Task::execute(), in microseconds.
+    Histogram runTime;
+};
+
+/**
+ * Snapshot of the reactor's event loop counters.
+ *
+ * All time values are in microseconds, all sizes are in bytes.
+ */
+struct ReactorStatistics
+{
+    // Busy time of each event loop iteration, sleep excluded. The
+    // number of samples is the number of loop iterations.
+    Histogram loopTime;
+
+    // Number of events returned by each epoll_wait() call.
+    Histogram eventsPerPulse;
+
+    // Time spent in running posted jobs.
+    Histogram jobRunTime;
+
+    // Amount of data moved by each Socket::read()/Socket::write(),
+    // calls which have moved nothing are not recorded.
+    Histogram bytesPerRead;
+    Histogram bytesPerWrite;
+
+    // Time spent in socket's input and output middleware chains.
+    Histogram inputMiddlewareTime;
+    Histogram outputMiddlewareTime;
+
+    std::vector<TaskStatistics> tasks;
+};
+
+} /* namespace Net */
+} /* namespace Hypergrace */
+
+Hypergrace::Debug::Debug &
+operator <<(Hypergrace::Debug::Debug &, const Hypergrace::Net::Histogram &);
+
+Hypergrace::Debug::Debug &
+operator <<(Hypergrace::Debug::Debug &, const Hypergrace::Net::ReactorStatistics &);
+
+#endif /* NET_REACTORSTATISTICS_HH_ */
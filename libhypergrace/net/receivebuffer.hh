@@ -0,0 +1,108 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NET_RECEIVEBUFFER_HH_
+#define NET_RECEIVEBUFFER_HH_
+
+#include <cstddef>
+
+namespace Hypergrace {
+namespace Net {
+
+/**
+ * Fixed capacity receive buffer owned by a socket.
+ *
+ * Incoming data is received directly into the free space of the
+ * buffer and consumed by advancing the read cursor. The buffer is a
+ * ring whose storage is mapped twice back to back, thus unread data
+ * and free space are always contiguous and messages can be parsed in
+ * place no matter where they wrap around. If the mirrored mapping
+ * cannot be established the buffer falls back to a linear one which
+ * moves unread data to the front when it runs out of space.
+ *
+ * Every mirrored buffer costs two memory mappings, so at most
+ * MaximumMirroredBuffers of them exist at once to stay well clear of
+ * vm.max_map_count. Buffers beyond that are linear.
+ *
+ * Storage is allocated lazily on the first write.
+ */
+class ReceiveBuffer
+{
+public:
+    enum {
+        DefaultCapacity = 0x10000,
+        MaximumMirroredBuffers = 8192
+    };
+
+public:
+    explicit ReceiveBuffer(size_t capacity = DefaultCapacity);
+    ~ReceiveBuffer();
+
+    /**
+     * Returns a pointer to the unread data.
+     */
+    const char *data() const { return base_ + head_; }
+
+    /**
+     * Returns the amount of unread data.
+     */
+    size_t size() const { return tail_ - head_; }
+    bool empty() const { return tail_ == head_; }
+
+    size_t capacity() const { return capacity_; }
+
+    /**
+     * Returns a pointer to the contiguous free space following the
+     * unread data, with room for the given number of bytes, which
+     * must not exceed space(). Written bytes must be committed with
+     * commit() afterwards.
+     */
+    char *reserve(size_t);
+    size_t space() const { return capacity_ - size(); }
+
+    void commit(size_t);
+    void consume(size_t);
+
+    /**
+     * Copies the data into the buffer.
+     *
+     * Returns false if the data doesn't fit into the buffer.
+     */
+    bool append(const char *, size_t);
+
+public:
+    ReceiveBuffer(const ReceiveBuffer &) = delete;
+    ReceiveBuffer &operator =(const ReceiveBuffer &) = delete;
+
+private:
+    void allocate();
+
+private:
+    char *base_;
+    size_t capacity_;
+    size_t head_;
+    size_t tail_;
+    bool mirrored_;
+};
+
+} /* namespace Net */
+} /* namespace Hypergrace */
+
+#endif /* NET_RECEIVEBUFFER_HH_ */
@@ -0,0 +1,162 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <errno.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+
+#include <debug/debug.hh>
+
+#include "receivebuffer.hh"
+
+using namespace Hypergrace;
+using namespace Net;
+
+// Number of mirrored buffers currently mapped
+static std::atomic<size_t> mirroredBuffers(0);
+
+
+ReceiveBuffer::ReceiveBuffer(size_t capacity) :
+    base_(0),
+    capacity_(capacity),
+    head_(0),
+    tail_(0),
+    mirrored_(false)
+{
+    // Mirrored mappings must be page aligned.
+    size_t pageSize = ::sysconf(_SC_PAGESIZE);
+
+    capacity_ = (capacity_ + pageSize - 1) / pageSize * pageSize;
+}
+
+ReceiveBuffer::~ReceiveBuffer()
+{
+    if (mirrored_) {
+        ::munmap(base_, capacity_ * 2);
+        --mirroredBuffers;
+    } else {
+        delete [] base_;
+    }
+}
+
+char *ReceiveBuffer::reserve(size_t wanted)
+{
+    assert(wanted <= space());
+
+    if (base_ == 0)
+        allocate();
+
+    // A linear buffer only moves unread data to the front once the
+    // space behind it runs short.
+    if (!mirrored_ && capacity_ - tail_ < wanted) {
+        std::memmove(base_, base_ + head_, size());
+
+        tail_ -= head_;
+        head_ = 0;
+    }
+
+    return base_ + tail_;
+}
+
+void ReceiveBuffer::commit(size_t size)
+{
+    assert(size <= space());
+    tail_ += size;
+}
+
+void ReceiveBuffer::consume(size_t size)
+{
+    assert(size <= this->size());
+    head_ += size;
+
+    if (head_ == tail_) {
+        head_ = tail_ = 0;
+    } else if (head_ >= capacity_) {
+        // Both cursors point into the mirror, move them back.
+        head_ -= capacity_;
+        tail_ -= capacity_;
+    }
+}
+
+bool ReceiveBuffer::append(const char *data, size_t size)
+{
+    if (size > space())
+        return false;
+
+    std::memcpy(reserve(size), data, size);
+    commit(size);
+
+    return true;
+}
+
+void ReceiveBuffer::allocate()
+{
+    // Too many mappings around already, make do with a linear buffer.
+    if (++mirroredBuffers > MaximumMirroredBuffers) {
+        --mirroredBuffers;
+        base_ = new char[capacity_];
+        return;
+    }
+
+    // Error of the call which has failed, later calls may clobber it.
+    int error = 0;
+    int fd = ::memfd_create("hypergrace-receive-buffer", MFD_CLOEXEC);
+
+    if (fd == -1 || ::ftruncate(fd, capacity_) == -1) {
+        error = errno;
+    } else {
+        void *area = ::mmap(0, capacity_ * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (area == MAP_FAILED) {
+            error = errno;
+        } else {
+            char *first = static_cast<char *>(area);
+            char *second = first + capacity_;
+
+            if (::mmap(first, capacity_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+                ::mmap(second, capacity_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED)
+            {
+                base_ = first;
+                mirrored_ = true;
+            } else {
+                error = errno;
+                ::munmap(area, capacity_ * 2);
+            }
+        }
+    }
+
+    // The mappings keep the memory alive.
+    if (fd != -1)
+        ::close(fd);
+
+    if (!mirrored_) {
+        --mirroredBuffers;
+
+        hWarning() << "Failed to set up mirrored receive buffer (" << strerror(error) << ")";
+        base_ = new char[capacity_];
+    }
+}
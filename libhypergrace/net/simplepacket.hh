@@ -23,8 +23,10 @@
 
 #include <arpa/inet.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <tuple>
 
@@ -73,34 +75,88 @@ namespace Details {
         MatchString(bool &result, Tuple &, const std::string &, size_t) { result = true; }
     };
 
-    template<typename Tuple, size_t field = std::tuple_size<Tuple>::value - 1>
-    struct Serialize
+    template<typename Tuple, size_t field = std::tuple_size<Tuple>::value>
+    struct Encode
     {
-        inline Serialize(std::string &accumulator, const Tuple &fields)
+        inline Encode(char *&out, const Tuple &fields)
         {
-            Serialize<Tuple, field - 1>(accumulator, fields);
-            accumulator.append(std::get<field>(fields).data());
+            Encode<Tuple, field - 1>(out, fields);
+            out += std::get<field - 1>(fields).encode(out);
         }
     };
 
     template<typename Tuple>
-    struct Serialize<Tuple, 0>
+    struct Encode<Tuple, 0>
     {
-        inline Serialize(std::string &accumulator, const Tuple &fields)
-        {
-            accumulator.append(std::get<0>(fields).data());
-        }
+        inline Encode(char *&, const Tuple &) {}
+    };
+
+    // Yields whether the matcher has a size known at compile time.
+    template<typename T>
+    struct IsStaticallySized
+    {
+        template<typename U> static char test(decltype(U::staticSize) *);
+        template<typename U> static long test(...);
+
+        static constexpr bool value = sizeof(test<T>(0)) == sizeof(char);
+    };
+
+    template<typename T, bool = IsStaticallySized<T>::value>
+    struct StaticSize
+    {
+        static constexpr size_t value = T::staticSize;
+    };
+
+    template<typename T>
+    struct StaticSize<T, false>
+    {
+        static constexpr size_t value = 0;
+    };
+
+    template<typename Tuple, size_t field = std::tuple_size<Tuple>::value>
+    struct FixedLayout
+    {
+        static constexpr bool value =
+            IsStaticallySized<typename std::tuple_element<field - 1, Tuple>::type>::value &&
+            FixedLayout<Tuple, field - 1>::value;
     };
 
     template<typename Tuple>
-    std::string serializeFields(const Tuple &fields)
+    struct FixedLayout<Tuple, 0>
     {
-        std::string accumulator;
+        static constexpr bool value = true;
+    };
 
-        Serialize<Tuple>(accumulator, fields);
+    // Offset of the field within a packet. Only meaningful if all
+    // preceding fields are statically sized.
+    template<typename Tuple, size_t field>
+    struct FieldOffset
+    {
+        static constexpr size_t value = FieldOffset<Tuple, field - 1>::value +
+            StaticSize<typename std::tuple_element<field - 1, Tuple>::type>::value;
+    };
 
-        return accumulator;
-    }
+    template<typename Tuple>
+    struct FieldOffset<Tuple, 0>
+    {
+        static constexpr size_t value = 0;
+    };
+
+    template<typename Tuple, size_t field = std::tuple_size<Tuple>::value>
+    struct Decode
+    {
+        inline Decode(Tuple &fields, const char *data)
+        {
+            Decode<Tuple, field - 1>(fields, data);
+            std::get<field - 1>(fields).decode(data + FieldOffset<Tuple, field - 1>::value);
+        }
+    };
+
+    template<typename Tuple>
+    struct Decode<Tuple, 0>
+    {
+        inline Decode(Tuple &, const char *) {}
+    };
 
     template<typename Tuple>
     bool matchString(const std::string &string, Tuple &fields, size_t offset)
@@ -183,6 +239,20 @@ public:
         return std::string((char *)&result, sizeof(ValueType));
     }
 
+    inline size_t encode(char *out) const
+    {
+        ValueType result = Filter::transformForOutput(this->value_);
+        std::memcpy(out, &result, sizeof(ValueType));
+        return sizeof(ValueType);
+    }
+
+    inline void decode(const char *in)
+    {
+        ValueType value;
+        std::memcpy(&value, in, sizeof(ValueType));
+        this->value_ = Filter::transformFromInput(value);
+    }
+
     inline static size_t size() { return staticSize; }
 
     template<typename Tuple>
@@ -244,6 +314,20 @@ public:
 
     inline std::string data() const { return this->value_; }
 
+    inline size_t encode(char *out) const
+    {
+        // Pad or truncate the value to the declared length so that
+        // the packet layout is preserved.
+        size_t copied = std::min(value_.size(), length);
+
+        std::memcpy(out, value_.data(), copied);
+        std::memset(out + copied, 0, length - copied);
+
+        return length;
+    }
+
+    inline void decode(const char *in) { value_.assign(in, length); }
+
     inline static size_t size()
     {
         static_assert(length > 0, "Zero-length strings are not allowed");
@@ -280,6 +364,12 @@ public:
     inline std::string data() const { return this->value_; }
     inline size_t size() const { return value_.size(); }
 
+    inline size_t encode(char *out) const
+    {
+        std::memcpy(out, value_.data(), value_.size());
+        return value_.size();
+    }
+
     template<typename Tuple>
     ssize_t match(const Tuple &fields, const std::string &data, unsigned int offset)
     {
@@ -309,6 +399,12 @@ public:
     inline std::string data() const { return this->value_; }
     inline size_t size() const { return value_.size(); }
 
+    inline size_t encode(char *out) const
+    {
+        std::memcpy(out, value_.data(), value_.size());
+        return value_.size();
+    }
+
     template<typename Tuple>
     ssize_t match(const Tuple &fields, const std::string &data, unsigned int offset)
     {
@@ -347,10 +443,67 @@ public:
 
     virtual ~SimplePacket() = default;
 
+    /**
+     * Whether all fields of the packet have a size known at compile
+     * time. Only such packets can be decoded with decode().
+     */
+    static constexpr bool fixedLayout = Details::FixedLayout<TupleType>::value;
+
+    /**
+     * Size of a packet with fixed layout.
+     */
+    static constexpr size_t fixedSize = Details::FieldOffset<TupleType, sizeof...(Matchers)>::value;
+
 public:
     inline std::string serialize() const
     {
-        return Details::serializeFields(fields_);
+        std::string result(size(), '\0');
+
+        result.resize(encode(&result[0]));
+
+        return result;
+    }
+
+    /**
+     * Encodes the packet into the buffer in a single pass.
+     *
+     * The buffer must be at least size() bytes long. Returns the
+     * number of bytes written.
+     */
+    inline size_t encode(char *buffer) const
+    {
+        char *out = buffer;
+
+        Details::Encode<TupleType>(out, fields_);
+
+        return out - buffer;
+    }
+
+    /**
+     * Decodes fields of a fixed layout packet directly from the
+     * buffer without intermediate copies.
+     *
+     * Returns false if the buffer is shorter than the packet.
+     */
+    inline bool decode(const char *data, size_t size)
+    {
+        static_assert(fixedLayout, "Only fixed layout packets can be decoded in place");
+
+        if (size < fixedSize)
+            return false;
+
+        Details::Decode<TupleType>(fields_, data);
+
+        return true;
+    }
+
+    /**
+     * Returns the offset of the field within a fixed layout packet.
+     */
+    template<unsigned int i>
+    static constexpr size_t offset()
+    {
+        return Details::FieldOffset<TupleType, i>::value;
     }
 
     inline size_t size() const
@@ -409,6 +562,12 @@ private:
     std::tuple<Matchers...> fields_;
 };
 
+template<typename... Matchers>
+constexpr bool SimplePacket<Matchers...>::fixedLayout;
+
+template<typename... Matchers>
+constexpr size_t SimplePacket<Matchers...>::fixedSize;
+
 template<typename T>
 struct YieldPacketSize {};
 
@@ -22,16 +22,20 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
+#include <algorithm>
 #include <cassert>
 
 #include <debug/debug.hh>
 
 #include <net/bandwidthallocator.hh>
 #include <net/packet.hh>
+#include <net/reactorstatistics.hh>
 
 #include <util/backtrace.hh>
+#include <util/time.hh>
 
 #include "socket.hh"
 
@@ -42,11 +46,17 @@ using namespace Net;
 Socket::Socket(int socket, const HostAddress &host) :
     socket_(socket),
     remoteAddress_(host),
+    statistics_(0),
     localDownloadAllocator_(0),
     localUploadAllocator_(0),
     globalDownloadAllocator_(0),
     globalUploadAllocator_(0),
     closed_(false),
+    downloadStarved_(false),
+    uploadStarved_(false),
+    directTarget_(0),
+    directRemaining_(0),
+    directCompleted_(false),
     pendingData_(),
     pendingOffset_(0),
     data_(0)
@@ -56,10 +66,8 @@ Socket::Socket(int socket, const HostAddress &host) :
 
 Socket::~Socket()
 {
-    if (::close(socket_) == -1) {
-        hDebug() << "Failed to close socket file descriptor associated with remote address"
-                 << remoteAddress_ << "(" << strerror(errno) << ")";
-    }
+    if (socket_ != -1)
+        closeDescriptor();
 
     std::for_each(packetQueue_.begin(), packetQueue_.end(), [](Packet *p) { delete p; });
 }
@@ -72,6 +80,47 @@ void Socket::send(Packet *packet)
     packetQueue_.push_back(packet);
 }
 
+ssize_t Socket::send(const struct iovec *buffers, int count)
+{
+    ssize_t total = 0;
+
+    for (int i = 0; i < count; ++i) {
+        ssize_t sent = send(static_cast<const char *>(buffers[i].iov_base), buffers[i].iov_len);
+
+        if (sent == -1)
+            return total > 0 ? total : -1;
+
+        total += sent;
+
+        if (static_cast<size_t>(sent) < buffers[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+void Socket::setCorked(bool)
+{
+}
+
+void Socket::maintain()
+{
+}
+
+void Socket::retireSentData(std::string &)
+{
+}
+
+void Socket::closeDescriptor()
+{
+    if (::close(socket_) == -1) {
+        hDebug() << "Failed to close socket file descriptor associated with remote address"
+                 << remoteAddress_ << "(" << strerror(errno) << ")";
+    }
+
+    socket_ = -1;
+}
+
 void Socket::setLocalBandwidthAllocators(BandwidthAllocator *dl, BandwidthAllocator *ul)
 {
     localDownloadAllocator_ = dl;
@@ -100,7 +149,13 @@ void Socket::close()
 
     std::for_each(packetQueue_.begin(), packetQueue_.end(), [](Packet *p) { delete p; });
 
+    // The kernel may still be reading partially sent data.
+    std::for_each(pendingData_.begin(), pendingData_.end(),
+                  [this](std::string &data) { retireSentData(data); });
+
     packetQueue_.clear();
+    pendingData_.clear();
+    pendingOffset_ = 0;
 }
 
 int Socket::cloneFd()
@@ -123,11 +178,77 @@ Net::OutputMiddleware &Socket::outputMiddleware()
     return *output_;
 }
 
+Net::ReceiveBuffer &Socket::receiveBuffer()
+{
+    return receiveBuffer_;
+}
+
+ssize_t Socket::receive(const struct iovec *buffers, int count)
+{
+    ssize_t total = 0;
+
+    for (int i = 0; i < count; ++i) {
+        ssize_t received = receive(static_cast<char *>(buffers[i].iov_base), buffers[i].iov_len);
+
+        if (received == -1)
+            return total > 0 ? total : -1;
+
+        total += received;
+
+        if (static_cast<size_t>(received) < buffers[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+void Socket::receiveDirectly(char *destination, size_t size)
+{
+    assert(receiveBuffer_.empty());
+    assert(directRemaining_ == 0);
+
+    directTarget_ = destination;
+    directRemaining_ = size;
+    directCompleted_ = false;
+}
+
+size_t Socket::directReceiveRemaining() const
+{
+    return directRemaining_;
+}
+
+size_t Socket::deliverDirectly(const char *data, size_t size)
+{
+    size_t taken = std::min(directRemaining_, size);
+
+    std::copy(data, data + taken, directTarget_);
+
+    directTarget_ += taken;
+    directRemaining_ -= taken;
+
+    return taken;
+}
+
 const HostAddress &Socket::remoteAddress() const
 {
     return remoteAddress_;
 }
 
+unsigned int Socket::roundTripTime() const
+{
+    return 0;
+}
+
+RateEstimator &Socket::downloadRate()
+{
+    return downloadRate_;
+}
+
+RateEstimator &Socket::uploadRate()
+{
+    return uploadRate_;
+}
+
 bool Socket::closed() const
 {
     return closed_;
@@ -143,7 +264,9 @@ int Socket::allocateBandwidth(BandwidthAllocator *local, BandwidthAllocator *glo
 
         assert(allocatedNow >= 0);
 
-        if (allocatedNow == 0 || global == 0)
+        // Allocators linked into a hierarchy charge their ancestors
+        // themselves.
+        if (allocatedNow == 0 || global == 0 || local->parent() != 0)
             return allocatedNow;
     } else if (global != 0) {
         return global->allocate(size);
@@ -174,39 +297,92 @@ void Socket::releaseBandwidth(BandwidthAllocator *local, BandwidthAllocator *glo
         if (local != 0)
             local->release(size);
 
-        if (global != 0)
+        if (global != 0 && (local == 0 || local->parent() == 0))
             global->release(size);
     }
 }
 
-ssize_t Socket::read()
+int Socket::availableBandwidth(BandwidthAllocator *local, BandwidthAllocator *global) const
+{
+    int available = (local != 0) ? local->available() : -1;
+
+    if (global == 0 || (local != 0 && local->parent() != 0))
+        return available;
+
+    int globallyAvailable = global->available();
+
+    if (available < 0)
+        return globallyAvailable;
+    else if (globallyAvailable < 0)
+        return available;
+    else
+        return std::min(available, globallyAvailable);
+}
+
+int Socket::availableDownloadBandwidth() const
+{
+    return availableBandwidth(localDownloadAllocator_, globalDownloadAllocator_);
+}
+
+int Socket::availableUploadBandwidth() const
 {
-    std::string buffer;
+    return availableBandwidth(localUploadAllocator_, globalUploadAllocator_);
+}
+
+ssize_t Socket::read(size_t limit)
+{
+    size_t totalReceived = 0;
     ssize_t received = 0;
     ssize_t allocated = 0;
 
-    // Receive incoming data in 16 KB chunks.
+    downloadStarved_ = false;
+
+    // Receive incoming data in 16 KB chunks straight into the receive
+    // buffer.
     do {
-        allocated = allocateBandwidth(localDownloadAllocator_, globalDownloadAllocator_, 0x4000);
+        if (directRemaining_ == 0 && receiveBuffer_.space() == 0) {
+            // Let the middleware consume what has been received so
+            // far to make room for more data.
+            dispatchReceivedData();
+
+            if (closed_ || receiveBuffer_.space() == 0)
+                break;
+        }
+
+        size_t chunk = std::min<size_t>(directRemaining_ + receiveBuffer_.space(), 0x4000);
+
+        chunk = std::min(chunk, limit - totalReceived);
+
+        allocated = allocateBandwidth(localDownloadAllocator_, globalDownloadAllocator_, chunk);
 
         if (allocated > 0) {
-            received = receive(buffer, allocated);
+            if (directRemaining_ > 0) {
+                received = receiveScattered(allocated);
+            } else {
+                received = receive(receiveBuffer_.reserve(allocated), allocated);
+
+                if (received > 0)
+                    receiveBuffer_.commit(received);
+            }
+
+            if (received > 0)
+                totalReceived += received;
         } else {
+            downloadStarved_ = true;
             break;
         }
-    } while (received == allocated);
+    } while (received == allocated && totalReceived < limit);
 
-    // Subsequent middleware calls might change the size of the buffer
-    // thus we need to store the total amount of data we received now.
-    size_t totalReceived = buffer.size();
+    if (totalReceived > 0)
+        downloadRate_.add(totalReceived);
 
     if (received >= 0) {
         // Last receive() call might left some bandwidth unused we
         // should return it back to the allocators.
         releaseBandwidth(localDownloadAllocator_, globalDownloadAllocator_, allocated - received);
 
-        if (input_ && totalReceived > 0)
-            input_->receive(*this, buffer);
+        if (totalReceived > 0)
+            dispatchReceivedData();
     } else if (received == -1) {
         releaseBandwidth(localDownloadAllocator_, globalDownloadAllocator_, allocated);
         close();
@@ -215,81 +391,227 @@ ssize_t Socket::read()
     return totalReceived;
 }
 
-ssize_t Socket::write()
+ssize_t Socket::receiveScattered(size_t size)
 {
-    ssize_t wrote = 0;
+    // Fill the direct receive destination first and let whatever
+    // follows land in the receive buffer within the same call.
+    size_t direct = std::min(directRemaining_, size);
+    struct iovec buffers[2];
 
-    if (output_)
-        output_->write(*this);
+    buffers[0].iov_base = directTarget_;
+    buffers[0].iov_len = direct;
+    buffers[1].iov_base = receiveBuffer_.reserve(size - direct);
+    buffers[1].iov_len = size - direct;
 
-    while (!packetQueue_.empty()) {
-        Packet *packet = packetQueue_.front();
+    ssize_t received = receive(buffers, size > direct ? 2 : 1);
 
-        // Load pending data from the new packet if we never sent
-        // anything before or the last time we sent all packets
-        // completely.
-        if (pendingData_.empty()) {
-            pendingData_ = packet->serialize();
-            pendingOffset_ = 0;
-        }
+    if (received > 0) {
+        size_t intoTarget = std::min<size_t>(received, direct);
+
+        directTarget_ += intoTarget;
+        directRemaining_ -= intoTarget;
+        directCompleted_ = directRemaining_ == 0;
+
+        receiveBuffer_.commit(received - intoTarget);
+    }
+
+    return received;
+}
+
+void Socket::dispatchReceivedData()
+{
+    if (receiveBuffer_.empty() && !directCompleted_)
+        return;
+
+    directCompleted_ = false;
+
+    if (!input_) {
+        // Nobody is interested in incoming data.
+        receiveBuffer_.consume(receiveBuffer_.size());
+        return;
+    }
 
-        assert(!pendingData_.empty());
+    if (statistics_ != 0) {
+        Util::Time start = Util::Time::monotonicTime();
 
-        // Don't send the packet if it has been discarded and no data
-        // from it has been uploaded yet.
-        if (packet->discarded() && pendingOffset_ == 0) {
-            packetQueue_.pop_front();
-            delete packet;
+        input_->receive(*this, receiveBuffer_);
 
-            continue;
+        statistics_->inputMiddlewareTime.record(
+                (Util::Time::monotonicTime() - start).toMicroseconds());
+    } else {
+        input_->receive(*this, receiveBuffer_);
+    }
+}
+
+ssize_t Socket::write(size_t limit)
+{
+    maintain();
+
+    if (output_) {
+        if (statistics_ != 0) {
+            Util::Time start = Util::Time::monotonicTime();
+
+            output_->write(*this);
+
+            statistics_->outputMiddlewareTime.record(
+                    (Util::Time::monotonicTime() - start).toMicroseconds());
+        } else {
+            output_->write(*this);
         }
+    }
 
-        int remain = pendingData_.size() - pendingOffset_;
-        int allocated = allocateBandwidth(localUploadAllocator_, globalUploadAllocator_, remain);
+    // Cork the socket when the queue can't be gathered into a single
+    // send so that the tail of one send and the head of the next one
+    // don't go out as separate partial segments.
+    bool corked = packetQueue_.size() > MaxGatheredPackets;
 
-        if (allocated == 0)
-            return wrote;
+    if (corked)
+        setCorked(true);
 
-        ssize_t sent = send(pendingData_.data() + pendingOffset_, allocated);
+    ssize_t wrote = writeGathered(limit);
 
-        if (sent == remain) {
-            // Sent the whole packet.
+    if (corked && !closed_)
+        setCorked(false);
 
-            // Don't issue the onSent() callback if the packet was
-            // discarded, because the sender is, obviously, not
-            // interested in learning about this packet being
-            // successfully sent anymore.
-            if (!packet->discarded())
-                packet->onSent();
+    return wrote;
+}
 
-            packetQueue_.pop_front();
-            pendingData_.clear();
-            pendingOffset_ = 0;
+ssize_t Socket::writeGathered(size_t limit)
+{
+    size_t wrote = 0;
 
-            wrote += sent;
+    uploadStarved_ = false;
 
-            delete packet;
-        } else if (sent >= 0) {
-            // Sent only a part of the packet.
-            assert(sent >= 0 && sent <= allocated);
+    while (!packetQueue_.empty() && wrote < limit) {
+        struct iovec buffers[MaxGatheredPackets];
+        int count = 0;
+        size_t gathered = 0;
 
-            releaseBandwidth(localUploadAllocator_, globalUploadAllocator_, allocated - sent);
+        // Gather as many queued packets as we can into a single send
+        // so that bursts of small control messages don't cost one
+        // system call each.
+        for (size_t i = 0; i < packetQueue_.size() && count < MaxGatheredPackets; ) {
+            Packet *packet = packetQueue_[i];
 
-            pendingOffset_ += sent;
-            wrote += sent;
+            // Don't send the packet if it has been discarded and no
+            // data from it has been uploaded yet.
+            if (packet->discarded() && (i > 0 || pendingOffset_ == 0)) {
+                packetQueue_.erase(packetQueue_.begin() + i);
+
+                if (i < pendingData_.size())
+                    pendingData_.erase(pendingData_.begin() + i);
+
+                if (i == 0)
+                    pendingOffset_ = 0;
+
+                delete packet;
+
+                continue;
+            }
 
+            // Serialize packets lazily and keep the result around
+            // until the packet has been sent completely.
+            if (i == pendingData_.size())
+                pendingData_.push_back(packet->serialize());
+
+            const std::string &data = pendingData_[i];
+            size_t offset = (i == 0) ? pendingOffset_ : 0;
+
+            assert(offset < data.size());
+
+            buffers[count].iov_base = const_cast<char *>(data.data()) + offset;
+            buffers[count].iov_len = data.size() - offset;
+
+            gathered += buffers[count].iov_len;
+            ++count;
+            ++i;
+        }
+
+        if (count == 0)
+            break;
+
+        gathered = std::min(gathered, limit - wrote);
+
+        int allocated = allocateBandwidth(localUploadAllocator_, globalUploadAllocator_, gathered);
+
+        if (allocated == 0) {
+            uploadStarved_ = true;
             return wrote;
-        } else {
+        }
+
+        // Trim the gathered buffers to the allocated bandwidth.
+        size_t budget = allocated;
+        int used = 0;
+
+        while (used < count && budget > 0) {
+            if (buffers[used].iov_len > budget)
+                buffers[used].iov_len = budget;
+
+            budget -= buffers[used].iov_len;
+            ++used;
+        }
+
+        ssize_t sent = send(buffers, used);
+
+        if (sent < 0) {
             releaseBandwidth(localUploadAllocator_, globalUploadAllocator_, allocated);
             close();
 
             return wrote;
         }
+
+        assert(sent <= allocated);
+
+        releaseBandwidth(localUploadAllocator_, globalUploadAllocator_, allocated - sent);
+        completePackets(sent);
+
+        wrote += sent;
+        uploadRate_.add(sent);
+
+        // Either the socket buffer or the bandwidth allocation is
+        // exhausted, wait for the next wakeup.
+        if (static_cast<size_t>(allocated) < gathered) {
+            uploadStarved_ = true;
+            return wrote;
+        } else if (sent < allocated) {
+            return wrote;
+        }
     }
 
     return wrote;
 }
 
+void Socket::completePackets(size_t sent)
+{
+    while (sent > 0 && !packetQueue_.empty()) {
+        size_t remain = pendingData_.front().size() - pendingOffset_;
+
+        if (sent < remain) {
+            // Sent only a part of the packet.
+            pendingOffset_ += sent;
+            break;
+        }
+
+        Packet *packet = packetQueue_.front();
+
+        retireSentData(pendingData_.front());
+
+        packetQueue_.pop_front();
+        pendingData_.pop_front();
+        pendingOffset_ = 0;
+        sent -= remain;
+
+        // Don't issue the onSent() callback if the packet was
+        // discarded, because the sender is, obviously, not
+        // interested in learning about this packet being
+        // successfully sent anymore.
+        if (!packet->discarded())
+            packet->onSent();
+
+        delete packet;
+    }
+}
+
 void Socket::shutdown()
 {
     if (input_)
@@ -31,10 +31,15 @@
 #include <net/hostaddress.hh>
 #include <net/inputmiddleware.hh>
 #include <net/outputmiddleware.hh>
+#include <net/rateestimator.hh>
+#include <net/receivebuffer.hh>
+
+struct iovec;
 
 namespace Hypergrace { namespace Net { class BandwidthAllocator; }}
 namespace Hypergrace { namespace Net { class Packet; }}
 namespace Hypergrace { namespace Net { class Reactor; }}
+namespace Hypergrace { namespace Net { struct ReactorStatistics; }}
 
 
 namespace Hypergrace {
@@ -52,7 +57,59 @@ public:
     void send(Packet *);
 
     virtual ssize_t send(const char *, size_t) = 0;
-    virtual ssize_t receive(std::string &, size_t) = 0;
+
+    /**
+     * Receives at most the given amount of data into the buffer.
+     *
+     * Returns the number of bytes received, 0 if there's no data
+     * available right now or -1 on failure.
+     */
+    virtual ssize_t receive(char *, size_t) = 0;
+
+    /**
+     * Receives data scattering it across several buffers.
+     *
+     * Returns the number of bytes received, 0 if there's no data
+     * available right now or -1 on failure. The default implementation
+     * fills buffers one by one and stops at the first incomplete one.
+     */
+    virtual ssize_t receive(const struct iovec *, int);
+
+    /**
+     * Directs the given amount of incoming data straight into the
+     * destination bypassing the receive buffer.
+     *
+     * Data that follows is received into the receive buffer as usual.
+     * Input middleware is notified once the destination is filled and
+     * can check for that with directReceiveRemaining(). Must only be
+     * called while the receive buffer is empty.
+     */
+    void receiveDirectly(char *, size_t);
+    size_t directReceiveRemaining() const;
+
+    /**
+     * Copies data obtained outside of the socket's read path into the
+     * direct receive destination. Returns the number of bytes taken.
+     */
+    size_t deliverDirectly(const char *, size_t);
+
+    /**
+     * Sends data gathered from several buffers at once.
+     *
+     * Returns the number of bytes sent, which may be less than the
+     * total size of the buffers, or -1 on failure. The default
+     * implementation sends buffers one by one and stops at the first
+     * incomplete send.
+     */
+    virtual ssize_t send(const struct iovec *, int);
+
+    /**
+     * Asks the transport to hold back partial segments until the
+     * socket is uncorked so that data written with several sends goes
+     * out in full-sized segments. The default implementation does
+     * nothing.
+     */
+    virtual void setCorked(bool);
 
     void setLocalBandwidthAllocators(BandwidthAllocator *, BandwidthAllocator *);
     void setGlobalBandwidthAllocators(BandwidthAllocator *, BandwidthAllocator *);
@@ -94,6 +151,14 @@ public:
      */
     Net::OutputMiddleware &outputMiddleware();
 
+    /**
+     * Returns the buffer incoming data is received into.
+     *
+     * Input middleware parsing data in place consumes processed bytes
+     * from it; unconsumed bytes stay until more data arrives.
+     */
+    Net::ReceiveBuffer &receiveBuffer();
+
     /**
      * Returns the address of connected peer.
      *
@@ -102,6 +167,20 @@ public:
      */
     const HostAddress &remoteAddress() const;
 
+    /**
+     * Returns the transport's estimate of the round trip time to the
+     * peer in microseconds or 0 if it has none. The default
+     * implementation has no estimate.
+     */
+    virtual unsigned int roundTripTime() const;
+
+    /**
+     * Returns the estimated rates of data received and sent through
+     * the socket, protocol overhead included.
+     */
+    RateEstimator &downloadRate();
+    RateEstimator &uploadRate();
+
     /**
      * Makes a duplicate of socket's file descriptor.
      *
@@ -122,21 +201,71 @@ public:
 
     bool operator =(const Socket &) = delete;
 
+protected:
+    /**
+     * Called whenever the reactor finds the socket writable, before
+     * queued packets are written. The default implementation does
+     * nothing.
+     */
+    virtual void maintain();
+
+    /**
+     * Called with the serialized data of every packet once it has
+     * been sent completely, right before the data is released.
+     *
+     * Transports which keep referencing the data after send() has
+     * returned (e.g. zero-copy sends) can take it over by swapping it
+     * out. The default implementation does nothing. Data of packets
+     * dropped by close() is offered too.
+     */
+    virtual void retireSentData(std::string &);
+
+    /**
+     * Closes the file descriptor ahead of the destructor, which is
+     * going to leave it alone then.
+     */
+    void closeDescriptor();
+
 private:
     int allocateBandwidth(BandwidthAllocator *, BandwidthAllocator *, int);
     void releaseBandwidth(BandwidthAllocator *, BandwidthAllocator *, int);
+    int availableBandwidth(BandwidthAllocator *, BandwidthAllocator *) const;
+
+    ssize_t receiveScattered(size_t);
+    void dispatchReceivedData();
+
+    void completePackets(size_t);
 
 private:
     friend class Net::Reactor;
 
-    ssize_t read();
-    ssize_t write();
+    // Maximum number of queued packets gathered into a single send.
+    static const int MaxGatheredPackets = 64;
+
+    // Reads and writes transfer at most the given number of bytes so
+    // that the reactor can share bandwidth among sockets in rounds.
+    // A write runs the output middleware and then sends queued data,
+    // further rounds within the same wakeup only send.
+    ssize_t read(size_t);
+    ssize_t write(size_t);
+    ssize_t writeGathered(size_t);
     void shutdown();
 
+    // Whether the last read or write has been held back because the
+    // bandwidth allocators ran out of tokens.
+    bool downloadStarved() const { return downloadStarved_; }
+    bool uploadStarved() const { return uploadStarved_; }
+
+    // Bandwidth available to the socket right now or -1 if unlimited.
+    int availableDownloadBandwidth() const;
+    int availableUploadBandwidth() const;
+
 private:
-    const int socket_;
+    int socket_;
     HostAddress remoteAddress_;
 
+    ReactorStatistics *statistics_;
+
     Net::InputMiddleware::Pointer input_;
     Net::OutputMiddleware::Pointer output_;
 
@@ -146,12 +275,25 @@ private:
     BandwidthAllocator *globalUploadAllocator_;
 
     bool closed_;
+    bool downloadStarved_;
+    bool uploadStarved_;
+
+    ReceiveBuffer receiveBuffer_;
+
+    char *directTarget_;
+    size_t directRemaining_;
+    bool directCompleted_;
 
     std::deque<Packet *> packetQueue_;
 
-    std::string pendingData_;
+    // Serialized form of the packets at the head of the queue, the
+    // first of which may have been sent partially up to the offset.
+    std::deque<std::string> pendingData_;
     size_t pendingOffset_;
 
+    RateEstimator downloadRate_;
+    RateEstimator uploadRate_;
+
     void *data_;
 };
 
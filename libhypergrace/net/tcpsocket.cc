@@ -21,13 +21,19 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <errno.h>
+#include <linux/errqueue.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <sstream>
 
 #include <debug/debug.hh>
@@ -45,9 +51,79 @@ using namespace Hypergrace;
 using namespace Net;
 
 
+namespace {
+
+std::atomic<size_t> bufferBudget_(TcpSocket::DefaultBufferBudget);
+std::atomic<size_t> bufferMemory_(0);
+
+std::atomic<size_t> zeroCopyThreshold_(TcpSocket::DefaultZeroCopyThreshold);
+
+// Takes up to the requested amount from the buffer budget and returns
+// the amount granted.
+size_t acquireBufferMemory(size_t requested)
+{
+    size_t used = bufferMemory_.load();
+    size_t granted;
+
+    do {
+        size_t budget = bufferBudget_.load();
+        granted = (used < budget) ? std::min(requested, budget - used) : 0;
+    } while (granted > 0 && !bufferMemory_.compare_exchange_weak(used, used + granted));
+
+    return granted;
+}
+
+void releaseBufferMemory(size_t amount)
+{
+    bufferMemory_ -= amount;
+}
+
+} /* namespace */
+
 TcpSocket::TcpSocket(int socket, const HostAddress &host) :
-    Socket(socket, host)
+    Socket(socket, host),
+    bytesSent_(0),
+    bytesReceived_(0),
+    sendBufferSize_(0),
+    receiveBufferSize_(0),
+    lastTune_(Util::Time::monotonicTime()),
+    zeroCopy_(false),
+    zeroCopyThreshold_(::zeroCopyThreshold_),
+    copiedZeroCopySends_(0),
+    nextZeroCopySend_(0),
+    retainedSize_(0)
 {
+    // Peer-wire control messages are small and latency sensitive,
+    // batching is done by gathering queued packets instead of Nagle.
+    // The descriptor might not be a TCP socket (e.g. in tests), so
+    // failures are not worth reporting.
+    int enable = 1;
+    ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    // Kernels older than 4.14 reject the option, sends are copied
+    // then.
+    if (zeroCopyThreshold_ > 0)
+        zeroCopy_ = ::setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+#endif
+}
+
+TcpSocket::~TcpSocket()
+{
+    reapCompletions();
+
+    // Zero-copy sends still pending keep referencing the retained data
+    // which is about to be freed. Reset the connection on close so that
+    // the kernel drops the queued data rather than transmit whatever
+    // the memory holds next.
+    if (!outstandingZeroCopySends_.empty()) {
+        struct linger reset = { 1, 0 };
+
+        ::setsockopt(fd(), SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        closeDescriptor();
+    }
+
+    releaseBufferMemory(sendBufferSize_ + receiveBufferSize_);
 }
 
 ssize_t TcpSocket::send(const char *data, size_t size)
@@ -61,6 +137,8 @@ ssize_t TcpSocket::send(const char *data, size_t size)
 
     assert(unsent <= end);
 
+    bytesSent_ += unsent - data;
+
     if (unsent == end) {
         return size;
     } else if (sent == -1 && errno == EAGAIN) {
@@ -71,13 +149,113 @@ ssize_t TcpSocket::send(const char *data, size_t size)
     }
 }
 
-ssize_t TcpSocket::receive(std::string &buffer, size_t size)
+ssize_t TcpSocket::send(const struct iovec *buffers, int count)
+{
+    if (!zeroCopy_)
+        return sendRun(buffers, count, false);
+
+    // Send runs of large buffers without copying them and the small
+    // ones in between the regular way. Small buffers don't pay off the
+    // completion handling and their storage can't be retained reliably.
+    ssize_t total = 0;
+    int first = 0;
+
+    while (first < count) {
+        bool large = buffers[first].iov_len >= zeroCopyThreshold_;
+        size_t size = buffers[first].iov_len;
+        int last = first + 1;
+
+        while (last < count && (buffers[last].iov_len >= zeroCopyThreshold_) == large)
+            size += buffers[last++].iov_len;
+
+        ssize_t sent = sendRun(buffers + first, last - first, large);
+
+        if (sent < 0)
+            return total > 0 ? total : -1;
+
+        total += sent;
+
+        if (static_cast<size_t>(sent) < size)
+            break;
+
+        first = last;
+    }
+
+    return total;
+}
+
+ssize_t TcpSocket::sendRun(const struct iovec *buffers, int count, bool zeroCopy)
+{
+    struct msghdr message = {};
+
+    message.msg_iov = const_cast<struct iovec *>(buffers);
+    message.msg_iovlen = count;
+
+    // A single sendmsg() is enough: if the kernel accepts less than
+    // the whole vector the socket buffer is full and another attempt
+    // would fail with EAGAIN anyway.
+    ssize_t sent;
+
+#ifdef MSG_ZEROCOPY
+    if (zeroCopy) {
+        sent = ::sendmsg(fd(), &message, MSG_NOSIGNAL | MSG_ZEROCOPY);
+
+        // Pinning pages is limited by the socket's option memory,
+        // copy the data this time.
+        if (sent == -1 && errno == ENOBUFS) {
+            zeroCopy = false;
+            sent = ::sendmsg(fd(), &message, MSG_NOSIGNAL);
+        }
+    } else {
+        sent = ::sendmsg(fd(), &message, MSG_NOSIGNAL);
+    }
+#else
+    sent = ::sendmsg(fd(), &message, MSG_NOSIGNAL);
+#endif
+
+    if (sent >= 0) {
+        // The kernel numbers zero-copy sends which have queued any
+        // data in order.
+        if (zeroCopy && sent > 0)
+            outstandingZeroCopySends_.insert(nextZeroCopySend_++);
+
+        bytesSent_ += sent;
+        tuneBuffers();
+
+        return sent;
+    } else if (errno == EAGAIN) {
+        // XXX: Check for EWOULDBLOCK too?
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+ssize_t TcpSocket::receive(char *buffer, size_t size)
+{
+    ssize_t received = ::recv(fd(), buffer, size, 0);
+
+    if (received > 0) {
+        bytesReceived_ += received;
+        tuneBuffers();
+
+        return received;
+    } else if (received == 0 || (received == -1 && errno == EAGAIN)) {
+        // XXX: Check for EWOULDBLOCK too?
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+ssize_t TcpSocket::receive(const struct iovec *buffers, int count)
 {
-    char recvBuffer[size];
-    ssize_t received = ::recv(fd(), recvBuffer, size, 0);
+    ssize_t received = ::readv(fd(), buffers, count);
 
     if (received > 0) {
-        buffer.append(recvBuffer, received);
+        bytesReceived_ += received;
+        tuneBuffers();
+
         return received;
     } else if (received == 0 || (received == -1 && errno == EAGAIN)) {
         // XXX: Check for EWOULDBLOCK too?
@@ -86,3 +264,202 @@ ssize_t TcpSocket::receive(std::string &buffer, size_t size)
         return -1;
     }
 }
+
+void TcpSocket::setCorked(bool corked)
+{
+    int value = corked;
+    ::setsockopt(fd(), IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+void TcpSocket::setBufferBudget(size_t budget)
+{
+    bufferBudget_ = budget;
+}
+
+size_t TcpSocket::bufferBudget()
+{
+    return bufferBudget_;
+}
+
+size_t TcpSocket::bufferMemory()
+{
+    return bufferMemory_;
+}
+
+unsigned int TcpSocket::roundTripTime() const
+{
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if (::getsockopt(fd(), IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+        return info.tcpi_rtt;
+    else
+        return 0;
+}
+
+void TcpSocket::tuneBuffers()
+{
+    Util::Time now = Util::Time::monotonicTime();
+    size_t elapsed = (now - lastTune_).toMilliseconds();
+
+    if (elapsed < BufferTuneInterval)
+        return;
+
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if (::getsockopt(fd(), IPPROTO_TCP, TCP_INFO, &info, &length) == 0 && info.tcpi_rtt > 0) {
+        // The receive side RTT estimate is only available once the
+        // peer has sent enough data, fall back to the send side one.
+        unsigned int receiveRtt = (info.tcpi_rcv_rtt > 0) ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+
+        resizeBuffer(SO_SNDBUF, sendBufferSize_, bytesSent_ * 1000 / elapsed, info.tcpi_rtt);
+        resizeBuffer(SO_RCVBUF, receiveBufferSize_, bytesReceived_ * 1000 / elapsed, receiveRtt);
+    }
+
+    bytesSent_ = 0;
+    bytesReceived_ = 0;
+    lastTune_ = now;
+}
+
+void TcpSocket::resizeBuffer(int option, size_t &current, size_t rate, unsigned int rtt)
+{
+    // Twice the bandwidth-delay product leaves room for the rate to
+    // grow until the next adjustment.
+    size_t wanted = static_cast<unsigned long long>(rate) * rtt * 2 / 1000000;
+
+    // Setting a buffer size explicitly turns off kernel autotuning,
+    // so leave connections that don't need large buffers alone.
+    if (current == 0 && wanted <= MinimumBufferSize)
+        return;
+
+    wanted = std::min<size_t>(std::max<size_t>(wanted, MinimumBufferSize), MaximumBufferSize);
+
+    // Ignore small fluctuations.
+    if (current > 0 && wanted * 4 > current * 3 && wanted * 4 < current * 5)
+        return;
+
+    size_t size;
+
+    if (wanted > current) {
+        size = current + acquireBufferMemory(wanted - current);
+
+        // Out of budget.
+        if (size < MinimumBufferSize || size == current) {
+            releaseBufferMemory(size - current);
+            return;
+        }
+    } else {
+        size = wanted;
+    }
+
+    int value = size;
+
+    if (::setsockopt(fd(), SOL_SOCKET, option, &value, sizeof(value)) == -1) {
+        hDebug() << "Failed to resize socket buffer of" << remoteAddress()
+                 << "(" << strerror(errno) << ")";
+
+        if (size > current)
+            releaseBufferMemory(size - current);
+
+        return;
+    }
+
+    if (size < current)
+        releaseBufferMemory(current - size);
+
+    current = size;
+}
+
+void TcpSocket::setZeroCopyThreshold(size_t threshold)
+{
+    ::zeroCopyThreshold_ = threshold;
+}
+
+size_t TcpSocket::zeroCopyThreshold()
+{
+    return ::zeroCopyThreshold_;
+}
+
+bool TcpSocket::zeroCopyEnabled() const
+{
+    return zeroCopy_;
+}
+
+size_t TcpSocket::retainedData() const
+{
+    return retainedSize_;
+}
+
+void TcpSocket::maintain()
+{
+    reapCompletions();
+}
+
+void TcpSocket::retireSentData(std::string &data)
+{
+    // Only large buffers are sent without copying. Any of them might
+    // still be referenced by the latest zero-copy send.
+    if (data.size() < zeroCopyThreshold_ || outstandingZeroCopySends_.empty())
+        return;
+
+    retainedData_.push_back(std::make_pair(nextZeroCopySend_ - 1, std::string()));
+    retainedData_.back().second.swap(data);
+    retainedSize_ += retainedData_.back().second.size();
+}
+
+void TcpSocket::reapCompletions()
+{
+    if (outstandingZeroCopySends_.empty() && retainedData_.empty())
+        return;
+
+    char control[128];
+
+    for (;;) {
+        struct msghdr message = {};
+
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if (::recvmsg(fd(), &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break;
+
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+             header != 0;
+             header = CMSG_NXTHDR(&message, header)) {
+            bool recvError = (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                             (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR);
+
+            if (!recvError)
+                continue;
+
+            struct sock_extended_err error;
+            std::memcpy(&error, CMSG_DATA(header), sizeof(error));
+
+            if (error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // Sends from ee_info to ee_data inclusive have completed.
+            outstandingZeroCopySends_.erase(
+                    outstandingZeroCopySends_.lower_bound(error.ee_info),
+                    outstandingZeroCopySends_.upper_bound(error.ee_data));
+
+            if (!(error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+                copiedZeroCopySends_ = 0;
+            } else if (zeroCopy_ && ++copiedZeroCopySends_ >= MaximumCopiedZeroCopySends) {
+                // The kernel had to copy the data anyway, zero-copy
+                // only adds the completion overhead.
+                hDebug() << "Disabling zero-copy sends to" << remoteAddress();
+                zeroCopy_ = false;
+            }
+        }
+    }
+
+    // Release data no outstanding send could be referencing.
+    while (!retainedData_.empty() &&
+           (outstandingZeroCopySends_.empty() ||
+            retainedData_.front().first < *outstandingZeroCopySends_.begin())) {
+        retainedSize_ -= retainedData_.front().second.size();
+        retainedData_.pop_front();
+    }
+}
@@ -21,19 +21,130 @@
 #ifndef NET_TCPCONNECTION_HH_
 #define NET_TCPCONNECTION_HH_
 
+#include <cstdint>
+#include <deque>
+#include <set>
 #include <string>
+#include <utility>
+
 #include <net/socket.hh>
+#include <util/time.hh>
 
 namespace Hypergrace {
 namespace Net {
 
 class TcpSocket : public Socket
 {
+public:
+    enum {
+        // Process-wide memory budget for enlarged socket buffers
+        DefaultBufferBudget = 64 * 1024 * 1024,
+
+        // Buffers are never pinned smaller than the kernel's usual
+        // autotuned size nor larger than the maximum.
+        MinimumBufferSize = 128 * 1024,
+        MaximumBufferSize = 4 * 1024 * 1024,
+
+        // How often (in milliseconds) buffer sizes are revisited
+        BufferTuneInterval = 1000,
+
+        // Gathered buffers at least this large are sent with
+        // MSG_ZEROCOPY, which covers whole 16 KiB PIECE messages
+        DefaultZeroCopyThreshold = 0x4000,
+
+        // Zero-copy is turned off for a connection once the kernel
+        // reports having copied the data this many times in a row
+        // (e.g. over the loopback interface)
+        MaximumCopiedZeroCopySends = 16
+    };
+
 public:
     TcpSocket(int, const HostAddress &);
+    ~TcpSocket();
 
     ssize_t send(const char *, size_t);
-    ssize_t receive(std::string &, size_t);
+    ssize_t send(const struct iovec *, int);
+    ssize_t receive(char *, size_t);
+    ssize_t receive(const struct iovec *, int);
+
+    void setCorked(bool);
+
+    /**
+     * Returns the kernel's smoothed RTT estimate of the connection
+     * (TCP_INFO).
+     */
+    unsigned int roundTripTime() const;
+
+    /**
+     * Limits the total size of socket buffers enlarged by TcpSocket
+     * instances across the process.
+     *
+     * Each connection sizes its SO_SNDBUF and SO_RCVBUF to the
+     * bandwidth-delay product measured from its transfer rate and
+     * the kernel's RTT estimate (TCP_INFO). Connections which don't
+     * need more than MinimumBufferSize are left to kernel autotuning
+     * and don't count against the budget.
+     */
+    static void setBufferBudget(size_t);
+    static size_t bufferBudget();
+
+    /**
+     * Returns the amount of the buffer budget currently in use.
+     */
+    static size_t bufferMemory();
+
+    /**
+     * Sets the size from which gathered buffers are sent without
+     * copying them into the socket buffer (MSG_ZEROCOPY). The data
+     * then stays referenced by the kernel until it reports completion
+     * on the socket's error queue and is retained by the socket until
+     * then. Zero disables zero-copy sends for sockets created
+     * afterwards. Connections fall back to regular sends if the
+     * kernel doesn't support zero-copy.
+     */
+    static void setZeroCopyThreshold(size_t);
+    static size_t zeroCopyThreshold();
+
+    bool zeroCopyEnabled() const;
+
+    /**
+     * Returns the amount of sent data waiting for zero-copy
+     * completion.
+     */
+    size_t retainedData() const;
+
+protected:
+    void maintain();
+    void retireSentData(std::string &);
+
+private:
+    void tuneBuffers();
+    void resizeBuffer(int, size_t &, size_t, unsigned int);
+
+    ssize_t sendRun(const struct iovec *, int, bool);
+    void reapCompletions();
+
+private:
+    size_t bytesSent_;
+    size_t bytesReceived_;
+
+    size_t sendBufferSize_;
+    size_t receiveBufferSize_;
+
+    Util::Time lastTune_;
+
+    bool zeroCopy_;
+    size_t zeroCopyThreshold_;
+    unsigned int copiedZeroCopySends_;
+
+    // Identifiers of zero-copy sends the kernel hasn't completed yet
+    uint32_t nextZeroCopySend_;
+    std::set<uint32_t> outstandingZeroCopySends_;
+
+    // Sent data tagged with the last zero-copy send it could be a
+    // part of
+    std::deque<std::pair<uint32_t, std::string> > retainedData_;
+    size_t retainedSize_;
 };
 
 } /* namespace Net */
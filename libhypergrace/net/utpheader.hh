@@ -0,0 +1,177 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NET_UTPHEADER_HH_
+#define NET_UTPHEADER_HH_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace Hypergrace {
+namespace Net {
+
+/**
+ * Fixed part of a uTP packet header (BEP 29).
+ *
+ * All fields are transmitted in network byte order. The selective ACK
+ * extension is the only one understood, others are skipped.
+ */
+struct UtpHeader
+{
+    enum Type {
+        Data = 0,
+        Fin = 1,
+        State = 2,
+        Reset = 3,
+        Syn = 4
+    };
+
+    enum {
+        Version = 1,
+        Size = 20,
+
+        SelectiveAckExtension = 1
+    };
+
+    uint8_t type;
+    uint16_t connectionId;
+    uint32_t timestamp;
+    uint32_t timestampDifference;
+    uint32_t windowSize;
+    uint16_t sequenceNumber;
+    uint16_t acknowledgementNumber;
+
+    // Bitmask of the packets received following the one after
+    // acknowledgementNumber, least significant bit first; its size is
+    // a multiple of four
+    const unsigned char *selectiveAck;
+    uint8_t selectiveAckSize;
+
+    UtpHeader() :
+        selectiveAck(0),
+        selectiveAckSize(0)
+    {
+    }
+
+    /**
+     * Returns the size of the serialized header.
+     */
+    size_t size() const
+    {
+        return Size + (selectiveAckSize > 0 ? 2 + selectiveAckSize : 0);
+    }
+
+    /**
+     * Parses the header at the beginning of a datagram.
+     *
+     * Returns the offset of the payload or 0 if the datagram isn't a
+     * valid uTP packet.
+     */
+    size_t parse(const char *data, size_t size)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+
+        if (size < Size || (p[0] & 0x0F) != Version || (p[0] >> 4) > Syn)
+            return 0;
+
+        type = p[0] >> 4;
+        connectionId = get16(p + 2);
+        timestamp = get32(p + 4);
+        timestampDifference = get32(p + 8);
+        windowSize = get32(p + 12);
+        sequenceNumber = get16(p + 16);
+        acknowledgementNumber = get16(p + 18);
+
+        // Walk the chain of extensions, each one is prefixed with the
+        // type of the next one and its own length.
+        size_t offset = Size;
+        unsigned char extension = p[1];
+
+        selectiveAck = 0;
+        selectiveAckSize = 0;
+
+        while (extension != 0) {
+            if (offset + 2 > size || offset + 2 + p[offset + 1] > size)
+                return 0;
+
+            if (extension == SelectiveAckExtension) {
+                selectiveAck = p + offset + 2;
+                selectiveAckSize = p[offset + 1];
+            }
+
+            extension = p[offset];
+            offset += 2 + p[offset + 1];
+        }
+
+        return offset;
+    }
+
+    void serialize(char *data) const
+    {
+        unsigned char *p = reinterpret_cast<unsigned char *>(data);
+
+        p[0] = (type << 4) | Version;
+        p[1] = (selectiveAckSize > 0) ? SelectiveAckExtension : 0;
+        put16(p + 2, connectionId);
+        put32(p + 4, timestamp);
+        put32(p + 8, timestampDifference);
+        put32(p + 12, windowSize);
+        put16(p + 16, sequenceNumber);
+        put16(p + 18, acknowledgementNumber);
+
+        if (selectiveAckSize > 0) {
+            p[Size] = 0;
+            p[Size + 1] = selectiveAckSize;
+            std::copy(selectiveAck, selectiveAck + selectiveAckSize, p + Size + 2);
+        }
+    }
+
+private:
+    static uint16_t get16(const unsigned char *p)
+    {
+        return (p[0] << 8) | p[1];
+    }
+
+    static uint32_t get32(const unsigned char *p)
+    {
+        return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    static void put16(unsigned char *p, uint16_t value)
+    {
+        p[0] = value >> 8;
+        p[1] = value;
+    }
+
+    static void put32(unsigned char *p, uint32_t value)
+    {
+        p[0] = value >> 24;
+        p[1] = value >> 16;
+        p[2] = value >> 8;
+        p[3] = value;
+    }
+};
+
+} /* namespace Net */
+} /* namespace Hypergrace */
+
+#endif /* NET_UTPHEADER_HH_ */
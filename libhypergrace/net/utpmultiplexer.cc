@@ -0,0 +1,330 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <debug/debug.hh>
+
+#include <net/utpheader.hh>
+#include <net/utpsocket.hh>
+
+#include <util/time.hh>
+
+#include "utpmultiplexer.hh"
+
+using namespace Hypergrace;
+using namespace Net;
+
+
+UtpMultiplexer::UtpMultiplexer(int socket) :
+    Socket(socket, HostAddress()),
+    receiveArea_(Batch * MaximumDatagram)
+{
+    // Have the kernel timestamp incoming datagrams so that the delay
+    // the peers measure doesn't include the time datagrams wait for
+    // the reactor.
+    int enable = 1;
+
+    if (::setsockopt(socket, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable)) == -1)
+        hDebug() << "Failed to enable receive timestamps on uTP socket (" << strerror(errno) << ")";
+
+    // Datagrams arriving between two reactor wakeups have to fit into
+    // the socket buffer or they are dropped. The kernel caps the size
+    // to the system-wide maximum.
+    int size = BufferSize;
+
+    if (::setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1 ||
+            ::setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1)
+        hDebug() << "Failed to resize uTP socket buffers (" << strerror(errno) << ")";
+}
+
+UtpMultiplexer::~UtpMultiplexer()
+{
+    for (auto it = connections_.begin(); it != connections_.end(); ++it)
+        it->second->detach();
+}
+
+UtpSocket *UtpMultiplexer::connect(const HostAddress &address)
+{
+    if (!address.valid())
+        return 0;
+
+    // Pick a connection identifier not used with the same peer yet.
+    uint16_t id = rand();
+    int attempts = 0;
+
+    while (connections_.find(ConnectionKey(address, id)) != connections_.end()) {
+        if (++attempts == 0x10)
+            return 0;
+
+        id = rand();
+    }
+
+    UtpSocket *socket = new UtpSocket(this, address, id, id + 1);
+
+    connections_[ConnectionKey(address, id)] = socket;
+
+    socket->connect(now());
+    flush();
+
+    return socket;
+}
+
+size_t UtpMultiplexer::connectionCount() const
+{
+    return connections_.size();
+}
+
+ssize_t UtpMultiplexer::send(const char *, size_t)
+{
+    // Data is only ever sent through the connections.
+    return -1;
+}
+
+ssize_t UtpMultiplexer::receive(char *, size_t)
+{
+    struct mmsghdr messages[Batch];
+    struct iovec buffers[Batch];
+    sockaddr_storage addresses[Batch];
+    char controls[Batch][CMSG_SPACE(sizeof(timeval))];
+
+    unsigned long long current = now();
+
+    for (int batch = 0; batch < MaximumBatches; ++batch) {
+        for (int i = 0; i < Batch; ++i) {
+            buffers[i].iov_base = &receiveArea_[i * MaximumDatagram];
+            buffers[i].iov_len = MaximumDatagram;
+
+            memset(&messages[i].msg_hdr, 0, sizeof(msghdr));
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            messages[i].msg_hdr.msg_iov = &buffers[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_control = controls[i];
+            messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+        }
+
+        int count = ::recvmmsg(fd(), messages, Batch, MSG_DONTWAIT, 0);
+
+        if (count == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                hDebug() << "Failed to receive uTP datagrams (" << strerror(errno) << ")";
+
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            msghdr &message = messages[i].msg_hdr;
+            uint32_t receivedAt = 0;
+
+            for (cmsghdr *control = CMSG_FIRSTHDR(&message); control != 0;
+                    control = CMSG_NXTHDR(&message, control)) {
+                if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMP) {
+                    timeval tv;
+
+                    memcpy(&tv, CMSG_DATA(control), sizeof(tv));
+                    receivedAt = tv.tv_sec * 1000000ULL + tv.tv_usec;
+                }
+            }
+
+            if (receivedAt == 0)
+                receivedAt = timestamp();
+
+            dispatch(HostAddress(*reinterpret_cast<sockaddr *>(&addresses[i])),
+                     static_cast<const char *>(buffers[i].iov_base), messages[i].msg_len,
+                     receivedAt, current);
+        }
+
+        if (count < Batch)
+            break;
+    }
+
+    // Acknowledge everything received in one go instead of packet
+    // by packet.
+    for (auto it = acknowledging_.begin(); it != acknowledging_.end(); ++it)
+        (*it)->acknowledgeReceived();
+
+    acknowledging_.clear();
+
+    flush();
+
+    return 0;
+}
+
+void UtpMultiplexer::maintain()
+{
+    unsigned long long current = now();
+
+    for (auto it = connections_.begin(); it != connections_.end(); ++it)
+        it->second->checkTimeouts(current);
+
+    flush();
+}
+
+void UtpMultiplexer::dispatch(const HostAddress &address, const char *data, size_t size,
+                              uint32_t receivedAt, unsigned long long current)
+{
+    UtpHeader header;
+    size_t offset = header.parse(data, size);
+
+    if (offset == 0)
+        return;
+
+    if (header.type == UtpHeader::Syn) {
+        ConnectionKey key(address, header.connectionId + 1);
+        auto it = connections_.find(key);
+
+        if (it != connections_.end()) {
+            it->second->accept(header, receivedAt);
+        } else if (onAccepted) {
+            UtpSocket *socket = new UtpSocket(this, address, header.connectionId + 1, header.connectionId);
+
+            connections_[key] = socket;
+
+            socket->accept(header, receivedAt);
+            onAccepted(socket);
+        } else {
+            refuse(address, header);
+        }
+    } else {
+        auto it = connections_.find(ConnectionKey(address, header.connectionId));
+
+        if (it != connections_.end())
+            it->second->process(header, data + offset, size - offset, receivedAt, current);
+        else if (header.type != UtpHeader::Reset)
+            refuse(address, header);
+    }
+}
+
+void UtpMultiplexer::refuse(const HostAddress &address, const UtpHeader &received)
+{
+    UtpHeader header;
+
+    header.type = UtpHeader::Reset;
+    header.connectionId = received.connectionId;
+    header.timestamp = timestamp();
+    header.timestampDifference = 0;
+    header.windowSize = 0;
+    header.sequenceNumber = 0;
+    header.acknowledgementNumber = received.sequenceNumber;
+
+    queue(address, header, 0, 0);
+}
+
+void UtpMultiplexer::queue(const HostAddress &address, const UtpHeader &header,
+                           const char *payload, size_t size)
+{
+    outbox_.push_back(Datagram());
+
+    Datagram &datagram = outbox_.back();
+
+    datagram.address = address;
+    datagram.data.resize(header.size() + size);
+
+    header.serialize(&datagram.data[0]);
+
+    if (size > 0)
+        memcpy(&datagram.data[header.size()], payload, size);
+
+    if (outbox_.size() >= Batch)
+        flush();
+}
+
+void UtpMultiplexer::scheduleAcknowledgement(UtpSocket *socket)
+{
+    if (!socket->ackPending_) {
+        socket->ackPending_ = true;
+        acknowledging_.push_back(socket);
+    }
+}
+
+void UtpMultiplexer::flush()
+{
+    size_t offset = 0;
+
+    while (offset < outbox_.size()) {
+        struct mmsghdr messages[Batch];
+        struct iovec buffers[Batch];
+        int count = std::min<size_t>(Batch, outbox_.size() - offset);
+
+        for (int i = 0; i < count; ++i) {
+            Datagram &datagram = outbox_[offset + i];
+
+            buffers[i].iov_base = &datagram.data[0];
+            buffers[i].iov_len = datagram.data.size();
+
+            memset(&messages[i].msg_hdr, 0, sizeof(msghdr));
+            messages[i].msg_hdr.msg_name = const_cast<sockaddr *>(datagram.address.nativeAddress());
+            messages[i].msg_hdr.msg_namelen = datagram.address.nativeAddressSize();
+            messages[i].msg_hdr.msg_iov = &buffers[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int sent = ::sendmmsg(fd(), messages, count, MSG_DONTWAIT);
+
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+
+            // The socket buffer is full, the datagrams are dropped and
+            // retransmitted later on like any other lost ones.
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            hDebug() << "Failed to send uTP datagram to" << outbox_[offset].address
+                     << "(" << strerror(errno) << ")";
+
+            sent = 1;
+        }
+
+        offset += sent;
+    }
+
+    outbox_.clear();
+}
+
+void UtpMultiplexer::detach(UtpSocket *socket)
+{
+    connections_.erase(ConnectionKey(socket->remoteAddress(), socket->receiveId_));
+
+    acknowledging_.erase(std::remove(acknowledging_.begin(), acknowledging_.end(), socket),
+                         acknowledging_.end());
+}
+
+unsigned long long UtpMultiplexer::now()
+{
+    return Util::Time::monotonicTime().toMicroseconds();
+}
+
+uint32_t UtpMultiplexer::timestamp()
+{
+    timeval tv;
+
+    gettimeofday(&tv, 0);
+
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
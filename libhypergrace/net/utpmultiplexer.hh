@@ -0,0 +1,143 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NET_UTPMULTIPLEXER_HH_
+#define NET_UTPMULTIPLEXER_HH_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <delegate/delegate.hh>
+
+#include <net/socket.hh>
+
+namespace Hypergrace { namespace Net { class UtpSocket; }}
+namespace Hypergrace { namespace Net { struct UtpHeader; }}
+
+
+namespace Hypergrace {
+namespace Net {
+
+/**
+ * Runs all uTP connections over a single bound UDP socket.
+ *
+ * The multiplexer is observed by the reactor like any other socket.
+ * Whenever the UDP socket is readable it drains the pending datagrams
+ * in batches with recvmmsg() and hands them to the connections they
+ * belong to; datagrams produced meanwhile are collected and sent in
+ * batches with sendmmsg(). Retransmission timeouts of all connections
+ * are checked every time the reactor finds the socket writable.
+ *
+ * Connections must be deleted (normally by the reactor once they are
+ * closed) before the multiplexer or be left detached by it.
+ */
+class UtpMultiplexer : public Socket
+{
+public:
+    enum {
+        // Datagrams received or sent with a single system call
+        Batch = 32,
+
+        // Largest datagram accepted
+        MaximumDatagram = 0x800,
+
+        // Receive batches handled in a single wakeup so that a flood
+        // of datagrams can't stall the reactor
+        MaximumBatches = 16,
+
+        // Size requested for the socket buffers in bytes
+        BufferSize = 0x200000
+    };
+
+public:
+    /**
+     * Takes over a bound UDP socket.
+     */
+    explicit UtpMultiplexer(int);
+    ~UtpMultiplexer();
+
+    /**
+     * Starts connecting to the given address.
+     *
+     * Returns a connection in the connecting state, which the caller
+     * should observe with the reactor, or 0 on failure. Data sent
+     * before the handshake completes stays queued on the socket.
+     */
+    UtpSocket *connect(const HostAddress &);
+
+    /**
+     * Called with every connection accepted from a peer. The handler
+     * takes the ownership of the connection and should observe it. If
+     * no handler is set incoming connections are refused.
+     */
+    Delegate::Delegate<void (UtpSocket *)> onAccepted;
+
+    size_t connectionCount() const;
+
+    ssize_t send(const char *, size_t);
+    ssize_t receive(char *, size_t);
+
+protected:
+    void maintain();
+
+private:
+    friend class UtpSocket;
+
+    typedef std::pair<HostAddress, uint16_t> ConnectionKey;
+    typedef std::map<ConnectionKey, UtpSocket *> ConnectionMap;
+
+    struct Datagram
+    {
+        HostAddress address;
+        std::string data;
+    };
+
+    void dispatch(const HostAddress &, const char *, size_t, uint32_t, unsigned long long);
+    void refuse(const HostAddress &, const UtpHeader &);
+
+    void queue(const HostAddress &, const UtpHeader &, const char *, size_t);
+    void scheduleAcknowledgement(UtpSocket *);
+    void flush();
+    void detach(UtpSocket *);
+
+    // Monotonic time in microseconds for timeouts and round trip
+    // times and the wall clock time in microseconds uTP timestamps
+    // packets with
+    static unsigned long long now();
+    static uint32_t timestamp();
+
+private:
+    ConnectionMap connections_;
+
+    // Connections owing the peer an acknowledgement for the datagrams
+    // received in the current batch
+    std::vector<UtpSocket *> acknowledging_;
+
+    std::vector<Datagram> outbox_;
+    std::vector<char> receiveArea_;
+};
+
+} /* namespace Net */
+} /* namespace Hypergrace */
+
+#endif /* NET_UTPMULTIPLEXER_HH_ */
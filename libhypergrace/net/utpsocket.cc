@@ -0,0 +1,670 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <debug/debug.hh>
+
+#include <net/utpmultiplexer.hh>
+
+#include "utpsocket.hh"
+
+using namespace Hypergrace;
+using namespace Net;
+
+
+UtpSocket::UtpSocket(UtpMultiplexer *multiplexer, const HostAddress &address,
+                     uint16_t receiveId, uint16_t sendId) :
+    Socket(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), address),
+    multiplexer_(multiplexer),
+    state_(SynSent),
+    receiveId_(receiveId),
+    sendId_(sendId),
+    sequenceNumber_(1),
+    ackNumber_(0),
+    inFlight_(0),
+    inboxOffset_(0),
+    reorderSize_(0),
+    finReceived_(false),
+    finPending_(false),
+    finSequence_(0),
+    ackPending_(false),
+    signalled_(false),
+    window_(MinimumWindow),
+    peerWindow_(ReceiveWindow),
+    slowStartThreshold_(MaximumWindow),
+    windowLimited_(false),
+    lossRecovery_(false),
+    recoverySequence_(0),
+    replyDelay_(0),
+    baseDelayStart_(0),
+    queuingDelay_(0),
+    roundTripTime_(0),
+    roundTripVariance_(0),
+    timeout_(InitialTimeout),
+    timeouts_(0)
+{
+    baseDelays_[0] = baseDelays_[1] = UINT32_MAX;
+}
+
+UtpSocket::~UtpSocket()
+{
+    if (multiplexer_ != 0) {
+        // Let the peer know we are gone. The FIN isn't retransmitted,
+        // if it gets lost the peer times out eventually.
+        if (state_ == Connected) {
+            sendControl(UtpHeader::Fin, sequenceNumber_++);
+            multiplexer_->flush();
+        }
+
+        multiplexer_->detach(this);
+    }
+}
+
+ssize_t UtpSocket::send(const char *data, size_t size)
+{
+    struct iovec buffer;
+
+    buffer.iov_base = const_cast<char *>(data);
+    buffer.iov_len = size;
+
+    return send(&buffer, 1);
+}
+
+ssize_t UtpSocket::send(const struct iovec *buffers, int count)
+{
+    if (state_ == Closed)
+        return -1;
+    else if (state_ == SynSent)
+        return 0;
+
+    size_t total = 0;
+
+    for (int i = 0; i < count; ++i)
+        total += buffers[i].iov_len;
+
+    // Keep a single packet going while the peer advertises a closed
+    // window, otherwise we would never learn that it has opened.
+    size_t window = std::min<size_t>(window_, peerWindow_);
+
+    if (inFlight_ == 0)
+        window = std::max<size_t>(window, MaximumPayload);
+
+    unsigned long long now = UtpMultiplexer::now();
+    size_t sent = 0;
+    int buffer = 0;
+    size_t offset = 0;
+
+    windowLimited_ = false;
+
+    // Lost packets go first.
+    resendLost(now);
+
+    while (sent < total) {
+        size_t room = (window > inFlight_) ? window - inFlight_ : 0;
+        size_t wanted = std::min<size_t>(total - sent, MaximumPayload);
+
+        // Don't split the data into runts only because the window is
+        // about to fill up.
+        if (room < wanted) {
+            windowLimited_ = true;
+            break;
+        }
+
+        OutgoingPacket packet;
+
+        packet.sequence = sequenceNumber_++;
+        packet.type = UtpHeader::Data;
+        packet.payload.reserve(wanted);
+        packet.sentAt = 0;
+        packet.transmissions = 0;
+        packet.acked = false;
+        packet.lost = false;
+
+        while (packet.payload.size() < wanted) {
+            size_t chunk = std::min(buffers[buffer].iov_len - offset, wanted - packet.payload.size());
+
+            packet.payload.append(static_cast<const char *>(buffers[buffer].iov_base) + offset, chunk);
+            offset += chunk;
+
+            if (offset == buffers[buffer].iov_len) {
+                ++buffer;
+                offset = 0;
+            }
+        }
+
+        outgoing_.push_back(packet);
+        inFlight_ += wanted;
+        sent += wanted;
+
+        transmit(outgoing_.back(), now);
+    }
+
+    multiplexer_->flush();
+
+    return sent;
+}
+
+ssize_t UtpSocket::receive(char *data, size_t size)
+{
+    size_t available = inbox_.size() - inboxOffset_;
+
+    if (available == 0) {
+        // Report the end of the stream once everything received
+        // before it has been taken.
+        if (finReceived_ || state_ == Closed)
+            return -1;
+
+        return 0;
+    }
+
+    size_t taken = std::min(available, size);
+
+    memcpy(data, inbox_.data() + inboxOffset_, taken);
+    inboxOffset_ += taken;
+
+    if (inboxOffset_ == inbox_.size()) {
+        inbox_.clear();
+        inboxOffset_ = 0;
+    } else if (inboxOffset_ > inbox_.size() / 2) {
+        inbox_.erase(0, inboxOffset_);
+        inboxOffset_ = 0;
+    }
+
+    updateSignal();
+
+    return taken;
+}
+
+bool UtpSocket::connected() const
+{
+    return state_ == Connected;
+}
+
+size_t UtpSocket::congestionWindow() const
+{
+    return window_;
+}
+
+size_t UtpSocket::bytesInFlight() const
+{
+    return inFlight_;
+}
+
+unsigned int UtpSocket::roundTripTime() const
+{
+    return roundTripTime_;
+}
+
+unsigned int UtpSocket::queuingDelay() const
+{
+    return queuingDelay_;
+}
+
+void UtpSocket::connect(unsigned long long now)
+{
+    OutgoingPacket syn;
+
+    syn.sequence = sequenceNumber_++;
+    syn.type = UtpHeader::Syn;
+    syn.sentAt = 0;
+    syn.transmissions = 0;
+    syn.acked = false;
+    syn.lost = false;
+
+    outgoing_.push_back(syn);
+
+    transmit(outgoing_.back(), now);
+}
+
+void UtpSocket::accept(const UtpHeader &syn, uint32_t receivedAt)
+{
+    // A retransmitted SYN means that our state packet got lost.
+    if (state_ == SynSent) {
+        state_ = Connected;
+        sequenceNumber_ = rand();
+        ackNumber_ = syn.sequenceNumber;
+    }
+
+    replyDelay_ = receivedAt - syn.timestamp;
+    peerWindow_ = syn.windowSize;
+
+    sendState();
+}
+
+void UtpSocket::process(const UtpHeader &header, const char *payload, size_t size,
+                        uint32_t receivedAt, unsigned long long now)
+{
+    if (state_ == Closed)
+        return;
+
+    if (header.type == UtpHeader::Reset) {
+        hDebug() << "uTP connection to" << remoteAddress() << "has been reset";
+
+        state_ = Closed;
+        updateSignal();
+
+        return;
+    }
+
+    if (state_ == SynSent) {
+        if (header.type != UtpHeader::State)
+            return;
+
+        // State packets carry the sequence number of the next packet
+        // the peer is going to send.
+        state_ = Connected;
+        ackNumber_ = header.sequenceNumber - 1;
+    }
+
+    replyDelay_ = receivedAt - header.timestamp;
+    peerWindow_ = header.windowSize;
+
+    acknowledge(header, now);
+
+    switch (header.type) {
+    case UtpHeader::Data:
+        receiveData(header.sequenceNumber, payload, size);
+        break;
+    case UtpHeader::Fin:
+        finPending_ = true;
+        finSequence_ = header.sequenceNumber;
+        multiplexer_->scheduleAcknowledgement(this);
+        break;
+    default:
+        break;
+    }
+
+    if (finPending_ && finSequence_ == uint16_t(ackNumber_ + 1)) {
+        finPending_ = false;
+        finReceived_ = true;
+        ackNumber_ = finSequence_;
+    }
+
+    updateSignal();
+}
+
+void UtpSocket::acknowledge(const UtpHeader &header, unsigned long long now)
+{
+    size_t acked = 0;
+    bool progress = false;
+
+    while (!outgoing_.empty() &&
+           int16_t(header.acknowledgementNumber - outgoing_.front().sequence) >= 0) {
+        acked += acknowledgePacket(outgoing_.front(), now);
+        progress = true;
+
+        outgoing_.pop_front();
+    }
+
+    if (header.selectiveAckSize > 0)
+        acked += acknowledgeSelectively(header, now);
+
+    if (progress) {
+        timeouts_ = 0;
+
+        // Forget the backoff of earlier timeouts.
+        if (roundTripTime_ > 0)
+            timeout_ = std::max<unsigned long long>(roundTripTime_ + 4 * roundTripVariance_, MinimumTimeout);
+
+        if (lossRecovery_ && int16_t(header.acknowledgementNumber - recoverySequence_) >= 0)
+            lossRecovery_ = false;
+    }
+
+    if (acked > 0) {
+        adjustWindow(acked, header.timestampDifference, now);
+        resendLost(now);
+    }
+}
+
+size_t UtpSocket::acknowledgeSelectively(const UtpHeader &header, unsigned long long now)
+{
+    // The first bit of the mask stands for the packet following the
+    // one after the acknowledged one, which is known to be missing.
+    uint16_t first = header.acknowledgementNumber + 2;
+    int bits = header.selectiveAckSize * 8;
+
+    size_t acked = 0;
+    unsigned int received = 0;
+    std::vector<OutgoingPacket *> lost;
+
+    // Walk from the newest packet to the oldest one counting packets
+    // that have made it, a packet followed by several of them has
+    // most probably been lost.
+    for (auto it = outgoing_.rbegin(); it != outgoing_.rend(); ++it) {
+        int distance = int16_t(it->sequence - first);
+
+        if (distance >= 0 && distance < bits &&
+                (header.selectiveAck[distance / 8] & (1 << (distance % 8)))) {
+            acked += acknowledgePacket(*it, now);
+            ++received;
+        } else if (!it->acked && received >= LossThreshold &&
+                   (it->transmissions == 1 || now - it->sentAt >= roundTripTime_)) {
+            lost.push_back(&*it);
+        }
+    }
+
+    if (!lost.empty()) {
+            enterLossRecovery();
+
+        for (auto it = lost.rbegin(); it != lost.rend(); ++it)
+            transmit(**it, now);
+    }
+
+    return acked;
+}
+
+size_t UtpSocket::acknowledgePacket(OutgoingPacket &packet, unsigned long long now)
+{
+    if (packet.acked)
+        return 0;
+
+    // Round trip times of retransmitted packets are ambiguous.
+    if (packet.transmissions == 1)
+        updateRoundTripTime(now - packet.sentAt);
+
+    if (!packet.lost)
+        inFlight_ -= packet.payload.size();
+
+    packet.acked = true;
+    packet.lost = false;
+
+    return packet.payload.size();
+}
+
+void UtpSocket::enterLossRecovery()
+{
+    if (lossRecovery_)
+        return;
+
+    window_ = std::max<size_t>(window_ / 2, MinimumWindow);
+    slowStartThreshold_ = window_;
+
+    lossRecovery_ = true;
+    recoverySequence_ = sequenceNumber_ - 1;
+}
+
+void UtpSocket::adjustWindow(size_t acked, uint32_t delay, unsigned long long now)
+{
+    // The peer hasn't received anything from us yet when it sent the
+    // packet.
+    if (delay == 0)
+        return;
+
+    // Clocks of the peers aren't synchronized so the delay measured
+    // by the peer is only meaningful relative to the lowest one seen
+    // recently, which is assumed to be the delay of an empty path.
+    if (now - baseDelayStart_ >= BaseDelayInterval) {
+        baseDelays_[1] = baseDelays_[0];
+        baseDelays_[0] = delay;
+        baseDelayStart_ = now;
+    } else if (int32_t(delay - baseDelays_[0]) < 0 || baseDelays_[0] == UINT32_MAX) {
+        baseDelays_[0] = delay;
+    }
+
+    uint32_t baseDelay = baseDelays_[0];
+
+    if (baseDelays_[1] != UINT32_MAX && int32_t(baseDelays_[1] - baseDelay) < 0)
+        baseDelay = baseDelays_[1];
+
+    queuingDelay_ = std::max<int32_t>(int32_t(delay - baseDelay), 0);
+
+    // Only grow the window while it is actually what limits us.
+    if (!windowLimited_)
+        return;
+
+    // Double the window every round trip until the delay starts to
+    // build up or a loss occurs.
+    if (window_ < slowStartThreshold_ && queuingDelay_ < TargetDelay / 2) {
+        window_ += acked;
+    } else {
+        slowStartThreshold_ = std::min(slowStartThreshold_, window_);
+
+        double offTarget = double(int(TargetDelay) - int(queuingDelay_)) / TargetDelay;
+        double gain = MaximumWindowIncrease * std::max(offTarget, -1.0) * acked / window_;
+
+        window_ = std::max<double>(window_ + gain, MinimumWindow);
+    }
+
+    window_ = std::min<size_t>(window_, MaximumWindow);
+}
+
+void UtpSocket::updateRoundTripTime(unsigned long long sample)
+{
+    if (roundTripTime_ == 0) {
+        roundTripTime_ = sample;
+        roundTripVariance_ = sample / 2;
+    } else {
+        int delta = int(roundTripTime_) - int(sample);
+
+        roundTripVariance_ += (std::abs(delta) - int(roundTripVariance_)) / 4;
+        roundTripTime_ += (int(sample) - int(roundTripTime_)) / 8;
+    }
+
+    timeout_ = std::max<unsigned long long>(roundTripTime_ + 4 * roundTripVariance_, MinimumTimeout);
+}
+
+void UtpSocket::receiveData(uint16_t sequence, const char *payload, size_t size)
+{
+    int16_t distance = sequence - uint16_t(ackNumber_ + 1);
+
+    if (distance == 0) {
+        inbox_.append(payload, size);
+        ++ackNumber_;
+
+        // Move on with the packets that have arrived ahead of this one.
+        auto next = reorder_.find(ackNumber_ + 1);
+
+        while (next != reorder_.end()) {
+            inbox_.append(next->second);
+            reorderSize_ -= next->second.size();
+            ++ackNumber_;
+
+            reorder_.erase(next);
+            next = reorder_.find(ackNumber_ + 1);
+        }
+
+        multiplexer_->scheduleAcknowledgement(this);
+    } else if (distance > 0) {
+        if (distance < ReorderLimit && buffered() + size <= ReceiveWindow &&
+                reorder_.find(sequence) == reorder_.end()) {
+            reorder_[sequence] = std::string(payload, size);
+            reorderSize_ += size;
+        }
+
+        // The acknowledgement tells the peer about the gap.
+        multiplexer_->scheduleAcknowledgement(this);
+    } else {
+        multiplexer_->scheduleAcknowledgement(this);
+    }
+}
+
+void UtpSocket::checkTimeouts(unsigned long long now)
+{
+    if (state_ == Closed || outgoing_.empty())
+        return;
+
+    OutgoingPacket &oldest = outgoing_.front();
+
+    if (now - oldest.sentAt < timeout_)
+        return;
+
+    if (++timeouts_ > MaximumTimeouts) {
+        hDebug() << "uTP connection to" << remoteAddress() << "timed out";
+
+        state_ = Closed;
+        updateSignal();
+
+        return;
+    }
+
+    // Assume the worst, everything in flight is lost. Start over
+    // with the smallest window and resend as it opens up again.
+    slowStartThreshold_ = std::max<size_t>(window_ / 2, MinimumWindow);
+    window_ = MinimumWindow;
+    lossRecovery_ = true;
+    recoverySequence_ = sequenceNumber_ - 1;
+    timeout_ = std::min<unsigned long long>(timeout_ * 2, MaximumTimeout);
+
+    for (auto it = outgoing_.begin(); it != outgoing_.end(); ++it) {
+        if (!it->acked && !it->lost) {
+            it->lost = true;
+            inFlight_ -= it->payload.size();
+        }
+    }
+
+    resendLost(now);
+}
+
+void UtpSocket::resendLost(unsigned long long now)
+{
+    for (auto it = outgoing_.begin(); it != outgoing_.end(); ++it) {
+        if (!it->lost)
+            continue;
+
+        if (inFlight_ > 0 && inFlight_ + it->payload.size() > window_) {
+            windowLimited_ = true;
+            break;
+        }
+
+        transmit(*it, now);
+    }
+}
+
+void UtpSocket::acknowledgeReceived()
+{
+    if (ackPending_)
+        sendState();
+}
+
+void UtpSocket::detach()
+{
+    multiplexer_ = 0;
+    state_ = Closed;
+
+    updateSignal();
+}
+
+void UtpSocket::transmit(OutgoingPacket &packet, unsigned long long now)
+{
+    UtpHeader header;
+
+    header.type = packet.type;
+    header.connectionId = (packet.type == UtpHeader::Syn) ? receiveId_ : sendId_;
+    header.timestamp = UtpMultiplexer::timestamp();
+    header.timestampDifference = replyDelay_;
+    header.windowSize = advertisedWindow();
+    header.sequenceNumber = packet.sequence;
+    header.acknowledgementNumber = ackNumber_;
+
+    if (packet.lost) {
+        packet.lost = false;
+        inFlight_ += packet.payload.size();
+    }
+
+    packet.sentAt = now;
+    ++packet.transmissions;
+
+    // Every packet acknowledges what we have received so far.
+    ackPending_ = false;
+
+    multiplexer_->queue(remoteAddress(), header, packet.payload.data(), packet.payload.size());
+}
+
+void UtpSocket::sendControl(uint8_t type, uint16_t sequence)
+{
+    UtpHeader header;
+
+    header.type = type;
+    header.connectionId = sendId_;
+    header.timestamp = UtpMultiplexer::timestamp();
+    header.timestampDifference = replyDelay_;
+    header.windowSize = advertisedWindow();
+    header.sequenceNumber = sequence;
+    header.acknowledgementNumber = ackNumber_;
+
+    // Tell the peer which packets have arrived beyond a gap.
+    unsigned char mask[MaximumSelectiveAck];
+
+    if (type == UtpHeader::State && !reorder_.empty()) {
+        size_t size = 0;
+
+        memset(mask, 0, sizeof(mask));
+
+        for (auto it = reorder_.begin(); it != reorder_.end(); ++it) {
+            int distance = int16_t(it->first - uint16_t(ackNumber_ + 2));
+
+            if (distance >= 0 && distance < MaximumSelectiveAck * 8) {
+                mask[distance / 8] |= 1 << (distance % 8);
+                size = std::max<size_t>(size, distance / 8 + 1);
+            }
+        }
+
+        header.selectiveAck = mask;
+        header.selectiveAckSize = (size + 3) & ~3;
+    }
+
+    ackPending_ = false;
+
+    multiplexer_->queue(remoteAddress(), header, 0, 0);
+}
+
+void UtpSocket::sendState()
+{
+    // State packets don't take up a sequence number.
+    sendControl(UtpHeader::State, sequenceNumber_);
+}
+
+size_t UtpSocket::buffered() const
+{
+    return inbox_.size() - inboxOffset_ + reorderSize_;
+}
+
+uint32_t UtpSocket::advertisedWindow() const
+{
+    return ReceiveWindow - std::min<size_t>(buffered(), ReceiveWindow);
+}
+
+void UtpSocket::updateSignal()
+{
+    bool readable = inbox_.size() > inboxOffset_ || finReceived_ || state_ == Closed;
+
+    if (readable == signalled_)
+        return;
+
+    uint64_t value = 1;
+
+    if (readable) {
+        if (::write(fd(), &value, sizeof(value)) != sizeof(value))
+            hWarning() << "Failed to signal uTP connection (" << strerror(errno) << ")";
+    } else {
+        if (::read(fd(), &value, sizeof(value)) != sizeof(value))
+            hWarning() << "Failed to reset uTP connection signal (" << strerror(errno) << ")";
+    }
+
+    signalled_ = readable;
+}
@@ -0,0 +1,232 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NET_UTPSOCKET_HH_
+#define NET_UTPSOCKET_HH_
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <net/socket.hh>
+#include <net/utpheader.hh>
+
+namespace Hypergrace { namespace Net { class UtpMultiplexer; }}
+
+
+namespace Hypergrace {
+namespace Net {
+
+/**
+ * A uTP (BEP 29) connection.
+ *
+ * Connections don't own a socket of their own, datagrams are sent and
+ * received by the UtpMultiplexer the connection belongs to. The file
+ * descriptor of the connection is an eventfd which the multiplexer
+ * makes readable whenever there is received data (or the end of the
+ * stream) waiting, so connections are observed by the reactor and
+ * take middleware and bandwidth allocators just like TCP sockets.
+ *
+ * The amount of data in flight is limited by the LEDBAT congestion
+ * controller: the window grows as long as the one-way delay measured
+ * by the peer stays below the target and shrinks once the queues on
+ * the path start to fill up, which makes uTP yield to other traffic.
+ */
+class UtpSocket : public Socket
+{
+public:
+    enum {
+        // Largest datagram sent, chosen to fit common path MTUs
+        PacketSize = 1400,
+        MaximumPayload = PacketSize - UtpHeader::Size,
+
+        // Queuing delay in microseconds LEDBAT steers towards
+        TargetDelay = 100000,
+
+        // Most the congestion window grows by in a round trip once
+        // out of slow start in bytes
+        MaximumWindowIncrease = 3000,
+
+        // Bounds of the congestion window in bytes
+        MinimumWindow = 2 * PacketSize,
+        MaximumWindow = 0x100000,
+
+        // Receive window advertised to the peer in bytes
+        ReceiveWindow = 0x100000,
+
+        // Retransmission timeout bounds in microseconds
+        InitialTimeout = 1000000,
+        MinimumTimeout = 500000,
+        MaximumTimeout = 30000000,
+
+        // Consecutive timeouts after which the connection is dropped
+        MaximumTimeouts = 6,
+
+        // Packets acknowledged selectively after an unacknowledged
+        // one for it to be considered lost
+        LossThreshold = 3,
+
+        // Largest selective ACK bitmask sent in bytes
+        MaximumSelectiveAck = 0x80,
+
+        // Packets ahead of the next expected one which are buffered
+        ReorderLimit = 0x400,
+
+        // Interval in microseconds over which base delay minima are
+        // kept; the base delay is the lowest of the last two
+        BaseDelayInterval = 60000000
+    };
+
+public:
+    ~UtpSocket();
+
+    using Socket::send;
+
+    ssize_t send(const char *, size_t);
+    ssize_t send(const struct iovec *, int);
+    ssize_t receive(char *, size_t);
+
+    /**
+     * Checks whether the handshake has completed and the connection
+     * hasn't been reset or timed out since.
+     */
+    bool connected() const;
+
+    /**
+     * Returns the congestion window and the amount of data sent but
+     * not acknowledged yet in bytes.
+     */
+    size_t congestionWindow() const;
+    size_t bytesInFlight() const;
+
+    /**
+     * Returns the smoothed round trip time in microseconds.
+     */
+    unsigned int roundTripTime() const;
+
+    /**
+     * Returns the queuing delay in microseconds the last
+     * acknowledgement reported, i.e. the one-way delay above the
+     * lowest one seen recently.
+     */
+    unsigned int queuingDelay() const;
+
+private:
+    friend class UtpMultiplexer;
+
+    enum State {
+        SynSent,
+        Connected,
+        Closed
+    };
+
+    struct OutgoingPacket
+    {
+        uint16_t sequence;
+        uint8_t type;
+        std::string payload;
+        unsigned long long sentAt;
+        unsigned int transmissions;
+        bool acked;
+        bool lost;
+    };
+
+    UtpSocket(UtpMultiplexer *, const HostAddress &, uint16_t, uint16_t);
+
+    void connect(unsigned long long);
+    void accept(const UtpHeader &, uint32_t);
+    void process(const UtpHeader &, const char *, size_t, uint32_t, unsigned long long);
+    void checkTimeouts(unsigned long long);
+    void resendLost(unsigned long long);
+    void acknowledgeReceived();
+    void detach();
+
+    void acknowledge(const UtpHeader &, unsigned long long);
+    size_t acknowledgeSelectively(const UtpHeader &, unsigned long long);
+    size_t acknowledgePacket(OutgoingPacket &, unsigned long long);
+    void enterLossRecovery();
+    void receiveData(uint16_t, const char *, size_t);
+    void adjustWindow(size_t, uint32_t, unsigned long long);
+    void updateRoundTripTime(unsigned long long);
+
+    void transmit(OutgoingPacket &, unsigned long long);
+    void sendControl(uint8_t, uint16_t);
+    void sendState();
+
+    size_t buffered() const;
+    uint32_t advertisedWindow() const;
+    void updateSignal();
+
+private:
+    UtpMultiplexer *multiplexer_;
+    State state_;
+
+    const uint16_t receiveId_;
+    const uint16_t sendId_;
+
+    // Sequence number of the next packet sent and of the last packet
+    // received in order
+    uint16_t sequenceNumber_;
+    uint16_t ackNumber_;
+
+    // Sent packets waiting for acknowledgement
+    std::deque<OutgoingPacket> outgoing_;
+    size_t inFlight_;
+
+    // Received data in order and packets received ahead of a gap
+    std::string inbox_;
+    size_t inboxOffset_;
+    std::map<uint16_t, std::string> reorder_;
+    size_t reorderSize_;
+
+    bool finReceived_;
+    bool finPending_;
+    uint16_t finSequence_;
+
+    bool ackPending_;
+    bool signalled_;
+
+    // Congestion control state
+    size_t window_;
+    uint32_t peerWindow_;
+    size_t slowStartThreshold_;
+    bool windowLimited_;
+
+    // Loss recovery lasts until everything sent before the loss has
+    // been acknowledged, the window is only cut once meanwhile
+    bool lossRecovery_;
+    uint16_t recoverySequence_;
+
+    uint32_t replyDelay_;
+    uint32_t baseDelays_[2];
+    unsigned long long baseDelayStart_;
+    uint32_t queuingDelay_;
+
+    unsigned int roundTripTime_;
+    unsigned int roundTripVariance_;
+    unsigned long long timeout_;
+    unsigned int timeouts_;
+};
+
+} /* namespace Net */
+} /* namespace Hypergrace */
+
+#endif /* NET_UTPSOCKET_HH_ */
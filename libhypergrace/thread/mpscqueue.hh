@@ -0,0 +1,111 @@
+/*
+   Copyright (C) 2009 Anton Mihalyov <anton@glyphsense.com>
+
+   This  library is  free software;  you can  redistribute it  and/or
+   modify  it under  the  terms  of the  GNU  Library General  Public
+   License  (LGPL)  as published  by  the  Free Software  Foundation;
+   either version  2 of the  License, or  (at your option)  any later
+   version.
+
+   This library  is distributed in the  hope that it will  be useful,
+   but WITHOUT  ANY WARRANTY;  without even  the implied  warranty of
+   MERCHANTABILITY or FITNESS  FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy  of the GNU Library General Public
+   License along with this library; see the file COPYING.LIB. If not,
+   write to the  Free Software Foundation, Inc.,  51 Franklin Street,
+   Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef THREAD_MPSCQUEUE_HH_
+#define THREAD_MPSCQUEUE_HH_
+
+#include <atomic>
+#include <utility>
+
+
+namespace Hypergrace {
+namespace Thread {
+
+/**
+ * Unbounded multiple-producer single-consumer queue.
+ *
+ * Any thread may push() concurrently; only one thread at a time is
+ * allowed to pop(). Producers never block each other: pushing is a
+ * single atomic exchange plus a store. The consumer owns a stub node
+ * which is recycled as the values are popped.
+ */
+template<typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() :
+        head_(new Node()),
+        tail_(head_.load())
+    {
+    }
+
+    ~MpscQueue()
+    {
+        T discarded;
+
+        while (pop(discarded)) {
+        }
+
+        delete tail_;
+    }
+
+    void push(const T &value)
+    {
+        Node *node = new Node(value);
+        Node *previous = head_.exchange(node, std::memory_order_acq_rel);
+
+        // Consumer may observe a short break in the chain between
+        // the exchange and this store. It treats the queue as empty
+        // in that case and picks the node up on the next pop().
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T &value)
+    {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+
+        if (next == 0)
+            return false;
+
+        value = std::move(next->value);
+        tail_ = next;
+
+        delete tail;
+
+        return true;
+    }
+
+    bool empty() const
+    {
+        return tail_->next.load(std::memory_order_acquire) == 0;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    void operator =(const MpscQueue &) = delete;
+
+private:
+    struct Node
+    {
+        Node() : next(0) {}
+        explicit Node(const T &v) : next(0), value(v) {}
+
+        std::atomic<Node *> next;
+        T value;
+    };
+
+    std::atomic<Node *> head_;
+    Node *tail_;
+};
+
+} /* namespace Thread */
+} /* namespace Hypergrace */
+
+#endif /* THREAD_MPSCQUEUE_HH_ */
@@ -18,16 +18,59 @@
    Fifth Floor, Boston, MA 02110-1301, USA.
 */
 
+#include <endian.h>
 #include <limits.h>
 #include <string.h>
 
 #include <cassert>
+#include <cstdint>
 
 #include "bitfield.hh"
 
 using namespace Hypergrace::Util;
 
 
+namespace {
+
+const size_t WordSize = sizeof(uint64_t);
+
+// Loads up to eight bytes so that the first bit of the first byte
+// becomes the most significant bit of the word.
+inline uint64_t loadWord(const unsigned char *bytes, size_t size)
+{
+    uint64_t word = 0;
+
+    if (size >= WordSize) {
+        memcpy(&word, bytes, WordSize);
+        return be64toh(word);
+    }
+
+    for (size_t i = 0; i < size; ++i)
+        word |= (uint64_t) bytes[i] << (CHAR_BIT * (WordSize - 1 - i));
+
+    return word;
+}
+
+struct Common
+{
+    uint64_t operator ()(uint64_t a, uint64_t b) const { return a & b; }
+};
+
+struct Exclusive
+{
+    uint64_t operator ()(uint64_t a, uint64_t b) const { return a & ~b; }
+};
+
+struct First
+{
+    uint64_t operator ()(uint64_t a, uint64_t) const { return a; }
+};
+
+} /* namespace */
+
+const size_t Bitfield::NotFound;
+
+
 Bitfield::Bitfield(size_t bitCount) :
     bytes_(new unsigned char[bitCount / CHAR_BIT + (bitCount % CHAR_BIT != 0)]),
     bitCount_(bitCount),
@@ -47,6 +90,7 @@ Bitfield::Bitfield(const std::string &bytes, size_t bitCount) :
     bytes_ = new unsigned char[byteCount];
     memcpy(bytes_, bytes.data(), byteCount);
 
+    clearSpareBits();
     updateEnabledBitsCounter();
 }
 
@@ -82,6 +126,8 @@ void Bitfield::unset(size_t bitIndex)
 void Bitfield::setAll()
 {
     memset(bytes_, 0xFF, byteCount());
+    clearSpareBits();
+
     setCount_ = bitCount_;
 }
 
@@ -105,6 +151,8 @@ bool Bitfield::assign(const unsigned char *bytes, size_t size)
         delete[] bytes_;
 
         bytes_ = newBytes;
+
+        clearSpareBits();
         updateEnabledBitsCounter();
 
         return true;
@@ -133,6 +181,31 @@ size_t Bitfield::disabledCount() const
     return bitCount_ - setCount_;
 }
 
+size_t Bitfield::commonCount(const Bitfield &other) const
+{
+    return count(other, Common());
+}
+
+size_t Bitfield::exclusiveCount(const Bitfield &other) const
+{
+    return count(other, Exclusive());
+}
+
+size_t Bitfield::nextEnabled(size_t bitIndex) const
+{
+    return next(*this, bitIndex, First());
+}
+
+size_t Bitfield::nextCommon(const Bitfield &other, size_t bitIndex) const
+{
+    return next(other, bitIndex, Common());
+}
+
+size_t Bitfield::nextExclusive(const Bitfield &other, size_t bitIndex) const
+{
+    return next(other, bitIndex, Exclusive());
+}
+
 bool Bitfield::bit(size_t bitIndex) const
 {
     assert(bitIndex < bitCount_);
@@ -150,10 +223,59 @@ const unsigned char *Bitfield::cstr() const
     return bytes_;
 }
 
+void Bitfield::clearSpareBits()
+{
+    // Spare bits of the last byte must stay zero as word operations
+    // count and search them along with the rest.
+    if (bitCount_ % CHAR_BIT != 0)
+        bytes_[byteCount() - 1] &= 0xFF << (CHAR_BIT - bitCount_ % CHAR_BIT);
+}
+
 void Bitfield::updateEnabledBitsCounter()
 {
-    setCount_ = 0;
+    setCount_ = count(*this, First());
+}
+
+template<typename Combine>
+size_t Bitfield::count(const Bitfield &other, Combine combine) const
+{
+    assert(other.bitCount_ == bitCount_);
+
+    const size_t size = byteCount();
+    size_t result = 0;
+
+    for (size_t offset = 0; offset < size; offset += WordSize) {
+        result += __builtin_popcountll(combine(
+                loadWord(bytes_ + offset, size - offset),
+                loadWord(other.bytes_ + offset, size - offset)));
+    }
+
+    return result;
+}
+
+template<typename Combine>
+size_t Bitfield::next(const Bitfield &other, size_t bitIndex, Combine combine) const
+{
+    assert(other.bitCount_ == bitCount_);
+
+    if (bitIndex >= bitCount_)
+        return NotFound;
+
+    const size_t size = byteCount();
+    size_t offset = bitIndex / CHAR_BIT;
+
+    // Words start at the byte holding the first bit, so only the bits
+    // before it have to be masked out of the first one.
+    uint64_t mask = ~0ULL >> (bitIndex % CHAR_BIT);
+
+    for (; offset < size; offset += WordSize, mask = ~0ULL) {
+        uint64_t word = combine(
+                loadWord(bytes_ + offset, size - offset),
+                loadWord(other.bytes_ + offset, size - offset)) & mask;
+
+        if (word != 0)
+            return offset * CHAR_BIT + __builtin_clzll(word);
+    }
 
-    for (size_t i = 0; i < bitCount_; ++i)
-        setCount_ += bit(i);
+    return NotFound;
 }
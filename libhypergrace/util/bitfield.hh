@@ -29,6 +29,9 @@ namespace Util {
 
 class Bitfield
 {
+public:
+    static const size_t NotFound = (size_t)-1;
+
 public:
     Bitfield(size_t);
     Bitfield(const std::string &, size_t);
@@ -49,14 +52,39 @@ public:
     size_t enabledCount() const;
     size_t disabledCount() const;
 
+    /**
+     * Count bits enabled both here and in the other bitfield, and bits
+     * enabled here but not there. Both bitfields must be of the same
+     * size.
+     */
+    size_t commonCount(const Bitfield &) const;
+    size_t exclusiveCount(const Bitfield &) const;
+
+    /**
+     * Find the first bit at or after the given index which is enabled
+     * here (and, respectively, is or isn't enabled in the other
+     * bitfield). Return NotFound if there is none. Set bits are walked
+     * with: for (i = nextEnabled(0); i != NotFound; i = nextEnabled(i + 1))
+     */
+    size_t nextEnabled(size_t) const;
+    size_t nextCommon(const Bitfield &, size_t) const;
+    size_t nextExclusive(const Bitfield &, size_t) const;
+
     bool bit(size_t) const;
     unsigned char byte(size_t) const;
 
     const unsigned char *cstr() const;
 
 private:
+    void clearSpareBits();
     void updateEnabledBitsCounter();
 
+    template<typename Combine>
+    size_t count(const Bitfield &, Combine) const;
+
+    template<typename Combine>
+    size_t next(const Bitfield &, size_t, Combine) const;
+
 private:
     unsigned char *bytes_;
     size_t bitCount_;
@@ -106,6 +106,11 @@ size_t Time::toMilliseconds() const
     return size_t(time_.sec) * 1000 + time_.nsec / 1000000;
 }
 
+size_t Time::toMicroseconds() const
+{
+    return size_t(time_.sec) * 1000000 + time_.nsec / 1000;
+}
+
 size_t Time::toSeconds() const
 {
     return time_.sec;
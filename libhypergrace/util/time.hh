@@ -47,6 +47,7 @@ public:
     size_t toHours() const;
     size_t toMinutes() const;
     size_t toMilliseconds() const;
+    size_t toMicroseconds() const;
     size_t toSeconds() const;
 
     bool equal(const Time &) const;
@@ -0,0 +1,65 @@
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <net/bandwidthallocator.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+
+namespace {
+
+const int iterations = 2000000;
+const int threadCount = 4;
+
+// Allocates and releases a packet worth of bandwidth in a loop, the
+// way a reactor thread does when the socket buffer turns out full.
+void churn(Net::BandwidthAllocator *allocator)
+{
+    for (int i = 0; i < iterations; ++i)
+        allocator->release(allocator->allocate(1500));
+}
+
+template<typename Setup>
+void measure(const char *name, Setup setup)
+{
+    Net::BandwidthAllocator global;
+    global.limit(1 << 30);
+
+    std::vector<std::unique_ptr<Net::BandwidthAllocator> > allocators;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < threadCount; ++i)
+        allocators.push_back(std::unique_ptr<Net::BandwidthAllocator>(setup(global)));
+
+    Util::Time start = Util::Time::monotonicTime();
+
+    for (int i = 0; i < threadCount; ++i)
+        threads.push_back(std::thread(&churn, allocators[i] ? allocators[i].get() : &global));
+
+    for (auto thread = threads.begin(); thread != threads.end(); ++thread)
+        thread->join();
+
+    size_t elapsed = (Util::Time::monotonicTime() - start).toMicroseconds();
+
+    std::printf("%-34s %8.1f ns/allocation\n", name,
+                elapsed * 1000.0 / (iterations * threadCount));
+}
+
+} /* namespace */
+
+int main()
+{
+    std::printf("%d threads sharing a limited global allocator\n", threadCount);
+
+    measure("global allocator only", [](Net::BandwidthAllocator &) {
+        return static_cast<Net::BandwidthAllocator *>(0);
+    });
+
+    measure("per-reactor child with cache", [](Net::BandwidthAllocator &global) {
+        return new Net::BandwidthAllocator(&global);
+    });
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <gtest/gtest.h>
+
+#include <net/bandwidthallocator.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+
+namespace {
+
+// Refills are driven by explicit points of time from here on, the
+// allocators ignore the real clock until it catches up with them.
+unsigned long long later(int milliseconds)
+{
+    return Util::Time::monotonicTime().toMicroseconds() + milliseconds * 1000ULL;
+}
+
+} /* namespace */
+
+
+TEST(BandwidthAllocatorTest, RefillsContinuouslyUpToBurst)
+{
+    Net::BandwidthAllocator allocator;
+
+    allocator.setBurst(1000);
+    allocator.limit(10000);
+
+    ASSERT_EQ(1000, allocator.available());
+    ASSERT_EQ(1000, allocator.allocate(5000));
+
+    unsigned long long now = later(0);
+
+    // 10 ms worth of the rate.
+    allocator.refill(now + 10000);
+    ASSERT_NEAR(100, allocator.available(), 10);
+
+    // Refills never overflow the bucket.
+    allocator.refill(now + 1000000);
+    ASSERT_EQ(1000, allocator.available());
+    ASSERT_EQ(1000, allocator.allocate(5000));
+}
+
+TEST(BandwidthAllocatorTest, KeepsFractionsOfTokensAtLowRates)
+{
+    Net::BandwidthAllocator allocator;
+
+    allocator.limit(100);
+    ASSERT_EQ(int(Net::BandwidthAllocator::MinimumBurst), allocator.allocate(0x10000));
+
+    unsigned long long now = later(0);
+
+    // A token accrues every 10 ms, 15 ms leave half of one behind.
+    allocator.refill(now + 15000);
+    ASSERT_EQ(1, allocator.allocate(100));
+
+    allocator.refill(now + 20000);
+    ASSERT_EQ(1, allocator.allocate(100));
+}
+
+TEST(BandwidthAllocatorTest, SplitsParentRefillsByWeight)
+{
+    Net::BandwidthAllocator parent;
+    Net::BandwidthAllocator light(&parent);
+    Net::BandwidthAllocator heavy(&parent);
+
+    parent.setBurst(3000);
+    parent.limit(6000);
+    heavy.setWeight(2);
+
+    // Children take part in the split once they ask for bandwidth.
+    ASSERT_EQ(1500, light.allocate(1500));
+    ASSERT_EQ(1500, heavy.allocate(1500));
+
+    parent.refill(later(500));
+
+    ASSERT_EQ(1000, light.available());
+    ASSERT_EQ(2000, heavy.available());
+
+    ASSERT_EQ(1000, light.allocate(5000));
+    ASSERT_EQ(0, light.allocate(5000));
+    ASSERT_EQ(2000, heavy.allocate(5000));
+    ASSERT_EQ(0, parent.available());
+}
+
+TEST(BandwidthAllocatorTest, LendsIdleBandwidthToBusyChildren)
+{
+    Net::BandwidthAllocator parent;
+    Net::BandwidthAllocator busy(&parent);
+    Net::BandwidthAllocator idle(&parent);
+
+    parent.setBurst(3000);
+    parent.limit(6000);
+
+    ASSERT_EQ(3000, busy.allocate(5000));
+    ASSERT_EQ(0, idle.available());
+
+    // Only the busy child has asked for bandwidth, so it gets all of it.
+    parent.refill(later(500));
+
+    ASSERT_EQ(3000, busy.available());
+    ASSERT_EQ(3000, busy.allocate(5000));
+
+    // Unused bandwidth goes back where it came from.
+    busy.release(500);
+
+    ASSERT_EQ(500, busy.available());
+    ASSERT_EQ(0, idle.available());
+}
+
+TEST(BandwidthAllocatorTest, AppliesChildLimitsBelowParentLimit)
+{
+    Net::BandwidthAllocator parent;
+    Net::BandwidthAllocator child(&parent);
+
+    parent.setBurst(3000);
+    parent.limit(3000);
+    child.setBurst(500);
+    child.limit(500);
+
+    ASSERT_EQ(500, child.available());
+    ASSERT_EQ(500, child.allocate(1000));
+    ASSERT_EQ(2500, parent.available());
+
+    // An unlimited parent leaves the child limit alone.
+    parent.limit(-1);
+    child.limit(500);
+
+    ASSERT_EQ(500, child.allocate(1000));
+}
+
+TEST(BandwidthAllocatorTest, FetchesParentTokensInBatches)
+{
+    Net::BandwidthAllocator parent;
+    Net::BandwidthAllocator child(&parent);
+
+    parent.setBurst(8000);
+    parent.limit(8000);
+
+    // A batch is an eighth of the parent burst.
+    ASSERT_EQ(100, child.allocate(100));
+    ASSERT_EQ(7000, parent.available());
+
+    // Served from the cache without touching the parent.
+    ASSERT_EQ(900, child.allocate(900));
+    ASSERT_EQ(7000, parent.available());
+
+    ASSERT_EQ(1500, child.allocate(1500));
+    ASSERT_EQ(5500, parent.available());
+
+    // The cache keeps a batch, the rest goes back to the parent.
+    child.release(1500);
+    ASSERT_EQ(7000, child.available());
+    ASSERT_EQ(5500, parent.available());
+
+    // Idle children hand their cache back on the next refill.
+    parent.refill(later(1500));
+    ASSERT_EQ(8000, parent.available());
+    ASSERT_EQ(8000, child.available());
+}
@@ -0,0 +1,123 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <util/bitfield.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+
+namespace {
+
+const size_t bitCount = 1 << 20;
+const int iterations = 100;
+
+template<typename Operation>
+void measure(const char *name, Operation operation)
+{
+    size_t checksum = 0;
+
+    Util::Time start = Util::Time::monotonicTime();
+
+    for (int i = 0; i < iterations; ++i)
+        checksum += operation();
+
+    size_t elapsed = (Util::Time::monotonicTime() - start).toMicroseconds();
+
+    std::printf("%-28s %8.1f us/pass (checksum %zu)\n", name,
+                (double) elapsed / iterations, checksum);
+}
+
+} /* namespace */
+
+int main()
+{
+    Util::Bitfield ours(bitCount);
+    Util::Bitfield theirs(bitCount);
+
+    srand(1);
+
+    // Half of the pieces on either side, roughly a quarter in common.
+    for (size_t i = 0; i < bitCount; ++i) {
+        if (rand() % 2)
+            ours.set(i);
+
+        if (rand() % 2)
+            theirs.set(i);
+    }
+
+    measure("common count (bit loop)", [&]() {
+        size_t count = 0;
+
+        for (size_t i = 0; i < bitCount; ++i)
+            count += ours.bit(i) && theirs.bit(i);
+
+        return count;
+    });
+
+    measure("common count (words)", [&]() {
+        return ours.commonCount(theirs);
+    });
+
+    measure("exclusive count (words)", [&]() {
+        return ours.exclusiveCount(theirs);
+    });
+
+    measure("enabled count (assign)", [&]() {
+        ours.assign(ours.cstr(), ours.byteCount());
+        return ours.enabledCount();
+    });
+
+    measure("common walk (bit loop)", [&]() {
+        size_t sum = 0;
+
+        for (size_t i = 0; i < bitCount; ++i) {
+            if (ours.bit(i) && theirs.bit(i))
+                sum += i;
+        }
+
+        return sum;
+    });
+
+    measure("common walk (words)", [&]() {
+        size_t sum = 0;
+
+        for (size_t i = ours.nextCommon(theirs, 0); i != Util::Bitfield::NotFound;
+             i = ours.nextCommon(theirs, i + 1))
+        {
+            sum += i;
+        }
+
+        return sum;
+    });
+
+    // A sparse field, as a fresh peer's would be.
+    Util::Bitfield sparse(bitCount);
+
+    for (size_t i = 0; i < bitCount; i += 4099)
+        sparse.set(i);
+
+    measure("sparse walk (bit loop)", [&]() {
+        size_t sum = 0;
+
+        for (size_t i = 0; i < bitCount; ++i) {
+            if (sparse.bit(i))
+                sum += i;
+        }
+
+        return sum;
+    });
+
+    measure("sparse walk (words)", [&]() {
+        size_t sum = 0;
+
+        for (size_t i = sparse.nextEnabled(0); i != Util::Bitfield::NotFound;
+             i = sparse.nextEnabled(i + 1))
+        {
+            sum += i;
+        }
+
+        return sum;
+    });
+
+    return 0;
+}
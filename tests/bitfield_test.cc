@@ -31,3 +31,49 @@ TEST(BitfieldTest, TestBoundaryCrossing)
     ASSERT_FALSE(bf.bit(8));
     ASSERT_EQ(0U, bf.byte(1));
 }
+
+TEST(BitfieldTest, TestWordOperations)
+{
+    Util::Bitfield first(131);
+    Util::Bitfield second(131);
+
+    for (size_t i = 0; i < 131; i += 3)
+        first.set(i);
+
+    for (size_t i = 0; i < 131; i += 5)
+        second.set(i);
+
+    size_t common = 0;
+    size_t exclusive = 0;
+
+    for (size_t i = 0; i < 131; ++i) {
+        common += first.bit(i) && second.bit(i);
+        exclusive += first.bit(i) && !second.bit(i);
+    }
+
+    ASSERT_EQ(44U, first.enabledCount());
+    ASSERT_EQ(common, first.commonCount(second));
+    ASSERT_EQ(exclusive, first.exclusiveCount(second));
+
+    ASSERT_EQ(0U, first.nextCommon(second, 0));
+    ASSERT_EQ(15U, first.nextCommon(second, 1));
+    ASSERT_EQ(3U, first.nextExclusive(second, 0));
+    ASSERT_EQ(129U, first.nextEnabled(128));
+    ASSERT_EQ(Util::Bitfield::NotFound, first.nextEnabled(130));
+    ASSERT_EQ(Util::Bitfield::NotFound, first.nextCommon(second, 121));
+}
+
+TEST(BitfieldTest, TestSpareBitsAreIgnored)
+{
+    Util::Bitfield bf(10);
+
+    ASSERT_TRUE(bf.assign(std::string("\xFF\xFF", 2)));
+    ASSERT_EQ(10U, bf.enabledCount());
+    ASSERT_EQ(0xC0U, (unsigned int)bf.byte(1));
+    ASSERT_EQ(Util::Bitfield::NotFound, bf.nextEnabled(10));
+
+    bf.unsetAll();
+    bf.setAll();
+    ASSERT_EQ(10U, bf.enabledCount());
+    ASSERT_EQ(9U, bf.nextEnabled(9));
+}
@@ -1,5 +1,17 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <gtest/gtest.h>
 #include <bt/peerwire/message.hh>
+#include <bt/peerwire/messageassembler.hh>
+#include <net/packetpool.hh>
+#include <net/reactor.hh>
+#include <net/tcpsocket.hh>
+#include <util/time.hh>
 
 using namespace Hypergrace;
 using namespace Hypergrace::Bt;
@@ -11,3 +23,182 @@ TEST(BitTorrentMessageTest, TestPieceMessageSize)
 
     ASSERT_EQ(0x04 + 0x01 + 0x04 + 0x04 + 0x4000, pieceMessage.serialize().size());
 }
+
+TEST(BitTorrentMessageTest, FixedLayoutMessagesHaveStaticOffsets)
+{
+    static_assert(RequestMessage::fixedLayout, "Request message must have fixed layout");
+    static_assert(!PieceMessage::fixedLayout, "Piece message carries a variable payload");
+
+    static_assert(RequestMessage::fixedSize == 17, "Unexpected request message size");
+    static_assert(HaveMessage::fixedSize == 9, "Unexpected have message size");
+    static_assert(RequestMessage::offset<3>() == 9, "Unexpected block offset position");
+
+    ASSERT_EQ(5U, ChokeMessage::fixedSize);
+}
+
+TEST(BitTorrentMessageTest, EncodesAndDecodesInPlace)
+{
+    RequestMessage request(0x01020304, 0x4000, 0x4000);
+    char buffer[RequestMessage::fixedSize];
+
+    ASSERT_EQ(sizeof(buffer), request.encode(buffer));
+    ASSERT_EQ(request.serialize(), std::string(buffer, sizeof(buffer)));
+    ASSERT_EQ(std::string("\x00\x00\x00\x0d\x06\x01\x02\x03\x04", 9), std::string(buffer, 9));
+
+    CancelMessage cancel;
+
+    ASSERT_TRUE(cancel.decode(buffer, sizeof(buffer)));
+    ASSERT_EQ(13U, cancel.field<0>());
+    ASSERT_EQ(0x01020304U, cancel.field<2>());
+    ASSERT_EQ(0x4000U, cancel.field<3>());
+    ASSERT_EQ(0x4000U, cancel.field<4>());
+
+    ASSERT_FALSE(CancelMessage().decode(buffer, sizeof(buffer) - 1));
+}
+
+TEST(BitTorrentMessageTest, RecyclesReleasedMessages)
+{
+    size_t idle = Net::PacketPool<RequestMessage>::idle();
+
+    Net::Packet *first = new RequestMessage(1, 0, 0x4000);
+    delete first;
+
+    ASSERT_EQ(idle + 1, Net::PacketPool<RequestMessage>::idle());
+
+    RequestMessage *second = new RequestMessage(2, 0, 0x4000);
+
+    ASSERT_EQ(static_cast<void *>(first), static_cast<void *>(second));
+    ASSERT_EQ(idle, Net::PacketPool<RequestMessage>::idle());
+    ASSERT_EQ(2U, second->field<2>());
+
+    // Pools are per type
+    delete second;
+    HaveMessage *have = new HaveMessage(3);
+
+    ASSERT_EQ(idle + 1, Net::PacketPool<RequestMessage>::idle());
+    ASSERT_EQ(3U, have->field<2>());
+
+    delete have;
+}
+
+namespace {
+
+class HaveRecorder : public Bt::InputMiddleware
+{
+public:
+    void processMessage(Net::Socket &, HaveMessage &message)
+    {
+        std::lock_guard<std::mutex> l(anchor);
+        pieces.push_back(message.field<2>());
+    }
+
+    char *reserveBlock(Net::Socket &, unsigned int piece, unsigned int, unsigned int size)
+    {
+        std::lock_guard<std::mutex> l(anchor);
+
+        // Piece 13 has never been requested.
+        if (piece == 13)
+            return 0;
+
+        slot.assign(size, '\0');
+        return &slot[0];
+    }
+
+    void processBlock(Net::Socket &, unsigned int, unsigned int, unsigned int, bool received)
+    {
+        std::lock_guard<std::mutex> l(anchor);
+
+        if (received)
+            payloads.push_back(slot);
+    }
+
+    size_t haveCount()
+    {
+        std::lock_guard<std::mutex> l(anchor);
+        return pieces.size();
+    }
+
+    std::mutex anchor;
+    std::string slot;
+    std::vector<uint32_t> pieces;
+    std::vector<std::string> payloads;
+};
+
+} /* namespace */
+
+TEST(BitTorrentMessageTest, AssemblesMessagesSplitAcrossReceives)
+{
+    int fds[2];
+
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    Net::TcpSocket socket(fds[0], Net::HostAddress());
+    HaveRecorder *recorder = new HaveRecorder();
+    MessageAssembler assembler((Bt::InputMiddleware::Pointer(recorder)));
+
+    std::string stream = HaveMessage(7).serialize() +
+                         std::string(4, '\0') +
+                         PieceMessage(1, 0, "payload").serialize() +
+                         PieceMessage(13, 0, "unsolicited").serialize() +
+                         HaveMessage(9).serialize();
+
+    // Feed the stream in uneven slices so that messages straddle
+    // receive boundaries.
+    for (size_t offset = 0; offset < stream.size(); offset += 5) {
+        std::string slice = stream.substr(offset, 5);
+        assembler.receive(socket, slice);
+    }
+
+    ASSERT_FALSE(socket.closed());
+    ASSERT_TRUE(socket.receiveBuffer().empty());
+
+    ASSERT_EQ(2U, recorder->pieces.size());
+    ASSERT_EQ(7U, recorder->pieces[0]);
+    ASSERT_EQ(9U, recorder->pieces[1]);
+
+    ASSERT_EQ(1U, recorder->payloads.size());
+    ASSERT_EQ("payload", recorder->payloads[0]);
+
+    ::close(fds[1]);
+}
+
+TEST(BitTorrentMessageTest, ReceivesBlocksStraightIntoReservedSlot)
+{
+    int fds[2];
+
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+    Net::Reactor reactor;
+    Net::Socket *socket = new Net::TcpSocket(fds[0], Net::HostAddress());
+    std::shared_ptr<HaveRecorder> recorder = std::make_shared<HaveRecorder>();
+
+    // The reactor takes the socket down with its middleware when it
+    // stops, the recorder must outlive it.
+    socket->setInputMiddleware(Net::InputMiddleware::Pointer(new MessageAssembler(recorder)));
+
+    ASSERT_TRUE(reactor.start());
+    ASSERT_TRUE(reactor.observe(socket));
+
+    std::string payload(0x4000, 'x');
+    std::string message = PieceMessage(1, 0, payload).serialize() + HaveMessage(3).serialize();
+
+    // Send the header with a bit of payload first so the rest of the
+    // block has to be received directly.
+    ASSERT_EQ(20, ::write(fds[1], message.data(), 20));
+    ::usleep(200000);
+    ASSERT_EQ((ssize_t)message.size() - 20, ::write(fds[1], message.data() + 20, message.size() - 20));
+
+    Util::Time deadline = Util::Time::monotonicTime() + Util::Time(1000);
+
+    while (recorder->haveCount() == 0 && Util::Time::monotonicTime() < deadline)
+        ::usleep(1000);
+
+    reactor.stop();
+
+    ASSERT_EQ(1U, recorder->pieces.size());
+    ASSERT_EQ(3U, recorder->pieces[0]);
+    ASSERT_EQ(1U, recorder->payloads.size());
+    ASSERT_EQ(payload, recorder->payloads[0]);
+
+    ::close(fds[1]);
+}
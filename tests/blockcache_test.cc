@@ -0,0 +1,66 @@
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <bt/io/blockcache.hh>
+
+using namespace Hypergrace;
+using Bt::BlockCache;
+
+
+TEST(BlockCacheTest, SharesMemoryOfReceivedBlocks)
+{
+    size_t base = BlockCache::memoryUsage();
+
+    BlockCache first;
+    BlockCache second;
+
+    first.setSizeLimit(base + 60);
+    second.setSizeLimit(base + 60);
+
+    // Registered pieces take no memory until their blocks arrive.
+    first.reserve(0, 2, 40);
+    first.reserve(1, 2, 40);
+    second.reserve(0, 2, 40);
+    ASSERT_EQ(base, BlockCache::memoryUsage());
+
+    ASSERT_FALSE(first.store(0, 0, std::string(20, 'a')));
+    ASSERT_FALSE(second.store(0, 0, std::string(20, 'b')));
+    ASSERT_FALSE(first.full());
+
+    // Pinned blocks count too.
+    char *slot = first.pin(1, 0, 20);
+    ASSERT_TRUE(slot != 0);
+    ASSERT_EQ(base + 60, BlockCache::memoryUsage());
+    ASSERT_TRUE(first.full());
+    ASSERT_TRUE(second.full());
+
+    first.unpin(1, 20);
+    ASSERT_EQ(base + 40, BlockCache::memoryUsage());
+
+    // Flushing a complete piece frees its memory.
+    ASSERT_TRUE(first.store(0, 20, std::string(20, 'c')));
+    ASSERT_EQ(base + 60, BlockCache::memoryUsage());
+    ASSERT_EQ(1U, first.flushComplete().size());
+    ASSERT_EQ(base + 20, BlockCache::memoryUsage());
+}
+
+TEST(BlockCacheTest, DropsUnpinnedPieces)
+{
+    size_t base = BlockCache::memoryUsage();
+
+    BlockCache cache;
+
+    cache.reserve(0, 2, 40);
+    ASSERT_FALSE(cache.store(0, 0, std::string(20, 'a')));
+
+    char *slot = cache.pin(0, 20, 20);
+    ASSERT_TRUE(slot != 0);
+    ASSERT_FALSE(cache.drop(0));
+
+    cache.unpin(0, 20);
+    ASSERT_TRUE(cache.drop(0));
+    ASSERT_EQ(0U, cache.storedPieceCount());
+    ASSERT_EQ(0U, cache.load());
+    ASSERT_EQ(base, BlockCache::memoryUsage());
+}
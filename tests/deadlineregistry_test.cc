@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+
+#include <bt/bundle/deadlineregistry.hh>
+
+using namespace Hypergrace;
+
+
+TEST(DeadlineRegistryTest, CursorDropsConsumedRanges)
+{
+    Bt::DeadlineRegistry registry;
+    Util::Time now = Util::Time::monotonicTime();
+
+    ASSERT_FALSE(registry.streaming());
+
+    registry.want(0, 1000, now + Util::Time(0, 0, 1));
+    registry.want(1000, 1000, now + Util::Time(0, 0, 2));
+    registry.want(2000, 0, now);
+
+    ASSERT_TRUE(registry.streaming());
+    ASSERT_EQ(2U, registry.deadlines().size());
+
+    unsigned long long revision = registry.revision();
+
+    // The first range has been read through, the second one not yet.
+    registry.setCursor(1500);
+
+    ASSERT_NE(revision, registry.revision());
+    ASSERT_EQ(1500U, registry.cursor());
+    ASSERT_EQ(1U, registry.deadlines().size());
+    ASSERT_EQ(1000U, registry.deadlines().front().offset);
+
+    // Ranges behind the cursor are of no use.
+    registry.want(0, 1000, now);
+    ASSERT_EQ(1U, registry.deadlines().size());
+
+    registry.clear();
+    ASSERT_FALSE(registry.streaming());
+}
+
+TEST(DeadlineRegistryTest, CountsMisses)
+{
+    Bt::DeadlineRegistry registry;
+
+    registry.reportMiss();
+    registry.reportMiss();
+
+    ASSERT_EQ(2U, registry.missedCount());
+}
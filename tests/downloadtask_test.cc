@@ -0,0 +1,57 @@
+#include <gtest/gtest.h>
+
+#include <bt/peerwire/downloadtask.hh>
+
+using namespace Hypergrace;
+
+
+TEST(DownloadTaskTest, CoversBandwidthDelayProduct)
+{
+    const unsigned int block = Bt::DownloadTask::BlockSize;
+
+    // Idle and slow peers keep the minimum queue.
+    ASSERT_EQ(unsigned(Bt::DownloadTask::MinimumQueueDepth), Bt::DownloadTask::requestQueueDepth(0, 0));
+    ASSERT_EQ(unsigned(Bt::DownloadTask::MinimumQueueDepth), Bt::DownloadTask::requestQueueDepth(4 * block, 50000));
+
+    // 100 Mbit/s at 100 ms: 12.5 MB/s over 600 ms.
+    unsigned int fast = Bt::DownloadTask::requestQueueDepth(12500000, 100000);
+
+    ASSERT_EQ(458u, fast);
+    ASSERT_GT(fast * block, 12500000u / 10);
+
+    // The queue follows the round trip time and the rate both ways.
+    ASSERT_GT(Bt::DownloadTask::requestQueueDepth(12500000, 300000), fast);
+    ASSERT_LT(Bt::DownloadTask::requestQueueDepth(6250000, 100000), fast);
+
+    // Peers without an RTT estimate are assumed to be far away.
+    ASSERT_EQ(Bt::DownloadTask::requestQueueDepth(1000000, Bt::DownloadTask::DefaultRoundTripTime),
+              Bt::DownloadTask::requestQueueDepth(1000000, 0));
+
+    ASSERT_EQ(unsigned(Bt::DownloadTask::MaximumQueueDepth),
+              Bt::DownloadTask::requestQueueDepth(1000000000, 1000000));
+}
+
+TEST(DownloadTaskTest, StartsEndGameByRemainingTransferTime)
+{
+    const unsigned long long floor = Bt::DownloadTask::EndGameBytes;
+
+    // Slow torrents keep a fixed tail.
+    ASSERT_EQ(floor, Bt::DownloadTask::endGameThreshold(0));
+    ASSERT_EQ(floor, Bt::DownloadTask::endGameThreshold(floor / Bt::DownloadTask::EndGameTime));
+
+    // Fast ones cover the bytes due within the end game time.
+    ASSERT_EQ(50000000ULL, Bt::DownloadTask::endGameThreshold(10000000));
+}
+
+TEST(DownloadTaskTest, ClassifiesPeersByPieceTime)
+{
+    const unsigned int pieceSize = 1 << 20;
+
+    ASSERT_EQ(Bt::DownloadTask::SlowPeer, Bt::DownloadTask::speedClass(0, pieceSize));
+    ASSERT_EQ(Bt::DownloadTask::SlowPeer, Bt::DownloadTask::speedClass(20000, pieceSize));
+    ASSERT_EQ(Bt::DownloadTask::MediumPeer, Bt::DownloadTask::speedClass(100000, pieceSize));
+    ASSERT_EQ(Bt::DownloadTask::FastPeer, Bt::DownloadTask::speedClass(pieceSize / 4, pieceSize));
+
+    // The same rate is fast for small pieces.
+    ASSERT_EQ(Bt::DownloadTask::FastPeer, Bt::DownloadTask::speedClass(100000, 1 << 18));
+}
@@ -0,0 +1,135 @@
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <bt/peerwire/message.hh>
+#include <net/receivebuffer.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+using namespace Hypergrace::Bt;
+
+namespace {
+
+const int iterations = 2000000;
+
+typedef Net::SimplePacket<Net::BigEndianIntegerMatcher<uint32_t> > MessageSizeField;
+typedef Net::SimplePacket<Net::ByteMatcher> MessageIdField;
+
+// Serializes the message the way SimplePacket used to: one temporary
+// string per field appended to an accumulator.
+std::string legacySerialize(const RequestMessage &message)
+{
+    std::string accumulator;
+
+    accumulator.append(Net::BigEndianIntegerMatcher<uint32_t>(message.field<0>()).data());
+    accumulator.append(Net::ByteMatcher(message.field<1>()).data());
+    accumulator.append(Net::BigEndianIntegerMatcher<uint32_t>(message.field<2>()).data());
+    accumulator.append(Net::BigEndianIntegerMatcher<uint32_t>(message.field<3>()).data());
+    accumulator.append(Net::BigEndianIntegerMatcher<uint32_t>(message.field<4>()).data());
+
+    return accumulator;
+}
+
+template<typename Function>
+void measure(const char *name, Function function)
+{
+    Util::Time start = Util::Time::monotonicTime();
+    uint64_t checksum = 0;
+
+    for (int i = 0; i < iterations; ++i)
+        checksum += function(i);
+
+    size_t elapsed = (Util::Time::monotonicTime() - start).toMicroseconds();
+
+    std::printf("%-28s %8.1f ns/message (checksum %llu)\n", name,
+                elapsed * 1000.0 / iterations, (unsigned long long) checksum);
+}
+
+} /* namespace */
+
+int main()
+{
+    RequestMessage request(1234, 0x4000, 0x4000);
+    std::string wire = request.serialize();
+
+    measure("encode: per-field strings", [&](int i) -> uint64_t {
+        request.modify<2>(i);
+        return legacySerialize(request)[8];
+    });
+
+    measure("encode: serialize()", [&](int i) -> uint64_t {
+        request.modify<2>(i);
+        return request.serialize()[8];
+    });
+
+    measure("encode: caller buffer", [&](int i) -> uint64_t {
+        char buffer[RequestMessage::fixedSize];
+
+        request.modify<2>(i);
+        request.encode(buffer);
+
+        return buffer[8];
+    });
+
+    // The way MessageAssembler used to take a message apart: received
+    // data accumulated in a string, every field absorbed from it and
+    // the parsed message cut off with substr().
+    std::string legacyBuffer;
+
+    measure("decode: substr + absorb()", [&](int) -> uint64_t {
+        legacyBuffer.append(wire);
+
+        MessageSizeField sizeField;
+        MessageIdField idField;
+        RequestMessage message;
+
+        sizeField.absorb(legacyBuffer, 0);
+        idField.absorb(legacyBuffer, Net::YieldPacketSize<MessageSizeField>::value);
+        message.absorb(legacyBuffer, 0);
+
+        legacyBuffer = legacyBuffer.substr(
+                Net::YieldPacketSize<MessageSizeField>::value + sizeField.field<0>());
+
+        return message.field<2>() + idField.field<0>();
+    });
+
+    // The same message parsed in place from the receive buffer.
+    Net::ReceiveBuffer buffer;
+
+    measure("decode: in place", [&](int) -> uint64_t {
+        buffer.append(wire.data(), wire.size());
+
+        MessageSizeField sizeField;
+        RequestMessage message;
+
+        sizeField.decode(buffer.data(), buffer.size());
+        unsigned char id = buffer.data()[MessageSizeField::fixedSize];
+        message.decode(buffer.data(), buffer.size());
+
+        buffer.consume(MessageSizeField::fixedSize + sizeField.field<0>());
+
+        return message.field<2>() + id;
+    });
+
+    measure("allocate: operator new", [&](int i) -> uint64_t {
+        RequestMessage *message = ::new RequestMessage(i, 0, 0x4000);
+        uint64_t piece = message->field<2>();
+
+        message->~RequestMessage();
+        ::operator delete(message);
+
+        return piece;
+    });
+
+    measure("allocate: packet pool", [&](int i) -> uint64_t {
+        RequestMessage *message = new RequestMessage(i, 0, 0x4000);
+        uint64_t piece = message->field<2>();
+
+        delete message;
+
+        return piece;
+    });
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <bt/peerwire/partialpiecetable.hh>
+
+using namespace Hypergrace;
+using Bt::PartialPieceTable;
+
+
+TEST(PartialPieceTableTest, DescribesBlockGeometry)
+{
+    // Three pieces of 40 bytes and a short one of 10, blocks of 16.
+    PartialPieceTable table(130, 40, 16);
+
+    ASSERT_EQ(40U, table.pieceLength(0));
+    ASSERT_EQ(10U, table.pieceLength(3));
+    ASSERT_EQ(3U, table.blockCount(0));
+    ASSERT_EQ(1U, table.blockCount(3));
+
+    ASSERT_EQ(8U, table.blockSize(0, 2));
+    ASSERT_EQ(2U, table.blockIndex(0, 32, 8));
+    ASSERT_EQ(unsigned(PartialPieceTable::NoBlock), table.blockIndex(0, 32, 16));
+    ASSERT_EQ(unsigned(PartialPieceTable::NoBlock), table.blockIndex(0, 8, 16));
+    ASSERT_EQ(unsigned(PartialPieceTable::NoBlock), table.blockIndex(3, 16, 16));
+    ASSERT_EQ(unsigned(PartialPieceTable::NoBlock), table.blockIndex(4, 0, 16));
+}
+
+TEST(PartialPieceTableTest, TracksRequestsUntilPieceCompletes)
+{
+    PartialPieceTable table(130, 40, 16);
+
+    unsigned int first = table.attachPeer();
+    unsigned int second = table.attachPeer();
+
+    table.open(1);
+    ASSERT_TRUE(table.active(1));
+    ASSERT_EQ(3U, table.freeBlockCount(1));
+    ASSERT_EQ(40U, table.missingBytes());
+
+    table.request(1, 0, first);
+    table.request(1, 0, second);
+    table.request(1, 2, first);
+
+    ASSERT_EQ(1U, table.freeBlockCount(1));
+    ASSERT_EQ(1U, table.nextFreeBlock(1, 0));
+    ASSERT_EQ(2U, table.requesterCount(1, 0));
+    ASSERT_EQ(2U, table.outstanding(first));
+    ASSERT_EQ(40U, table.requestedBytes());
+
+    // A duplicate is cancelled, the block stays requested.
+    table.cancel(1, 0, second);
+    ASSERT_EQ(PartialPieceTable::Requested, table.state(1, 0));
+    ASSERT_FALSE(table.requestedFrom(1, 0, second));
+
+    std::vector<unsigned int> requesters;
+    table.requesters(1, 0, requesters);
+    ASSERT_EQ(std::vector<unsigned int>(1, first), requesters);
+
+    ASSERT_FALSE(table.receive(1, 0));
+    ASSERT_EQ(PartialPieceTable::Received, table.state(1, 0));
+    ASSERT_EQ(24U, table.missingBytes());
+    ASSERT_EQ(1U, table.outstanding(first));
+
+    // Choking drops the rest, the blocks become free again.
+    table.cancelAll(first);
+    ASSERT_EQ(0U, table.outstanding(first));
+    ASSERT_EQ(0U, table.requestedBytes());
+    ASSERT_EQ(2U, table.freeBlockCount(1));
+
+    table.request(1, 1, second);
+    table.request(1, 2, second);
+
+    ASSERT_FALSE(table.receive(1, 1));
+    ASSERT_TRUE(table.receive(1, 2));
+
+    ASSERT_FALSE(table.active(1));
+    ASSERT_EQ(0U, table.activeCount());
+    ASSERT_EQ(0U, table.missingBytes());
+    ASSERT_EQ(0U, table.outstanding(second));
+}
+
+TEST(PartialPieceTableTest, GrowsRequesterSets)
+{
+    PartialPieceTable table(1 << 20, 1 << 18, 1 << 14);
+    std::vector<unsigned int> slots;
+
+    table.open(0);
+    table.open(3);
+
+    for (unsigned int i = 0; i < 100; ++i) {
+        slots.push_back(table.attachPeer());
+        table.request(3, 15, slots.back());
+    }
+
+    ASSERT_EQ(100U, table.requesterCount(3, 15));
+    ASSERT_TRUE(table.requestedFrom(3, 15, slots[99]));
+    ASSERT_FALSE(table.requestedFrom(3, 14, slots[99]));
+
+    // Detached slots are handed out again.
+    table.detachPeer(slots[70]);
+    ASSERT_EQ(99U, table.requesterCount(3, 15));
+    ASSERT_EQ(slots[70], table.attachPeer());
+
+    ASSERT_FALSE(table.receive(3, 15));
+
+    for (unsigned int i = 0; i < 100; ++i)
+        ASSERT_EQ(0U, table.outstanding(slots[i]));
+
+    std::vector<unsigned int> pieces = table.activePieces();
+    ASSERT_EQ(2U, pieces.size());
+}
+
+TEST(PartialPieceTableTest, ReleasesClaimsOfDetachedPeers)
+{
+    PartialPieceTable table(130, 40, 16);
+
+    unsigned int fast = table.attachPeer();
+    unsigned int slow = table.attachPeer();
+
+    table.open(0);
+    table.open(1);
+
+    ASSERT_EQ(unsigned(PartialPieceTable::NoSlot), table.owner(0));
+
+    table.claim(0, fast);
+    table.claim(1, slow);
+    ASSERT_EQ(fast, table.owner(0));
+
+    table.release(slow);
+    ASSERT_EQ(unsigned(PartialPieceTable::NoSlot), table.owner(1));
+
+    table.detachPeer(fast);
+    ASSERT_EQ(unsigned(PartialPieceTable::NoSlot), table.owner(0));
+}
+
+TEST(PartialPieceTableTest, AbortsPieceWithItsRequests)
+{
+    PartialPieceTable table(130, 40, 16);
+
+    unsigned int peer = table.attachPeer();
+
+    table.open(0);
+    table.open(1);
+
+    table.request(0, 0, peer);
+    table.request(0, 1, peer);
+    table.request(1, 0, peer);
+    ASSERT_FALSE(table.receive(0, 0));
+    ASSERT_EQ(64U, table.missingBytes());
+
+    table.abort(0);
+
+    ASSERT_FALSE(table.active(0));
+    ASSERT_TRUE(table.active(1));
+    ASSERT_EQ(1U, table.outstanding(peer));
+    ASSERT_EQ(16U, table.requestedBytes());
+    ASSERT_EQ(40U, table.missingBytes());
+
+    // The piece starts over when opened again.
+    table.open(0);
+    ASSERT_EQ(3U, table.freeBlockCount(0));
+}
@@ -0,0 +1,173 @@
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <bt/peerwire/pieceadvisor.hh>
+#include <util/bitfield.hh>
+
+using namespace Hypergrace;
+
+
+TEST(PieceAdvisorTest, RecommendsRarestPieceFirst)
+{
+    Util::Bitfield scheduled(16);
+    scheduled.setAll();
+
+    Bt::PieceAdvisor advisor(scheduled);
+
+    Util::Bitfield everything(16);
+    everything.setAll();
+
+    advisor.reference(everything);
+    advisor.reference(everything);
+    advisor.unreference(5);
+    advisor.reference(9);
+
+    ASSERT_EQ(1U, advisor.availability(5));
+    ASSERT_EQ(3U, advisor.availability(9));
+
+    ASSERT_EQ(5U, advisor.recommend());
+    ASSERT_TRUE(advisor.isDirty(5));
+
+    // The rest is equally rare except for piece 9, which goes last.
+    for (unsigned int i = 0; i < 14; ++i) {
+        unsigned int piece = advisor.recommend();
+
+        ASSERT_NE(5U, piece);
+        ASSERT_NE(9U, piece);
+    }
+
+    ASSERT_EQ(9U, advisor.recommend());
+    ASSERT_EQ((unsigned int)-1, advisor.recommend());
+
+    advisor.markClean(5);
+    ASSERT_EQ(5U, advisor.recommend());
+}
+
+TEST(PieceAdvisorTest, SkipsPiecesNobodyHasOrUnscheduled)
+{
+    Util::Bitfield scheduled(8);
+    scheduled.setAll();
+
+    Bt::PieceAdvisor advisor(scheduled);
+
+    advisor.reference(2);
+    advisor.reference(3);
+
+    scheduled.unset(2);
+
+    ASSERT_EQ(3U, advisor.recommend());
+    ASSERT_EQ((unsigned int)-1, advisor.recommend());
+
+    // A bad piece comes back as soon as it is clean again.
+    advisor.markClean(3);
+    ASSERT_EQ(3U, advisor.recommend());
+
+    // Rescheduled pieces are picked up after resynchronization.
+    scheduled.set(2);
+    advisor.resynchronize();
+    ASSERT_EQ(2U, advisor.recommend());
+}
+
+TEST(PieceAdvisorTest, PicksRarestPiecesPeerHas)
+{
+    Util::Bitfield scheduled(64);
+    scheduled.setAll();
+
+    Bt::PieceAdvisor advisor(scheduled);
+
+    Util::Bitfield peer(64);
+
+    for (unsigned int piece = 0; piece < 64; ++piece) {
+        // Piece n is seen by n % 4 + 1 peers.
+        for (unsigned int i = 0; i <= piece % 4; ++i)
+            advisor.reference(piece);
+
+        if (piece % 2)
+            peer.set(piece);
+    }
+
+    advisor.markDirty(1);
+
+    std::vector<unsigned int> picked;
+    advisor.recommend(peer, 20, picked);
+
+    ASSERT_EQ(20U, picked.size());
+
+    // 15 pieces seen by two peers, then the ones seen by four.
+    for (unsigned int i = 0; i < 20; ++i) {
+        ASSERT_TRUE(peer.bit(picked[i]));
+        ASSERT_FALSE(advisor.isDirty(picked[i]));
+        ASSERT_EQ(i < 15 ? 1U : 3U, picked[i] % 4);
+    }
+}
+
+TEST(PieceAdvisorTest, StaysConsistentUnderChurn)
+{
+    const unsigned int pieceCount = 300;
+
+    Util::Bitfield scheduled(pieceCount);
+    scheduled.setAll();
+
+    Bt::PieceAdvisor advisor(scheduled);
+    std::vector<unsigned int> expected(pieceCount, 0);
+    std::vector<std::shared_ptr<Util::Bitfield> > peers;
+
+    srand(7);
+
+    for (unsigned int round = 0; round < 2000; ++round) {
+        unsigned int piece = rand() % pieceCount;
+
+        switch (rand() % 4) {
+        case 0: {
+            std::shared_ptr<Util::Bitfield> peer(new Util::Bitfield(pieceCount));
+
+            for (unsigned int i = 0; i < pieceCount; ++i) {
+                if (rand() % 3 == 0) {
+                    peer->set(i);
+                    ++expected[i];
+                }
+            }
+
+            advisor.reference(*peer);
+            peers.push_back(peer);
+            break;
+        }
+        case 1:
+            if (!peers.empty()) {
+                for (unsigned int i = 0; i < pieceCount; ++i)
+                    expected[i] -= peers.back()->bit(i);
+
+                advisor.unreference(*peers.back());
+                peers.pop_back();
+            }
+            break;
+        case 2:
+            advisor.reference(piece);
+            ++expected[piece];
+            break;
+        case 3:
+            if (advisor.isDirty(piece))
+                advisor.markClean(piece);
+            else
+                advisor.markDirty(piece);
+            break;
+        }
+    }
+
+    unsigned int last = 0;
+    unsigned int piece;
+
+    while ((piece = advisor.recommend()) != (unsigned int)-1) {
+        ASSERT_EQ(expected[piece], advisor.availability(piece));
+        ASSERT_LE(last, expected[piece]);
+        ASSERT_LT(0U, expected[piece]);
+
+        last = expected[piece];
+    }
+
+    for (unsigned int i = 0; i < pieceCount; ++i)
+        ASSERT_TRUE(advisor.isDirty(i) || expected[i] == 0);
+}
@@ -0,0 +1,147 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include <bt/peerwire/inputmiddleware.hh>
+#include <bt/peerwire/message.hh>
+#include <bt/peerwire/messageassembler.hh>
+#include <bt/peerwire/pipeline.hh>
+#include <net/receivebuffer.hh>
+#include <net/tcpsocket.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+using namespace Hypergrace::Bt;
+
+namespace {
+
+const int iterations = 200000;
+const int messagesPerBatch = 32;
+
+// A stage of the runtime chain: counts and passes everything on
+// through a virtual call into the next middleware.
+class CountingMiddleware : public Bt::InputMiddleware
+{
+public:
+    CountingMiddleware(Pointer delegate, uint64_t &counter) :
+        Bt::InputMiddleware(delegate),
+        counter_(counter)
+    {
+    }
+
+    void processMessage(Net::Socket &s, HaveMessage &m)
+    {
+        counter_ += m.field<2>();
+        delegateMessage(s, m);
+    }
+
+    void processMessage(Net::Socket &s, RequestMessage &m)
+    {
+        counter_ += m.field<3>();
+        delegateMessage(s, m);
+    }
+
+private:
+    uint64_t &counter_;
+};
+
+// The same stage for the statically composed pipeline.
+class CountingStage : public Bt::PipelineStage
+{
+public:
+    explicit CountingStage(uint64_t &counter) : counter_(counter) {}
+
+    using PipelineStage::handle;
+
+    bool handle(Net::Socket &, HaveMessage &m)
+    {
+        counter_ += m.field<2>();
+        return true;
+    }
+
+    bool handle(Net::Socket &, RequestMessage &m)
+    {
+        counter_ += m.field<3>();
+        return true;
+    }
+
+private:
+    uint64_t &counter_;
+};
+
+std::string makeBatch()
+{
+    std::string batch;
+
+    for (int i = 0; i < messagesPerBatch; ++i) {
+        if (i % 2)
+            batch += HaveMessage(i).serialize();
+        else
+            batch += RequestMessage(i, 0x4000, 0x4000).serialize();
+    }
+
+    return batch;
+}
+
+void measure(const char *name, Net::InputMiddleware &assembler, Net::Socket &socket,
+             const uint64_t &counter)
+{
+    std::string batch = makeBatch();
+    Net::ReceiveBuffer buffer;
+
+    Util::Time start = Util::Time::monotonicTime();
+
+    for (int i = 0; i < iterations; ++i) {
+        buffer.append(batch.data(), batch.size());
+        assembler.receive(socket, buffer);
+    }
+
+    size_t elapsed = (Util::Time::monotonicTime() - start).toMicroseconds();
+
+    std::printf("%-28s %8.1f ns/message (checksum %llu)\n", name,
+                elapsed * 1000.0 / (iterations * messagesPerBatch),
+                (unsigned long long) counter);
+}
+
+} /* namespace */
+
+int main()
+{
+    int fds[2];
+
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return 1;
+
+    Net::TcpSocket socket(fds[0], Net::HostAddress());
+
+    {
+        uint64_t counter = 0;
+
+        Bt::InputMiddleware::Pointer third(new CountingMiddleware(Bt::InputMiddleware::Pointer(), counter));
+        Bt::InputMiddleware::Pointer second(new CountingMiddleware(third, counter));
+        Bt::InputMiddleware::Pointer first(new CountingMiddleware(second, counter));
+        MessageAssembler assembler(first);
+
+        measure("runtime chain (3 stages)", assembler, socket, counter);
+    }
+
+    {
+        uint64_t counter = 0;
+
+        typedef Pipeline<CountingStage, CountingStage, CountingStage> CountingPipeline;
+
+        Bt::InputMiddleware::Pointer pipeline(new CountingPipeline(
+                new CountingStage(counter), new CountingStage(counter), new CountingStage(counter)));
+        MessageAssembler assembler(pipeline);
+
+        measure("static pipeline (3 stages)", assembler, socket, counter);
+    }
+
+    ::close(fds[1]);
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+
+#include <net/rateestimator.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+
+
+TEST(RateEstimatorTest, ConvergesToSteadyRate)
+{
+    Net::RateEstimator estimator;
+    unsigned long long now = Util::Time::monotonicTime().toMicroseconds();
+
+    // 10 KB every 100 ms for 10 s, five half-lives.
+    for (int i = 1; i <= 100; ++i) {
+        estimator.add(10000);
+        estimator.rate(now + i * 100000ULL);
+    }
+
+    ASSERT_NEAR(100000.0, estimator.rate(now + 100 * 100000ULL), 5000.0);
+    ASSERT_EQ(1000000U, estimator.total());
+}
+
+TEST(RateEstimatorTest, HalvesAfterIdleHalfLife)
+{
+    Net::RateEstimator estimator(0, 1000);
+    unsigned long long now = Util::Time::monotonicTime().toMicroseconds();
+
+    for (int i = 1; i <= 100; ++i) {
+        estimator.add(5000);
+        estimator.rate(now + i * 100000ULL);
+    }
+
+    size_t steady = estimator.rate(now + 100 * 100000ULL);
+
+    ASSERT_NEAR(steady / 2.0, estimator.rate(now + 110 * 100000ULL), 1.0);
+}
+
+TEST(RateEstimatorTest, SkipsQueriesTooCloseTogether)
+{
+    Net::RateEstimator estimator;
+    unsigned long long now = Util::Time::monotonicTime().toMicroseconds();
+
+    estimator.add(1000);
+    size_t rate = estimator.rate(now + 1000000);
+
+    estimator.add(1000000);
+    ASSERT_EQ(rate, estimator.rate(now + 1000000 + Net::RateEstimator::MinimumInterval / 2));
+    ASSERT_LT(rate, estimator.rate(now + 1000000 + Net::RateEstimator::MinimumInterval));
+}
+
+TEST(RateEstimatorTest, FeedsParents)
+{
+    Net::RateEstimator torrent;
+    Net::RateEstimator first(&torrent);
+    Net::RateEstimator second;
+
+    second.setParent(&torrent);
+
+    first.add(100);
+    second.add(250);
+
+    ASSERT_EQ(100U, first.total());
+    ASSERT_EQ(250U, second.total());
+    ASSERT_EQ(350U, torrent.total());
+}
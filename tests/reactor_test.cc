@@ -0,0 +1,524 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <delegate/bind.hh>
+#include <net/bandwidthallocator.hh>
+#include <net/inputmiddleware.hh>
+#include <net/reactor.hh>
+#include <net/reactorstatistics.hh>
+#include <net/simplepacket.hh>
+#include <net/tcpsocket.hh>
+#include <thread/event.hh>
+#include <thread/mpscqueue.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+
+
+class JobCounter
+{
+public:
+    JobCounter(int expected) :
+        expected(expected),
+        executed(0)
+    {
+    }
+
+    void run()
+    {
+        if (++executed == expected)
+            done.broadcastSignal();
+    }
+
+    bool waitUntilDone(int timeout)
+    {
+        Util::Time deadline = Util::Time::monotonicTime() + Util::Time(timeout);
+
+        // The signal might be broadcasted before we start waiting, so
+        // never rely on it alone.
+        while (executed < expected) {
+            if (Util::Time::monotonicTime() >= deadline)
+                return false;
+
+            done.wait(5);
+        }
+
+        return true;
+    }
+
+public:
+    const int expected;
+    std::atomic<int> executed;
+    Thread::Event done;
+};
+
+class RecordingMiddleware : public Net::InputMiddleware
+{
+public:
+    RecordingMiddleware() :
+        shutDown(false)
+    {
+    }
+
+    void receive(Net::Socket &, std::string &data)
+    {
+        std::lock_guard<std::mutex> l(anchor);
+        received.append(data);
+    }
+
+    void shutdown(Net::Socket &)
+    {
+        shutDown = true;
+    }
+
+    std::string data()
+    {
+        std::lock_guard<std::mutex> l(anchor);
+        return received;
+    }
+
+    template<typename Predicate>
+    static bool waitFor(Predicate predicate, int timeout)
+    {
+        Util::Time deadline = Util::Time::monotonicTime() + Util::Time(timeout);
+
+        while (!predicate()) {
+            if (Util::Time::monotonicTime() >= deadline)
+                return false;
+
+            ::usleep(1000);
+        }
+
+        return true;
+    }
+
+public:
+    std::atomic<bool> shutDown;
+
+private:
+    std::mutex anchor;
+    std::string received;
+};
+
+class ReactorTest : public ::testing::Test
+{
+public:
+    ReactorTest()
+    {
+        if (!reactor_.start())
+            throw std::runtime_error("Reactor has failed to initialize!");
+    }
+
+public:
+    Net::Reactor reactor_;
+};
+
+TEST(MpscQueueTest, PreservesProducerOrder)
+{
+    Thread::MpscQueue<int> queue;
+    int value = -1;
+
+    ASSERT_TRUE(queue.empty());
+    ASSERT_FALSE(queue.pop(value));
+
+    for (int i = 0; i < 100; ++i)
+        queue.push(i);
+
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(queue.pop(value));
+        ASSERT_EQ(i, value);
+    }
+
+    ASSERT_FALSE(queue.pop(value));
+    ASSERT_TRUE(queue.empty());
+}
+
+TEST(MpscQueueTest, DeliversEverythingFromConcurrentProducers)
+{
+    const int producerCount = 4;
+    const int perProducer = 10000;
+
+    Thread::MpscQueue<int> queue;
+    std::vector<std::thread *> producers;
+
+    for (int p = 0; p < producerCount; ++p) {
+        producers.push_back(new std::thread([&queue, p]() {
+            for (int i = 0; i < perProducer; ++i)
+                queue.push(p * perProducer + i);
+        }));
+    }
+
+    std::vector<int> lastSeen(producerCount, -1);
+    int received = 0;
+    int value;
+
+    while (received < producerCount * perProducer) {
+        if (!queue.pop(value))
+            continue;
+
+        // Values of a single producer must come out in order.
+        int producer = value / perProducer;
+        ASSERT_LT(lastSeen[producer], value);
+        lastSeen[producer] = value;
+
+        ++received;
+    }
+
+    for (auto it = producers.begin(); it != producers.end(); ++it) {
+        (*it)->join();
+        delete *it;
+    }
+
+    ASSERT_FALSE(queue.pop(value));
+}
+
+TEST(HistogramTest, SortsSamplesIntoPowerOfTwoBuckets)
+{
+    Net::Histogram histogram;
+
+    histogram.record(0);
+    histogram.record(1);
+    histogram.record(3);
+    histogram.record(4);
+    histogram.record(1000);
+
+    ASSERT_EQ(5U, histogram.count());
+    ASSERT_EQ(1008U, histogram.sum());
+    ASSERT_EQ(1000U, histogram.max());
+    ASSERT_EQ(201U, histogram.mean());
+
+    ASSERT_EQ(1U, histogram.bucket(0));
+    ASSERT_EQ(1U, histogram.bucket(1));
+    ASSERT_EQ(1U, histogram.bucket(2));
+    ASSERT_EQ(1U, histogram.bucket(3));
+    ASSERT_EQ(1U, histogram.bucket(10));
+
+    ASSERT_EQ(7U, histogram.percentile(80));
+    ASSERT_EQ(1023U, histogram.percentile(100));
+
+    Net::Histogram copy(histogram);
+
+    ASSERT_EQ(histogram.count(), copy.count());
+    ASSERT_EQ(histogram.bucket(10), copy.bucket(10));
+}
+
+TEST_F(ReactorTest, RunsPostedJobsPromptly)
+{
+    JobCounter counter(1);
+    Util::Time start = Util::Time::monotonicTime();
+
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&JobCounter::run, &counter)));
+    ASSERT_TRUE(counter.waitUntilDone(1000));
+
+    // The reactor sleeps 100 ms between pulses; a posted job must not
+    // wait for the pulse.
+    ASSERT_LT((Util::Time::monotonicTime() - start).toMilliseconds(), 50U);
+
+    // Timings are recorded once the job returns, so give the reactor a
+    // moment to finish the iteration.
+    for (int i = 0; i < 100; ++i) {
+        Net::ReactorStatistics statistics = reactor_.statistics();
+
+        if (statistics.jobRunTime.count() > 0 && statistics.loopTime.count() > 0)
+            break;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    Net::ReactorStatistics statistics = reactor_.statistics();
+
+    ASSERT_GE(statistics.jobRunTime.count(), 1U);
+    ASSERT_GE(statistics.loopTime.count(), 1U);
+}
+
+TEST_F(ReactorTest, RunsJobsPostedFromManyThreads)
+{
+    const int threadCount = 4;
+    const int perThread = 500;
+
+    JobCounter counter(threadCount * perThread);
+    std::vector<std::thread *> posters;
+
+    for (int t = 0; t < threadCount; ++t) {
+        posters.push_back(new std::thread([this, &counter]() {
+            for (int i = 0; i < perThread; ++i)
+                reactor_.post(Delegate::bind(&JobCounter::run, &counter));
+        }));
+    }
+
+    for (auto it = posters.begin(); it != posters.end(); ++it) {
+        (*it)->join();
+        delete *it;
+    }
+
+    ASSERT_TRUE(counter.waitUntilDone(5000));
+    ASSERT_EQ(counter.expected, counter.executed);
+}
+
+TEST(ReactorPostTest, RefusesJobsWhenStopped)
+{
+    Net::Reactor reactor;
+    JobCounter counter(1);
+
+    ASSERT_FALSE(reactor.post(Delegate::bind(&JobCounter::run, &counter)));
+    ASSERT_EQ(0, counter.executed);
+}
+
+TEST(ReactorPostTest, RunsEveryAcceptedJobWhenStopping)
+{
+    Net::Reactor reactor;
+    JobCounter counter(-1);
+    std::atomic<int> accepted(0);
+
+    ASSERT_TRUE(reactor.start());
+
+    std::thread poster([&reactor, &counter, &accepted]() {
+        while (reactor.post(Delegate::bind(&JobCounter::run, &counter)))
+            ++accepted;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    reactor.stop();
+    poster.join();
+
+    ASSERT_GT(accepted.load(), 0);
+    ASSERT_EQ(accepted.load(), counter.executed.load());
+}
+
+TEST_F(ReactorTest, ObservesSocketsOnReusedDescriptors)
+{
+    for (int round = 0; round < 3; ++round) {
+        int fds[2];
+
+        ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+        auto *recorder = new RecordingMiddleware();
+        Net::InputMiddleware::Pointer input(recorder);
+        Net::Socket *socket = new Net::TcpSocket(fds[0], Net::HostAddress());
+
+        socket->setInputMiddleware(input);
+        ASSERT_TRUE(reactor_.observe(socket));
+
+        ASSERT_EQ(5, ::write(fds[1], "hello", 5));
+        ASSERT_TRUE(RecordingMiddleware::waitFor(
+                [recorder]() { return recorder->data() == "hello"; }, 1000));
+
+        // Hanging up makes the reactor purge the socket and release
+        // the descriptor, which the next round will likely reuse.
+        ::close(fds[1]);
+
+        ASSERT_TRUE(RecordingMiddleware::waitFor(
+                [recorder]() { return (bool)recorder->shutDown; }, 1000));
+    }
+}
+
+namespace {
+
+typedef Net::SimplePacket<Net::BigEndianIntegerMatcher<uint32_t> > CounterPacket;
+
+void queuePackets(Net::Socket *socket, int count, JobCounter *sent)
+{
+    for (int i = 0; i < count; ++i) {
+        CounterPacket *packet = new CounterPacket(i);
+
+        packet->onSent = Delegate::bind(&JobCounter::run, sent);
+        socket->send(packet);
+
+        // Discarded packets must never reach the wire.
+        CounterPacket *discarded = new CounterPacket(0xffffffff);
+
+        discarded->discard();
+        socket->send(discarded);
+    }
+}
+
+} /* namespace */
+
+TEST_F(ReactorTest, GathersQueuedPacketsInOrder)
+{
+    const int packetCount = 1000;
+
+    int fds[2];
+
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+    Net::Socket *socket = new Net::TcpSocket(fds[0], Net::HostAddress());
+    JobCounter sent(packetCount);
+
+    ASSERT_TRUE(reactor_.observe(socket));
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&queuePackets, socket, packetCount, &sent)));
+
+    std::string received;
+    Util::Time deadline = Util::Time::monotonicTime() + Util::Time(2000);
+
+    while (received.size() < packetCount * 4U && Util::Time::monotonicTime() < deadline) {
+        char buffer[4096];
+        ssize_t size = ::read(fds[1], buffer, sizeof(buffer));
+
+        if (size > 0)
+            received.append(buffer, size);
+        else
+            ::usleep(1000);
+    }
+
+    ASSERT_EQ(packetCount * 4U, received.size());
+    ASSERT_TRUE(sent.waitUntilDone(1000));
+
+    for (int i = 0; i < packetCount; ++i) {
+        CounterPacket packet;
+
+        ASSERT_TRUE(packet.absorb(received.substr(i * 4, 4)));
+        ASSERT_EQ((uint32_t) i, packet.field<0>());
+    }
+
+    ::close(fds[1]);
+}
+
+namespace {
+
+class BulkPacket : public Net::Packet
+{
+public:
+    explicit BulkPacket(size_t size) : data_(size, 'x') {}
+
+    std::string serialize() const { return data_; }
+
+private:
+    std::string data_;
+};
+
+void queueBulk(Net::Socket *socket, size_t size)
+{
+    socket->send(new BulkPacket(size));
+}
+
+void queueBulkPair(Net::Socket *first, Net::Socket *second, size_t size)
+{
+    queueBulk(first, size);
+    queueBulk(second, size);
+}
+
+size_t drain(int fd)
+{
+    char buffer[0x10000];
+    size_t total = 0;
+    ssize_t size;
+
+    while ((size = ::read(fd, buffer, sizeof(buffer))) > 0)
+        total += size;
+
+    return total;
+}
+
+} /* namespace */
+
+TEST_F(ReactorTest, SharesBandwidthAmongReadySockets)
+{
+    const int limit = 0x4000;
+
+    int first[2];
+    int second[2];
+
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, first));
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, second));
+
+    // The allocator refills at a negligible rate, so the sockets have
+    // to share a single burst of tokens.
+    Net::BandwidthAllocator allocator;
+    allocator.setBurst(limit);
+    allocator.limit(1);
+
+    Net::Socket *firstSocket = new Net::TcpSocket(first[0], Net::HostAddress());
+    Net::Socket *secondSocket = new Net::TcpSocket(second[0], Net::HostAddress());
+
+    firstSocket->setLocalBandwidthAllocators(0, &allocator);
+    secondSocket->setLocalBandwidthAllocators(0, &allocator);
+
+    ASSERT_TRUE(reactor_.observe(firstSocket));
+    ASSERT_TRUE(reactor_.observe(secondSocket));
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&queueBulkPair, firstSocket, secondSocket, 0x100000)));
+
+    size_t firstReceived = 0;
+    size_t secondReceived = 0;
+    Util::Time deadline = Util::Time::monotonicTime() + Util::Time(2000);
+
+    while (firstReceived + secondReceived < size_t(limit) && Util::Time::monotonicTime() < deadline) {
+        firstReceived += drain(first[1]);
+        secondReceived += drain(second[1]);
+        ::usleep(1000);
+    }
+
+    // Give the reactor a chance to overspend.
+    ::usleep(300 * 1000);
+
+    firstReceived += drain(first[1]);
+    secondReceived += drain(second[1]);
+
+    ASSERT_EQ(size_t(limit), firstReceived + secondReceived);
+    ASSERT_EQ(size_t(limit / 2), firstReceived);
+    ASSERT_EQ(size_t(limit / 2), secondReceived);
+
+    reactor_.stop();
+
+    ::close(first[1]);
+    ::close(second[1]);
+}
+
+TEST_F(ReactorTest, PacesLimitedSocketsSmoothly)
+{
+    const int rate = 0x10000;
+    const int burst = 0x2000;
+    const int duration = 400;
+
+    int fds[2];
+
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+    Net::BandwidthAllocator allocator;
+    allocator.setBurst(burst);
+    allocator.limit(rate);
+
+    Net::Socket *socket = new Net::TcpSocket(fds[0], Net::HostAddress());
+    socket->setLocalBandwidthAllocators(0, &allocator);
+
+    Util::Time start = Util::Time::monotonicTime();
+
+    ASSERT_TRUE(reactor_.observe(socket));
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&queueBulk, socket, 0x100000)));
+
+    size_t received = 0;
+    size_t largestStep = 0;
+
+    while ((Util::Time::monotonicTime() - start).toMilliseconds() < size_t(duration)) {
+        size_t step = drain(fds[1]);
+
+        received += step;
+        largestStep = std::max(largestStep, step);
+
+        ::usleep(10 * 1000);
+    }
+
+    size_t elapsed = (Util::Time::monotonicTime() - start).toMilliseconds();
+
+    reactor_.stop();
+
+    // The data trickles in at the limited rate instead of leaving in
+    // one burst per second.
+    ASSERT_GE(received, size_t(rate) * duration / 1000 / 2);
+    ASSERT_LE(received, burst + size_t(rate) * elapsed / 1000 + 0x1000);
+    ASSERT_LE(largestStep, size_t(burst + rate / 10));
+
+    ::close(fds[1]);
+}
@@ -0,0 +1,74 @@
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <net/receivebuffer.hh>
+
+using namespace Hypergrace;
+
+
+TEST(ReceiveBufferTest, ConsumesDataByAdvancingCursor)
+{
+    Net::ReceiveBuffer buffer(4096);
+
+    ASSERT_TRUE(buffer.empty());
+    ASSERT_EQ(buffer.capacity(), buffer.space());
+
+    ASSERT_TRUE(buffer.append("hello world", 11));
+    ASSERT_EQ(11U, buffer.size());
+
+    const char *data = buffer.data();
+
+    buffer.consume(6);
+
+    ASSERT_EQ(data + 6, buffer.data());
+    ASSERT_EQ("world", std::string(buffer.data(), buffer.size()));
+
+    buffer.consume(5);
+
+    ASSERT_TRUE(buffer.empty());
+    ASSERT_EQ(buffer.capacity(), buffer.space());
+}
+
+TEST(ReceiveBufferTest, KeepsDataContiguousAcrossWrapAround)
+{
+    Net::ReceiveBuffer buffer(4096);
+    const size_t capacity = buffer.capacity();
+
+    std::string filler(capacity - 10, 'x');
+
+    // Leave a partial message right before the end of the storage.
+    ASSERT_TRUE(buffer.append(filler.data(), filler.size()));
+    ASSERT_TRUE(buffer.append("0123456789", 10));
+    buffer.consume(filler.size());
+
+    std::string tail(capacity - 10, 'y');
+
+    ASSERT_EQ(capacity - 10, buffer.space());
+    ASSERT_TRUE(buffer.append(tail.data(), tail.size()));
+    ASSERT_FALSE(buffer.append("z", 1));
+
+    ASSERT_EQ(capacity, buffer.size());
+    ASSERT_EQ(0, std::memcmp(buffer.data(), "0123456789", 10));
+    ASSERT_EQ(tail, std::string(buffer.data() + 10, tail.size()));
+
+    buffer.consume(capacity - 1);
+
+    ASSERT_EQ('y', *buffer.data());
+    ASSERT_TRUE(buffer.append("abc", 3));
+    ASSERT_EQ("yabc", std::string(buffer.data(), buffer.size()));
+}
+
+TEST(ReceiveBufferTest, ReceivesDirectlyIntoFreeSpace)
+{
+    Net::ReceiveBuffer buffer(4096);
+
+    char *space = buffer.reserve(6);
+
+    std::memcpy(space, "abcdef", 6);
+    buffer.commit(4);
+
+    ASSERT_EQ("abcd", std::string(buffer.data(), buffer.size()));
+    ASSERT_EQ(buffer.capacity() - 4, buffer.space());
+}
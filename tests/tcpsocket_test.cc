@@ -0,0 +1,176 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <delegate/bind.hh>
+#include <net/hostaddress.hh>
+#include <net/packet.hh>
+#include <net/reactor.hh>
+#include <net/tcpsocket.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+
+namespace {
+
+// Connects a pair of TCP sockets over the loopback interface.
+bool connectLoopback(int fds[2])
+{
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {};
+    socklen_t length = sizeof(address);
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bool ok = listener != -1 &&
+              ::bind(listener, (struct sockaddr *) &address, sizeof(address)) == 0 &&
+              ::listen(listener, 1) == 0 &&
+              ::getsockname(listener, (struct sockaddr *) &address, &length) == 0 &&
+              (fds[0] = ::socket(AF_INET, SOCK_STREAM, 0)) != -1 &&
+              ::connect(fds[0], (struct sockaddr *) &address, sizeof(address)) == 0 &&
+              (fds[1] = ::accept(listener, 0, 0)) != -1;
+
+    ::close(listener);
+
+    return ok;
+}
+
+int tcpOption(int fd, int option)
+{
+    int value = -1;
+    socklen_t length = sizeof(value);
+
+    ::getsockopt(fd, IPPROTO_TCP, option, &value, &length);
+
+    return value;
+}
+
+class BlobPacket : public Net::Packet
+{
+public:
+    BlobPacket(size_t size, char fill) : data_(size, fill) {}
+
+    std::string serialize() const { return data_; }
+
+private:
+    std::string data_;
+};
+
+void queueBlobs(Net::Socket *socket, int count, size_t size)
+{
+    for (int i = 0; i < count; ++i)
+        socket->send(new BlobPacket(size, 'a' + i % 26));
+}
+
+void sampleRetainedData(Net::TcpSocket *socket, std::atomic<size_t> *retained)
+{
+    *retained = socket->retainedData();
+}
+
+} /* namespace */
+
+
+TEST(TcpSocketTest, DisablesNagleAndCorksOnDemand)
+{
+    int fds[2];
+
+    ASSERT_TRUE(connectLoopback(fds));
+
+    ASSERT_EQ(0, tcpOption(fds[0], TCP_NODELAY));
+
+    Net::TcpSocket socket(fds[0], Net::HostAddress());
+
+    ASSERT_NE(0, tcpOption(fds[0], TCP_NODELAY));
+    ASSERT_EQ(0, tcpOption(fds[0], TCP_CORK));
+
+    socket.setCorked(true);
+    ASSERT_NE(0, tcpOption(fds[0], TCP_CORK));
+
+    socket.setCorked(false);
+    ASSERT_EQ(0, tcpOption(fds[0], TCP_CORK));
+
+    ::close(fds[1]);
+}
+
+TEST(TcpSocketTest, LeavesQuietConnectionsToAutotuning)
+{
+    int fds[2];
+
+    ASSERT_TRUE(connectLoopback(fds));
+
+    size_t memory = Net::TcpSocket::bufferMemory();
+
+    {
+        Net::TcpSocket socket(fds[0], Net::HostAddress());
+
+        ASSERT_EQ(3, socket.send("abc", 3));
+        ASSERT_EQ(memory, Net::TcpSocket::bufferMemory());
+    }
+
+    ASSERT_EQ(memory, Net::TcpSocket::bufferMemory());
+    ASSERT_EQ(size_t(Net::TcpSocket::DefaultBufferBudget), Net::TcpSocket::bufferBudget());
+
+    ::close(fds[1]);
+}
+
+TEST(TcpSocketTest, KeepsZeroCopyDataUntilCompletion)
+{
+    const int blobCount = 64;
+    const size_t blobSize = 0x10000;
+
+    int fds[2];
+
+    ASSERT_TRUE(connectLoopback(fds));
+
+    Net::Reactor reactor;
+    Net::TcpSocket *socket = new Net::TcpSocket(fds[0], Net::HostAddress());
+
+    // Falls back to copying sends on kernels without MSG_ZEROCOPY
+    // support, the data must arrive intact either way.
+    ASSERT_EQ(0, ::fcntl(fds[0], F_SETFL, O_NONBLOCK));
+    ASSERT_EQ(0, ::fcntl(fds[1], F_SETFL, O_NONBLOCK));
+    ASSERT_TRUE(reactor.start());
+    ASSERT_TRUE(reactor.observe(socket));
+    ASSERT_TRUE(reactor.post(Delegate::bind(&queueBlobs, socket, blobCount, blobSize)));
+
+    std::string received;
+    Util::Time deadline = Util::Time::monotonicTime() + Util::Time(5000);
+
+    while (received.size() < blobCount * blobSize && Util::Time::monotonicTime() < deadline) {
+        char buffer[0x10000];
+        ssize_t size = ::read(fds[1], buffer, sizeof(buffer));
+
+        if (size > 0)
+            received.append(buffer, size);
+        else
+            ::usleep(1000);
+    }
+
+    ASSERT_EQ(blobCount * blobSize, received.size());
+
+    for (int i = 0; i < blobCount; ++i)
+        ASSERT_EQ(std::string(blobSize, 'a' + i % 26), received.substr(i * blobSize, blobSize));
+
+    // Completions are reaped on the following wakeups.
+    std::atomic<size_t> retained(1);
+    deadline = Util::Time::monotonicTime() + Util::Time(2000);
+
+    while (retained != 0 && Util::Time::monotonicTime() < deadline) {
+        ASSERT_TRUE(reactor.post(Delegate::bind(&sampleRetainedData, socket, &retained)));
+        ::usleep(10000);
+    }
+
+    ASSERT_EQ(0U, retained.load());
+
+    reactor.stop();
+    ::close(fds[1]);
+}
@@ -51,6 +51,7 @@ TEST(TimeTest, ProperlyConvertsUnits)
     ASSERT_EQ(61, t.toMinutes());
     ASSERT_EQ(3661, t.toSeconds());
     ASSERT_EQ(3661000, t.toMilliseconds());
+    ASSERT_EQ(3661000000U, t.toMicroseconds());
 }
 
 TEST(TimeTest, DefaultConstructorInitializesToZero)
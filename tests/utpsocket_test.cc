@@ -0,0 +1,386 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <delegate/bind.hh>
+#include <net/inputmiddleware.hh>
+#include <net/packet.hh>
+#include <net/reactor.hh>
+#include <net/utpheader.hh>
+#include <net/utpmultiplexer.hh>
+#include <net/utpsocket.hh>
+#include <util/time.hh>
+
+using namespace Hypergrace;
+
+
+namespace {
+
+class StreamRecorder : public Net::InputMiddleware
+{
+public:
+    StreamRecorder() :
+        shutDown(false)
+    {
+    }
+
+    void receive(Net::Socket &, std::string &data)
+    {
+        std::lock_guard<std::mutex> l(anchor);
+        received.append(data);
+    }
+
+    void shutdown(Net::Socket &)
+    {
+        shutDown = true;
+    }
+
+    std::string data()
+    {
+        std::lock_guard<std::mutex> l(anchor);
+        return received;
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> l(anchor);
+        return received.size();
+    }
+
+public:
+    std::atomic<bool> shutDown;
+
+private:
+    std::mutex anchor;
+    std::string received;
+};
+
+class PatternPacket : public Net::Packet
+{
+public:
+    explicit PatternPacket(const std::string &data) : data_(data) {}
+
+    std::string serialize() const { return data_; }
+
+private:
+    std::string data_;
+};
+
+std::string pattern(size_t size, int seed)
+{
+    std::string data(size, 0);
+
+    for (size_t i = 0; i < size; ++i)
+        data[i] = (i * 7 + seed) % 251;
+
+    return data;
+}
+
+template<typename Predicate>
+bool waitFor(Predicate predicate, int timeout)
+{
+    Util::Time deadline = Util::Time::monotonicTime() + Util::Time(timeout);
+
+    while (!predicate()) {
+        if (Util::Time::monotonicTime() >= deadline)
+            return false;
+
+        ::usleep(1000);
+    }
+
+    return true;
+}
+
+int bindLoopback(Net::HostAddress &address)
+{
+    int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+    if (fd == -1)
+        throw std::runtime_error("Failed to create a UDP socket");
+
+    sockaddr_in sin;
+    socklen_t length = sizeof(sin);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) == -1 ||
+            ::getsockname(fd, reinterpret_cast<sockaddr *>(&sin), &length) == -1)
+        throw std::runtime_error("Failed to bind a UDP socket");
+
+    address = Net::HostAddress(*reinterpret_cast<sockaddr *>(&sin));
+
+    return fd;
+}
+
+} /* namespace */
+
+class UtpSocketTest : public ::testing::Test
+{
+public:
+    UtpSocketTest() :
+        client_(0),
+        accepted_(0),
+        clientInput_(std::make_shared<StreamRecorder>()),
+        serverInput_(std::make_shared<StreamRecorder>()),
+        clientWindow_(0),
+        clientFlight_(0),
+        inspected_(false)
+    {
+        if (!reactor_.start())
+            throw std::runtime_error("Reactor has failed to initialize!");
+
+        clientMultiplexer_ = new Net::UtpMultiplexer(bindLoopback(clientAddress_));
+        serverMultiplexer_ = new Net::UtpMultiplexer(bindLoopback(serverAddress_));
+
+        reactor_.observe(clientMultiplexer_);
+        reactor_.observe(serverMultiplexer_);
+    }
+
+    ~UtpSocketTest()
+    {
+        reactor_.stop();
+    }
+
+    void accept(Net::UtpSocket *socket)
+    {
+        accepted_ = socket;
+
+        socket->setInputMiddleware(serverInput_);
+
+        if (!reply_.empty())
+            socket->send(new PatternPacket(reply_));
+
+        reactor_.observe(socket);
+    }
+
+    void connect()
+    {
+        client_ = clientMultiplexer_->connect(serverAddress_);
+
+        client_->setInputMiddleware(clientInput_);
+        client_->send(new PatternPacket(request_));
+
+        reactor_.observe(client_);
+    }
+
+    void recordClientState()
+    {
+        clientWindow_ = client_->congestionWindow();
+        clientFlight_ = client_->bytesInFlight();
+        inspected_ = true;
+    }
+
+    void inspectClient()
+    {
+        inspected_ = false;
+        reactor_.post(Delegate::bind(&UtpSocketTest::recordClientState, this));
+
+        waitFor([this]() { return inspected_ == true; }, 1000);
+    }
+
+    void closeClient()
+    {
+        client_->close();
+    }
+
+public:
+    Net::Reactor reactor_;
+
+    Net::HostAddress clientAddress_;
+    Net::HostAddress serverAddress_;
+
+    Net::UtpMultiplexer *clientMultiplexer_;
+    Net::UtpMultiplexer *serverMultiplexer_;
+
+    Net::UtpSocket *client_;
+    Net::UtpSocket *accepted_;
+
+    std::shared_ptr<StreamRecorder> clientInput_;
+    std::shared_ptr<StreamRecorder> serverInput_;
+
+    std::string request_;
+    std::string reply_;
+
+    std::atomic<size_t> clientWindow_;
+    std::atomic<size_t> clientFlight_;
+    std::atomic<bool> inspected_;
+};
+
+TEST(UtpHeaderTest, SkipsExtensions)
+{
+    Net::UtpHeader header;
+
+    header.type = Net::UtpHeader::Data;
+    header.connectionId = 0x1234;
+    header.timestamp = 0xDEADBEEF;
+    header.timestampDifference = 42;
+    header.windowSize = 0x100000;
+    header.sequenceNumber = 0xFFFF;
+    header.acknowledgementNumber = 7;
+
+    char datagram[Net::UtpHeader::Size + 6 + 6 + 3];
+
+    header.serialize(datagram);
+
+    // Chain a selective ACK and an unknown extension in front of the
+    // payload.
+    datagram[1] = Net::UtpHeader::SelectiveAckExtension;
+    memcpy(datagram + 20, "\x02\x04\x05\x00\x00\x80", 6);
+    memcpy(datagram + 26, "\x00\x04xxxx", 6);
+    memcpy(datagram + 32, "abc", 3);
+
+    Net::UtpHeader parsed;
+
+    ASSERT_EQ(size_t(32), parsed.parse(datagram, sizeof(datagram)));
+    ASSERT_EQ(Net::UtpHeader::Data, parsed.type);
+    ASSERT_EQ(0x1234, parsed.connectionId);
+    ASSERT_EQ(0xDEADBEEF, parsed.timestamp);
+    ASSERT_EQ(42u, parsed.timestampDifference);
+    ASSERT_EQ(0x100000u, parsed.windowSize);
+    ASSERT_EQ(0xFFFF, parsed.sequenceNumber);
+    ASSERT_EQ(7, parsed.acknowledgementNumber);
+    ASSERT_EQ(4, parsed.selectiveAckSize);
+    ASSERT_EQ(0x05, parsed.selectiveAck[0]);
+    ASSERT_EQ(0x80, parsed.selectiveAck[3]);
+
+    // Serializing the parsed header reproduces the selective ACK.
+    char copy[Net::UtpHeader::Size + 6];
+
+    ASSERT_EQ(sizeof(copy), parsed.size());
+
+    parsed.serialize(copy);
+
+    ASSERT_EQ(0, memcmp(copy, datagram, 20));
+    ASSERT_EQ(0, copy[20]);
+    ASSERT_EQ(4, copy[21]);
+    ASSERT_EQ(0, memcmp(copy + 22, datagram + 22, 4));
+
+    // Truncated extensions and unknown versions are rejected.
+    ASSERT_EQ(size_t(0), parsed.parse(datagram, 29));
+
+    datagram[0] = (Net::UtpHeader::Data << 4) | 2;
+
+    ASSERT_EQ(size_t(0), parsed.parse(datagram, sizeof(datagram)));
+}
+
+TEST_F(UtpSocketTest, TransfersDataOverLoopback)
+{
+    request_ = pattern(0x80000, 1);
+    reply_ = pattern(0x10000, 2);
+
+    serverMultiplexer_->onAccepted = Delegate::bind(&UtpSocketTest::accept, this, _1);
+
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&UtpSocketTest::connect, this)));
+
+    ASSERT_TRUE(waitFor([this]() { return serverInput_->size() >= request_.size(); }, 10000));
+    ASSERT_TRUE(waitFor([this]() { return clientInput_->size() >= reply_.size(); }, 10000));
+
+    ASSERT_TRUE(serverInput_->data() == request_);
+    ASSERT_TRUE(clientInput_->data() == reply_);
+
+    // Everything sent has been acknowledged.
+    ASSERT_TRUE(waitFor([this]() { inspectClient(); return clientFlight_ == 0; }, 2000));
+}
+
+TEST_F(UtpSocketTest, YieldsWhenQueuingDelayBuildsUp)
+{
+    // Play the peer by hand so that we control the delay reported
+    // back to the sender.
+    int peer = bindLoopback(serverAddress_);
+
+    timeval timeout = { 0, 20000 };
+    ::setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    request_ = pattern(0x1000000, 5);
+
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&UtpSocketTest::connect, this)));
+
+    auto acknowledgeFor = [&](int duration, uint32_t delay) {
+        Util::Time deadline = Util::Time::monotonicTime() + Util::Time(duration);
+
+        while (Util::Time::monotonicTime() < deadline) {
+            char datagram[0x800];
+            sockaddr_storage from;
+            socklen_t length = sizeof(from);
+
+            ssize_t size = ::recvfrom(peer, datagram, sizeof(datagram), 0,
+                                      reinterpret_cast<sockaddr *>(&from), &length);
+
+            Net::UtpHeader received;
+
+            if (size <= 0 || received.parse(datagram, size) == 0)
+                continue;
+
+            Net::UtpHeader reply;
+
+            reply.type = Net::UtpHeader::State;
+            reply.connectionId = received.connectionId - (received.type == Net::UtpHeader::Syn ? 0 : 1);
+            reply.timestamp = 0;
+            reply.timestampDifference = delay;
+            reply.windowSize = 0x100000;
+            reply.sequenceNumber = 1;
+            reply.acknowledgementNumber = received.sequenceNumber;
+
+            reply.serialize(datagram);
+
+            ::sendto(peer, datagram, Net::UtpHeader::Size, 0,
+                     reinterpret_cast<sockaddr *>(&from), length);
+        }
+    };
+
+    // While the delay stays at the base the window opens up.
+    acknowledgeFor(1000, 1000);
+
+    // Let the sender take in the last acknowledgements.
+    ::usleep(250 * 1000);
+
+    inspectClient();
+
+    size_t opened = clientWindow_;
+
+    ASSERT_GT(opened, size_t(Net::UtpSocket::MinimumWindow));
+
+    // Delay above the target makes it shrink.
+    acknowledgeFor(1000, 1000 + 3 * Net::UtpSocket::TargetDelay);
+
+    inspectClient();
+
+    ASSERT_LT(clientWindow_, opened);
+
+    ::close(peer);
+}
+
+TEST_F(UtpSocketTest, ShutsPeerDownOnClose)
+{
+    request_ = pattern(0x1000, 3);
+
+    serverMultiplexer_->onAccepted = Delegate::bind(&UtpSocketTest::accept, this, _1);
+
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&UtpSocketTest::connect, this)));
+    ASSERT_TRUE(waitFor([this]() { return serverInput_->size() == request_.size(); }, 5000));
+
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&UtpSocketTest::closeClient, this)));
+    ASSERT_TRUE(waitFor([this]() { return serverInput_->shutDown == true; }, 5000));
+}
+
+TEST_F(UtpSocketTest, RefusesConnectionsWithoutHandler)
+{
+    request_ = pattern(0x1000, 4);
+
+    ASSERT_TRUE(reactor_.post(Delegate::bind(&UtpSocketTest::connect, this)));
+    ASSERT_TRUE(waitFor([this]() { return clientInput_->shutDown == true; }, 5000));
+
+    ASSERT_EQ(size_t(0), serverInput_->size());
+}